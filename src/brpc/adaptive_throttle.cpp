@@ -0,0 +1,218 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>
+#include <pthread.h>
+#include "butil/fast_rand.h"
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "bvar/bvar.h"
+#include "brpc/errno.pb.h"
+#include "brpc/adaptive_throttle.h"
+
+
+namespace brpc {
+
+// Requests checked and dropped by all throttles.
+static bvar::Adder<int64_t>* g_throttle_requested = NULL;
+static bvar::Adder<int64_t>* g_throttle_dropped = NULL;
+static bvar::Window<bvar::Adder<int64_t> >* g_throttle_requested_window = NULL;
+static bvar::Window<bvar::Adder<int64_t> >* g_throttle_dropped_window = NULL;
+
+static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
+
+static double GetDropRatio(void*) {
+    const int64_t requested = g_throttle_requested_window->get_value();
+    if (requested <= 0) {
+        return 0;
+    }
+    return g_throttle_dropped_window->get_value() / (double)requested;
+}
+
+static void CreateVars() {
+    g_throttle_requested = new bvar::Adder<int64_t>("rpc_throttle_requested");
+    g_throttle_dropped = new bvar::Adder<int64_t>("rpc_throttle_dropped");
+    new bvar::PerSecond<bvar::Adder<int64_t> >(
+        "rpc_throttle_dropped_second", g_throttle_dropped);
+    g_throttle_requested_window =
+        new bvar::Window<bvar::Adder<int64_t> >(g_throttle_requested, 10);
+    g_throttle_dropped_window =
+        new bvar::Window<bvar::Adder<int64_t> >(g_throttle_dropped, 10);
+    // Dropped / requested in last 10 seconds.
+    new bvar::PassiveStatus<double>("rpc_throttle_drop_ratio",
+                                    GetDropRatio, NULL);
+}
+
+AdaptiveThrottleOptions::AdaptiveThrottleOptions()
+    : multiplier(2.0)
+    , window_size(10) {
+}
+
+AdaptiveThrottle::ServerStat::ServerStat(int window_size)
+    : buckets(std::max(window_size, 1))
+    , last_active_s(0) {
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        buckets[i].second = -1;
+        buckets[i].requests = 0;
+        buckets[i].accepts = 0;
+    }
+}
+
+AdaptiveThrottle::Bucket*
+AdaptiveThrottle::ServerStat::GetBucket(int64_t now_s) {
+    Bucket* b = &buckets[now_s % buckets.size()];
+    if (b->second != now_s) {
+        b->second = now_s;
+        b->requests = 0;
+        b->accepts = 0;
+    }
+    return b;
+}
+
+void AdaptiveThrottle::ServerStat::Sum(
+    int64_t now_s, int64_t* requests, int64_t* accepts) const {
+    *requests = 0;
+    *accepts = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        if (buckets[i].second > now_s - (int64_t)buckets.size()) {
+            *requests += buckets[i].requests;
+            *accepts += buckets[i].accepts;
+        }
+    }
+}
+
+AdaptiveThrottle::AdaptiveThrottle()
+    : AdaptiveThrottle(AdaptiveThrottleOptions()) {
+}
+
+AdaptiveThrottle::AdaptiveThrottle(const AdaptiveThrottleOptions& options)
+    : _options(options) {
+    CHECK_EQ(0, pthread_once(&s_create_vars_once, CreateVars));
+}
+
+size_t AdaptiveThrottle::AddStat(StatMap& bg, const StatMap& fg,
+                                 SocketId server, int window_size) {
+    if (bg.find(server) != bg.end()) {
+        return 0;
+    }
+    // Servers are added rarely, remove the ones idle for a whole window
+    // here, e.g. removed from the naming service.
+    const int64_t now_s = butil::cpuwide_time_s();
+    for (StatMap::iterator it = bg.begin(); it != bg.end();) {
+        if (it->second->last_active_s.load(butil::memory_order_relaxed)
+            < now_s - window_size) {
+            bg.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    StatMap::const_iterator it = fg.find(server);
+    if (it != fg.end()) {
+        // The other buffer was modified, share the stat.
+        bg[server] = it->second;
+    } else {
+        std::shared_ptr<ServerStat> stat =
+            std::make_shared<ServerStat>(window_size);
+        stat->last_active_s.store(now_s, butil::memory_order_relaxed);
+        bg[server] = stat;
+    }
+    return 1;
+}
+
+std::shared_ptr<AdaptiveThrottle::ServerStat>
+AdaptiveThrottle::GetStat(SocketId server, bool create) const {
+    for (int i = 0; i < 2; ++i) {
+        {
+            butil::DoublyBufferedData<StatMap>::ScopedPtr s;
+            if (_db_stats.Read(&s) != 0) {
+                return NULL;
+            }
+            StatMap::const_iterator it = s->find(server);
+            if (it != s->end()) {
+                return it->second;
+            }
+        }
+        if (!create) {
+            return NULL;
+        }
+        _db_stats.ModifyWithForeground(AddStat, server, _options.window_size);
+    }
+    return NULL;
+}
+
+double AdaptiveThrottle::DropProbability(int64_t requests,
+                                         int64_t accepts) const {
+    const double p = (requests - _options.multiplier * accepts) /
+        (double)(requests + 1);
+    return std::max(p, 0.0);
+}
+
+bool AdaptiveThrottle::OnRequest(SocketId server) {
+    *g_throttle_requested << 1;
+    std::shared_ptr<ServerStat> stat = GetStat(server, true);
+    if (stat == NULL) {
+        return true;
+    }
+    const int64_t now_s = butil::cpuwide_time_s();
+    stat->last_active_s.store(now_s, butil::memory_order_relaxed);
+    int64_t requests = 0;
+    int64_t accepts = 0;
+    {
+        BAIDU_SCOPED_LOCK(stat->mutex);
+        stat->Sum(now_s, &requests, &accepts);
+        // Dropped requests are counted as well, so that the probability
+        // keeps rising if the server rejects everything.
+        ++stat->GetBucket(now_s)->requests;
+    }
+    const double p = DropProbability(requests, accepts);
+    if (p > 0 && butil::fast_rand_double() < p) {
+        *g_throttle_dropped << 1;
+        return false;
+    }
+    return true;
+}
+
+void AdaptiveThrottle::OnResponse(SocketId server, int error_code,
+                                  bool responded) {
+    if (!responded || error_code == ELIMIT) {
+        return;
+    }
+    std::shared_ptr<ServerStat> stat = GetStat(server, false);
+    if (stat == NULL) {
+        return;
+    }
+    const int64_t now_s = butil::cpuwide_time_s();
+    BAIDU_SCOPED_LOCK(stat->mutex);
+    ++stat->GetBucket(now_s)->accepts;
+}
+
+double AdaptiveThrottle::drop_probability(SocketId server) const {
+    std::shared_ptr<ServerStat> stat = GetStat(server, false);
+    if (stat == NULL) {
+        return 0;
+    }
+    int64_t requests = 0;
+    int64_t accepts = 0;
+    {
+        BAIDU_SCOPED_LOCK(stat->mutex);
+        stat->Sum(butil::cpuwide_time_s(), &requests, &accepts);
+    }
+    return DropProbability(requests, accepts);
+}
+
+} // namespace brpc
@@ -0,0 +1,105 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_ADAPTIVE_THROTTLE_H
+#define BRPC_ADAPTIVE_THROTTLE_H
+
+#include <map>
+#include <memory>
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/socket_id.h"
+
+
+namespace brpc {
+
+struct AdaptiveThrottleOptions {
+    // Constructed with default values.
+    AdaptiveThrottleOptions();
+
+    // Requests to a server are dropped locally with probability
+    //   max(0, (requests - multiplier * accepts) / (requests + 1))
+    // where requests includes the dropped ones. Smaller values throttle
+    // more aggressively.
+    // Default: 2.0
+    double multiplier;
+
+    // Requests and accepts are counted over last so many seconds.
+    // Default: 10
+    int window_size;
+};
+
+// Client-side adaptive throttling: a server rejecting requests with ELIMIT
+// (e.g. by AutoConcurrencyLimiter) still spends CPU on parsing and rejecting
+// them. This class tracks requests and accepts of each server and drops
+// requests locally before sending when the server rejects too much, so that
+// the server only sees about `multiplier' times of what it can accept.
+// Set ChannelOptions.throttle to an instance of this class.
+class AdaptiveThrottle {
+public:
+    AdaptiveThrottle();
+    explicit AdaptiveThrottle(const AdaptiveThrottleOptions& options);
+
+    // Called before sending a request to `server'. Returns false if the
+    // request should be dropped.
+    bool OnRequest(SocketId server);
+
+    // Called when a request admitted by OnRequest() ends. `responded' is
+    // true if the server replied, which is accepted unless `error_code' is
+    // ELIMIT. Requests not seen by the server(connection failures, canceled
+    // backup requests, timeouts...) are never counted as accepted.
+    void OnResponse(SocketId server, int error_code, bool responded);
+
+    // Current probability of dropping requests to `server'.
+    double drop_probability(SocketId server) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveThrottle);
+
+    struct Bucket {
+        int64_t second;
+        int64_t requests;
+        int64_t accepts;
+    };
+    struct ServerStat {
+        explicit ServerStat(int window_size);
+        // Sum up buckets in the window ending at `now_s'.
+        void Sum(int64_t now_s, int64_t* requests, int64_t* accepts) const;
+        Bucket* GetBucket(int64_t now_s);
+
+        mutable butil::Mutex mutex;
+        std::vector<Bucket> buckets;
+        butil::atomic<int64_t> last_active_s;
+    };
+    typedef std::map<SocketId, std::shared_ptr<ServerStat> > StatMap;
+
+    std::shared_ptr<ServerStat> GetStat(SocketId server, bool create) const;
+    static size_t AddStat(StatMap& bg, const StatMap& fg,
+                          SocketId server, int window_size);
+    double DropProbability(int64_t requests, int64_t accepts) const;
+
+    AdaptiveThrottleOptions _options;
+    mutable butil::DoublyBufferedData<StatMap> _db_stats;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_ADAPTIVE_THROTTLE_H
@@ -0,0 +1,154 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>
+#include <pthread.h>
+#include "butil/time.h"
+#include "bvar/reducer.h"
+#include "brpc/backup_request_policy.h"
+
+
+namespace brpc {
+
+// Percentiles of a method are recomputed at most once in this interval.
+static const int64_t UPDATE_INTERVAL_US = 100000L;
+
+static bvar::Adder<int64_t>* g_backup_request_suppressed = NULL;
+
+static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
+
+static void CreateVars() {
+    g_backup_request_suppressed =
+        new bvar::Adder<int64_t>("rpc_backup_request_suppressed");
+}
+
+AdaptiveBackupRequestOptions::AdaptiveBackupRequestOptions()
+    : latency_percentile(0.95)
+    , window_size(10)
+    , min_samples(100)
+    , fallback_backup_request_ms(-1)
+    , min_backup_request_ms(1)
+    , max_backup_ratio(0.05)
+    , max_burst(10) {
+}
+
+AdaptiveBackupRequestPolicy::MethodStat::MethodStat(int window_size)
+    : latency(window_size)
+    , backup_request_ms(-1)
+    , next_update_us(0) {
+}
+
+AdaptiveBackupRequestPolicy::AdaptiveBackupRequestPolicy()
+    : AdaptiveBackupRequestPolicy(AdaptiveBackupRequestOptions()) {
+}
+
+AdaptiveBackupRequestPolicy::AdaptiveBackupRequestPolicy(
+    const AdaptiveBackupRequestOptions& options)
+    : _options(options)
+    , _tokens(options.max_backup_ratio, options.max_burst) {
+    CHECK_EQ(0, pthread_once(&s_create_vars_once, CreateVars));
+}
+
+size_t AdaptiveBackupRequestPolicy::AddStat(
+    StatMap& bg, const StatMap& fg,
+    const google::protobuf::MethodDescriptor* method, int window_size) {
+    if (bg.find(method) != bg.end()) {
+        return 0;
+    }
+    StatMap::const_iterator it = fg.find(method);
+    if (it != fg.end()) {
+        // The other buffer was modified, share the stat.
+        bg[method] = it->second;
+    } else {
+        bg[method] = std::make_shared<MethodStat>(window_size);
+    }
+    return 1;
+}
+
+std::shared_ptr<AdaptiveBackupRequestPolicy::MethodStat>
+AdaptiveBackupRequestPolicy::GetStat(
+    const google::protobuf::MethodDescriptor* method) const {
+    for (int i = 0; i < 2; ++i) {
+        {
+            butil::DoublyBufferedData<StatMap>::ScopedPtr s;
+            if (_db_stats.Read(&s) != 0) {
+                return NULL;
+            }
+            StatMap::const_iterator it = s->find(method);
+            if (it != s->end()) {
+                return it->second;
+            }
+        }
+        // First call of the method, methods are few and modifications are
+        // rare.
+        _db_stats.ModifyWithForeground(AddStat, method, _options.window_size);
+    }
+    return NULL;
+}
+
+int32_t AdaptiveBackupRequestPolicy::GetBackupRequestMs(
+    const Controller* controller) const {
+    std::shared_ptr<MethodStat> stat = GetStat(controller->method());
+    if (stat == NULL) {
+        return _options.fallback_backup_request_ms;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    int64_t next_update_us = stat->next_update_us.load(butil::memory_order_relaxed);
+    if (now >= next_update_us &&
+        stat->next_update_us.compare_exchange_strong(
+            next_update_us, now + UPDATE_INTERVAL_US,
+            butil::memory_order_relaxed)) {
+        int32_t backup_request_ms = _options.fallback_backup_request_ms;
+        if (stat->latency.count() >= _options.min_samples) {
+            const int64_t latency_us =
+                stat->latency.latency_percentile(_options.latency_percentile);
+            backup_request_ms = std::max((int32_t)((latency_us + 999) / 1000),
+                                         _options.min_backup_request_ms);
+        }
+        stat->backup_request_ms.store(backup_request_ms,
+                                      butil::memory_order_relaxed);
+        return backup_request_ms;
+    }
+    return stat->backup_request_ms.load(butil::memory_order_relaxed);
+}
+
+bool AdaptiveBackupRequestPolicy::DoBackup(const Controller*) const {
+    if (_tokens.Withdraw()) {
+        return true;
+    }
+    *g_backup_request_suppressed << 1;
+    return false;
+}
+
+void AdaptiveBackupRequestPolicy::OnRPCEnd(const Controller* controller) {
+    // Latencies of failed RPCs are mostly timeouts which say nothing about
+    // the distribution.
+    if (!controller->Failed()) {
+        std::shared_ptr<MethodStat> stat = GetStat(controller->method());
+        if (stat != NULL) {
+            stat->latency << controller->latency_us();
+        }
+    }
+    _tokens.Deposit();
+}
+
+double AdaptiveBackupRequestPolicy::tokens() const {
+    return _tokens.tokens();
+}
+
+} // namespace brpc
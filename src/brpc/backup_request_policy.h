@@ -0,0 +1,133 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_BACKUP_REQUEST_POLICY_H
+#define BRPC_BACKUP_REQUEST_POLICY_H
+
+#include <map>
+#include <memory>
+#include "butil/atomicops.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "bvar/latency_recorder.h"
+#include "brpc/controller.h"
+#include "brpc/details/token_bucket.h"
+
+
+namespace brpc {
+
+// Inherit this class to customize when and whether backup requests are sent.
+class BackupRequestPolicy {
+public:
+    virtual ~BackupRequestPolicy() = default;
+
+    // Returns the time in milliseconds after which a backup request is sent
+    // if the RPC does not finish. Negative values disable backup requests.
+    // Only called when Controller.set_backup_request_ms() is not called.
+    virtual int32_t GetBackupRequestMs(const Controller* controller) const = 0;
+
+    // Returns true if the backup request should be sent when it's time.
+    virtual bool DoBackup(const Controller* controller) const = 0;
+
+    // Called when the RPC ends, no matter it succeeded or not.
+    virtual void OnRPCEnd(const Controller* controller) = 0;
+};
+
+struct AdaptiveBackupRequestOptions {
+    // Constructed with default values.
+    AdaptiveBackupRequestOptions();
+
+    // Backup requests are sent after this percentile of recent latencies of
+    // the method.
+    // Default: 0.95
+    double latency_percentile;
+
+    // Percentiles are computed over latencies of last so many seconds.
+    // Default: 10
+    int window_size;
+
+    // Percentiles of methods with fewer calls are not trustworthy,
+    // `fallback_backup_request_ms' is used instead.
+    // Default: 100
+    int64_t min_samples;
+
+    // Used before the method has `min_samples' calls.
+    // Default: -1 (no backup request)
+    int32_t fallback_backup_request_ms;
+
+    // Lower bound of the computed time.
+    // Default: 1
+    int32_t min_backup_request_ms;
+
+    // At most so much ratio of calls are backed up in the long run. Every
+    // finished RPC adds this number of tokens into a bucket and every
+    // backup request takes one.
+    // Default: 0.05
+    double max_backup_ratio;
+
+    // Capacity of the token bucket, namely the max backup requests sent in a
+    // burst.
+    // Default: 10
+    int max_burst;
+};
+
+// Sets the time of backup requests to a percentile of recent latencies of
+// each method rather than a constant, and limits backup requests to a ratio
+// of calls to avoid amplifying load during slowdowns.
+// Set ChannelOptions.backup_request_policy to an instance of this class,
+// which should be shared by all RPCs of the channel.
+class AdaptiveBackupRequestPolicy : public BackupRequestPolicy {
+public:
+    AdaptiveBackupRequestPolicy();
+    explicit AdaptiveBackupRequestPolicy(
+        const AdaptiveBackupRequestOptions& options);
+
+    int32_t GetBackupRequestMs(const Controller* controller) const override;
+    bool DoBackup(const Controller* controller) const override;
+    void OnRPCEnd(const Controller* controller) override;
+
+    // Number of backup requests that can be sent right now.
+    double tokens() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveBackupRequestPolicy);
+
+    struct MethodStat {
+        explicit MethodStat(int window_size);
+        bvar::LatencyRecorder latency;
+        // Cached result of the percentile which is expensive to compute.
+        butil::atomic<int32_t> backup_request_ms;
+        butil::atomic<int64_t> next_update_us;
+    };
+    typedef std::map<const google::protobuf::MethodDescriptor*,
+                     std::shared_ptr<MethodStat> > StatMap;
+
+    std::shared_ptr<MethodStat> GetStat(
+        const google::protobuf::MethodDescriptor* method) const;
+    static size_t AddStat(StatMap& bg, const StatMap& fg,
+                          const google::protobuf::MethodDescriptor* method,
+                          int window_size);
+
+    AdaptiveBackupRequestOptions _options;
+    mutable TokenBucket _tokens;
+    mutable butil::DoublyBufferedData<StatMap> _db_stats;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_BACKUP_REQUEST_POLICY_H
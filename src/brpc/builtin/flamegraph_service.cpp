@@ -0,0 +1,196 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include "butil/string_splitter.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "brpc/controller.h"                // Controller
+#include "brpc/closure_guard.h"             // ClosureGuard
+#include "brpc/server.h"
+#include "brpc/builtin/common.h"
+#include "brpc/details/sampling_profiler.h"
+#include "brpc/builtin/flamegraph_service.h"
+
+namespace brpc {
+
+static const int DEFAULT_FLAMEGRAPH_SECONDS = 10;
+
+// Frames whose samples are less than 1/MIN_FRAME_RATIO of all samples are
+// not shown.
+static const int64_t MIN_FRAME_RATIO = 1000;
+
+namespace {
+struct FlameNode {
+    int64_t count;
+    std::map<std::string, FlameNode*> children;
+
+    FlameNode() : count(0) {}
+    ~FlameNode() {
+        for (std::map<std::string, FlameNode*>::iterator
+                 it = children.begin(); it != children.end(); ++it) {
+            delete it->second;
+        }
+    }
+};
+}  // namespace
+
+static void AddStack(FlameNode* root, const std::string& folded,
+                     int64_t count) {
+    root->count += count;
+    FlameNode* node = root;
+    for (butil::StringSplitter sp(folded.c_str(), ';'); sp; ++sp) {
+        FlameNode*& child = node->children[std::string(sp.field(), sp.length())];
+        if (child == NULL) {
+            child = new FlameNode;
+        }
+        child->count += count;
+        node = child;
+    }
+}
+
+static void PrintEscaped(std::ostream& os, const std::string& s) {
+    for (size_t i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+        case '<': os << "&lt;"; break;
+        case '>': os << "&gt;"; break;
+        case '&': os << "&amp;"; break;
+        case '"': os << "&quot;"; break;
+        case '\'': os << "&#39;"; break;
+        default: os << s[i]; break;
+        }
+    }
+}
+
+// Children of a frame are placed under the frame with widths proportional
+// to their samples, as the flame graph upside down.
+static void PrintFlameNode(std::ostream& os, const std::string& name,
+                           const FlameNode& node, int64_t parent_count,
+                           int64_t total) {
+    uint32_t hash = 0;
+    butil::MurmurHash3_x86_32(name.data(), name.size(), 0, &hash);
+    os << "<div class=\"fn\" style=\"width:"
+       << node.count * 100.0 / parent_count << "%\"><div class=\"fl\" "
+       "style=\"background:hsl(" << hash % 55 << ",85%," << 55 + hash / 55 % 15
+       << "%)\" title=\"";
+    PrintEscaped(os, name);
+    os << " (" << node.count << " samples, "
+       << node.count * 100.0 / total << "%)\">";
+    PrintEscaped(os, name);
+    os << "</div>";
+    if (!node.children.empty()) {
+        os << "<div class=\"fc\">";
+        for (std::map<std::string, FlameNode*>::const_iterator
+                 it = node.children.begin(); it != node.children.end(); ++it) {
+            if (it->second->count * MIN_FRAME_RATIO >= total) {
+                PrintFlameNode(os, it->first, *it->second, node.count, total);
+            }
+        }
+        os << "</div>";
+    }
+    os << "</div>";
+}
+
+static const char* FlameGraphStyle() {
+    return "<style type=\"text/css\">\n"
+        ".fn { overflow: hidden; }\n"
+        ".fc { display: flex; }\n"
+        ".fl { height: 16px; margin: 1px 0px; border-right: 1px solid white;"
+        " font: 12px monospace; line-height: 16px; white-space: nowrap;"
+        " overflow: hidden; text-overflow: ellipsis; cursor: default; }\n"
+        "</style>\n";
+}
+
+void FlameGraphService::default_method(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::FlameGraphRequest*,
+    ::brpc::FlameGraphResponse*,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    const bool use_html = UseHTML(cntl->http_request());
+    cntl->http_response().set_content_type(
+        use_html ? "text/html" : "text/plain");
+
+    int seconds = DEFAULT_FLAMEGRAPH_SECONDS;
+    const std::string* param = cntl->http_request().uri().GetQuery("seconds");
+    if (param != NULL) {
+        char* endptr = NULL;
+        seconds = strtol(param->c_str(), &endptr, 10);
+        if (*endptr != '\0' || seconds <= 0) {
+            cntl->SetFailed(EINVAL, "Invalid seconds=%s", param->c_str());
+            return;
+        }
+    }
+    seconds = std::min(seconds, (int)SamplingProfiler::MAX_SECONDS);
+
+    SamplingProfiler* profiler = SamplingProfiler::GetInstance();
+    std::map<std::string, int64_t> stacks;
+    const int64_t nsample = profiler->GetFoldedStacks(seconds, &stacks);
+
+    butil::IOBufBuilder os;
+    if (!use_html) {
+        // Folded format which can be processed by tools of FlameGraph.
+        for (std::map<std::string, int64_t>::const_iterator
+                 it = stacks.begin(); it != stacks.end(); ++it) {
+            os << it->first << ' ' << it->second << '\n';
+        }
+        os.move_to(cntl->response_attachment());
+        return;
+    }
+    os << "<!DOCTYPE html><html><head>\n"
+        "<script language=\"javascript\" type=\"text/javascript\""
+        " src=\"/js/jquery_min\"></script>\n"
+       << TabsHead() << FlameGraphStyle() << "</head><body>";
+    cntl->server()->PrintTabsBody(os, "flamegraph");
+    if (profiler->frequency() == 0) {
+        os << "<p>Sampling is off, set <a href=\"/flags/"
+            "sampling_profiler_hz\">sampling_profiler_hz</a> to a positive"
+            " value (e.g. 49) to turn it on.</p>";
+    }
+    os << "<p>" << nsample << " samples in last " << seconds << " seconds ("
+       << profiler->dropped_count() << " dropped in total), last";
+    const int candidates[] = { 5, 10, 30, 60 };
+    for (size_t i = 0; i < arraysize(candidates); ++i) {
+        os << " <a href=\"/flamegraph?seconds=" << candidates[i] << "\">"
+           << candidates[i] << "s</a>";
+    }
+    os << ". Hover on frames to see full names. "
+        "<a href=\"/flamegraph?seconds=" << seconds << "&console=1\">"
+        "Folded stacks</a></p>\n";
+    if (nsample > 0) {
+        FlameNode root;
+        for (std::map<std::string, int64_t>::const_iterator
+                 it = stacks.begin(); it != stacks.end(); ++it) {
+            AddStack(&root, it->first, it->second);
+        }
+        PrintFlameNode(os, "all", root, root.count, root.count);
+    }
+    os << "</body></html>";
+    os.move_to(cntl->response_attachment());
+}
+
+void FlameGraphService::GetTabInfo(TabInfoList* info_list) const {
+    TabInfo* info = info_list->add();
+    info->path = "/flamegraph";
+    info->tab_name = "flamegraph";
+}
+
+} // namespace brpc
@@ -36,6 +36,7 @@ void IndexService::GetTabInfo(TabInfoList* info_list) const {
 DECLARE_bool(enable_rpcz);
 DECLARE_bool(enable_dir_service);
 DECLARE_bool(enable_threads_service);
+DECLARE_int32(sampling_profiler_hz);
 
 // Set in ProfilerLinker.
 bool cpu_profiler_enabled = false;
@@ -136,6 +137,9 @@ void IndexService::default_method(::google::protobuf::RpcController* controller,
 
            << Path("/hotspots/cpu", html_addr) << " : Profiling CPU"
            << (!cpu_profiler_enabled ? " (disabled)" : "") << NL
+           << Path("/flamegraph", html_addr)
+           << " : Flame graphs of CPU in recent seconds"
+           << (FLAGS_sampling_profiler_hz == 0 ? " (disabled)" : "") << NL
            << Path("/hotspots/heap", html_addr) << " : Profiling heap"
            << (!IsHeapProfilerEnabled() ? " (disabled)" : "") << NL
            << Path("/hotspots/growth", html_addr)
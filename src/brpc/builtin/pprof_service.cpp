@@ -48,6 +48,8 @@ void __attribute__((weak)) ProfilerStop();
 namespace bthread {
 bool ContentionProfilerStart(const char* filename);
 void ContentionProfilerStop();
+bool BlockingProfilerStart(const char* filename);
+void BlockingProfilerStop();
 }
 
 
@@ -206,6 +208,57 @@ void PProfService::contention(
     cntl->response_attachment().swap(portal);
 }
 
+void PProfService::blocking(
+    ::google::protobuf::RpcController* controller_base,
+    const ::brpc::ProfileRequest* /*request*/,
+    ::brpc::ProfileResponse* /*response*/,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller* cntl = static_cast<Controller*>(controller_base);
+    cntl->http_response().set_content_type("text/plain");
+    int sleep_sec = ReadSeconds(cntl);
+    if (sleep_sec <= 0) {
+        if (!cntl->Failed()) {
+            cntl->SetFailed(EINVAL, "You have to specify ?seconds=N. If you're "
+                            "using pprof, add --seconds=N");
+        }
+        return;
+    }
+    // Log requester
+    std::ostringstream client_info;
+    client_info << cntl->remote_side();
+    if (cntl->auth_context()) {
+        client_info << "(auth=" << cntl->auth_context()->user() << ')';
+    } else {
+        client_info << "(no auth)";
+    }
+    LOG(INFO) << client_info.str() << " requests for blocking profile for "
+              << sleep_sec << " seconds";
+
+    char prof_name[256];
+    if (MakeProfName(PROFILING_BLOCKING, prof_name, sizeof(prof_name)) != 0) {
+        cntl->SetFailed(errno, "Fail to create .prof file, %s", berror());
+        return;
+    }
+    if (!bthread::BlockingProfilerStart(prof_name)) {
+        cntl->SetFailed(EAGAIN, "Another profiler is running, try again later");
+        return;
+    }
+    if (bthread_usleep(sleep_sec * 1000000L) != 0) {
+        PLOG(WARNING) << "Profiling has been interrupted";
+    }
+    bthread::BlockingProfilerStop();
+
+    butil::fd_guard fd(open(prof_name, O_RDONLY));
+    if (fd < 0) {
+        cntl->SetFailed(ENOENT, "Fail to open %s", prof_name);
+        return;
+    }
+    butil::IOPortal portal;
+    portal.append_from_file_descriptor(fd, ULONG_MAX);
+    cntl->response_attachment().swap(portal);
+}
+
 void PProfService::heap(
     ::google::protobuf::RpcController* controller_base,
     const ::brpc::ProfileRequest* /*request*/,
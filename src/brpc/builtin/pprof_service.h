@@ -34,6 +34,11 @@ public:
                     const ::brpc::ProfileRequest* request,
                     ::brpc::ProfileResponse* response,
                     ::google::protobuf::Closure* done);
+
+    void blocking(::google::protobuf::RpcController* controller,
+                  const ::brpc::ProfileRequest* request,
+                  ::brpc::ProfileResponse* response,
+                  ::google::protobuf::Closure* done);
     
     void heap(::google::protobuf::RpcController* controller,
               const ::brpc::ProfileRequest* request,
@@ -16,12 +16,21 @@
 // under the License.
 
 
+#include <stdlib.h>
+#include <math.h>
 #include <vector>
-#include <iomanip>
 #include <map>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+#include <google/protobuf/io/coded_stream.h>
+#include "butil/iobuf.h"
+#include "butil/synchronization/lock.h"
 #include "brpc/controller.h"                // Controller
 #include "brpc/server.h"                    // Server
 #include "brpc/closure_guard.h"             // ClosureGuard
+#include "brpc/protocol.h"                  // GetProtobufByteSize
+#include "brpc/prometheus_metrics.pb.h"
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/builtin/common.h"
 #include "bvar/bvar.h"
@@ -38,156 +47,560 @@ namespace brpc {
 // Defined in server.cpp
 extern const char* const g_server_info_prefix;
 
-// This is a class that convert bvar result to prometheus output.
-// Currently the output only includes gauge and summary for two
-// reasons:
-// 1) We cannot tell gauge and counter just from name and what's
-// more counter is just another gauge.
-// 2) Histogram and summary is equivalent except that histogram
-// calculates quantiles in the server side.
-class PrometheusMetricsDumper : public bvar::Dumper {
+// Exposed variables are converted to metric families as follows:
+// 1) Numeric variables are gauges, since counters cannot be told from gauges
+// just from names and a counter is just another gauge.
+// 2) Variables exposed by LatencyRecorders of servers (with
+// g_server_info_prefix) are grouped into summaries.
+// 3) Histograms, e.g. the ones exposed by LatencyRecorders with
+// -bvar_latency_histogram, are histograms.
+// Which variables are exposed only changes on Variable::expose() and hide(),
+// so the conversion is cached and only values are read in scrapes.
+struct MetricDesc {
+    enum Type {
+        GAUGE,
+        SUMMARY,
+        HISTOGRAM,
+    };
+    Type type;
+    std::string name;
+    // GAUGE/HISTOGRAM: the variable.
+    // SUMMARY: variables of SummaryVar in the order.
+    std::vector<std::string> vars;
+    // SUMMARY: the histogram of the same latencies, empty if absent.
+    std::string histogram;
+};
+
+// Variables of a LatencyRecorder grouped into a summary.
+enum SummaryVar {
+    SUMMARY_P1,
+    SUMMARY_P2,
+    SUMMARY_P3,
+    SUMMARY_999,
+    SUMMARY_9999,
+    SUMMARY_MAX,
+    SUMMARY_AVG,
+    SUMMARY_COUNT,
+    SUMMARY_HISTOGRAM,
+    SUMMARY_VAR_NUM
+};
+
+typedef std::vector<MetricDesc> MetricDescs;
+
+static std::string QuantileLabel(double quantile) {
+    std::ostringstream os;
+    os << "{quantile=\"" << quantile << "\"}";
+    return os.str();
+}
+
+// Values of quantiles in the order of SummaryVar.
+static const std::vector<std::string>& SummaryQuantileLabels() {
+    static const std::vector<std::string> labels = {
+        QuantileLabel(bvar::FLAGS_bvar_latency_p1 / 100.0),
+        QuantileLabel(bvar::FLAGS_bvar_latency_p2 / 100.0),
+        QuantileLabel(bvar::FLAGS_bvar_latency_p3 / 100.0),
+        QuantileLabel(0.999),
+        QuantileLabel(0.9999),
+        QuantileLabel(1),
+    };
+    return labels;
+}
+
+// Returns the metric name and sets `var' if `name' ends with a suffix of
+// variables exposed by LatencyRecorder, returns empty string otherwise.
+static std::string MatchLatencyRecorderSuffix(const std::string& name,
+                                              SummaryVar* var) {
+    static const std::string suffixes[] = {
+        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p1),
+        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p2),
+        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p3),
+        "_latency_999", "_latency_9999", "_max_latency", "_latency", "_count",
+        "_latency_histogram"
+    };
+    BAIDU_CASSERT(arraysize(suffixes) == SUMMARY_VAR_NUM, suffixes_not_match);
+    butil::StringPiece metric_name(name);
+    for (int i = 0; i < SUMMARY_VAR_NUM; ++i) {
+        if (metric_name.ends_with(suffixes[i])) {
+            metric_name.remove_suffix(suffixes[i].size());
+            *var = (SummaryVar)i;
+            return metric_name.as_string();
+        }
+    }
+    return std::string();
+}
+
+// Returns true if `desc' is a number acceptable by prometheus.
+static bool IsNumber(const std::string& desc) {
+    if (desc.empty()) {
+        return false;
+    }
+    char* endptr = NULL;
+    strtod(desc.c_str(), &endptr);
+    return *endptr == '\0';
+}
+
+static void BuildMetricDescs(const std::string& server_prefix,
+                             MetricDescs* descs) {
+    std::vector<std::string> names;
+    bvar::Variable::list_exposed(&names, bvar::DISPLAY_ON_PLAIN_TEXT);
+    std::sort(names.begin(), names.end());
+
+    // Group variables of LatencyRecorders of servers by the metric name.
+    std::map<std::string, std::vector<std::string> > summaries;
+    for (size_t i = 0; i < names.size(); ++i) {
+        SummaryVar var;
+        if (!butil::StringPiece(names[i]).starts_with(server_prefix)) {
+            continue;
+        }
+        const std::string metric_name = MatchLatencyRecorderSuffix(names[i], &var);
+        if (!metric_name.empty()) {
+            std::vector<std::string>& vars = summaries[metric_name];
+            vars.resize(SUMMARY_VAR_NUM);
+            vars[var] = names[i];
+        }
+    }
+    std::map<std::string, const std::vector<std::string>*> grouped;
+    for (std::map<std::string, std::vector<std::string> >::iterator
+             it = summaries.begin(); it != summaries.end(); ++it) {
+        const std::vector<std::string>& vars = it->second;
+        if (std::find(vars.begin(), vars.begin() + SUMMARY_HISTOGRAM,
+                      std::string()) != vars.begin() + SUMMARY_HISTOGRAM) {
+            // Incomplete, not exposed by LatencyRecorder.
+            continue;
+        }
+        for (size_t i = 0; i < vars.size(); ++i) {
+            if (!vars[i].empty()) {
+                grouped[vars[i]] = &it->second;
+            }
+        }
+    }
+
+    descs->clear();
+    std::ostringstream os;
+    bvar::detail::HistogramBuckets buckets;
+    for (size_t i = 0; i < names.size(); ++i) {
+        std::map<std::string, const std::vector<std::string>*>::const_iterator
+            it = grouped.find(names[i]);
+        if (it != grouped.end()) {
+            const std::vector<std::string>& vars = *it->second;
+            if (names[i] != vars[SUMMARY_AVG]) {
+                // Add the summary once.
+                continue;
+            }
+            MetricDesc desc;
+            desc.type = MetricDesc::SUMMARY;
+            desc.name = names[i].substr(0, names[i].size() - 8/*_latency*/);
+            desc.vars.assign(vars.begin(), vars.begin() + SUMMARY_HISTOGRAM);
+            desc.histogram = vars[SUMMARY_HISTOGRAM];
+            descs->push_back(desc);
+            continue;
+        }
+        os.str("");
+        if (bvar::Variable::describe_exposed(names[i], os) != 0) {
+            continue;
+        }
+        MetricDesc desc;
+        if (IsNumber(os.str())) {
+            desc.type = MetricDesc::GAUGE;
+        } else if (bvar::Variable::get_exposed_histogram(names[i], &buckets) == 0) {
+            desc.type = MetricDesc::HISTOGRAM;
+        } else {
+            // there is no necessary to monitor string in prometheus
+            continue;
+        }
+        desc.name = names[i];
+        desc.vars.push_back(names[i]);
+        descs->push_back(desc);
+    }
+}
+
+// Rebuilt when any variable is exposed or hidden.
+struct MetricDescCache {
+    MetricDescCache() : version(-1) {}
+    butil::Mutex mutex;
+    int64_t version;
+    std::shared_ptr<const MetricDescs> descs;
+};
+
+static std::shared_ptr<const MetricDescs> GetMetricDescs() {
+    static MetricDescCache* cache = new MetricDescCache;
+    BAIDU_SCOPED_LOCK(cache->mutex);
+    // Read before listing, changes during the building are seen in next call.
+    const int64_t version = bvar::Variable::exposed_version();
+    if (cache->descs == NULL || cache->version != version) {
+        std::shared_ptr<MetricDescs> descs(new MetricDescs);
+        BuildMetricDescs(g_server_info_prefix, descs.get());
+        cache->descs = descs;
+        cache->version = version;
+    }
+    return cache->descs;
+}
+
+// Put the value of the exposed variable `name' into `value'.
+static bool GetNumber(const std::string& name, std::ostringstream& os,
+                      std::string* value) {
+    os.str("");
+    if (bvar::Variable::describe_exposed(name, os) != 0) {
+        return false;
+    }
+    *value = os.str();
+    return IsNumber(*value);
+}
+
+// Dump values of cached metric families and multi-dimensional variables.
+static int DumpMetrics(bvar::Dumper* dumper) {
+    std::shared_ptr<const MetricDescs> descs = GetMetricDescs();
+    std::ostringstream os;
+    std::string values[SUMMARY_VAR_NUM];
+    bvar::detail::HistogramBuckets buckets;
+    const std::vector<std::string>& quantile_labels = SummaryQuantileLabels();
+    for (size_t i = 0; i < descs->size(); ++i) {
+        const MetricDesc& desc = (*descs)[i];
+        switch (desc.type) {
+        case MetricDesc::GAUGE:
+            if (GetNumber(desc.vars[0], os, &values[0])) {
+                dumper->dump_comment(desc.name, "gauge");
+                dumper->dump(desc.name, values[0]);
+            }
+            break;
+        case MetricDesc::HISTOGRAM:
+            if (bvar::Variable::get_exposed_histogram(desc.vars[0], &buckets) == 0) {
+                dumper->dump_comment(desc.name, "histogram");
+                dumper->dump_histogram(desc.name, std::string(), buckets);
+            }
+            break;
+        case MetricDesc::SUMMARY: {
+            size_t j = 0;
+            for (; j < desc.vars.size() &&
+                     GetNumber(desc.vars[j], os, &values[j]); ++j) {}
+            if (j != desc.vars.size()) {
+                // Hidden after the caching.
+                break;
+            }
+            const bool has_histogram = !desc.histogram.empty() &&
+                bvar::Variable::get_exposed_histogram(desc.histogram, &buckets) == 0;
+            dumper->dump_comment(desc.name, "summary");
+            for (j = 0; j < quantile_labels.size(); ++j) {
+                dumper->dump(desc.name + quantile_labels[j], values[j]);
+            }
+            const int64_t count = strtoll(values[SUMMARY_COUNT].c_str(), NULL, 10);
+            // There is no sum of latency without histograms, just use
+            // average * count as approximation
+            const int64_t sum = has_histogram ? buckets.sum() :
+                strtoll(values[SUMMARY_AVG].c_str(), NULL, 10) * count;
+            dumper->dump(desc.name + "_sum", std::to_string(sum));
+            dumper->dump(desc.name + "_count", values[SUMMARY_COUNT]);
+            if (has_histogram) {
+                dumper->dump_comment(desc.histogram, "histogram");
+                dumper->dump_histogram(desc.histogram, std::string(), buckets);
+            }
+            break;
+        }
+        }
+    }
+
+    if (bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number > 0) {
+        // dump_exposed() returns (size_t)-1 on error.
+        const int ndump_md = bvar::MVariable::dump_exposed(dumper, NULL);
+        if (ndump_md < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write metrics in the text format of prometheus.
+class PrometheusTextDumper : public bvar::Dumper {
 public:
-    explicit PrometheusMetricsDumper(butil::IOBufBuilder* os,
-                                     const std::string& server_prefix)
-        : _os(os)
-        , _server_prefix(server_prefix) {
+    explicit PrometheusTextDumper(butil::IOBufBuilder* os) : _os(os) {}
+
+    bool dump(const std::string& name, const butil::StringPiece& desc) override {
+        if (!desc.empty() && desc[0] == '"') {
+            // there is no necessary to monitor string in prometheus
+            return false;
+        }
+        *_os << name << ' ' << desc << '\n';
+        return true;
     }
 
-    bool dump(const std::string& name, const butil::StringPiece& desc) override;
+    bool dump_comment(const std::string& name, const std::string& type) override {
+        *_os << "# HELP " << name << '\n'
+             << "# TYPE " << name << ' ' << type << '\n';
+        return true;
+    }
 
 private:
-    DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
+    DISALLOW_COPY_AND_ASSIGN(PrometheusTextDumper);
 
-    // Return true iff name ends with suffix output by LatencyRecorder.
-    bool DumpLatencyRecorderSuffix(const butil::StringPiece& name,
-                                   const butil::StringPiece& desc);
+    butil::IOBufBuilder* _os;
+};
 
-    // 6 is the number of bvars in LatencyRecorder that indicating percentiles
-    static const int NPERCENTILES = 6;
+// Write metrics as length-delimited io.prometheus.client.MetricFamily.
+class PrometheusProtobufDumper : public bvar::Dumper {
+public:
+    explicit PrometheusProtobufDumper(butil::IOBuf* out) : _out(out) {}
+    ~PrometheusProtobufDumper() { Flush(); }
 
-    struct SummaryItems {
-        std::string latency_percentiles[NPERCENTILES];
-        int64_t latency_avg;
-        int64_t count;
-        std::string metric_name;
+    bool dump(const std::string& name, const butil::StringPiece& desc) override;
+    bool dump_comment(const std::string& name, const std::string& type) override;
+    bool dump_histogram(const std::string& name, const std::string& labels,
+                        const bvar::detail::HistogramBuckets& buckets) override;
 
-        bool IsComplete() const { return !metric_name.empty(); }
-    };
-    const SummaryItems* ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
-                                                     const butil::StringPiece& desc);
+    // Write the current family into the output.
+    void Flush();
 
 private:
-    butil::IOBufBuilder* _os;
-    const std::string _server_prefix;
-    std::map<std::string, SummaryItems> _m;
+    DISALLOW_COPY_AND_ASSIGN(PrometheusProtobufDumper);
+
+    prometheus::Metric* AddMetric(const std::string& labels);
+
+    butil::IOBuf* _out;
+    prometheus::MetricFamily _family;
+    // Summaries of the current family are dumped in multiple lines, which
+    // are merged by the labels.
+    std::map<std::string, int> _summaries;
 };
 
-bool PrometheusMetricsDumper::dump(const std::string& name,
-                                   const butil::StringPiece& desc) {
-    if (!desc.empty() && desc[0] == '"') {
-        // there is no necessary to monitor string in prometheus
+// Split `key' like name{a="b",c="d"} into the name and the labels.
+static bool ParseMetricKey(const butil::StringPiece& key, std::string* name,
+                           std::vector<std::pair<std::string, std::string> >* labels) {
+    labels->clear();
+    const size_t brace = key.find('{');
+    if (brace == butil::StringPiece::npos) {
+        key.CopyToString(name);
         return true;
     }
-    if (DumpLatencyRecorderSuffix(name, desc)) {
-        // Has encountered name with suffix exposed by LatencyRecorder,
-        // Leave it to DumpLatencyRecorderSuffix to output Summary.
-        return true;
+    key.substr(0, brace).CopyToString(name);
+    size_t i = brace + 1;
+    while (i < key.size() && key[i] != '}') {
+        const size_t eq = key.find('=', i);
+        if (eq == butil::StringPiece::npos || eq + 1 >= key.size() ||
+            key[eq + 1] != '"') {
+            return false;
+        }
+        labels->push_back(std::make_pair(key.substr(i, eq - i).as_string(),
+                                         std::string()));
+        std::string& value = labels->back().second;
+        for (i = eq + 2; i < key.size() && key[i] != '"'; ++i) {
+            if (key[i] == '\\' && i + 1 < key.size()) {
+                ++i;
+                value.push_back(key[i] == 'n' ? '\n' : key[i]);
+            } else {
+                value.push_back(key[i]);
+            }
+        }
+        if (i >= key.size()) {
+            return false;
+        }
+        ++i;  // skip "
+        if (i < key.size() && key[i] == ',') {
+            ++i;
+        }
     }
-    *_os << "# HELP " << name << '\n'
-         << "# TYPE " << name << " gauge" << '\n'
-         << name << " " << desc << '\n';
     return true;
 }
 
-const PrometheusMetricsDumper::SummaryItems*
-PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
-                                                      const butil::StringPiece& desc) {
-    static std::string latency_names[] = {
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p1),
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p2),
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p3),
-        "_latency_999", "_latency_9999", "_max_latency"
-    };
-    CHECK(NPERCENTILES == arraysize(latency_names));
+static prometheus::MetricType ToMetricType(const std::string& type) {
+    if (type == "counter") {
+        return prometheus::COUNTER;
+    } else if (type == "gauge") {
+        return prometheus::GAUGE;
+    } else if (type == "summary") {
+        return prometheus::SUMMARY;
+    } else if (type == "histogram") {
+        return prometheus::HISTOGRAM;
+    }
+    return prometheus::UNTYPED;
+}
+
+bool PrometheusProtobufDumper::dump_comment(const std::string& name,
+                                            const std::string& type) {
+    Flush();
+    _family.set_name(name);
+    _family.set_type(ToMetricType(type));
+    return true;
+}
+
+prometheus::Metric* PrometheusProtobufDumper::AddMetric(const std::string& labels) {
+    std::string name;
+    std::vector<std::pair<std::string, std::string> > label_pairs;
+    if (!ParseMetricKey(labels, &name, &label_pairs)) {
+        return NULL;
+    }
+    prometheus::Metric* metric = _family.add_metric();
+    for (size_t i = 0; i < label_pairs.size(); ++i) {
+        prometheus::LabelPair* label = metric->add_label();
+        label->set_name(label_pairs[i].first);
+        label->set_value(label_pairs[i].second);
+    }
+    return metric;
+}
+
+bool PrometheusProtobufDumper::dump(const std::string& key,
+                                    const butil::StringPiece& desc) {
     const std::string desc_str = desc.as_string();
-    butil::StringPiece metric_name(name);
-    for (int i = 0; i < NPERCENTILES; ++i) {
-        if (!metric_name.ends_with(latency_names[i])) {
-            continue;
+    if (!IsNumber(desc_str)) {
+        return false;
+    }
+    const double value = strtod(desc_str.c_str(), NULL);
+    const size_t brace = std::min(key.find('{'), key.size());
+    const butil::StringPiece name(key.data(), brace);
+    std::string labels = key.substr(brace);
+    if (!_family.has_name()) {
+        _family.set_name(name.data(), name.size());
+        _family.set_type(prometheus::UNTYPED);
+    }
+    prometheus::Metric* metric = NULL;
+    switch (_family.type()) {
+    case prometheus::SUMMARY: {
+        double quantile = -1;
+        const size_t pos = labels.find("quantile=\"");
+        if (pos != std::string::npos) {
+            quantile = strtod(labels.c_str() + pos + 10, NULL);
+            // Remove the quantile and the comma before or after it.
+            size_t end = labels.find('"', pos + 10) + 1;
+            size_t begin = pos;
+            if (labels[begin - 1] == ',') {
+                --begin;
+            } else if (labels[end] == ',') {
+                ++end;
+            }
+            labels.erase(begin, end - begin);
+            if (labels == "{}") {
+                labels.clear();
+            }
+        }
+        std::map<std::string, int>::iterator it = _summaries.find(labels);
+        if (it != _summaries.end()) {
+            metric = _family.mutable_metric(it->second);
+        } else {
+            metric = AddMetric(labels);
+            if (metric == NULL) {
+                return false;
+            }
+            _summaries[labels] = _family.metric_size() - 1;
+        }
+        prometheus::Summary* summary = metric->mutable_summary();
+        if (quantile >= 0) {
+            prometheus::Quantile* q = summary->add_quantile();
+            q->set_quantile(quantile);
+            q->set_value(value);
+        } else if (name.ends_with("_sum")) {
+            summary->set_sample_sum(value);
+        } else if (name.ends_with("_count")) {
+            summary->set_sample_count((uint64_t)value);
         }
-        metric_name.remove_suffix(latency_names[i].size());
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_percentiles[i] = desc_str;
-        if (i == NPERCENTILES - 1) {
-            // '_max_latency' is the last suffix name that appear in the sorted bvar
-            // list, which means all related percentiles have been gathered and we are
-            // ready to output a Summary.
-            si->metric_name = metric_name.as_string();
-        }
-        return si;
-    }
-    // Get the average of latency in recent window size
-    if (metric_name.ends_with("_latency")) {
-        metric_name.remove_suffix(8);
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_avg = strtoll(desc_str.data(), NULL, 10);
-        return si;
-    }
-    if (metric_name.ends_with("_count")) {
-        metric_name.remove_suffix(6);
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->count = strtoll(desc_str.data(), NULL, 10);
-        return si;
-    }
-    return NULL;
-}
-
-bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
-    const butil::StringPiece& name,
-    const butil::StringPiece& desc) {
-    if (!name.starts_with(_server_prefix)) {
+        return true;
+    }
+    case prometheus::HISTOGRAM:
+        // Buckets are dumped by dump_histogram().
         return false;
+    default:
+        break;
     }
-    const SummaryItems* si = ProcessLatencyRecorderSuffix(name, desc);
-    if (!si) {
+    metric = AddMetric(labels);
+    if (metric == NULL) {
         return false;
     }
-    if (!si->IsComplete()) {
-        return true;
+    switch (_family.type()) {
+    case prometheus::COUNTER:
+        metric->mutable_counter()->set_value(value);
+        break;
+    case prometheus::GAUGE:
+        metric->mutable_gauge()->set_value(value);
+        break;
+    default:
+        metric->mutable_untyped()->set_value(value);
+        break;
+    }
+    return true;
+}
+
+bool PrometheusProtobufDumper::dump_histogram(
+    const std::string&, const std::string& labels,
+    const bvar::detail::HistogramBuckets& buckets) {
+    prometheus::Metric* metric = AddMetric(labels);
+    if (metric == NULL) {
+        return false;
+    }
+    prometheus::Histogram* h = metric->mutable_histogram();
+    h->set_sample_count(buckets.count());
+    h->set_sample_sum(buckets.sum());
+    // Classic buckets for scrapers without native histograms.
+    std::vector<std::pair<double, int64_t> > cumulative;
+    buckets.get_cumulative_counts(bvar::FLAGS_bvar_histogram_dump_schema,
+                                  &cumulative);
+    for (size_t i = 0; i < cumulative.size(); ++i) {
+        prometheus::Bucket* b = h->add_bucket();
+        b->set_upper_bound(cumulative[i].first);
+        b->set_cumulative_count(cumulative[i].second);
+    }
+    // Native buckets have the same layout as HistogramBuckets. Values are
+    // integers so that the zero bucket only counts zeros.
+    h->set_schema(bvar::detail::HistogramBuckets::SCHEMA);
+    h->set_zero_threshold(ldexp(1.0, -128));
+    h->set_zero_count(buckets.zero_count());
+    prometheus::BucketSpan* span = NULL;
+    int last = 0;
+    int64_t prev = 0;
+    for (int i = buckets.begin_index(); i < buckets.end_index(); ++i) {
+        const int64_t n = buckets.bucket_count(i);
+        if (n == 0) {
+            continue;
+        }
+        if (span == NULL || i - last > 3) {
+            // Start a new span after more than 2 empty buckets.
+            const int offset = (span == NULL ? i : i - last - 1);
+            span = h->add_positive_span();
+            span->set_offset(offset);
+            span->set_length(0);
+        } else {
+            for (++last; last < i; ++last) {
+                h->add_positive_delta(-prev);
+                prev = 0;
+                span->set_length(span->length() + 1);
+            }
+        }
+        h->add_positive_delta(n - prev);
+        prev = n;
+        span->set_length(span->length() + 1);
+        last = i;
     }
-    *_os << "# HELP " << si->metric_name << '\n'
-         << "# TYPE " << si->metric_name << " summary\n"
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p1) / 100 << "\"} "
-         << si->latency_percentiles[0] << '\n'
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p2) / 100 << "\"} "
-         << si->latency_percentiles[1] << '\n'
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p3) / 100 << "\"} "
-         << si->latency_percentiles[2] << '\n'
-         << si->metric_name << "{quantile=\"0.999\"} "
-         << si->latency_percentiles[3] << '\n'
-         << si->metric_name << "{quantile=\"0.9999\"} "
-         << si->latency_percentiles[4] << '\n'
-         << si->metric_name << "{quantile=\"1\"} "
-         << si->latency_percentiles[5] << '\n'
-         << si->metric_name << "{quantile=\"avg\"} "
-         << si->latency_avg << '\n'
-         << si->metric_name << "_sum "
-         // There is no sum of latency in bvar output, just use
-         // average * count as approximation
-         << si->latency_avg * si->count << '\n'
-         << si->metric_name << "_count " << si->count << '\n';
     return true;
 }
 
+void PrometheusProtobufDumper::Flush() {
+    if (_family.metric_size() > 0) {
+        const uint32_t size = GetProtobufByteSize(_family);
+        butil::IOBufAsZeroCopyOutputStream wrapper(_out);
+        google::protobuf::io::CodedOutputStream coded_out(&wrapper);
+        coded_out.WriteVarint32(size);
+        _family.SerializeWithCachedSizes(&coded_out);
+        CHECK(!coded_out.HadError());
+    }
+    _family.Clear();
+    _summaries.clear();
+}
+
+static const char* const PROTOBUF_CONTENT_TYPE =
+    "application/vnd.google.protobuf; "
+    "proto=io.prometheus.client.MetricFamily; encoding=delimited";
+
 void PrometheusMetricsService::default_method(::google::protobuf::RpcController* cntl_base,
                                               const ::brpc::MetricsRequest*,
                                               ::brpc::MetricsResponse*,
                                               ::google::protobuf::Closure* done) {
     ClosureGuard done_guard(done);
     Controller *cntl = static_cast<Controller*>(cntl_base);
+    const std::string* accept = cntl->http_request().GetHeader("Accept");
+    if (accept != NULL &&
+        accept->find("application/vnd.google.protobuf") != std::string::npos) {
+        cntl->http_response().set_content_type(PROTOBUF_CONTENT_TYPE);
+        if (DumpPrometheusMetricsToIOBufAsProtobuf(&cntl->response_attachment()) != 0) {
+            cntl->SetFailed("Fail to dump metrics");
+        }
+        return;
+    }
     cntl->http_response().set_content_type("text/plain");
     if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment()) != 0) {
         cntl->SetFailed("Fail to dump metrics");
@@ -197,21 +610,23 @@ void PrometheusMetricsService::default_method(::google::protobuf::RpcController*
 
 int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output) {
     butil::IOBufBuilder os;
-    PrometheusMetricsDumper dumper(&os, g_server_info_prefix);
-    const int ndump = bvar::Variable::dump_exposed(&dumper, NULL);
-    if (ndump < 0) {
+    PrometheusTextDumper dumper(&os);
+    if (DumpMetrics(&dumper) != 0) {
         return -1;
     }
-    os.move_to(*output);
+    output->append(butil::IOBuf::Movable(os.buf()));
+    return 0;
+}
 
-    if (bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number > 0) {
-        PrometheusMetricsDumper dumper_md(&os, g_server_info_prefix);
-        const int ndump_md = bvar::MVariable::dump_exposed(&dumper_md, NULL);
-        if (ndump_md < 0) {
+int DumpPrometheusMetricsToIOBufAsProtobuf(butil::IOBuf* output) {
+    butil::IOBuf buf;
+    {
+        PrometheusProtobufDumper dumper(&buf);
+        if (DumpMetrics(&dumper) != 0) {
             return -1;
         }
-        output->append(butil::IOBuf::Movable(os.buf()));
     }
+    output->append(butil::IOBuf::Movable(buf));
     return 0;
 }
 
@@ -31,8 +31,15 @@ public:
                         ::google::protobuf::Closure* done) override;
 };
 
+// Append metrics in the text format of prometheus to `output'.
+// Returns 0 on success, -1 otherwise.
 int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output);
 
+// Append metrics as length-delimited io.prometheus.client.MetricFamily
+// (see brpc/prometheus_metrics.proto) to `output', which is cheaper to parse.
+// Returns 0 on success, -1 otherwise.
+int DumpPrometheusMetricsToIOBufAsProtobuf(butil::IOBuf* output);
+
 } // namepace brpc
 
 #endif  // BRPC_PROMETHEUS_METRICS_SERVICE_H
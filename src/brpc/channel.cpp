@@ -53,7 +53,11 @@ ChannelOptions::ChannelOptions()
     , use_rdma(false)
     , auth(NULL)
     , retry_policy(NULL)
+    , retry_budget(NULL)
+    , throttle(NULL)
+    , backup_request_policy(NULL)
     , ns_filter(NULL)
+    , subset_size(0)
 {}
 
 ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
@@ -385,7 +389,8 @@ int Channel::Init(const char* ns_url,
     if (CreateSocketSSLContext(_options, &ns_opt.ssl_ctx) != 0) {
         return -1;
     }
-    if (lb->Init(ns_url, lb_name, _options.ns_filter, &ns_opt) != 0) {
+    if (lb->Init(ns_url, lb_name, _options.ns_filter, &ns_opt,
+                 _options.subset_size > 0 ? _options.subset_size : 0) != 0) {
         LOG(ERROR) << "Fail to initialize LoadBalancerWithNaming";
         delete lb;
         return -1;
@@ -435,6 +440,8 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     }
     cntl->_preferred_index = _preferred_index;
     cntl->_retry_policy = _options.retry_policy;
+    cntl->_retry_budget = _options.retry_budget;
+    cntl->_throttle = _options.throttle;
     if (_options.enable_circuit_breaker) {
         cntl->add_flag(Controller::FLAGS_ENABLED_CIRCUIT_BREAKER);
     }
@@ -464,7 +471,8 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     }
     cntl->set_used_by_rpc();
 
-    if (cntl->_sender == NULL && IsTraceable(Span::tls_parent())) {
+    if (cntl->_sender == NULL && !cntl->is_tracing_disabled() &&
+        IsTraceable(Span::tls_parent())) {
         const int64_t start_send_us = butil::cpuwide_time_us();
         const std::string* method_name = NULL;
         if (_get_method_name) {
@@ -491,9 +499,6 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     // overriding connect_timeout_ms does not make sense, just use the
     // one in ChannelOptions
     cntl->_connect_timeout_ms = _options.connect_timeout_ms;
-    if (cntl->backup_request_ms() == UNSET_MAGIC_NUM) {
-        cntl->set_backup_request_ms(_options.backup_request_ms);
-    }
     if (cntl->connection_type() == CONNECTION_TYPE_UNKNOWN) {
         cntl->set_connection_type(_options.connection_type);
     }
@@ -502,6 +507,12 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     cntl->_pack_request = _pack_request;
     cntl->_method = method;
     cntl->_auth = _options.auth;
+    cntl->_backup_request_policy = _options.backup_request_policy;
+    if (cntl->backup_request_ms() == UNSET_MAGIC_NUM) {
+        cntl->set_backup_request_ms(_options.backup_request_policy ?
+            _options.backup_request_policy->GetBackupRequestMs(cntl) :
+            _options.backup_request_ms);
+    }
 
     if (SingleServer()) {
         cntl->_single_server_id = _server_id;
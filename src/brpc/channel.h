@@ -34,6 +34,9 @@
 #include "brpc/controller.h"                // brpc::Controller
 #include "brpc/details/profiler_linker.h"
 #include "brpc/retry_policy.h"
+#include "brpc/backup_request_policy.h"
+#include "brpc/retry_budget.h"
+#include "brpc/adaptive_throttle.h"
 #include "brpc/naming_service_filter.h"
 
 namespace brpc {
@@ -119,6 +122,31 @@ struct ChannelOptions {
     // Default: NULL
     const RetryPolicy* retry_policy;
 
+    // Limit retries of all RPCs of this channel to a ratio of successful
+    // RPCs. The class is defined in src/brpc/retry_budget.h
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used. Channels to the same cluster may share one budget.
+    // Default: NULL
+    RetryBudget* retry_budget;
+
+    // Drop requests locally before sending when servers reject too many
+    // requests with ELIMIT. The class is defined in
+    // src/brpc/adaptive_throttle.h
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used.
+    // Default: NULL
+    AdaptiveThrottle* throttle;
+
+    // Customize when and whether backup requests are sent, e.g.
+    // AdaptiveBackupRequestPolicy sends backup requests after a percentile
+    // of recent latencies with a budget. backup_request_ms is ignored if
+    // this field is set. The interface is defined in
+    // src/brpc/backup_request_policy.h
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used.
+    // Default: NULL
+    BackupRequestPolicy* backup_request_policy;
+
     // Filter ServerNodes (i.e. based on `tag' field of `ServerNode')
     // which are generated by NamingService. The interface is defined
     // in src/brpc/naming_service_filter.h
@@ -127,6 +155,14 @@ struct ChannelOptions {
     // Default: NULL
     const NamingServiceFilter* ns_filter;
 
+    // Only connect to a subset of at most `subset_size' servers of the
+    // NamingService. Subsets of clients are chosen deterministically by
+    // -subset_client_id and spread evenly over all servers, which bounds
+    // connections of large fan-in services. A removed server only changes
+    // subsets containing it.
+    // Default: 0 (use all servers)
+    int subset_size;
+
     // Channels with same connection_group share connections.
     // In other words, set to a different value to stop sharing connections.
     // Case-sensitive, leading and trailing spaces are ignored.
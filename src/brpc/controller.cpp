@@ -39,6 +39,9 @@
 #include "brpc/server.h"   // Server::_session_local_data_pool
 #include "brpc/simple_data_pool.h"
 #include "brpc/retry_policy.h"
+#include "brpc/retry_budget.h"
+#include "brpc/adaptive_throttle.h"
+#include "brpc/backup_request_policy.h"
 #include "brpc/stream_impl.h"
 #include "brpc/policy/streaming_rpc_protocol.h" // FIXME
 #include "brpc/rpc_dump.h"
@@ -127,11 +130,18 @@ const Controller* GetSubControllerOfSelectiveChannel(
 DECLARE_bool(usercode_in_pthread);
 static const int MAX_RETRY_COUNT = 1000;
 static bvar::Adder<int64_t>* g_ncontroller = NULL;
+// Backup requests sent, responded before and after the original requests.
+static bvar::Adder<int64_t>* g_nbackup_request = NULL;
+static bvar::Adder<int64_t>* g_nbackup_request_won = NULL;
+static bvar::Adder<int64_t>* g_nbackup_request_lost = NULL;
 
 static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
 
 static void CreateVars() {
     g_ncontroller = new bvar::Adder<int64_t>("rpc_controller_count");
+    g_nbackup_request = new bvar::Adder<int64_t>("rpc_backup_request_count");
+    g_nbackup_request_won = new bvar::Adder<int64_t>("rpc_backup_request_won");
+    g_nbackup_request_lost = new bvar::Adder<int64_t>("rpc_backup_request_lost");
 }
 
 Controller::Controller() {
@@ -249,6 +259,9 @@ void Controller::ResetPods() {
     _request_protocol = PROTOCOL_UNKNOWN;
     _max_retry = UNSET_MAGIC_NUM;
     _retry_policy = NULL;
+    _backup_request_policy = NULL;
+    _retry_budget = NULL;
+    _throttle = NULL;
     _correlation_id = INVALID_BTHREAD_ID;
     _connection_type = CONNECTION_TYPE_UNKNOWN;
     _timeout_ms = UNSET_MAGIC_NUM;
@@ -611,6 +624,15 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
             SetFailed(rc, "Fail to add timer");
             goto END_OF_RPC;
         }
+        if (_backup_request_policy && !_backup_request_policy->DoBackup(this)) {
+            // Keep waiting for _current_call until the timeout.
+            if (_span) {
+                _span->Annotate("Backup request is suppressed");
+            }
+            _error_code = saved_error;
+            CHECK_EQ(0, bthread_id_unlock(info.id));
+            return;
+        }
         if (!SingleServer()) {
             if (_accessed == NULL) {
                 _accessed = ExcludedServers::Create(
@@ -631,6 +653,11 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
         }
         ++_current_call.nretry;
         add_flag(FLAGS_BACKUP_REQUEST);
+        *g_nbackup_request << 1;
+        if (_span) {
+            _span->Annotate("Sending backup request after %dms",
+                            (int)_backup_request_ms);
+        }
         return IssueRPC(butil::gettimeofday_us());
     } else {
         auto retry_policy = _retry_policy ? _retry_policy : DefaultRetryPolicy();
@@ -639,6 +666,12 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
             //  * we intercepted error from _unfinished_call in OnVersionedRPCReturned
             //  * ERPCTIMEDOUT/ECANCELED are not retrying error by default.
             CHECK_EQ(current_id(), info.id) << "error_code=" << _error_code;
+            if (_retry_budget && !_retry_budget->TryRetry()) {
+                if (_span) {
+                    _span->Annotate("Retry budget is exhausted");
+                }
+                goto END_OF_RPC;
+            }
             if (!SingleServer()) {
                 if (_accessed == NULL) {
                     _accessed = ExcludedServers::Create(
@@ -760,9 +793,15 @@ void Controller::Call::OnComplete(
             sending_sock->AddRecentError();
         }
 
-        if (enable_circuit_breaker) {
-            sending_sock->FeedbackCircuitBreaker(error_code,
-                butil::gettimeofday_us() - begin_time_us);
+        if (c->_throttle) {
+            c->_throttle->OnResponse(peer_id, error_code, responded);
+        }
+
+        if (enable_circuit_breaker &&
+            sending_sock->FeedbackCircuitBreaker(
+                error_code, butil::gettimeofday_us() - begin_time_us) &&
+            c->_retry_budget) {
+            c->_retry_budget->OnServerIsolated();
         }
     }
 
@@ -867,6 +906,12 @@ void Controller::EndRPC(const CompletionInfo& info) {
             _unfinished_call->OnComplete(this, err, false, false);
             delete _unfinished_call;
             _unfinished_call = NULL;
+            if (info.id == current_id() && _error_code == 0) {
+                *g_nbackup_request_won << 1;
+                if (_span) {
+                    _span->Annotate("Backup request won");
+                }
+            }
         }
         // TODO: Replace this with stream_creator.
         HandleStreamConnection(_current_call.sending_sock.get());
@@ -894,6 +939,10 @@ void Controller::EndRPC(const CompletionInfo& info) {
             if (get_id(_unfinished_call->nretry) == info.id) {
                 _unfinished_call->OnComplete(
                         this, _error_code, info.responded, true);
+                *g_nbackup_request_lost << 1;
+                if (_span) {
+                    _span->Annotate("Original request won");
+                }
             } else {
                 CHECK(false) << "A previous non-backup request responded";
                 _unfinished_call->OnComplete(this, ECANCELED, false, true);
@@ -980,6 +1029,16 @@ void Controller::DoneInBackupThread() {
     }
 }
 
+void Controller::OnRPCEnd(int64_t end_time_us) {
+    _end_time_us = end_time_us;
+    if (_backup_request_policy) {
+        _backup_request_policy->OnRPCEnd(this);
+    }
+    if (_retry_budget && !Failed()) {
+        _retry_budget->OnSuccess();
+    }
+}
+
 void Controller::SubmitSpan() {
     const int64_t now = butil::cpuwide_time_us();
     _span->set_start_callback_us(now);
@@ -1075,6 +1134,13 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
         // here.
         _remote_side = tmp_sock->remote_side();
     }
+    if (_throttle && !is_health_check_call() &&
+        !_throttle->OnRequest(_current_call.peer_id)) {
+        tmp_sock.reset();
+        SetFailed(ELIMIT, "Throttled by client since %s rejected too many "
+                  "requests", endpoint2str(_remote_side).c_str());
+        return HandleSendFailed();
+    }
     if (_stream_creator) {
         _current_call.stream_user_data =
             _stream_creator->OnCreatingStream(&tmp_sock, this);
@@ -70,6 +70,9 @@ class StreamSettings;
 class SampledRequest;
 class MongoContext;
 class RetryPolicy;
+class BackupRequestPolicy;
+class RetryBudget;
+class AdaptiveThrottle;
 class InputMessageBase;
 class ThriftStub;
 namespace policy {
@@ -145,17 +148,20 @@ friend void policy::ProcessThriftRequest(InputMessageBase*);
     static const uint32_t FLAGS_PB_SINGLE_REPEATED_TO_ARRAY = (1 << 20);
     static const uint32_t FLAGS_MANAGE_HTTP_BODY_ON_ERROR = (1 << 21);
     static const uint32_t FLAGS_WRITE_TO_SOCKET_IN_BACKGROUND = (1 << 22);
+    static const uint32_t FLAGS_DISABLE_TRACING = (1 << 23);
 
 public:
     struct Inheritable {
-        Inheritable() : log_id(0) {}
+        Inheritable() : log_id(0), priority(0) {}
         void Reset() {
             log_id = 0;
             request_id.clear();
+            priority = 0;
         }
 
         uint64_t log_id;
         std::string request_id;
+        int32_t priority;
     };
 
 public:
@@ -218,6 +224,13 @@ public:
 
     void set_request_id(std::string request_id) { _inheritable.request_id = request_id; }
 
+    // Importance of the request, sent to server along with the request.
+    // Default is 0, requests with negative priorities are rejected earlier
+    // by server-side concurrency limiters supporting priorities (e.g.
+    // "gradient") when the server is overloaded. Propagated to downstream
+    // calls through Inheritable.
+    void set_request_priority(int32_t priority) { _inheritable.priority = priority; }
+
     // Set type of service: http://en.wikipedia.org/wiki/Type_of_service
     // Current implementation has limits: If the connection is already
     // established, this setting has no effect until the connection is broken
@@ -521,6 +534,7 @@ public:
     bool has_log_id() const { return has_flag(FLAGS_LOG_ID); }
     uint64_t log_id() const { return _inheritable.log_id; }
     const std::string& request_id() const { return _inheritable.request_id; }
+    int32_t request_priority() const { return _inheritable.priority; }
     CompressType request_compress_type() const { return _request_compress_type; }
     CompressType response_compress_type() const { return _response_compress_type; }
     const HttpHeader& http_request() const 
@@ -659,6 +673,10 @@ private:
     // Tell RPC that this particular call is used to do health check.
     bool is_health_check_call() const { return has_flag(FLAGS_HEALTH_CHECK_CALL); }
 
+    // Tell RPC not to create spans for this call, used by calls exporting
+    // spans to avoid tracing themselves.
+    bool is_tracing_disabled() const { return has_flag(FLAGS_DISABLE_TRACING); }
+
 public:
     CallId current_id() const {
         CallId id = { _correlation_id.value + _current_call.nretry + 1 };
@@ -704,9 +722,7 @@ private:
         _end_time_us = begin_time_us;
     }
 
-    void OnRPCEnd(int64_t end_time_us) {
-        _end_time_us = end_time_us;
-    }
+    void OnRPCEnd(int64_t end_time_us);
 
     static void RunDoneInBackupThread(void*);
     void DoneInBackupThread();
@@ -752,6 +768,9 @@ private:
     // after CallMethod.
     int _max_retry;
     const RetryPolicy* _retry_policy;
+    BackupRequestPolicy* _backup_request_policy;
+    RetryBudget* _retry_budget;
+    AdaptiveThrottle* _throttle;
     // Synchronization object for one RPC call. It remains unchanged even
     // when retry happens. Synchronous RPC will wait on this id.
     CallId _correlation_id;
@@ -152,6 +152,11 @@ public:
         return *this;
     }
 
+    ControllerPrivateAccessor& disable_tracing() {
+        _cntl->add_flag(Controller::FLAGS_DISABLE_TRACING);
+        return *this;
+    }
+
 private:
     Controller* _cntl;
 };
@@ -23,21 +23,25 @@ namespace brpc {
 
 LoadBalancerWithNaming::~LoadBalancerWithNaming() {
     if (_nsthread_ptr.get()) {
-        _nsthread_ptr->RemoveWatcher(this);
+        _nsthread_ptr->RemoveWatcher(watcher());
     }
 }
 
 int LoadBalancerWithNaming::Init(const char* ns_url, const char* lb_name,
                                  const NamingServiceFilter* filter,
-                                 const GetNamingServiceThreadOptions* options) {
+                                 const GetNamingServiceThreadOptions* options,
+                                 size_t subset_size) {
     if (SharedLoadBalancer::Init(lb_name) != 0) {
         return -1;
     }
+    if (subset_size > 0) {
+        _subset.reset(new ServerSubset(subset_size, "", this));
+    }
     if (GetNamingServiceThread(&_nsthread_ptr, ns_url, options) != 0) {
         LOG(ERROR) << "Fail to get NamingServiceThread";
         return -1;
     }
-    if (_nsthread_ptr->AddWatcher(this, filter) != 0) {
+    if (_nsthread_ptr->AddWatcher(watcher(), filter) != 0) {
         LOG(ERROR) << "Fail to add watcher into _server_list";
         return -1;
     }
@@ -54,6 +58,12 @@ void LoadBalancerWithNaming::OnRemovedServers(
     RemoveServersInBatch(servers);
 }
 
+void LoadBalancerWithNaming::OnServersChanged(
+    const std::vector<ServerId>& added,
+    const std::vector<ServerId>& removed) {
+    UpdateServersInBatch(added, removed);
+}
+
 void LoadBalancerWithNaming::Describe(std::ostream& os,
                                       const DescribeOptions& options) {
     if (_nsthread_ptr) {
@@ -61,6 +71,10 @@ void LoadBalancerWithNaming::Describe(std::ostream& os,
     } else {
         os << "NULL";
     }
+    if (_subset) {
+        os << " subset=" << _subset->subset_count() << '/'
+           << _subset->server_count();
+    }
     os << " lb=";
     SharedLoadBalancer::Describe(os, options);
 }
@@ -19,9 +19,11 @@
 #ifndef BRPC_LOAD_BALANCER_WITH_NAMING_H
 #define BRPC_LOAD_BALANCER_WITH_NAMING_H
 
+#include <memory>
 #include "butil/intrusive_ptr.hpp"
 #include "brpc/load_balancer.h"
 #include "brpc/details/naming_service_thread.h"         // NamingServiceWatcher
+#include "brpc/details/server_subset.h"
 
 
 namespace brpc {
@@ -32,17 +34,27 @@ public:
     LoadBalancerWithNaming() {}
     ~LoadBalancerWithNaming();
 
+    // Only a subset of at most `subset_size' servers are added into the
+    // load balancer if `subset_size' is positive.
     int Init(const char* ns_url, const char* lb_name,
              const NamingServiceFilter* filter,
-             const GetNamingServiceThreadOptions* options);
+             const GetNamingServiceThreadOptions* options,
+             size_t subset_size = 0);
     
     void OnAddedServers(const std::vector<ServerId>& servers);
     void OnRemovedServers(const std::vector<ServerId>& servers);
+    void OnServersChanged(const std::vector<ServerId>& added,
+                          const std::vector<ServerId>& removed);
 
     void Describe(std::ostream& os, const DescribeOptions& options);
 
 private:
+    NamingServiceWatcher* watcher() {
+        return _subset ? (NamingServiceWatcher*)_subset.get() : this;
+    }
+
     butil::intrusive_ptr<NamingServiceThread> _nsthread_ptr;
+    std::unique_ptr<ServerSubset> _subset;
 };
 
 } // namespace brpc
@@ -17,13 +17,19 @@
 
 
 #include <limits>
+#include <gflags/gflags.h>
 #include "butil/macros.h"
 #include "brpc/controller.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/details/method_status.h"
 
 namespace brpc {
 
+DEFINE_bool(enable_method_cpu_usage, true, "Attribute cpu time of bthreads "
+            "processing requests to methods, shown as <method>_cpu_usage");
+BRPC_VALIDATE_GFLAG(enable_method_cpu_usage, PassValidate);
+
 static int cast_int(void* arg) {
     return *(int*)arg;
 }
@@ -36,11 +42,18 @@ static int cast_cl(void* arg) {
     return 0;
 }
 
+static double get_cputime_second(void* arg) {
+    return static_cast<bthread::CpuUsageCounter*>(arg)->cputime_ns() / 1000000000.0;
+}
+
 MethodStatus::MethodStatus()
-    : _nconcurrency(0)
+    : _cpu_usage_counter(new bthread::CpuUsageCounter)
+    , _nconcurrency(0)
     , _nconcurrency_bvar(cast_int, &_nconcurrency)
     , _eps_bvar(&_nerror_bvar)
     , _max_concurrency_bvar(cast_cl, &_cl)
+    , _cputime_bvar(get_cputime_second, _cpu_usage_counter.get())
+    , _cpu_usage_bvar(&_cputime_bvar)
 {
 }
 
@@ -60,6 +73,9 @@ int MethodStatus::Expose(const butil::StringPiece& prefix) {
     if (_latency_rec.expose(prefix) != 0) {
         return -1;
     }
+    if (_cpu_usage_bvar.expose_as(prefix, "cpu_usage") != 0) {
+        return -1;
+    }
     if (_cl) {
         if (_max_concurrency_bvar.expose_as(prefix, "max_concurrency") != 0) {
             return -1;
@@ -136,6 +152,10 @@ void MethodStatus::Describe(
     OutputValue(os, "max_latency: ", _latency_rec.max_latency_name(),
                 _latency_rec.max_latency(), options, false);
 
+    // Cores used in last second
+    OutputValue(os, "cpu_usage: ", _cpu_usage_bvar.name(),
+                _cpu_usage_bvar.get_value(1), options, false);
+
     // Concurrency
     OutputValue(os, "concurrency: ", _nconcurrency_bvar.name(),
                 _nconcurrency, options, false);
@@ -19,14 +19,18 @@
 #ifndef  BRPC_METHOD_STATUS_H
 #define  BRPC_METHOD_STATUS_H
 
+#include <gflags/gflags_declare.h>
 #include "butil/macros.h"                  // DISALLOW_COPY_AND_ASSIGN
 #include "bvar/bvar.h"                    // vars
+#include "bthread/cpu_usage.h"            // CpuUsageCounter
 #include "brpc/describable.h"
 #include "brpc/concurrency_limiter.h"
 
 
 namespace brpc {
 
+DECLARE_bool(enable_method_cpu_usage);
+
 class Controller;
 class Server;
 // Record accessing stats of a method.
@@ -58,6 +62,14 @@ public:
     // Current max_concurrency of the method.
     int MaxConcurrency() const { return _cl ? _cl->MaxConcurrency() : 0; }
 
+    // Counter of cpu time spent by bthreads processing requests of the
+    // method, NULL when -enable_method_cpu_usage is off. Attribute the
+    // bthread processing a request with bthread::ScopedCpuUsageAttribution,
+    // bthreads created by the handler are attributed to the method as well.
+    bthread::CpuUsageCounter* cpu_usage_counter() const {
+        return FLAGS_enable_method_cpu_usage ? _cpu_usage_counter.get() : NULL;
+    }
+
 private:
 friend class Server;
     DISALLOW_COPY_AND_ASSIGN(MethodStatus);
@@ -67,12 +79,18 @@ friend class Server;
     void SetConcurrencyLimiter(ConcurrencyLimiter* cl);
 
     std::unique_ptr<ConcurrencyLimiter> _cl;
+    // Referenced by bthreads which may outlive the method status.
+    std::unique_ptr<bthread::CpuUsageCounter,
+                    bthread::CpuUsageCounterDeref> _cpu_usage_counter;
     butil::atomic<int> _nconcurrency;
     bvar::Adder<int64_t>  _nerror_bvar;
     bvar::LatencyRecorder _latency_rec;
     bvar::PassiveStatus<int>  _nconcurrency_bvar;
     bvar::PerSecond<bvar::Adder<int64_t>> _eps_bvar;
     bvar::PassiveStatus<int32_t> _max_concurrency_bvar;
+    // Cpu time in seconds and cores used per second.
+    bvar::PassiveStatus<double> _cputime_bvar;
+    bvar::PerSecond<bvar::PassiveStatus<double> > _cpu_usage_bvar;
 };
 
 class ConcurrencyRemover {
@@ -65,58 +65,83 @@ NamingServiceThread::Actions::Actions(NamingServiceThread* owner)
     , _has_wait_error(false)
     , _wait_error(0) {
     CHECK_EQ(0, bthread_id_create(&_wait_id, NULL, NULL));
+    CHECK_EQ(0, _servers.init(64));
 }
 
 NamingServiceThread::Actions::~Actions() {
     // Remove all sockets from SocketMap
-    for (std::vector<ServerNode>::const_iterator it = _last_servers.begin();
-         it != _last_servers.end(); ++it) {
-        const SocketMapKey key(*it, _owner->_options.channel_signature);
+    for (ServerNodeMap::const_iterator it = _owner->_last_sockets.begin();
+         it != _owner->_last_sockets.end(); ++it) {
+        const SocketMapKey key(it->first, _owner->_options.channel_signature);
         SocketMapRemove(key);
     }
     EndWait(0);
 }
 
+void NamingServiceThread::Actions::FindAdded(
+    const std::vector<ServerNode>& servers) {
+    _servers.clear();
+    _added.clear();
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (_servers.seek(servers[i]) != NULL) {
+            continue;
+        }
+        _servers.insert(servers[i]);
+        if (_owner->_last_sockets.seek(servers[i]) == NULL) {
+            _added.push_back(servers[i]);
+        }
+    }
+    if (_servers.size() != servers.size()) {
+        LOG(WARNING) << "Removed " << servers.size() - _servers.size()
+                     << " duplicated servers";
+    }
+}
+
 void NamingServiceThread::Actions::AddServers(
-    const std::vector<ServerNode>&) {
-    // FIXME(gejun)
-    RELEASE_ASSERT_VERBOSE(false, "Not implemented");
+    const std::vector<ServerNode>& servers) {
+    FindAdded(servers);
+    _removed.clear();
+    ApplyChanges();
+    EndWait(_owner->_last_sockets.empty() ? ENODATA : 0);
 }
 
 void NamingServiceThread::Actions::RemoveServers(
-    const std::vector<ServerNode>&) {
-    // FIXME(gejun)
-    RELEASE_ASSERT_VERBOSE(false, "Not implemented");
+    const std::vector<ServerNode>& servers) {
+    UpdateServers(std::vector<ServerNode>(), servers);
+}
+
+void NamingServiceThread::Actions::UpdateServers(
+    const std::vector<ServerNode>& added,
+    const std::vector<ServerNode>& removed) {
+    FindAdded(added);
+    // Servers both in `added' and `removed' are kept.
+    _removed.clear();
+    for (size_t i = 0; i < removed.size(); ++i) {
+        if (_owner->_last_sockets.seek(removed[i]) != NULL &&
+            _servers.seek(removed[i]) == NULL) {
+            _servers.insert(removed[i]);
+            _removed.push_back(removed[i]);
+        }
+    }
+    ApplyChanges();
+    EndWait(_owner->_last_sockets.empty() ? ENODATA : 0);
 }
 
 void NamingServiceThread::Actions::ResetServers(
         const std::vector<ServerNode>& servers) {
-    _servers.assign(servers.begin(), servers.end());
-    
-    // Diff servers with _last_servers by comparing sorted vectors.
-    // Notice that _last_servers is always sorted.
-    std::sort(_servers.begin(), _servers.end());
-    const size_t dedup_size = std::unique(_servers.begin(), _servers.end())
-        - _servers.begin();
-    if (dedup_size != _servers.size()) {
-        LOG(WARNING) << "Removed " << _servers.size() - dedup_size
-                     << " duplicated servers";
-        _servers.resize(dedup_size);
-    }
-    _added.resize(_servers.size());
-    std::vector<ServerNode>::iterator _added_end = 
-        std::set_difference(_servers.begin(), _servers.end(),
-                            _last_servers.begin(), _last_servers.end(),
-                            _added.begin());
-    _added.resize(_added_end - _added.begin());
-
-    _removed.resize(_last_servers.size());
-    std::vector<ServerNode>::iterator _removed_end = 
-        std::set_difference(_last_servers.begin(), _last_servers.end(),
-                            _servers.begin(), _servers.end(),
-                            _removed.begin());
-    _removed.resize(_removed_end - _removed.begin());
+    FindAdded(servers);
+    _removed.clear();
+    for (ServerNodeMap::const_iterator it = _owner->_last_sockets.begin();
+         it != _owner->_last_sockets.end(); ++it) {
+        if (_servers.seek(it->first) == NULL) {
+            _removed.push_back(it->first);
+        }
+    }
+    ApplyChanges();
+    EndWait(servers.empty() ? ENODATA : 0);
+}
 
+void NamingServiceThread::Actions::ApplyChanges() {
     _added_sockets.clear();
     for (size_t i = 0; i < _added.size(); ++i) {
         ServerNodeWithId tagged_id;
@@ -134,51 +159,29 @@ void NamingServiceThread::Actions::ResetServers(
     for (size_t i = 0; i < _removed.size(); ++i) {
         ServerNodeWithId tagged_id;
         tagged_id.node = _removed[i];
-        const SocketMapKey key(_removed[i], _owner->_options.channel_signature);
-        CHECK_EQ(0, SocketMapFind(key, &tagged_id.id));
+        tagged_id.id = *_owner->_last_sockets.seek(_removed[i]);
         _removed_sockets.push_back(tagged_id);
     }
 
-    // Refresh sockets
-    if (_removed_sockets.empty()) {
-        _sockets = _owner->_last_sockets;
-    } else {
-        std::sort(_removed_sockets.begin(), _removed_sockets.end());
-        _sockets.resize(_owner->_last_sockets.size());
-        std::vector<ServerNodeWithId>::iterator _sockets_end =
-            std::set_difference(
-                _owner->_last_sockets.begin(), _owner->_last_sockets.end(),
-                _removed_sockets.begin(), _removed_sockets.end(),
-                _sockets.begin());
-        _sockets.resize(_sockets_end - _sockets.begin());
-    }
-    if (!_added_sockets.empty()) {
-        const size_t before_added = _sockets.size();
-        std::sort(_added_sockets.begin(), _added_sockets.end());
-        _sockets.insert(_sockets.end(),
-                       _added_sockets.begin(), _added_sockets.end());
-        std::inplace_merge(_sockets.begin(), _sockets.begin() + before_added,
-                           _sockets.end());
-    }
-    std::vector<ServerId> removed_ids;
-    ServerNodeWithId2ServerId(_removed_sockets, &removed_ids, NULL);
+    if (!_added_sockets.empty() || !_removed_sockets.empty()) {
+        std::vector<ServerId> removed_ids;
+        ServerNodeWithId2ServerId(_removed_sockets, &removed_ids, NULL);
 
-    {
         BAIDU_SCOPED_LOCK(_owner->_mutex);
-        _last_servers.swap(_servers);
-        _owner->_last_sockets.swap(_sockets);
+        for (size_t i = 0; i < _removed_sockets.size(); ++i) {
+            _owner->_last_sockets.erase(_removed_sockets[i].node);
+        }
+        for (size_t i = 0; i < _added_sockets.size(); ++i) {
+            _owner->_last_sockets[_added_sockets[i].node] = _added_sockets[i].id;
+        }
         for (std::map<NamingServiceWatcher*,
                       const NamingServiceFilter*>::iterator
                  it = _owner->_watchers.begin();
              it != _owner->_watchers.end(); ++it) {
-            if (!_removed_sockets.empty()) {
-                it->first->OnRemovedServers(removed_ids);
-            }
-
             std::vector<ServerId> added_ids;
             ServerNodeWithId2ServerId(_added_sockets, &added_ids, it->second);
-            if (!_added_sockets.empty()) {
-                it->first->OnAddedServers(added_ids);
+            if (!added_ids.empty() || !removed_ids.empty()) {
+                it->first->OnServersChanged(added_ids, removed_ids);
             }
         }
     }
@@ -202,8 +205,6 @@ void NamingServiceThread::Actions::ResetServers(
         }
         LOG(INFO) << info.str();
     }
-
-    EndWait(servers.empty() ? ENODATA : 0);
 }
 
 void NamingServiceThread::Actions::EndWait(int error_code) {
@@ -227,6 +228,7 @@ NamingServiceThread::NamingServiceThread()
     : _tid(0)
     , _ns(NULL)
     , _actions(this) {
+    CHECK_EQ(0, _last_sockets.init(64));
 }
 
 NamingServiceThread::~NamingServiceThread() {
@@ -250,7 +252,7 @@ NamingServiceThread::~NamingServiceThread() {
     {
         BAIDU_SCOPED_LOCK(_mutex);
         std::vector<ServerId> to_be_removed;
-        ServerNodeWithId2ServerId(_last_sockets, &to_be_removed, NULL);
+        ServerNodeMap2ServerId(_last_sockets, &to_be_removed, NULL);
         if (!_last_sockets.empty()) {
             for (std::map<NamingServiceWatcher*,
                           const NamingServiceFilter*>::iterator
@@ -335,6 +337,21 @@ void NamingServiceThread::ServerNodeWithId2ServerId(
     }
 }
 
+void NamingServiceThread::ServerNodeMap2ServerId(
+    const ServerNodeMap& src,
+    std::vector<ServerId>* dst, const NamingServiceFilter* filter) {
+    dst->reserve(src.size());
+    for (ServerNodeMap::const_iterator it = src.begin(); it != src.end(); ++it) {
+        if (filter && !filter->Accept(it->first)) {
+            continue;
+        }
+        ServerId socket;
+        socket.id = it->second;
+        socket.tag = it->first.tag;
+        dst->push_back(socket);
+    }
+}
+
 int NamingServiceThread::AddWatcher(NamingServiceWatcher* watcher,
                                     const NamingServiceFilter* filter) {
     if (watcher == NULL) {
@@ -345,7 +362,7 @@ int NamingServiceThread::AddWatcher(NamingServiceWatcher* watcher,
     if (_watchers.emplace(watcher, filter).second) {
         if (!_last_sockets.empty()) {
             std::vector<ServerId> added_ids;
-            ServerNodeWithId2ServerId(_last_sockets, &added_ids, filter);
+            ServerNodeMap2ServerId(_last_sockets, &added_ids, filter);
             watcher->OnAddedServers(added_ids);
         }
         return 0;
@@ -21,6 +21,7 @@
 
 #include <string>
 #include "butil/intrusive_ptr.hpp"               // butil::intrusive_ptr
+#include "butil/containers/flat_map.h"           // butil::FlatMap
 #include "bthread/bthread.h"                    // bthread_t
 #include "brpc/server_id.h"                     // ServerId
 #include "brpc/shared_object.h"                 // SharedObject
@@ -39,6 +40,18 @@ public:
     virtual ~NamingServiceWatcher() {}
     virtual void OnAddedServers(const std::vector<ServerId>& servers) = 0;
     virtual void OnRemovedServers(const std::vector<ServerId>& servers) = 0;
+    // Called when some servers are added and some are removed at the same
+    // time, e.g. tags of servers are changed. Override this method to apply
+    // both changes at once.
+    virtual void OnServersChanged(const std::vector<ServerId>& added,
+                                  const std::vector<ServerId>& removed) {
+        if (!removed.empty()) {
+            OnRemovedServers(removed);
+        }
+        if (!added.empty()) {
+            OnAddedServers(added);
+        }
+    }
 };
 
 struct GetNamingServiceThreadOptions {
@@ -59,11 +72,19 @@ class NamingServiceThread : public SharedObject, public Describable {
     struct ServerNodeWithId {
         ServerNode node;
         SocketId id;
-
-        inline bool operator<(const ServerNodeWithId& rhs) const {
-            return id != rhs.id ? (id < rhs.id) : (node < rhs.node);
+    };
+    struct ServerNodeHasher {
+        size_t operator()(const ServerNode& node) const {
+            size_t h = butil::DefaultHasher<butil::EndPoint>()(node.addr);
+            h = h * 101 + butil::DefaultHasher<std::string>()(node.tag);
+            return h;
         }
     };
+    typedef butil::FlatMap<ServerNode, SocketId, ServerNodeHasher> ServerNodeMap;
+    typedef butil::FlatSet<ServerNode, ServerNodeHasher> ServerNodeSet;
+
+    // Changes are found by looking up hash tables, costing O(number of
+    // changed servers) except ResetServers() which scans all servers.
     class Actions : public NamingServiceActions {
     public:
         explicit Actions(NamingServiceThread* owner);
@@ -71,19 +92,25 @@ class NamingServiceThread : public SharedObject, public Describable {
         void AddServers(const std::vector<ServerNode>& servers) override;
         void RemoveServers(const std::vector<ServerNode>& servers) override;
         void ResetServers(const std::vector<ServerNode>& servers) override;
+        void UpdateServers(const std::vector<ServerNode>& added,
+                           const std::vector<ServerNode>& removed) override;
         int WaitForFirstBatchOfServers();
         void EndWait(int error_code);
 
     private:
+        // Put servers in `servers' but not in _last_sockets into _added,
+        // deduplicated by _servers.
+        void FindAdded(const std::vector<ServerNode>& servers);
+        // Notify watchers with _added and _removed.
+        void ApplyChanges();
+
         NamingServiceThread* _owner;
         bthread_id_t _wait_id;
         butil::atomic<bool> _has_wait_error;
         int _wait_error;
-        std::vector<ServerNode> _last_servers;
-        std::vector<ServerNode> _servers;
+        ServerNodeSet _servers;
         std::vector<ServerNode> _added;
         std::vector<ServerNode> _removed;
-        std::vector<ServerNodeWithId> _sockets;
         std::vector<ServerNodeWithId> _added_sockets;
         std::vector<ServerNodeWithId> _removed_sockets;
     };
@@ -112,6 +139,9 @@ private:
     static void ServerNodeWithId2ServerId(
         const std::vector<ServerNodeWithId>& src,
         std::vector<ServerId>* dst, const NamingServiceFilter* filter);
+    static void ServerNodeMap2ServerId(
+        const ServerNodeMap& src,
+        std::vector<ServerId>* dst, const NamingServiceFilter* filter);
 
     butil::Mutex _mutex;
     bthread_t _tid;
@@ -119,7 +149,8 @@ private:
     std::string _protocol;
     std::string _service_name;
     GetNamingServiceThreadOptions _options;
-    std::vector<ServerNodeWithId> _last_sockets;
+    // Modified by _actions only, which runs in the thread of _ns.
+    ServerNodeMap _last_sockets;
     Actions _actions;
     std::map<NamingServiceWatcher*, const NamingServiceFilter*> _watchers;
 };
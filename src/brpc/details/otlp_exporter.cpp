@@ -0,0 +1,385 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <limits>
+#include <gflags/gflags.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include "butil/files/file_path.h"
+#include "butil/iobuf.h"
+#include "butil/logging.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
+#include "butil/time.h"
+#include "brpc/controller.h"
+#include "brpc/protocol.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/span.h"
+#include "brpc/builtin/common.h"                  // GetProgramName
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/otlp_exporter.h"
+
+
+namespace brpc {
+
+DEFINE_string(rpcz_otlp_endpoint, "", "Export spans collected by rpcz to "
+              "this OpenTelemetry collector, e.g. 127.0.0.1:4318");
+DEFINE_string(rpcz_otlp_protocol, "http", "Export spans with `http' "
+              "(OTLP/HTTP) or `grpc' (OTLP/gRPC)");
+DEFINE_string(rpcz_otlp_service_name, "", "service.name of exported spans, "
+              "name of the program if it's empty");
+DEFINE_int32(rpcz_otlp_max_pending_spans, 8192,
+             "Drop spans when so many spans are waiting to be exported");
+BRPC_VALIDATE_GFLAG(rpcz_otlp_max_pending_spans, PositiveInteger);
+DEFINE_int32(rpcz_otlp_max_batch_spans, 512,
+             "Export at most so many spans in one request");
+BRPC_VALIDATE_GFLAG(rpcz_otlp_max_batch_spans, PositiveInteger);
+DEFINE_int32(rpcz_otlp_export_interval_ms, 1000,
+             "Export pending spans at least once in so many milliseconds");
+BRPC_VALIDATE_GFLAG(rpcz_otlp_export_interval_ms, PositiveInteger);
+DEFINE_int32(rpcz_otlp_timeout_ms, 3000, "Timeout of exporting spans");
+
+static const char* const OTLP_HTTP_PATH = "/v1/traces";
+static const char* const OTLP_GRPC_PATH =
+    "/opentelemetry.proto.collector.trace.v1.TraceService/Export";
+
+// gRPC calls /<service>/<method> of the method given to the channel, but
+// otlp.proto is not in the package of OTLP. Build the method in a separate
+// pool which does not conflict with OTLP protos linked by users. Types of
+// the method are not used in serializing.
+static const google::protobuf::MethodDescriptor* CreateGrpcExportMethod() {
+    google::protobuf::FileDescriptorProto file;
+    file.set_name("opentelemetry/proto/collector/trace/v1/trace_service.proto");
+    file.set_package("opentelemetry.proto.collector.trace.v1");
+    file.add_message_type()->set_name("ExportTraceServiceRequest");
+    file.add_message_type()->set_name("ExportTraceServiceResponse");
+    google::protobuf::MethodDescriptorProto* method =
+        file.add_service()->add_method();
+    file.mutable_service(0)->set_name("TraceService");
+    method->set_name("Export");
+    method->set_input_type(".opentelemetry.proto.collector.trace.v1."
+                           "ExportTraceServiceRequest");
+    method->set_output_type(".opentelemetry.proto.collector.trace.v1."
+                            "ExportTraceServiceResponse");
+    // Leaked intentionally, the method is used until exit.
+    google::protobuf::DescriptorPool* pool = new google::protobuf::DescriptorPool;
+    const google::protobuf::FileDescriptor* fd = pool->BuildFile(file);
+    if (fd == NULL) {
+        LOG(ERROR) << "Fail to build " << file.name();
+        return NULL;
+    }
+    return fd->service(0)->method(0);
+}
+
+// Exporting RPCs are not traced at client-side, see ExportBatch(). Spans of
+// collectors running inside this process are not exported either, otherwise
+// each export generates more spans to export.
+static bool IsExportingSpan(const Span* span) {
+    const std::string& name = span->full_method_name();
+    return name == OTLP_HTTP_PATH || name == OTLP_GRPC_PATH ||
+        name == otlp::TraceService::descriptor()->method(0)->full_name();
+}
+
+OtlpExporter::OtlpExporter()
+    : _channel_inited(false)
+    , _grpc(false)
+    , _nexported("rpcz_otlp_exported_spans")
+    , _ndropped("rpcz_otlp_dropped_spans")
+    , _nfailed("rpcz_otlp_failed_spans") {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+
+    std::string service_name = FLAGS_rpcz_otlp_service_name;
+    if (service_name.empty()) {
+        service_name = butil::FilePath(GetProgramName()).BaseName().value();
+    }
+    otlp::KeyValue* kv = _resource.add_attributes();
+    kv->set_key("service.name");
+    kv->mutable_value()->set_string_value(service_name);
+    kv = _resource.add_attributes();
+    kv->set_key("telemetry.sdk.name");
+    kv->mutable_value()->set_string_value("brpc");
+
+    pthread_t th;
+    const int rc = pthread_create(&th, NULL, RunExporter, this);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to create thread for exporting spans: "
+                   << berror(rc);
+        return;
+    }
+    pthread_detach(th);
+}
+
+OtlpExporter* OtlpExporter::GetInstance() {
+    if (FLAGS_rpcz_otlp_endpoint.empty()) {
+        return NULL;
+    }
+    return butil::get_leaky_singleton<OtlpExporter>();
+}
+
+void* OtlpExporter::RunExporter(void* arg) {
+    static_cast<OtlpExporter*>(arg)->ExportLoop();
+    return NULL;
+}
+
+void OtlpExporter::ExportLoop() {
+    while (true) {
+        pthread_mutex_lock(&_mutex);
+        if (_pending.size() < (size_t)FLAGS_rpcz_otlp_max_batch_spans) {
+            const timespec abstime = butil::milliseconds_from_now(
+                FLAGS_rpcz_otlp_export_interval_ms);
+            pthread_cond_timedwait(&_cond, &_mutex, &abstime);
+        }
+        pthread_mutex_unlock(&_mutex);
+        Flush();
+    }
+}
+
+inline void AppendBigEndian(uint64_t n, std::string* out) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out->push_back((char)((n >> shift) & 0xFF));
+    }
+}
+
+static void AddAttribute(otlp::Span* span, const char* key,
+                         const std::string& value) {
+    otlp::KeyValue* kv = span->add_attributes();
+    kv->set_key(key);
+    kv->mutable_value()->set_string_value(value);
+}
+
+static void AddAttribute(otlp::Span* span, const char* key, int64_t value) {
+    otlp::KeyValue* kv = span->add_attributes();
+    kv->set_key(key);
+    kv->mutable_value()->set_int_value(value);
+}
+
+static otlp::Span* ToOtlp(const Span* span, uint64_t span_id,
+                          uint64_t parent_span_id) {
+    otlp::Span* out = new otlp::Span;
+    // Trace ids of brpc are 64-bit, the higher 64 bits are non-zero only
+    // for traces started by W3C traceparent of upstream.
+    std::string* trace_id = out->mutable_trace_id();
+    AppendBigEndian(span->trace_id_high(), trace_id);
+    AppendBigEndian(span->trace_id(), trace_id);
+    AppendBigEndian(span_id, out->mutable_span_id());
+    if (parent_span_id) {
+        AppendBigEndian(parent_span_id, out->mutable_parent_span_id());
+    }
+    out->set_name(span->full_method_name());
+    out->set_kind(span->type() == SPAN_TYPE_SERVER ?
+                  otlp::Span::SPAN_KIND_SERVER : otlp::Span::SPAN_KIND_CLIENT);
+    out->set_start_time_unix_nano(span->GetStartRealTimeUs() * 1000UL);
+    out->set_end_time_unix_nano(span->GetEndRealTimeUs() * 1000UL);
+
+    AddAttribute(out, "rpc.system", "brpc");
+    const Protocol* protocol = FindProtocol(span->protocol());
+    if (protocol) {
+        AddAttribute(out, "rpc.brpc.protocol", protocol->name);
+    }
+    if (span->remote_side().port) {
+        AddAttribute(out, "network.peer.address",
+                     butil::ip2str(span->remote_side().ip).c_str());
+        AddAttribute(out, "network.peer.port", span->remote_side().port);
+    }
+    if (span->log_id()) {
+        AddAttribute(out, "rpc.brpc.log_id", (int64_t)span->log_id());
+    }
+    AddAttribute(out, "rpc.brpc.request_size", span->request_size());
+    AddAttribute(out, "rpc.brpc.response_size", span->response_size());
+    if (span->error_code()) {
+        AddAttribute(out, "rpc.brpc.error_code", span->error_code());
+        out->mutable_status()->set_code(otlp::Status::STATUS_CODE_ERROR);
+        out->mutable_status()->set_message(berror(span->error_code()));
+    }
+
+    SpanInfoExtractor extractor(span->info().c_str());
+    int64_t anno_time = 0;
+    std::string annotation;
+    while (extractor.PopAnnotation(std::numeric_limits<int64_t>::max(),
+                                   &anno_time, &annotation)) {
+        otlp::Span::Event* event = out->add_events();
+        event->set_time_unix_nano(anno_time * 1000UL);
+        event->set_name(annotation);
+    }
+    return out;
+}
+
+// A client span and the server span created for it in downstream share
+// span_id in brpc, while span ids in OTLP are unique. Such server spans
+// are exported with mixed ids and the client spans as parents, and their
+// client spans are children of the mixed ids.
+void OtlpExporter::SpanToOtlp(const Span* span, std::deque<otlp::Span*>* out) {
+    uint64_t span_id = span->span_id();
+    uint64_t parent_span_id = span->parent_span_id();
+    if (span->_shared_span_id) {
+        parent_span_id = span_id;
+        span_id = butil::fmix64(span_id);
+    }
+    out->push_back(ToOtlp(span, span_id, parent_span_id));
+    for (const Span* p = span->_next_client; p; p = p->_next_client) {
+        out->push_back(ToOtlp(p, p->span_id(), span_id));
+    }
+}
+
+void OtlpExporter::Export(const Span* span) {
+    if (IsExportingSpan(span)) {
+        return;
+    }
+    const size_t nspan = 1 + span->CountClientSpans();
+    pthread_mutex_lock(&_mutex);
+    const bool full = (_pending.size() + nspan >
+                       (size_t)FLAGS_rpcz_otlp_max_pending_spans);
+    pthread_mutex_unlock(&_mutex);
+    if (full) {
+        _ndropped << nspan;
+        return;
+    }
+    std::deque<otlp::Span*> spans;
+    SpanToOtlp(span, &spans);
+    pthread_mutex_lock(&_mutex);
+    _pending.insert(_pending.end(), spans.begin(), spans.end());
+    if (_pending.size() >= (size_t)FLAGS_rpcz_otlp_max_batch_spans) {
+        pthread_cond_signal(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+int OtlpExporter::InitChannelIfNeeded() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_channel_inited) {
+        return 0;
+    }
+    _grpc = (FLAGS_rpcz_otlp_protocol == "grpc");
+    ChannelOptions options;
+    options.protocol = (_grpc ? "h2:grpc" : "http");
+    options.timeout_ms = FLAGS_rpcz_otlp_timeout_ms;
+    if (_channel.Init(FLAGS_rpcz_otlp_endpoint.c_str(), "", &options) != 0) {
+        LOG(ERROR) << "Fail to init channel to -rpcz_otlp_endpoint="
+                   << FLAGS_rpcz_otlp_endpoint;
+        return -1;
+    }
+    _channel_inited = true;
+    return 0;
+}
+
+int OtlpExporter::ExportBatch() {
+    otlp::ExportTraceServiceRequest request;
+    otlp::ResourceSpans* resource_spans = request.add_resource_spans();
+    otlp::ScopeSpans* scope_spans = resource_spans->add_scope_spans();
+    pthread_mutex_lock(&_mutex);
+    resource_spans->mutable_resource()->CopyFrom(_resource);
+    size_t nspan = std::min(_pending.size(),
+                            (size_t)FLAGS_rpcz_otlp_max_batch_spans);
+    for (size_t i = 0; i < nspan; ++i) {
+        scope_spans->mutable_spans()->AddAllocated(_pending.front());
+        _pending.pop_front();
+    }
+    pthread_mutex_unlock(&_mutex);
+    if (nspan == 0) {
+        return 0;
+    }
+    scope_spans->mutable_scope()->set_name("brpc");
+
+    Controller cntl;
+    // Spans of exporting RPCs would be exported again, don't trace them.
+    // The parent span is cleared as well since Flush() may be called inside
+    // a traced RPC.
+    ControllerPrivateAccessor(&cntl).disable_tracing();
+    void* const saved_parent_span = bthread::tls_bls.rpcz_parent_span;
+    bthread::tls_bls.rpcz_parent_span = NULL;
+    otlp::ExportTraceServiceResponse response;
+    if (_grpc) {
+        static const google::protobuf::MethodDescriptor* s_method =
+            CreateGrpcExportMethod();
+        if (s_method == NULL) {
+            bthread::tls_bls.rpcz_parent_span = saved_parent_span;
+            _nfailed << nspan;
+            return -1;
+        }
+        cntl.http_request().uri() = OTLP_GRPC_PATH;
+        _channel.CallMethod(s_method, &cntl, &request, &response, NULL);
+    } else {
+        cntl.http_request().uri() = OTLP_HTTP_PATH;
+        cntl.http_request().set_method(HTTP_METHOD_POST);
+        cntl.http_request().set_content_type("application/x-protobuf");
+        butil::IOBufAsZeroCopyOutputStream wrapper(&cntl.request_attachment());
+        if (!request.SerializeToZeroCopyStream(&wrapper)) {
+            bthread::tls_bls.rpcz_parent_span = saved_parent_span;
+            LOG(ERROR) << "Fail to serialize ExportTraceServiceRequest";
+            _nfailed << nspan;
+            return -1;
+        }
+        _channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        if (!cntl.Failed()) {
+            butil::IOBufAsZeroCopyInputStream wrapper2(cntl.response_attachment());
+            if (!response.ParseFromZeroCopyStream(&wrapper2)) {
+                // Accept bodies of other content-types.
+                response.Clear();
+            }
+        }
+    }
+    bthread::tls_bls.rpcz_parent_span = saved_parent_span;
+    if (cntl.Failed()) {
+        LOG_EVERY_SECOND(WARNING) << "Fail to export " << nspan << " spans to "
+            << FLAGS_rpcz_otlp_endpoint << ": " << cntl.ErrorText();
+        _nfailed << nspan;
+        return -1;
+    }
+    const int64_t nrejected = std::min((int64_t)nspan,
+        response.partial_success().rejected_spans());
+    if (nrejected > 0) {
+        LOG_EVERY_SECOND(WARNING) << FLAGS_rpcz_otlp_endpoint << " rejected "
+            << nrejected << " spans: "
+            << response.partial_success().error_message();
+        _nfailed << nrejected;
+    }
+    _nexported << nspan - nrejected;
+    return nspan - nrejected;
+}
+
+int OtlpExporter::Flush() {
+    if (InitChannelIfNeeded() != 0) {
+        pthread_mutex_lock(&_mutex);
+        const size_t nspan = _pending.size();
+        for (size_t i = 0; i < nspan; ++i) {
+            delete _pending[i];
+        }
+        _pending.clear();
+        pthread_mutex_unlock(&_mutex);
+        _nfailed << nspan;
+        return -1;
+    }
+    int total = 0;
+    while (true) {
+        const int rc = ExportBatch();
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            pthread_mutex_lock(&_mutex);
+            const bool empty = _pending.empty();
+            pthread_mutex_unlock(&_mutex);
+            if (empty) {
+                return total;
+            }
+        }
+        total += rc;
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,93 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#ifndef BRPC_DETAILS_OTLP_EXPORTER_H
+#define BRPC_DETAILS_OTLP_EXPORTER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <gflags/gflags_declare.h>
+#include "butil/macros.h"
+#include "bvar/reducer.h"
+#include "brpc/channel.h"
+#include "brpc/otlp.pb.h"
+
+
+namespace brpc {
+
+DECLARE_string(rpcz_otlp_endpoint);
+
+class Span;
+
+// Export spans collected by rpcz to an OpenTelemetry collector. Spans are
+// converted into OTLP and queued by the thread dumping spans, and sent in
+// batches by a separate thread to -rpcz_otlp_endpoint with OTLP/HTTP
+// (POST /v1/traces) or OTLP/gRPC. Spans are dropped when the queue is full
+// or the collector is unavailable, which are counted by bvars.
+class OtlpExporter {
+public:
+    OtlpExporter();
+
+    // Returns NULL when -rpcz_otlp_endpoint is empty.
+    static OtlpExporter* GetInstance();
+
+    // Queue `span' and its client spans for exporting.
+    void Export(const Span* span);
+
+    // Send pending spans in batches and wait for the responses.
+    // Returns number of spans accepted by the collector, -1 on error.
+    int Flush();
+
+    int64_t exported_count() const { return _nexported.get_value(); }
+    int64_t dropped_count() const { return _ndropped.get_value(); }
+    int64_t failed_count() const { return _nfailed.get_value(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(OtlpExporter);
+
+    static void* RunExporter(void* arg);
+    void ExportLoop();
+    int InitChannelIfNeeded();
+    // Send one batch of pending spans. Returns number of spans accepted,
+    // -1 on error, 0 when no spans are pending.
+    int ExportBatch();
+
+    // Convert `span' and its client spans, ids are changed to make them
+    // unique, see comments in the impl.
+    static void SpanToOtlp(const Span* span, std::deque<otlp::Span*>* out);
+
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    std::deque<otlp::Span*> _pending;
+    bool _channel_inited;
+    // Protocol of _channel is fixed once it's initialized.
+    bool _grpc;
+    Channel _channel;
+    otlp::Resource _resource;
+    bvar::Adder<int64_t> _nexported;
+    bvar::Adder<int64_t> _ndropped;
+    bvar::Adder<int64_t> _nfailed;
+};
+
+} // namespace brpc
+
+
+#endif // BRPC_DETAILS_OTLP_EXPORTER_H
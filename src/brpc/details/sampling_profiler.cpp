@@ -0,0 +1,353 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <algorithm>                             // std::min
+#include <set>
+#include <execinfo.h>                            // backtrace
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "butil/third_party/symbolize/symbolize.h"
+#include "bthread/bthread.h"                     // bthread_self
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/sampling_profiler.h"
+
+namespace brpc {
+
+static bool SetSamplingProfilerHz(const char*, int32_t hz) {
+    if (hz < 0 || hz > 1000) {
+        return false;
+    }
+    return SamplingProfiler::GetInstance()->SetFrequency(hz) == 0;
+}
+
+DEFINE_int32(sampling_profiler_hz, 0, "Sample stacks of the process so many "
+             "times per second of consumed cpu time and show flame graphs "
+             "in /flamegraph, 0 disables sampling. A value around 50 is cheap "
+             "enough to be always on");
+BRPC_VALIDATE_GFLAG(sampling_profiler_hz, SetSamplingProfilerHz);
+
+enum SampleState {
+    SAMPLE_EMPTY = 0,
+    SAMPLE_WRITING,
+    SAMPLE_READY
+};
+
+// A realtime signal is used rather than SIGPROF which is occupied by
+// ProfilerStart() of gperftools.
+static int ProfilingSignal() {
+    return SIGRTMAX - 1;
+}
+
+static void ProfilingSignalHandler(int, siginfo_t*, void* context) {
+    const int saved_errno = errno;
+    SamplingProfiler* p = butil::has_leaky_singleton<SamplingProfiler>();
+    if (p) {
+        void* pc = NULL;
+        const ucontext_t* uc = static_cast<const ucontext_t*>(context);
+#if defined(__x86_64__)
+        pc = reinterpret_cast<void*>(uc->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__aarch64__)
+        pc = reinterpret_cast<void*>(uc->uc_mcontext.pc);
+#else
+        (void)uc;
+#endif
+        p->Record(pc);
+    }
+    errno = saved_errno;
+}
+
+#if defined(OS_LINUX)
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Clock of cpu time of thread `tid' in this process, the same as
+// MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED) of the kernel.
+static clockid_t ThreadCpuClock(pid_t tid) {
+    return (~(clockid_t)tid << 3) | 6;
+}
+
+static void ListThreads(std::set<pid_t>* tids) {
+    DIR* dir = opendir("/proc/self/task");
+    if (dir == NULL) {
+        PLOG(ERROR) << "Fail to open /proc/self/task";
+        return;
+    }
+    while (struct dirent* ent = readdir(dir)) {
+        const pid_t tid = (pid_t)strtol(ent->d_name, NULL, 10);
+        if (tid > 0) {
+            tids->insert(tid);
+        }
+    }
+    closedir(dir);
+}
+#endif
+
+SamplingProfiler* SamplingProfiler::GetInstance() {
+    return butil::get_leaky_singleton<SamplingProfiler>();
+}
+
+SamplingProfiler::SamplingProfiler()
+    : _hz(0)
+    , _handler_installed(false)
+    , _collector_started(false)
+    , _next_sample(0)
+    , _ndropped(0)
+    , _ring(new Sample[RING_SIZE]) {
+    for (int i = 0; i < RING_SIZE; ++i) {
+        _ring[i].state.store(SAMPLE_EMPTY, butil::memory_order_relaxed);
+    }
+}
+
+SamplingProfiler::~SamplingProfiler() {
+    // Never deleted.
+}
+
+int SamplingProfiler::SetFrequency(int hz) {
+    if (hz < 0) {
+        return -1;
+    }
+#if defined(OS_LINUX)
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (hz > 0 && !_handler_installed) {
+        // backtrace() loads the unwinder at the first call which is not
+        // async-signal-safe, call it before any signals.
+        void* dummy[4];
+        backtrace(dummy, arraysize(dummy));
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = ProfilingSignalHandler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(ProfilingSignal(), &sa, NULL) != 0) {
+            PLOG(ERROR) << "Fail to set handler of signal=" << ProfilingSignal();
+            return -1;
+        }
+        _handler_installed = true;
+    }
+    if (hz > 0 && !_collector_started) {
+        pthread_t th;
+        const int rc = pthread_create(&th, NULL, RunCollector, this);
+        if (rc != 0) {
+            LOG(ERROR) << "Fail to create collector, " << berror(rc);
+            return -1;
+        }
+        pthread_detach(th);
+        _collector_started = true;
+    }
+    _hz = hz;
+    for (std::map<pid_t, timer_t>::iterator
+             it = _timers.begin(); it != _timers.end(); ++it) {
+        ArmTimerLocked(it->second);
+    }
+    UpdateTimersLocked();
+    return 0;
+#else
+    if (hz > 0) {
+        LOG(ERROR) << "SamplingProfiler is only supported on Linux";
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+void SamplingProfiler::Record(void* pc) {
+    // NOTE: This function is called in the signal handler, no locks or
+    // memory allocations are allowed.
+    void* frames[MAX_DEPTH + 4];
+    const int n = backtrace(frames, arraysize(frames));
+    // Skip frames of the signal handler, namely frames before the
+    // interrupted pc, or the handler and the signal trampoline when the pc
+    // is unknown.
+    int begin = std::min(n, 2);
+    if (pc != NULL) {
+        for (int i = 0; i < n && i < 6; ++i) {
+            if (frames[i] == pc) {
+                begin = i;
+                break;
+            }
+        }
+    }
+    const uint64_t index =
+        _next_sample.fetch_add(1, butil::memory_order_relaxed) & (RING_SIZE - 1);
+    Sample& s = _ring[index];
+    int expected = SAMPLE_EMPTY;
+    if (!s.state.compare_exchange_strong(
+            expected, SAMPLE_WRITING, butil::memory_order_acquire,
+            butil::memory_order_relaxed)) {
+        // Not collected yet.
+        _ndropped.fetch_add(1, butil::memory_order_relaxed);
+        return;
+    }
+    s.in_bthread = (bthread_self() != INVALID_BTHREAD);
+    s.depth = std::min(n - begin, (int)MAX_DEPTH);
+    memcpy(s.frames, frames + begin, s.depth * sizeof(void*));
+    s.state.store(SAMPLE_READY, butil::memory_order_release);
+}
+
+void* SamplingProfiler::RunCollector(void* arg) {
+    SamplingProfiler* p = static_cast<SamplingProfiler*>(arg);
+    while (true) {
+        ::usleep(1000000L);
+        BAIDU_SCOPED_LOCK(p->_mutex);
+        p->CollectLocked();
+        p->UpdateTimersLocked();
+    }
+    return NULL;
+}
+
+int SamplingProfiler::ArmTimerLocked(timer_t timer) {
+#if defined(OS_LINUX)
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (_hz > 0) {
+        its.it_interval.tv_nsec = 1000000000L / _hz;
+        its.it_value = its.it_interval;
+    }
+    return timer_settime(timer, 0, &its, NULL);
+#else
+    return -1;
+#endif
+}
+
+void SamplingProfiler::UpdateTimersLocked() {
+#if defined(OS_LINUX)
+    std::set<pid_t> tids;
+    if (_hz > 0) {
+        ListThreads(&tids);
+    }
+    for (std::map<pid_t, timer_t>::iterator it = _timers.begin();
+         it != _timers.end();) {
+        if (tids.erase(it->first) == 0) {
+            // Exited, or sampling is stopped.
+            timer_delete(it->second);
+            _timers.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    // New threads.
+    for (std::set<pid_t>::const_iterator
+             it = tids.begin(); it != tids.end(); ++it) {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = ProfilingSignal();
+        sev.sigev_notify_thread_id = *it;
+        timer_t timer;
+        if (timer_create(ThreadCpuClock(*it), &sev, &timer) != 0) {
+            // The thread may have just exited.
+            continue;
+        }
+        if (ArmTimerLocked(timer) != 0) {
+            timer_delete(timer);
+            continue;
+        }
+        _timers[*it] = timer;
+    }
+#endif
+}
+
+void SamplingProfiler::CollectLocked() {
+    const int64_t now = butil::monotonic_time_s();
+    while (!_slots.empty() && _slots.front().second <= now - MAX_SECONDS) {
+        _slots.pop_front();
+    }
+    if (_slots.empty() || _slots.back().second != now) {
+        _slots.push_back(Slot());
+        _slots.back().second = now;
+    }
+    Slot& slot = _slots.back();
+    std::string key;
+    for (int i = 0; i < RING_SIZE; ++i) {
+        Sample& s = _ring[i];
+        if (s.state.load(butil::memory_order_acquire) != SAMPLE_READY) {
+            continue;
+        }
+        key.assign(1, s.in_bthread ? 'b' : 'p');
+        key.append(reinterpret_cast<const char*>(s.frames),
+                   s.depth * sizeof(void*));
+        s.state.store(SAMPLE_EMPTY, butil::memory_order_release);
+        ++slot.counts[key];
+    }
+}
+
+const std::string& SamplingProfiler::SymbolizeLocked(void* frame) {
+    std::unordered_map<void*, std::string>::iterator
+        it = _symbols.find(frame);
+    if (it != _symbols.end()) {
+        return it->second;
+    }
+    if (_symbols.size() >= MAX_SYMBOLS) {
+        // References returned before are used by callers already.
+        _symbols.clear();
+    }
+    std::string& name = _symbols[frame];
+    char buf[1024];
+    // Subtract by one as return address of function may be in the next
+    // function when a function is annotated as noreturn.
+    if (google::Symbolize(static_cast<char*>(frame) - 1, buf, sizeof(buf))) {
+        name = buf;
+    } else {
+        snprintf(buf, sizeof(buf), "%p", frame);
+        name = buf;
+    }
+    return name;
+}
+
+int64_t SamplingProfiler::GetFoldedStacks(
+    int seconds, std::map<std::string, int64_t>* stacks) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    CollectLocked();
+    const int64_t now = butil::monotonic_time_s();
+    int64_t nsample = 0;
+    std::string folded;
+    for (size_t i = 0; i < _slots.size(); ++i) {
+        const Slot& slot = _slots[i];
+        if (slot.second <= now - seconds) {
+            continue;
+        }
+        for (std::unordered_map<std::string, int64_t>::const_iterator
+                 it = slot.counts.begin(); it != slot.counts.end(); ++it) {
+            const std::string& key = it->first;
+            folded = (key[0] == 'b' ? "bthread" : "pthread");
+            const size_t depth = (key.size() - 1) / sizeof(void*);
+            for (size_t j = depth; j > 0; --j) {
+                void* frame = NULL;
+                memcpy(&frame, key.data() + 1 + (j - 1) * sizeof(void*),
+                       sizeof(void*));
+                folded.push_back(';');
+                folded.append(SymbolizeLocked(frame));
+            }
+            (*stacks)[folded] += it->second;
+            nsample += it->second;
+        }
+    }
+    return nsample;
+}
+
+}  // namespace brpc
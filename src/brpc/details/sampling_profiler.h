@@ -0,0 +1,129 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_SAMPLING_PROFILER_H
+#define BRPC_SAMPLING_PROFILER_H
+
+#include <stdint.h>
+#include <sys/types.h>                          // pid_t
+#include <time.h>                               // timer_t
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <gflags/gflags_declare.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/synchronization/lock.h"
+
+namespace brpc {
+
+DECLARE_int32(sampling_profiler_hz);
+
+// Always-on cpu profiler with low overhead. Each thread has a timer
+// measuring its cpu time, which sends a signal to the thread every 1/hz
+// seconds of cpu time consumed, the signal handler saves backtrace of the
+// thread into a lock-free ring which is drained by a collecting thread
+// every second. The collecting thread also creates timers for threads
+// found in /proc/self/task, threads are sampled within a second after
+// creation. Samples of last minute are kept so that flame graphs of
+// recent seconds can be viewed at any time without starting profilers.
+// Backtraces of threads running bthreads end at entries of the bthreads,
+// they're under a root frame named "bthread" while others are under
+// "pthread".
+// Compared to ProfilerStart() of gperftools used by /hotspots/cpu, no
+// extra libraries or scripts are required and cost of sampling is bounded
+// by the frequency rather than the number of cores.
+class SamplingProfiler {
+public:
+    static const int MAX_DEPTH = 48;
+    // Must be power of 2.
+    static const int RING_SIZE = 1024;
+    // Seconds of samples kept.
+    static const int MAX_SECONDS = 60;
+    // Symbolized frames are cached, the cache is cleared when it's full.
+    static const size_t MAX_SYMBOLS = 65536;
+
+    static SamplingProfiler* GetInstance();
+
+    // Sample `hz' times per second of cpu time consumed by the process,
+    // 0 stops sampling.
+    // Returns 0 on success, -1 otherwise.
+    int SetFrequency(int hz);
+    int frequency() const { return _hz; }
+
+    // Put stacks sampled in last `seconds' seconds into `stacks'. Keys are
+    // symbolized frames from outermost to innermost separated by ';', values
+    // are numbers of samples, which is the "folded" format of FlameGraph.
+    // Returns number of samples.
+    int64_t GetFoldedStacks(int seconds, std::map<std::string, int64_t>* stacks);
+
+    // Number of samples dropped because the ring was full.
+    int64_t dropped_count() const {
+        return _ndropped.load(butil::memory_order_relaxed);
+    }
+
+    // Save backtrace of the calling thread. Called in the signal handler
+    // with the interrupted pc.
+    void Record(void* pc);
+
+private:
+    struct Sample {
+        // EMPTY, WRITING or READY.
+        butil::atomic<int> state;
+        bool in_bthread;
+        int depth;
+        void* frames[MAX_DEPTH];
+    };
+    // Samples collected in a second, keyed by in_bthread and frames.
+    struct Slot {
+        int64_t second;
+        std::unordered_map<std::string, int64_t> counts;
+    };
+
+friend class butil::GetLeakySingleton<SamplingProfiler>;
+    SamplingProfiler();
+    ~SamplingProfiler();
+    DISALLOW_COPY_AND_ASSIGN(SamplingProfiler);
+
+    static void* RunCollector(void* arg);
+    // Move samples in the ring into slots. _mutex must be held.
+    void CollectLocked();
+    // Create timers for new threads and delete timers of exited threads,
+    // or delete all timers when _hz is 0. _mutex must be held.
+    void UpdateTimersLocked();
+    int ArmTimerLocked(timer_t timer);
+    const std::string& SymbolizeLocked(void* frame);
+
+    butil::Mutex _mutex;
+    int _hz;
+    bool _handler_installed;
+    // Timers of threads, keyed by tid.
+    std::map<pid_t, timer_t> _timers;
+    bool _collector_started;
+    std::deque<Slot> _slots;
+    std::unordered_map<void*, std::string> _symbols;
+    butil::atomic<uint64_t> _next_sample;
+    butil::atomic<int64_t> _ndropped;
+    Sample* _ring;
+};
+
+}  // namespace brpc
+
+#endif  // BRPC_SAMPLING_PROFILER_H
@@ -0,0 +1,206 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <unistd.h>                                // getpid
+#include <gflags/gflags.h>
+#include "butil/endpoint.h"
+#include "butil/string_printf.h"
+#include "bvar/bvar.h"
+#include "brpc/socket.h"
+#include "brpc/policy/hasher.h"
+#include "brpc/details/server_subset.h"
+
+
+namespace brpc {
+
+DEFINE_string(subset_client_id, "",
+              "Identity of this process in subsetting servers of naming "
+              "services, processes with different ids choose different "
+              "subsets. ip:pid if this flag is empty");
+
+// Number of virtual nodes of each server on the ring.
+static const size_t SUBSET_REPLICAS = 100;
+
+// Servers in subsets of all channels, namely the number of servers that
+// connections may be created to.
+static bvar::Adder<int64_t>* g_subset_server_count = NULL;
+// Servers from naming services of channels using subsets.
+static bvar::Adder<int64_t>* g_subset_naming_server_count = NULL;
+// Servers added into or removed from subsets.
+static bvar::Adder<int64_t>* g_subset_churn = NULL;
+
+static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
+
+static void CreateVars() {
+    g_subset_server_count = new bvar::Adder<int64_t>("rpc_subset_server_count");
+    g_subset_naming_server_count =
+        new bvar::Adder<int64_t>("rpc_subset_naming_server_count");
+    g_subset_churn = new bvar::Adder<int64_t>("rpc_subset_churn");
+    new bvar::PerSecond<bvar::Adder<int64_t> >(
+        "rpc_subset_churn_second", g_subset_churn);
+}
+
+static uint32_t ClientPosition(const std::string& client_id) {
+    std::string id = client_id;
+    if (id.empty()) {
+        id = FLAGS_subset_client_id;
+    }
+    if (id.empty()) {
+        id = butil::string_printf("%s:%d", butil::my_ip_cstr(), (int)getpid());
+    }
+    return policy::MurmurHash32(id.data(), id.size());
+}
+
+ServerSubset::ServerSubset(size_t size, const std::string& client_id,
+                           NamingServiceWatcher* downstream)
+    : _size(size)
+    , _position(ClientPosition(client_id))
+    , _downstream(downstream) {
+    CHECK_EQ(0, pthread_once(&s_create_vars_once, CreateVars));
+}
+
+ServerSubset::~ServerSubset() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    *g_subset_server_count << -(int64_t)_subset.size();
+    *g_subset_naming_server_count << -(int64_t)_servers.size();
+}
+
+// Hash addresses rather than ids to place servers at the same positions in
+// all clients.
+static uint32_t PointHash(const std::string& addr, size_t replica) {
+    char host[256];
+    const int len = snprintf(host, sizeof(host), "%s-%lu",
+                             addr.c_str(), replica);
+    return policy::MurmurHash32(host, len);
+}
+
+bool ServerSubset::AddToRing(const ServerId& server) {
+    if (_servers.find(server.id) != _servers.end()) {
+        return false;
+    }
+    SocketUniquePtr ptr;
+    if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
+        return false;
+    }
+    const std::string addr = endpoint2str(ptr->remote_side()).c_str();
+    for (size_t i = 0; i < SUBSET_REPLICAS; ++i) {
+        Point p = { PointHash(addr, i), server.id };
+        _ring.insert(p);
+    }
+    _servers[server.id] = server;
+    _addresses[server.id] = addr;
+    return true;
+}
+
+bool ServerSubset::RemoveFromRing(SocketId id) {
+    std::map<SocketId, std::string>::iterator it = _addresses.find(id);
+    if (it == _addresses.end()) {
+        return false;
+    }
+    for (size_t i = 0; i < SUBSET_REPLICAS; ++i) {
+        Point p = { PointHash(it->second, i), id };
+        _ring.erase(p);
+    }
+    _addresses.erase(it);
+    _servers.erase(id);
+    return true;
+}
+
+void ServerSubset::OnAddedServers(const std::vector<ServerId>& servers) {
+    OnServersChanged(servers, std::vector<ServerId>());
+}
+
+void ServerSubset::OnRemovedServers(const std::vector<ServerId>& servers) {
+    OnServersChanged(std::vector<ServerId>(), servers);
+}
+
+void ServerSubset::OnServersChanged(const std::vector<ServerId>& added,
+                                    const std::vector<ServerId>& removed) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const size_t nserver_before = _servers.size();
+    for (size_t i = 0; i < removed.size(); ++i) {
+        RemoveFromRing(removed[i].id);
+    }
+    for (size_t i = 0; i < added.size(); ++i) {
+        AddToRing(added[i]);
+    }
+    *g_subset_naming_server_count
+        << (int64_t)_servers.size() - (int64_t)nserver_before;
+    Refresh();
+}
+
+void ServerSubset::Refresh() {
+    std::map<SocketId, ServerId> subset;
+    if (_servers.size() <= _size) {
+        subset = _servers;
+    } else {
+        const Point start = { _position, 0 };
+        std::set<Point>::const_iterator it = _ring.lower_bound(start);
+        for (size_t i = 0; i < _ring.size() && subset.size() < _size; ++i) {
+            if (it == _ring.end()) {
+                it = _ring.begin();
+            }
+            if (subset.find(it->id) == subset.end()) {
+                subset[it->id] = _servers[it->id];
+            }
+            ++it;
+        }
+    }
+    std::vector<ServerId> added;
+    std::vector<ServerId> removed;
+    for (std::map<SocketId, ServerId>::const_iterator
+             it = subset.begin(); it != subset.end(); ++it) {
+        if (_subset.find(it->first) == _subset.end()) {
+            added.push_back(it->second);
+        }
+    }
+    for (std::map<SocketId, ServerId>::const_iterator
+             it = _subset.begin(); it != _subset.end(); ++it) {
+        if (subset.find(it->first) == subset.end()) {
+            removed.push_back(it->second);
+        }
+    }
+    if (added.empty() && removed.empty()) {
+        return;
+    }
+    *g_subset_server_count << (int64_t)subset.size() - (int64_t)_subset.size();
+    *g_subset_churn << (int64_t)(added.size() + removed.size());
+    _subset.swap(subset);
+    _downstream->OnServersChanged(added, removed);
+}
+
+size_t ServerSubset::subset_count() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _subset.size();
+}
+
+size_t ServerSubset::server_count() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _servers.size();
+}
+
+void ServerSubset::GetSubset(std::vector<ServerId>* servers) const {
+    servers->clear();
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (std::map<SocketId, ServerId>::const_iterator
+             it = _subset.begin(); it != _subset.end(); ++it) {
+        servers->push_back(it->second);
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,92 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_SERVER_SUBSET_H
+#define BRPC_SERVER_SUBSET_H
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "butil/synchronization/lock.h"
+#include "brpc/server_id.h"
+#include "brpc/details/naming_service_thread.h"   // NamingServiceWatcher
+
+namespace brpc {
+
+// Watches all servers of a naming service and forwards changes of a
+// deterministic subset of them to `downstream', so that a client only
+// connects to and health-checks the subset.
+// Servers are put on a hash ring with virtual nodes, the subset is the first
+// `size' distinct servers clockwise from the position of the client, which is
+// decided by `client_id'. Clients with different ids spread over servers
+// evenly, and adding or removing a server only changes subsets near it on the
+// ring.
+class ServerSubset : public NamingServiceWatcher {
+public:
+    // Use -subset_client_id if `client_id' is empty.
+    ServerSubset(size_t size, const std::string& client_id,
+                 NamingServiceWatcher* downstream);
+    ~ServerSubset();
+
+    void OnAddedServers(const std::vector<ServerId>& servers) override;
+    void OnRemovedServers(const std::vector<ServerId>& servers) override;
+    void OnServersChanged(const std::vector<ServerId>& added,
+                          const std::vector<ServerId>& removed) override;
+
+    size_t size() const { return _size; }
+    // Number of servers in the subset.
+    size_t subset_count() const;
+    // Number of all servers.
+    size_t server_count() const;
+    void GetSubset(std::vector<ServerId>* servers) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ServerSubset);
+
+    struct Point {
+        uint32_t hash;
+        SocketId id;
+        bool operator<(const Point& rhs) const {
+            return hash != rhs.hash ? hash < rhs.hash : id < rhs.id;
+        }
+    };
+    // Add or remove virtual nodes of a server in _ring. Only the changed
+    // points are touched, which is O(SUBSET_REPLICAS * log(ring size)).
+    bool AddToRing(const ServerId& server);
+    bool RemoveFromRing(SocketId id);
+    // Recompute the subset and notify `_downstream' with the difference.
+    void Refresh();
+
+    const size_t _size;
+    const uint32_t _position;
+    NamingServiceWatcher* _downstream;
+    mutable butil::Mutex _mutex;
+    // Virtual nodes of all servers, ordered by hash.
+    std::set<Point> _ring;
+    std::map<SocketId, ServerId> _servers;
+    // Addresses that virtual nodes of servers are hashed from.
+    std::map<SocketId, std::string> _addresses;
+    std::map<SocketId, ServerId> _subset;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_SERVER_SUBSET_H
@@ -0,0 +1,510 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <fcntl.h>                                 // open
+#include <algorithm>                               // std::min
+#include <unistd.h>                                // ftruncate
+#include <sys/mman.h>                              // mmap
+#include <sys/stat.h>                              // fstat
+#include <gflags/gflags.h>
+#include "butil/fd_guard.h"
+#include "butil/logging.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
+#include "brpc/span.h"
+#include "brpc/details/span_db.h"
+
+
+namespace brpc {
+
+DECLARE_bool(rpcz_keep_span_db);
+
+static const char SPAN_RING_MAGIC[8] = { 'B', 'R', 'P', 'C', 'S', 'P', 'A', 'N' };
+static const uint32_t SPAN_RING_VERSION = 1;
+
+// Beginning of the memory, followed by entries, buckets and data.
+struct MemorySpanDB::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_spans;
+    uint64_t data_capacity;
+    // Number of spans ever indexed, sequence of the next span.
+    butil::atomic<uint64_t> nspan;
+    // Number of bytes ever written into the data ring.
+    butil::atomic<uint64_t> data_end;
+    // Spans with smaller time keys are removed.
+    butil::atomic<int64_t> min_time_key;
+    // Accessed by the indexing thread only.
+    int64_t last_time_key;
+};
+
+struct MemorySpanDB::EntryData {
+    uint64_t trace_id;
+    uint64_t span_id;
+    uint64_t log_id;
+    // Starting time made monotonic, for searching entries by time.
+    int64_t time_key;
+    int64_t start_real_us;
+    int64_t latency_us;
+    // 1 + sequence of the previous span in the same bucket, 0 for none.
+    uint64_t prev_in_bucket;
+    // Position in the data ring: full_method_name followed by serialized
+    // RpczSpan.
+    uint64_t data_offset;
+    uint32_t name_size;
+    uint32_t span_size;
+    int32_t type;
+    int32_t error_code;
+    int32_t request_size;
+    int32_t response_size;
+};
+
+struct MemorySpanDB::Entry {
+    // 2 * seq + 1: being written, 2 * seq + 2: the entry of seq is ready.
+    butil::atomic<uint64_t> version;
+    EntryData data;
+};
+
+BAIDU_CASSERT(sizeof(butil::atomic<uint64_t>) == sizeof(uint64_t),
+              atomic_must_be_mappable);
+
+inline size_t AlignUp64(size_t n) {
+    return (n + 63) & ~(size_t)63;
+}
+
+MemorySpanDB::MemorySpanDB()
+    : _readonly(false)
+    , _mem(NULL)
+    , _mem_len(0)
+    , _header(NULL)
+    , _entries(NULL)
+    , _buckets(NULL)
+    , _data(NULL)
+    , _span_mask(0)
+    , _data_capacity(0) {
+}
+
+MemorySpanDB::~MemorySpanDB() {
+    if (_mem) {
+        munmap(_mem, _mem_len);
+        _mem = NULL;
+    }
+    if (!_readonly && !_path.empty() && !FLAGS_rpcz_keep_span_db) {
+        unlink(_path.c_str());
+        // Remove the directory created for this file as well, which fails
+        // harmlessly when it's not empty.
+        const size_t slash_pos = _path.find_last_of('/');
+        if (slash_pos != std::string::npos && slash_pos != 0) {
+            rmdir(_path.substr(0, slash_pos).c_str());
+        }
+    }
+}
+
+int MemorySpanDB::Map(int fd, size_t length, bool readonly) {
+    void* mem = NULL;
+    if (fd >= 0) {
+        mem = mmap(NULL, length, (readonly ? PROT_READ : PROT_READ|PROT_WRITE),
+                   MAP_SHARED, fd, 0);
+    } else {
+        mem = mmap(NULL, length, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to mmap " << length << " bytes";
+        return -1;
+    }
+    _mem = mem;
+    _mem_len = length;
+    _readonly = readonly;
+    return 0;
+}
+
+void MemorySpanDB::Attach() {
+    char* p = (char*)_mem;
+    _header = (Header*)p;
+    _span_mask = _header->max_spans - 1;
+    _data_capacity = _header->data_capacity;
+    p += AlignUp64(sizeof(Header));
+    _entries = (Entry*)p;
+    p += AlignUp64(sizeof(Entry) * _header->max_spans);
+    _buckets = (butil::atomic<uint64_t>*)p;
+    p += AlignUp64(sizeof(uint64_t) * _header->max_spans);
+    _data = p;
+}
+
+size_t MemorySpanDB::MemoryLength(size_t max_spans, size_t data_bytes) {
+    return AlignUp64(sizeof(Header))
+        + AlignUp64(sizeof(Entry) * max_spans)
+        + AlignUp64(sizeof(uint64_t) * max_spans)
+        + data_bytes;
+}
+
+MemorySpanDB* MemorySpanDB::Open(const std::string& path,
+                                 size_t max_spans, size_t data_bytes) {
+    if (max_spans == 0 || max_spans > (1UL << 30)) {
+        LOG(ERROR) << "Invalid max_spans=" << max_spans;
+        return NULL;
+    }
+    size_t n = 1;
+    while (n < max_spans) {
+        n <<= 1;
+    }
+    max_spans = n;
+    if (data_bytes < 4096) {
+        LOG(ERROR) << "Invalid data_bytes=" << data_bytes;
+        return NULL;
+    }
+    const size_t length = MemoryLength(max_spans, data_bytes);
+
+    MemorySpanDB* db = new (std::nothrow) MemorySpanDB;
+    if (db == NULL) {
+        return NULL;
+    }
+    if (path.empty()) {
+        if (db->Map(-1, length, false) != 0) {
+            delete db;
+            return NULL;
+        }
+    } else {
+        db->_path = path;
+        butil::fd_guard fd(open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644));
+        if (fd < 0) {
+            PLOG(ERROR) << "Fail to open " << path;
+            delete db;
+            return NULL;
+        }
+        // Zero-filled.
+        if (ftruncate(fd, length) != 0) {
+            PLOG(ERROR) << "Fail to resize " << path << " to " << length;
+            delete db;
+            return NULL;
+        }
+        if (db->Map(fd, length, false) != 0) {
+            delete db;
+            return NULL;
+        }
+    }
+    Header* h = (Header*)db->_mem;
+    h->version = SPAN_RING_VERSION;
+    h->max_spans = max_spans;
+    h->data_capacity = data_bytes;
+    // Set magic at last so that an incompletely initialized file is not
+    // recognized.
+    memcpy(h->magic, SPAN_RING_MAGIC, sizeof(h->magic));
+    db->Attach();
+    return db;
+}
+
+MemorySpanDB* MemorySpanDB::Load(const std::string& path) {
+    butil::fd_guard fd(open(path.c_str(), O_RDONLY));
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << path;
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        PLOG(ERROR) << "Fail to fstat " << path;
+        return NULL;
+    }
+    const size_t file_len = st.st_size;
+    Header h;
+    if (file_len < sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+        LOG(ERROR) << "Fail to read header of " << path;
+        return NULL;
+    }
+    if (memcmp(h.magic, SPAN_RING_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != SPAN_RING_VERSION) {
+        LOG(ERROR) << path << " is not a span file of version "
+                   << SPAN_RING_VERSION;
+        return NULL;
+    }
+    if (h.max_spans == 0 || (h.max_spans & (h.max_spans - 1)) != 0 ||
+        MemoryLength(h.max_spans, h.data_capacity) != file_len) {
+        LOG(ERROR) << "Invalid header of " << path;
+        return NULL;
+    }
+    MemorySpanDB* db = new (std::nothrow) MemorySpanDB;
+    if (db == NULL) {
+        return NULL;
+    }
+    db->_path = path;
+    if (db->Map(fd, file_len, true) != 0) {
+        delete db;
+        return NULL;
+    }
+    db->Attach();
+    return db;
+}
+
+uint64_t MemorySpanDB::span_count() const {
+    return _header->nspan.load(butil::memory_order_acquire);
+}
+
+uint64_t MemorySpanDB::BucketOf(uint64_t trace_id) const {
+    return butil::fmix64(trace_id) & _span_mask;
+}
+
+int MemorySpanDB::Index(const Span* span) {
+    if (_readonly) {
+        LOG(ERROR) << "Fail to index span into read-only " << _path;
+        return -1;
+    }
+    RpczSpan value_proto;
+    SpanToProto(span, &value_proto);
+    _buf.assign(span->full_method_name());
+    const size_t name_size = _buf.size();
+    if (!value_proto.AppendToString(&_buf)) {
+        LOG(WARNING) << "Fail to serialize RpczSpan";
+        return 0;
+    }
+    const size_t size = _buf.size();
+    if (size > _data_capacity / 4) {
+        LOG_EVERY_SECOND(WARNING) << "Span of " << size << " bytes is too "
+            "large to be kept in " << _data_capacity << " bytes";
+        return 0;
+    }
+
+    const int64_t start_time = span->GetStartRealTimeUs();
+    // Make time keys monotonic for binary searching, see comments in the
+    // leveldb version for details.
+    int64_t time_key = start_time;
+    if (time_key <= _header->last_time_key) {
+        time_key = _header->last_time_key + 1;
+    }
+    _header->last_time_key = time_key;
+
+    const uint64_t seq = _header->nspan.load(butil::memory_order_relaxed);
+    Entry& e = _entries[seq & _span_mask];
+    const uint64_t offset = _header->data_end.load(butil::memory_order_relaxed);
+    // Invalidate the entry and the bytes being overwritten before writing
+    // them, which are checked by readers after copying.
+    e.version.store(2 * seq + 1, butil::memory_order_relaxed);
+    _header->data_end.store(offset + size, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_release);
+
+    const size_t pos = offset % _data_capacity;
+    const size_t n1 = std::min((size_t)(_data_capacity - pos), size);
+    memcpy(_data + pos, _buf.data(), n1);
+    if (n1 < size) {
+        memcpy(_data, _buf.data() + n1, size - n1);
+    }
+
+    const uint64_t bucket = BucketOf(span->trace_id());
+    EntryData& d = e.data;
+    d.trace_id = span->trace_id();
+    d.span_id = span->span_id();
+    d.log_id = span->log_id();
+    d.time_key = time_key;
+    d.start_real_us = start_time;
+    d.latency_us = span->GetEndRealTimeUs() - start_time;
+    d.prev_in_bucket = _buckets[bucket].load(butil::memory_order_relaxed);
+    d.data_offset = offset;
+    d.name_size = name_size;
+    d.span_size = size - name_size;
+    d.type = span->type();
+    d.error_code = span->error_code();
+    d.request_size = span->request_size();
+    d.response_size = span->response_size();
+    e.version.store(2 * seq + 2, butil::memory_order_release);
+
+    _buckets[bucket].store(seq + 1, butil::memory_order_release);
+    _header->nspan.store(seq + 1, butil::memory_order_release);
+    return 0;
+}
+
+int MemorySpanDB::RemoveSpansBefore(int64_t tm) {
+    if (_readonly) {
+        return 0;
+    }
+    // Spans are not erased, just hidden from queries and overwritten later.
+    if (tm > _header->min_time_key.load(butil::memory_order_relaxed)) {
+        _header->min_time_key.store(tm, butil::memory_order_relaxed);
+    }
+    return 0;
+}
+
+bool MemorySpanDB::ReadEntry(uint64_t seq, EntryData* data) const {
+    const Entry& e = _entries[seq & _span_mask];
+    const uint64_t expected_version = 2 * seq + 2;
+    if (e.version.load(butil::memory_order_acquire) != expected_version) {
+        return false;
+    }
+    memcpy(data, &e.data, sizeof(*data));
+    butil::atomic_thread_fence(butil::memory_order_acquire);
+    if (e.version.load(butil::memory_order_relaxed) != expected_version) {
+        return false;
+    }
+    return data->time_key >=
+        _header->min_time_key.load(butil::memory_order_relaxed);
+}
+
+bool MemorySpanDB::ReadData(const EntryData& data, bool with_span,
+                            std::string* name, std::string* span) const {
+    const size_t size = data.name_size + (with_span ? data.span_size : 0);
+    if (data.name_size + (uint64_t)data.span_size > _data_capacity) {
+        return false;  // corrupted
+    }
+    std::string buf;
+    buf.resize(size);
+    const size_t pos = data.data_offset % _data_capacity;
+    const size_t n1 = std::min((size_t)(_data_capacity - pos), size);
+    memcpy(&buf[0], _data + pos, n1);
+    if (n1 < size) {
+        memcpy(&buf[n1], _data, size - n1);
+    }
+    butil::atomic_thread_fence(butil::memory_order_acquire);
+    const uint64_t data_end = _header->data_end.load(butil::memory_order_relaxed);
+    if (data_end < data.data_offset + data.name_size + data.span_size ||
+        data_end - data.data_offset > _data_capacity) {
+        return false;
+    }
+    name->assign(buf.data(), data.name_size);
+    if (with_span) {
+        span->assign(buf.data() + data.name_size, data.span_size);
+    }
+    return true;
+}
+
+void MemorySpanDB::ToBriefSpan(const EntryData& data, const std::string& name,
+                               BriefSpan* brief) const {
+    brief->set_trace_id(data.trace_id);
+    brief->set_span_id(data.span_id);
+    brief->set_log_id(data.log_id);
+    brief->set_type((SpanType)data.type);
+    brief->set_error_code(data.error_code);
+    brief->set_request_size(data.request_size);
+    brief->set_response_size(data.response_size);
+    brief->set_start_real_us(data.start_real_us);
+    brief->set_latency_us(data.latency_us);
+    brief->set_full_method_name(name);
+}
+
+int MemorySpanDB::FindSpan(uint64_t trace_id, uint64_t span_id,
+                           RpczSpan* response) {
+    const uint64_t nspan = span_count();
+    uint64_t cur = _buckets[BucketOf(trace_id)].load(butil::memory_order_acquire);
+    std::string name;
+    std::string value;
+    EntryData data;
+    while (cur != 0 && cur + _span_mask >= nspan) {
+        if (!ReadEntry(cur - 1, &data)) {
+            break;
+        }
+        if (data.trace_id == trace_id && data.span_id == span_id) {
+            if (!ReadData(data, true, &name, &value)) {
+                return -1;
+            }
+            if (!response->ParseFromString(value)) {
+                LOG(ERROR) << "Fail to parse from the value";
+                return -1;
+            }
+            return 0;
+        }
+        if (data.prev_in_bucket >= cur) {
+            break;
+        }
+        cur = data.prev_in_bucket;
+    }
+    return -1;
+}
+
+void MemorySpanDB::FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) {
+    const uint64_t nspan = span_count();
+    uint64_t cur = _buckets[BucketOf(trace_id)].load(butil::memory_order_acquire);
+    std::string name;
+    std::string value;
+    EntryData data;
+    while (cur != 0 && cur + _span_mask >= nspan) {
+        if (!ReadEntry(cur - 1, &data)) {
+            break;
+        }
+        if (data.trace_id == trace_id &&
+            ReadData(data, true, &name, &value)) {
+            out->push_back(RpczSpan());
+            if (!out->back().ParseFromString(value)) {
+                LOG(ERROR) << "Fail to parse from value";
+                out->pop_back();
+            }
+        }
+        if (data.prev_in_bucket >= cur) {
+            break;
+        }
+        cur = data.prev_in_bucket;
+    }
+}
+
+void MemorySpanDB::ListSpans(int64_t starting_realtime, size_t max_scan,
+                             std::deque<BriefSpan>* out, SpanFilter* filter) {
+    const uint64_t nspan = span_count();
+    if (nspan == 0) {
+        return;
+    }
+    // Entries which are not readable at the beginning are overwritten soon,
+    // skip the first 1/16 of the ring.
+    uint64_t lo = 0;
+    if (nspan > _span_mask + 1) {
+        lo = nspan - (_span_mask + 1) + ((_span_mask + 1) >> 4);
+    }
+    // Find the last entry whose time key is not greater than
+    // starting_realtime in [lo, nspan).
+    EntryData data;
+    uint64_t hi = nspan;
+    while (lo < hi) {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (!ReadEntry(mid, &data) || data.time_key <= starting_realtime) {
+            // Unreadable entries are overwritten(older) or removed.
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    std::string name;
+    BriefSpan brief;
+    size_t nscan = 0;
+    for (uint64_t seq = lo; seq > 0 && nscan < max_scan; --seq) {
+        if (!ReadEntry(seq - 1, &data)) {
+            break;
+        }
+        if (data.start_real_us > starting_realtime) {
+            continue;
+        }
+        if (!ReadData(data, false, &name, NULL)) {
+            break;
+        }
+        brief.Clear();
+        ToBriefSpan(data, name, &brief);
+        if (NULL == filter || filter->Keep(brief)) {
+            out->push_back(brief);
+        }
+        // We increase the count no matter filter passed or not to avoid
+        // scaning too many entries.
+        ++nscan;
+    }
+}
+
+void MemorySpanDB::Describe(std::ostream& os) {
+    const uint64_t nspan = span_count();
+    const uint64_t data_end = _header->data_end.load(butil::memory_order_relaxed);
+    os << "[ " << (_path.empty() ? "memory" : _path)
+       << (_readonly ? " (read-only)" : "") << " ]\n"
+       << "spans: " << std::min(nspan, _span_mask + 1) << '/'
+       << (_span_mask + 1) << " (" << nspan << " indexed)\n"
+       << "bytes: " << std::min(data_end, _data_capacity) << '/'
+       << _data_capacity << " (" << data_end << " written)\n";
+}
+
+} // namespace brpc
@@ -0,0 +1,139 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_SPAN_DB_H
+#define BRPC_DETAILS_SPAN_DB_H
+
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <ostream>
+#include "butil/macros.h"
+#include "butil/atomicops.h"
+#include "brpc/shared_object.h"
+#include "brpc/span.pb.h"
+
+
+namespace brpc {
+
+class Span;
+class SpanFilter;
+
+// Storage of spans collected by rpcz. Spans are indexed by the collecting
+// thread only, while queries from builtin services may run concurrently.
+class SpanDB : public SharedObject {
+public:
+    // Store `span' along with its client spans.
+    // Returns 0 on success, -1 when this DB is unusable and should be
+    // replaced. Other failures are logged.
+    virtual int Index(const Span* span) = 0;
+
+    // Remove spans started before `tm' (in microseconds since epoch).
+    // Returns 0 on success, -1 when this DB is unusable.
+    virtual int RemoveSpansBefore(int64_t tm) = 0;
+
+    // Query interfaces, see comments in span.h
+    virtual int FindSpan(uint64_t trace_id, uint64_t span_id,
+                         RpczSpan* span) = 0;
+    virtual void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) = 0;
+    virtual void ListSpans(int64_t before_this_time, size_t max_scan,
+                           std::deque<BriefSpan>* out, SpanFilter* filter) = 0;
+
+    virtual void Describe(std::ostream& os) = 0;
+
+protected:
+    // Convert `span' and its client spans into `out'.
+    static void SpanToProto(const Span* span, RpczSpan* out);
+};
+
+// Keep spans in a ring of fixed memory: new spans overwrite the oldest ones
+// when the ring is full. Spans are serialized when being indexed and stored
+// with their brief information, which is enough for listing spans without
+// parsing. The ring is written by one thread and read without locks: readers
+// validate what they copied with versions, entries overwritten during
+// reading are just skipped.
+// If the ring is opened with a file, the memory is mapped to the file and
+// spans survive restarts of the program, the file can be loaded by
+// LoadSpanDBFromFile() later.
+class MemorySpanDB : public SpanDB {
+public:
+    // Create a ring of at most `max_spans' spans (rounded up to power of 2)
+    // and `data_bytes' bytes of serialized spans. The memory is mapped to
+    // `path' if it's not empty.
+    // Returns NULL on error.
+    static MemorySpanDB* Open(const std::string& path,
+                              size_t max_spans, size_t data_bytes);
+
+    // Map a file written by a ring opened with a path, read-only.
+    // Returns NULL on error.
+    static MemorySpanDB* Load(const std::string& path);
+
+    int Index(const Span* span) override;
+    int RemoveSpansBefore(int64_t tm) override;
+    int FindSpan(uint64_t trace_id, uint64_t span_id,
+                 RpczSpan* span) override;
+    void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) override;
+    void ListSpans(int64_t before_this_time, size_t max_scan,
+                   std::deque<BriefSpan>* out, SpanFilter* filter) override;
+    void Describe(std::ostream& os) override;
+
+    // Number of spans ever indexed.
+    uint64_t span_count() const;
+
+private:
+    struct Header;
+    struct Entry;
+    struct EntryData;
+
+    MemorySpanDB();
+    ~MemorySpanDB();
+    DISALLOW_COPY_AND_ASSIGN(MemorySpanDB);
+
+    static size_t MemoryLength(size_t max_spans, size_t data_bytes);
+    int Map(int fd, size_t length, bool readonly);
+    void Attach();
+
+    // Copy the entry of `seq' into `data'. Returns false if the entry
+    // is being written or was overwritten.
+    bool ReadEntry(uint64_t seq, EntryData* data) const;
+    // Copy name and serialized span of the entry. Returns false if the
+    // bytes were overwritten.
+    bool ReadData(const EntryData& data, bool with_span,
+                  std::string* name, std::string* span) const;
+    void ToBriefSpan(const EntryData& data, const std::string& name,
+                     BriefSpan* brief) const;
+    uint64_t BucketOf(uint64_t trace_id) const;
+
+    std::string _path;
+    bool _readonly;
+    void* _mem;
+    size_t _mem_len;
+    Header* _header;
+    Entry* _entries;
+    butil::atomic<uint64_t>* _buckets;
+    char* _data;
+    uint64_t _span_mask;
+    uint64_t _data_capacity;
+    // Buffer for serializing spans, used by the indexing thread.
+    std::string _buf;
+};
+
+} // namespace brpc
+
+
+#endif // BRPC_DETAILS_SPAN_DB_H
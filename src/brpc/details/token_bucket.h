@@ -0,0 +1,90 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_TOKEN_BUCKET_H
+#define BRPC_DETAILS_TOKEN_BUCKET_H
+
+#include <stdint.h>
+#include <algorithm>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+
+
+namespace brpc {
+
+// Lock-free bucket of fractional tokens, used to limit some actions (e.g.
+// retries) to a ratio of calls while allowing bursts: every call deposits
+// `ratio' tokens and every action withdraws one. The bucket is full
+// initially.
+class TokenBucket {
+public:
+    TokenBucket(double ratio, int capacity)
+        : _delta((int64_t)(ratio * SCALE))
+        , _capacity(std::max(capacity, 0) * SCALE)
+        , _tokens(_capacity) {}
+
+    // Take one token. Returns false if there's not enough tokens.
+    bool Withdraw() {
+        int64_t tokens = _tokens.load(butil::memory_order_relaxed);
+        while (tokens >= SCALE) {
+            if (_tokens.compare_exchange_weak(tokens, tokens - SCALE,
+                                              butil::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Add `ratio' tokens, at most up to the capacity.
+    void Deposit() {
+        int64_t tokens = _tokens.load(butil::memory_order_relaxed);
+        while (tokens < _capacity) {
+            if (_tokens.compare_exchange_weak(
+                    tokens, std::min(tokens + _delta, _capacity),
+                    butil::memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+
+    void Halve() {
+        int64_t tokens = _tokens.load(butil::memory_order_relaxed);
+        while (!_tokens.compare_exchange_weak(tokens, tokens / 2,
+                                              butil::memory_order_relaxed)) {
+        }
+    }
+
+    double tokens() const {
+        return _tokens.load(butil::memory_order_relaxed) / (double)SCALE;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(TokenBucket);
+
+    // Tokens are stored as integers multiplied by this.
+    static const int64_t SCALE = 1000;
+
+    const int64_t _delta;
+    const int64_t _capacity;
+    butil::atomic<int64_t> _tokens;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_DETAILS_TOKEN_BUCKET_H
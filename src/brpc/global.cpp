@@ -46,7 +46,10 @@
 #include "brpc/policy/randomized_load_balancer.h"
 #include "brpc/policy/weighted_randomized_load_balancer.h"
 #include "brpc/policy/locality_aware_load_balancer.h"
+#include "brpc/policy/p2c_load_balancer.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
+#include "brpc/policy/lookup_hashing_load_balancer.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
 #include "brpc/policy/hasher.h"
 #include "brpc/policy/dynpart_load_balancer.h"
 
@@ -81,6 +84,7 @@
 #include "brpc/policy/auto_concurrency_limiter.h"
 #include "brpc/policy/constant_concurrency_limiter.h"
 #include "brpc/policy/timeout_concurrency_limiter.h"
+#include "brpc/policy/gradient_concurrency_limiter.h"
 
 #include "brpc/input_messenger.h"     // get_or_new_client_side_messenger
 #include "brpc/socket_map.h"          // SocketMapList
@@ -123,6 +127,8 @@ struct GlobalExtensions {
         , ch_mh_lb(CONS_HASH_LB_MURMUR3)
         , ch_md5_lb(CONS_HASH_LB_MD5)
         , ch_ketama_lb(CONS_HASH_LB_KETAMA)
+        , maglev_lb(LOOKUP_HASH_LB_MAGLEV)
+        , jump_lb(LOOKUP_HASH_LB_JUMP)
         , constant_cl(0) {
     }
     
@@ -144,14 +150,19 @@ struct GlobalExtensions {
     RandomizedLoadBalancer randomized_lb;
     WeightedRandomizedLoadBalancer wr_lb;
     LocalityAwareLoadBalancer la_lb;
+    P2CLoadBalancer p2c_lb;
     ConsistentHashingLoadBalancer ch_mh_lb;
     ConsistentHashingLoadBalancer ch_md5_lb;
     ConsistentHashingLoadBalancer ch_ketama_lb;
+    LookupHashingLoadBalancer maglev_lb;
+    LookupHashingLoadBalancer jump_lb;
+    ZoneAwareLoadBalancer zone_lb;
     DynPartLoadBalancer dynpart_lb;
 
     AutoConcurrencyLimiter auto_cl;
     ConstantConcurrencyLimiter constant_cl;
     TimeoutConcurrencyLimiter timeout_cl;
+    GradientConcurrencyLimiter gradient_cl;
 };
 
 static pthread_once_t register_extensions_once = PTHREAD_ONCE_INIT;
@@ -370,9 +381,13 @@ static void GlobalInitializeOrDieImpl() {
     LoadBalancerExtension()->RegisterOrDie("random", &g_ext->randomized_lb);
     LoadBalancerExtension()->RegisterOrDie("wr", &g_ext->wr_lb);
     LoadBalancerExtension()->RegisterOrDie("la", &g_ext->la_lb);
+    LoadBalancerExtension()->RegisterOrDie("p2c", &g_ext->p2c_lb);
     LoadBalancerExtension()->RegisterOrDie("c_murmurhash", &g_ext->ch_mh_lb);
     LoadBalancerExtension()->RegisterOrDie("c_md5", &g_ext->ch_md5_lb);
     LoadBalancerExtension()->RegisterOrDie("c_ketama", &g_ext->ch_ketama_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_maglev", &g_ext->maglev_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_jump", &g_ext->jump_lb);
+    LoadBalancerExtension()->RegisterOrDie("zone", &g_ext->zone_lb);
     LoadBalancerExtension()->RegisterOrDie("_dynpart", &g_ext->dynpart_lb);
 
     // Compress Handlers
@@ -604,6 +619,7 @@ static void GlobalInitializeOrDieImpl() {
     ConcurrencyLimiterExtension()->RegisterOrDie("auto", &g_ext->auto_cl);
     ConcurrencyLimiterExtension()->RegisterOrDie("constant", &g_ext->constant_cl);
     ConcurrencyLimiterExtension()->RegisterOrDie("timeout", &g_ext->timeout_cl);
+    ConcurrencyLimiterExtension()->RegisterOrDie("gradient", &g_ext->gradient_cl);
 
     if (FLAGS_usercode_in_pthread) {
         // Optional. If channel/server are initialized before main(), this
@@ -87,6 +87,18 @@ public:
     // Remove a list of `servers' from this balancer.
     // Returns number of servers removed.
     virtual size_t RemoveServersInBatch(const std::vector<ServerId>& servers) = 0;
+
+    // Remove `removed' and then add `added' into this balancer, numbers of
+    // servers actually added and removed are written into `nadded' and
+    // `nremoved'. Override this method if the balancer can apply both in
+    // one modification, which is much cheaper than two for balancers
+    // rebuilding internal structures on each modification.
+    virtual void UpdateServersInBatch(const std::vector<ServerId>& added,
+                                      const std::vector<ServerId>& removed,
+                                      size_t* nadded, size_t* nremoved) {
+        *nremoved = (removed.empty() ? 0 : RemoveServersInBatch(removed));
+        *nadded = (added.empty() ? 0 : AddServersInBatch(added));
+    }
     
     // Select a server and address it into `out->ptr'.
     // If Feedback() should be called when the RPC is done, set
@@ -159,6 +171,17 @@ public:
         return n;
     }
 
+    void UpdateServersInBatch(const std::vector<ServerId>& added,
+                              const std::vector<ServerId>& removed) {
+        size_t nadded = 0;
+        size_t nremoved = 0;
+        _lb->UpdateServersInBatch(added, removed, &nadded, &nremoved);
+        if (nadded != nremoved) {
+            _weight_sum.fetch_add((int)nadded - (int)nremoved,
+                                  butil::memory_order_relaxed);
+        }
+    }
+
     virtual void Describe(std::ostream& os, const DescribeOptions&);
 
     virtual int Weight() {
@@ -36,9 +36,21 @@ namespace brpc {
 class NamingServiceActions {
 public:
     virtual ~NamingServiceActions() {}
+    // Add/remove some servers. Naming services able to get changes (e.g.
+    // by watching) should call these methods rather than ResetServers()
+    // with the full list, which costs O(number of all servers).
     virtual void AddServers(const std::vector<ServerNode>& servers) = 0;
     virtual void RemoveServers(const std::vector<ServerNode>& servers) = 0;
+    // Replace all servers with `servers'.
     virtual void ResetServers(const std::vector<ServerNode>& servers) = 0;
+    // Remove `removed' and add `added' at once. A server whose tag(e.g.
+    // weight) is changed should be in `removed' with the old tag and in
+    // `added' with the new tag, load balancers are updated once.
+    virtual void UpdateServers(const std::vector<ServerNode>& added,
+                               const std::vector<ServerNode>& removed) {
+        RemoveServers(removed);
+        AddServers(added);
+    }
 };
 
 // Mapping a name to ServerNodes.
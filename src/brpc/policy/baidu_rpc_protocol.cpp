@@ -361,6 +361,9 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     if (request_meta.has_timeout_ms()) {
         cntl->set_timeout_ms(request_meta.timeout_ms());
     }
+    if (request_meta.has_priority()) {
+        cntl->set_request_priority(request_meta.priority());
+    }
     cntl->set_request_compress_type((CompressType)meta.compress_type());
     accessor.set_server(server)
         .set_security_mode(security_mode)
@@ -461,6 +464,9 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
                 break;
             }
         }
+        // Attribute cpu time of processing the request to the method.
+        bthread::ScopedCpuUsageAttribution cpu_usage_scope(
+            method_status ? method_status->cpu_usage_counter() : NULL);
         google::protobuf::Service* svc = mp->service;
         const google::protobuf::MethodDescriptor* method = mp->method;
         accessor.set_method(method);
@@ -678,6 +684,9 @@ void PackRpcRequest(butil::IOBuf* req_buf,
     if (!cntl->request_id().empty()) {
         request_meta->set_request_id(cntl->request_id());
     }
+    if (cntl->request_priority() != 0) {
+        request_meta->set_priority(cntl->request_priority());
+    }
     meta.set_correlation_id(correlation_id);
     StreamId request_stream_id = accessor.request_stream();
     if (request_stream_id != INVALID_STREAM_ID) {
@@ -704,7 +713,8 @@ void PackRpcRequest(butil::IOBuf* req_buf,
     }
 
     Span* span = accessor.span();
-    if (span) {
+    // Servers always trace requests with trace_id, see IsTraceable().
+    if (span && span->sampled()) {
         request_meta->set_trace_id(span->trace_id());
         request_meta->set_span_id(span->span_id());
         request_meta->set_parent_span_id(span->parent_span_id());
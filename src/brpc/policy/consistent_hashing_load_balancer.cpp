@@ -18,6 +18,8 @@
 
 #include <algorithm>                                           // std::set_union
 #include <array>
+#include <cmath>                                               // std::ceil
+#include <set>
 #include <gflags/gflags.h>
 #include "butil/containers/flat_map.h"
 #include "butil/errno.h"
@@ -143,7 +145,11 @@ inline const ReplicaPolicy* GetReplicaPolicy(ConsistentHashingLoadBalancerType t
 
 ConsistentHashingLoadBalancer::ConsistentHashingLoadBalancer(
     ConsistentHashingLoadBalancerType type)
-    : _num_replicas(FLAGS_chash_num_replicas), _type(type) {
+    : _num_replicas(FLAGS_chash_num_replicas)
+    , _type(type)
+    , _load_epsilon(0)
+    , _total_inflight(0)
+    , _num_servers(0) {
     CHECK(GetReplicaPolicy(_type))
         << "Fail to find replica policy for consistency lb type: '" << _type << '\'';
 }
@@ -216,37 +222,120 @@ size_t ConsistentHashingLoadBalancer::Remove(
     return fg.size() - bg.size();
 }
 
+size_t ConsistentHashingLoadBalancer::AddLoads(
+        LoadMap& bg, const LoadMap& fg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        const SocketId id = servers[i].id;
+        if (bg.find(id) != bg.end()) {
+            continue;
+        }
+        LoadMap::const_iterator it = fg.find(id);
+        if (it != fg.end()) {
+            // The other buffer was modified, share the load.
+            bg[id] = it->second;
+        } else {
+            bg[id] = std::make_shared<ServerLoad>();
+        }
+        ++count;
+    }
+    return count;
+}
+
+size_t ConsistentHashingLoadBalancer::RemoveLoads(
+        LoadMap& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += bg.erase(servers[i].id);
+    }
+    return count;
+}
+
+void ConsistentHashingLoadBalancer::AttachLoads(std::vector<Node>* nodes) {
+    std::vector<ServerId> servers;
+    for (size_t i = 0; i < nodes->size(); ++i) {
+        if (i == 0 || (*nodes)[i].server_sock != (*nodes)[i - 1].server_sock) {
+            servers.push_back((*nodes)[i].server_sock);
+        }
+    }
+    _db_loads.ModifyWithForeground(AddLoads, servers);
+    butil::DoublyBufferedData<LoadMap>::ScopedPtr s;
+    CHECK_EQ(0, _db_loads.Read(&s));
+    for (size_t i = 0; i < nodes->size(); ++i) {
+        LoadMap::const_iterator it = s->find((*nodes)[i].server_sock.id);
+        CHECK(it != s->end());
+        // Owned by both buffers of _db_loads until DetachLoads(), which is
+        // called after the nodes are removed from the ring.
+        (*nodes)[i].load = it->second.get();
+    }
+}
+
+void ConsistentHashingLoadBalancer::DetachLoads(
+        const std::vector<ServerId>& servers) {
+    {
+        butil::DoublyBufferedData<LoadMap>::ScopedPtr s;
+        if (_db_loads.Read(&s) == 0) {
+            // Feedback() of in-flight requests to the servers can't find
+            // the loads anymore, remove them from the total.
+            for (size_t i = 0; i < servers.size(); ++i) {
+                LoadMap::const_iterator it = s->find(servers[i].id);
+                if (it != s->end()) {
+                    _total_inflight.fetch_sub(
+                        it->second->inflight.load(butil::memory_order_relaxed),
+                        butil::memory_order_relaxed);
+                }
+            }
+        }
+    }
+    _db_loads.Modify(RemoveLoads, servers);
+}
+
 bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
     std::vector<Node> add_nodes;
     add_nodes.reserve(_num_replicas);
     if (!GetReplicaPolicy(_type)->Build(server, _num_replicas, &add_nodes)) {
         return false;
     }
+    if (_load_epsilon > 0) {
+        AttachLoads(&add_nodes);
+    }
     std::sort(add_nodes.begin(), add_nodes.end());
     bool executed = false;
     const size_t ret = _db_hash_ring.ModifyWithForeground(
                         AddBatch, add_nodes, &executed);
     CHECK(ret == 0 || ret == _num_replicas) << ret;
+    if (ret != 0) {
+        _num_servers.fetch_add(1, butil::memory_order_relaxed);
+    }
     return ret != 0;
 }
 
-size_t ConsistentHashingLoadBalancer::AddServersInBatch(
-    const std::vector<ServerId> &servers) {
-    std::vector<Node> add_nodes;
-    add_nodes.reserve(servers.size() * _num_replicas);
+void ConsistentHashingLoadBalancer::BuildNodes(
+    const std::vector<ServerId>& servers, std::vector<Node>* nodes) {
+    nodes->reserve(servers.size() * _num_replicas);
     std::vector<Node> replicas;
     replicas.reserve(_num_replicas);
     for (size_t i = 0; i < servers.size(); ++i) {
         replicas.clear();
         if (GetReplicaPolicy(_type)->Build(servers[i], _num_replicas, &replicas)) {
-            add_nodes.insert(add_nodes.end(), replicas.begin(), replicas.end());
+            nodes->insert(nodes->end(), replicas.begin(), replicas.end());
         }
     }
-    std::sort(add_nodes.begin(), add_nodes.end());
+    if (_load_epsilon > 0) {
+        AttachLoads(nodes);
+    }
+    std::sort(nodes->begin(), nodes->end());
+}
+
+size_t ConsistentHashingLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId> &servers) {
+    std::vector<Node> add_nodes;
+    BuildNodes(servers, &add_nodes);
     bool executed = false;
     const size_t ret = _db_hash_ring.ModifyWithForeground(AddBatch, add_nodes, &executed);
     CHECK(ret % _num_replicas == 0);
     const size_t n = ret / _num_replicas;
+    _num_servers.fetch_add(n, butil::memory_order_relaxed);
     LOG_IF(ERROR, n != servers.size())
         << "Fail to AddServersInBatch, expected " << servers.size()
         << " actually " << n;
@@ -257,6 +346,12 @@ bool ConsistentHashingLoadBalancer::RemoveServer(const ServerId& server) {
     bool executed = false;
     const size_t ret = _db_hash_ring.ModifyWithForeground(Remove, server, &executed);
     CHECK(ret == 0 || ret == _num_replicas);
+    if (ret != 0) {
+        _num_servers.fetch_sub(1, butil::memory_order_relaxed);
+        if (_load_epsilon > 0) {
+            DetachLoads(std::vector<ServerId>(1, server));
+        }
+    }
     return ret != 0;
 }
 
@@ -266,12 +361,70 @@ size_t ConsistentHashingLoadBalancer::RemoveServersInBatch(
     const size_t ret = _db_hash_ring.ModifyWithForeground(RemoveBatch, servers, &executed);
     CHECK(ret % _num_replicas == 0);
     const size_t n = ret / _num_replicas;
+    _num_servers.fetch_sub(n, butil::memory_order_relaxed);
+    if (_load_epsilon > 0) {
+        DetachLoads(servers);
+    }
     LOG_IF(ERROR, n != servers.size())
         << "Fail to RemoveServersInBatch, expected " << servers.size()
         << " actually " << n;
     return n;
 }
 
+size_t ConsistentHashingLoadBalancer::UpdateBatch(
+        std::vector<Node> &bg, const std::vector<Node> &fg, Update* update) {
+    if (update->executed) {
+        // Hack DBD
+        return update->nadded + update->nremoved;
+    }
+    bool executed = false;
+    update->nremoved = RemoveBatch(bg, fg, *update->removed, &executed);
+    update->executed = true;
+    if (update->added->empty()) {
+        return update->nremoved;
+    }
+    // Merge in place rather than set_union() into another vector.
+    const size_t nkept = bg.size();
+    bg.insert(bg.end(), update->added->begin(), update->added->end());
+    std::inplace_merge(bg.begin(), bg.begin() + nkept, bg.end());
+    bg.erase(std::unique(bg.begin(), bg.end(),
+                         [](const Node& a, const Node& b) {
+                             return !(a < b) && !(b < a);
+                         }), bg.end());
+    update->nadded = bg.size() - nkept;
+    // Nothing is changed if 0, DBD does not flip.
+    return update->nadded + update->nremoved;
+}
+
+void ConsistentHashingLoadBalancer::UpdateServersInBatch(
+    const std::vector<ServerId>& added, const std::vector<ServerId>& removed,
+    size_t* nadded, size_t* nremoved) {
+    std::vector<Node> add_nodes;
+    BuildNodes(added, &add_nodes);
+    Update update = { &add_nodes, &removed, false, 0, 0 };
+    _db_hash_ring.ModifyWithForeground(UpdateBatch, &update);
+    CHECK(update.nadded % _num_replicas == 0);
+    CHECK(update.nremoved % _num_replicas == 0);
+    *nadded = update.nadded / _num_replicas;
+    *nremoved = update.nremoved / _num_replicas;
+    _num_servers.fetch_add((int64_t)*nadded - (int64_t)*nremoved,
+                           butil::memory_order_relaxed);
+    if (_load_epsilon > 0 && !removed.empty()) {
+        // Loads of servers added back are still used by the ring.
+        std::set<SocketId> added_ids;
+        for (size_t i = 0; i < added.size(); ++i) {
+            added_ids.insert(added[i].id);
+        }
+        std::vector<ServerId> detached;
+        for (size_t i = 0; i < removed.size(); ++i) {
+            if (added_ids.find(removed[i].id) == added_ids.end()) {
+                detached.push_back(removed[i]);
+            }
+        }
+        DetachLoads(detached);
+    }
+}
+
 LoadBalancer *ConsistentHashingLoadBalancer::New(const butil::StringPiece& params) const {
     ConsistentHashingLoadBalancer* lb = 
         new (std::nothrow) ConsistentHashingLoadBalancer(_type);
@@ -308,6 +461,9 @@ int ConsistentHashingLoadBalancer::SelectServer(
     if (choice == s->end()) {
         choice = s->begin();
     }
+    if (_load_epsilon > 0) {
+        return SelectServerWithBoundedLoad(*s, choice, in, out);
+    }
     for (size_t i = 0; i < s->size(); ++i) {
         if (((i + 1) == s->size() // always take last chance
              || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
@@ -323,6 +479,99 @@ int ConsistentHashingLoadBalancer::SelectServer(
     return EHOSTDOWN;
 }
 
+int ConsistentHashingLoadBalancer::SelectServerWithBoundedLoad(
+    const std::vector<Node>& ring, std::vector<Node>::const_iterator choice,
+    const SelectIn &in, SelectOut *out) {
+    const int64_t nserver =
+        std::max(_num_servers.load(butil::memory_order_relaxed), (int64_t)1);
+    const int64_t total =
+        std::max(_total_inflight.load(butil::memory_order_relaxed), (int64_t)0);
+    // Including the one being selected.
+    const int64_t capacity =
+        (int64_t)std::ceil((1 + _load_epsilon) * (total + 1) / nserver);
+    ServerLoad* const home = choice->load;
+    home->nselect.fetch_add(1, butil::memory_order_relaxed);
+    bool home_full = false;
+    ServerLoad* selected = NULL;
+    // The first usable server, chosen if all usable servers are full, which
+    // happens when most servers are excluded or unavailable.
+    ServerLoad* fallback = NULL;
+    SocketUniquePtr fallback_ptr;
+    for (size_t i = 0; i < ring.size(); ++i) {
+        ServerLoad* load = choice->load;
+        const bool full =
+            load->inflight.load(butil::memory_order_relaxed) >= capacity;
+        if (!(full && fallback != NULL)
+            && ((i + 1) == ring.size() // always take last chance
+                || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
+            && Socket::Address(choice->server_sock.id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            if (!full) {
+                selected = load;
+                break;
+            }
+            home_full = home_full || (load == home);
+            fallback = load;
+            fallback_ptr.reset(out->ptr->release());
+        }
+        if (++choice == ring.end()) {
+            choice = ring.begin();
+        }
+    }
+    if (selected == NULL) {
+        if (fallback == NULL) {
+            return EHOSTDOWN;
+        }
+        selected = fallback;
+        out->ptr->reset(fallback_ptr.release());
+    }
+    if (home_full && selected != home) {
+        home->noverflow.fetch_add(1, butil::memory_order_relaxed);
+    }
+    selected->inflight.fetch_add(1, butil::memory_order_relaxed);
+    _total_inflight.fetch_add(1, butil::memory_order_relaxed);
+    out->need_feedback = true;
+    return 0;
+}
+
+void ConsistentHashingLoadBalancer::Feedback(const CallInfo& info) {
+    butil::DoublyBufferedData<LoadMap>::ScopedPtr s;
+    if (_db_loads.Read(&s) != 0) {
+        return;
+    }
+    LoadMap::const_iterator it = s->find(info.server_id);
+    if (it == s->end()) {
+        // Removed.
+        return;
+    }
+    it->second->inflight.fetch_sub(1, butil::memory_order_relaxed);
+    _total_inflight.fetch_sub(1, butil::memory_order_relaxed);
+}
+
+void ConsistentHashingLoadBalancer::GetOverflowRates(
+    std::map<butil::EndPoint, double> *rate_map) {
+    rate_map->clear();
+    std::map<butil::EndPoint, const ServerLoad*> loads;
+    butil::DoublyBufferedData<std::vector<Node> >::ScopedPtr s;
+    if (_db_hash_ring.Read(&s) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < s->size(); ++i) {
+        const Node& node = (*s.get())[i];
+        if (node.load != NULL) {
+            loads[node.server_addr] = node.load;
+        }
+    }
+    for (std::map<butil::EndPoint, const ServerLoad*>::iterator
+            it = loads.begin(); it != loads.end(); ++it) {
+        const int64_t nselect =
+            it->second->nselect.load(butil::memory_order_relaxed);
+        const int64_t noverflow =
+            it->second->noverflow.load(butil::memory_order_relaxed);
+        (*rate_map)[it->first] = (nselect > 0 ? (double)noverflow / nselect : 0);
+    }
+}
+
 void ConsistentHashingLoadBalancer::Describe(
     std::ostream &os, const DescribeOptions& options) {
     if (!options.verbose) {
@@ -350,6 +599,19 @@ void ConsistentHashingLoadBalancer::Describe(
     os << "deviation: "  
        << sqrt(load_sqr_sum * load_map.size() - load_sum * load_sum) 
           / load_map.size();
+    if (_load_epsilon > 0) {
+        os << "\n  load epsilon: " << _load_epsilon << '\n';
+        os << "  in-flight requests: "
+           << _total_inflight.load(butil::memory_order_relaxed) << '\n';
+        std::map<butil::EndPoint, double> rate_map;
+        GetOverflowRates(&rate_map);
+        os << "  overflow rate of hosts: {\n";
+        for (std::map<butil::EndPoint, double>::iterator
+                it = rate_map.begin(); it != rate_map.end(); ++it) {
+            os << "    " << it->first << ": " << it->second << '\n';
+        }
+        os << "  }";
+    }
     os << "}\n";
 }
 
@@ -391,6 +653,14 @@ bool ConsistentHashingLoadBalancer::SetParameters(const butil::StringPiece& para
             }
             continue;
         }
+        if (sp.key() == "load_epsilon") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_load_epsilon) ||
+                _load_epsilon < 0) {
+                LOG(ERROR) << "Invalid load_epsilon=" << sp.value();
+                return false;
+            }
+            continue;
+        }
         LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
     }
     return true;
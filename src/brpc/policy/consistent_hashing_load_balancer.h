@@ -22,6 +22,9 @@
 #include <stdint.h>                                     // uint32_t
 #include <functional>
 #include <vector>                                       // std::vector
+#include <map>                                          // std::map
+#include <memory>                                       // std::shared_ptr
+#include "butil/atomicops.h"
 #include "butil/endpoint.h"                              // butil::EndPoint
 #include "butil/containers/doubly_buffered_data.h"
 #include "brpc/load_balancer.h"
@@ -41,12 +44,30 @@ enum ConsistentHashingLoadBalancerType {
     CONS_HASH_LB_LAST = 3
 };
 
+// With parameter `load_epsilon' being positive, consistent hashing with
+// bounded loads is enabled: in-flight requests of each server are capped at
+// (1 + load_epsilon) times of the average, requests to a full server
+// overflow to the next servers on the ring. Requests with the same code
+// always try servers in the same order.
 class ConsistentHashingLoadBalancer : public LoadBalancer {
 public:
+    // In-flight requests of a server, bounded-load mode only.
+    struct BAIDU_CACHELINE_ALIGNMENT ServerLoad {
+        ServerLoad() : inflight(0), nselect(0), noverflow(0) {}
+        butil::atomic<int64_t> inflight;
+        // Number of selections mapped to this server.
+        butil::atomic<int64_t> nselect;
+        // Number of selections overflowed to other servers since this
+        // server was full.
+        butil::atomic<int64_t> noverflow;
+    };
     struct Node {
+        Node() : hash(0), load(NULL) {}
         uint32_t hash;
         ServerId server_sock;
         butil::EndPoint server_addr;  // To make sorting stable among all clients
+        // Owned by _db_loads, NULL if bounded-load mode is off.
+        ServerLoad* load;
         bool operator<(const Node &rhs) const {
             if (hash < rhs.hash) { return true; }
             if (hash > rhs.hash) { return false; }
@@ -61,23 +82,61 @@ public:
     bool RemoveServer(const ServerId& server);
     size_t AddServersInBatch(const std::vector<ServerId> &servers);
     size_t RemoveServersInBatch(const std::vector<ServerId> &servers);
+    void UpdateServersInBatch(const std::vector<ServerId>& added,
+                              const std::vector<ServerId>& removed,
+                              size_t* nadded, size_t* nremoved);
     LoadBalancer *New(const butil::StringPiece& params) const;
     void Destroy();
     int SelectServer(const SelectIn &in, SelectOut *out);
+    void Feedback(const CallInfo& info);
     void Describe(std::ostream &os, const DescribeOptions& options);
 
+    // Fractions of selections overflowed from each server in bounded-load
+    // mode, empty otherwise.
+    void GetOverflowRates(std::map<butil::EndPoint, double> *rate_map);
+
 private:
+    typedef std::map<SocketId, std::shared_ptr<ServerLoad> > LoadMap;
+    struct Update {
+        const std::vector<Node>* added;
+        const std::vector<ServerId>* removed;
+        bool executed;
+        // Numbers of nodes.
+        size_t nadded;
+        size_t nremoved;
+    };
     bool SetParameters(const butil::StringPiece& params);
     void GetLoads(std::map<butil::EndPoint, double> *load_map);
+    // Point load of `nodes' to ServerLoad in _db_loads, creating them if
+    // absent.
+    void AttachLoads(std::vector<Node>* nodes);
+    void DetachLoads(const std::vector<ServerId>& servers);
+    static size_t AddLoads(LoadMap& bg, const LoadMap& fg,
+                           const std::vector<ServerId>& servers);
+    static size_t RemoveLoads(LoadMap& bg, const std::vector<ServerId>& servers);
+    int SelectServerWithBoundedLoad(const std::vector<Node>& ring,
+                                    std::vector<Node>::const_iterator choice,
+                                    const SelectIn &in, SelectOut *out);
     static size_t AddBatch(std::vector<Node> &bg, const std::vector<Node> &fg,
                            const std::vector<Node> &servers, bool *executed);
     static size_t RemoveBatch(std::vector<Node> &bg, const std::vector<Node> &fg,
                               const std::vector<ServerId> &servers, bool *executed);
     static size_t Remove(std::vector<Node> &bg, const std::vector<Node> &fg,
                          const ServerId& server, bool *executed);
+    static size_t UpdateBatch(std::vector<Node> &bg, const std::vector<Node> &fg,
+                              Update* update);
+    // Build sorted replicas of `servers'.
+    void BuildNodes(const std::vector<ServerId>& servers,
+                    std::vector<Node>* nodes);
     size_t _num_replicas;
     ConsistentHashingLoadBalancerType _type;
+    // Bounded-load mode is on when positive.
+    double _load_epsilon;
     butil::DoublyBufferedData<std::vector<Node> > _db_hash_ring;
+    // Used by bounded-load mode only.
+    butil::DoublyBufferedData<LoadMap> _db_loads;
+    butil::atomic<int64_t> _total_inflight;
+    butil::atomic<int64_t> _num_servers;
 };
 
 }  // namespace policy
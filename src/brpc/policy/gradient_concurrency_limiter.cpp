@@ -0,0 +1,215 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <cmath>
+#include <gflags/gflags.h>
+#include "brpc/errno.pb.h"
+#include "brpc/policy/gradient_concurrency_limiter.h"
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(gradient_cl_sample_window_size_ms, 1000,
+             "Duration of the sampling window.");
+DEFINE_int32(gradient_cl_min_sample_count, 100,
+             "During the duration of the sampling window, if the number of "
+             "requests collected is less than this value, the sampling window "
+             "will be discarded.");
+DEFINE_int32(gradient_cl_max_sample_count, 200,
+             "During the duration of the sampling window, once the number of "
+             "requests collected is greater than this value, even if the "
+             "duration of the window has not ended, the max_concurrency will "
+             "be updated and a new sampling window will be started.");
+DEFINE_double(gradient_cl_sampling_interval_ms, 0.1,
+              "Interval for sampling request in gradient concurrency limiter");
+DEFINE_int32(gradient_cl_initial_max_concurrency, 40,
+             "Initial max concurrency for gradient concurrency limiter");
+DEFINE_int32(gradient_cl_min_concurrency, 4,
+             "Lower bound of max concurrency of gradient concurrency limiter");
+DEFINE_int32(gradient_cl_max_concurrency, 1000,
+             "Upper bound of max concurrency of gradient concurrency limiter");
+DEFINE_double(gradient_cl_rtt_tolerance, 1.5,
+              "Tolerated ratio of the short-term average latency to the "
+              "long-term one before max concurrency is reduced");
+DEFINE_int32(gradient_cl_long_window, 600,
+             "Number of sampling windows that the long-term average latency "
+             "is computed over");
+DEFINE_double(gradient_cl_smoothing, 0.2,
+              "Weight of the new max concurrency of each sampling window, "
+              "the value range is (0-1]. The smaller the value, the smoother "
+              "max concurrency changes");
+DEFINE_int32(gradient_cl_queue_size, 4,
+             "Max concurrency grows by at most this value in each sampling "
+             "window");
+DEFINE_double(gradient_cl_fail_punish_ratio, 1.0,
+              "Use the failed requests to punish normal requests. The larger "
+              "the configuration item, the more aggressive the penalty strategy.");
+DEFINE_double(gradient_cl_priority_step, 0.1,
+              "Requests with priority -N are rejected when concurrency reaches "
+              "(1 - N * gradient_cl_priority_step) of max concurrency");
+
+GradientConcurrencyLimiter::GradientConcurrencyLimiter()
+    : _long_rtt_us(0)
+    , _limit(FLAGS_gradient_cl_initial_max_concurrency)
+    , _max_concurrency(FLAGS_gradient_cl_initial_max_concurrency)
+    , _last_sampling_time_us(0)
+    , _max_inflight(0) {
+}
+
+GradientConcurrencyLimiter* GradientConcurrencyLimiter::New(
+    const AdaptiveMaxConcurrency&) const {
+    return new (std::nothrow) GradientConcurrencyLimiter;
+}
+
+bool GradientConcurrencyLimiter::OnRequested(int current_concurrency,
+                                             Controller* cntl) {
+    int max_inflight = _max_inflight.load(butil::memory_order_relaxed);
+    while (current_concurrency > max_inflight &&
+           !_max_inflight.compare_exchange_weak(
+               max_inflight, current_concurrency,
+               butil::memory_order_relaxed)) {
+    }
+    double limit = _max_concurrency.load(butil::memory_order_relaxed);
+    const int priority = (cntl != NULL ? cntl->request_priority() : 0);
+    if (priority < 0) {
+        // Leave room for more important requests.
+        limit *= std::max(1.0 + priority * FLAGS_gradient_cl_priority_step,
+                          0.0);
+    }
+    return current_concurrency <= std::max(limit, 1.0);
+}
+
+void GradientConcurrencyLimiter::OnResponded(int error_code,
+                                             int64_t latency_us) {
+    if (ELIMIT == error_code) {
+        return;
+    }
+    const int64_t now_time_us = NowUs();
+    int64_t last_sampling_time_us =
+        _last_sampling_time_us.load(butil::memory_order_relaxed);
+    if (last_sampling_time_us == 0 ||
+        now_time_us - last_sampling_time_us >=
+            FLAGS_gradient_cl_sampling_interval_ms * 1000) {
+        bool sample_this_call = _last_sampling_time_us.compare_exchange_strong(
+            last_sampling_time_us, now_time_us, butil::memory_order_relaxed);
+        if (sample_this_call) {
+            bool sample_window_submitted =
+                AddSample(error_code, latency_us, now_time_us);
+            if (sample_window_submitted) {
+                // The following log prints has data-race in extreme cases,
+                // unless you are in debug, you should not open it.
+                VLOG(1) << "Sample window submitted, current max_concurrency:"
+                        << _max_concurrency.load(butil::memory_order_relaxed)
+                        << " long_rtt_us:" << _long_rtt_us;
+            }
+        }
+    }
+}
+
+int GradientConcurrencyLimiter::MaxConcurrency() {
+    return _max_concurrency.load(butil::memory_order_relaxed);
+}
+
+bool GradientConcurrencyLimiter::AddSample(int error_code, int64_t latency_us,
+                                           int64_t sampling_time_us) {
+    std::unique_lock<butil::Mutex> lock_guard(_sw_mutex);
+    if (_sw.start_time_us == 0) {
+        _sw.start_time_us = sampling_time_us;
+    }
+
+    if (error_code != 0) {
+        ++_sw.failed_count;
+        _sw.total_failed_us += latency_us;
+    } else {
+        ++_sw.succ_count;
+        _sw.total_succ_us += latency_us;
+    }
+
+    if (_sw.succ_count + _sw.failed_count <
+        FLAGS_gradient_cl_min_sample_count) {
+        if (sampling_time_us - _sw.start_time_us >=
+            FLAGS_gradient_cl_sample_window_size_ms * 1000) {
+            // If the sample size is insufficient at the end of the sampling
+            // window, discard the entire sampling window
+            ResetSampleWindow(sampling_time_us);
+        }
+        return false;
+    }
+    if (sampling_time_us - _sw.start_time_us <
+            FLAGS_gradient_cl_sample_window_size_ms * 1000 &&
+        _sw.succ_count + _sw.failed_count <
+            FLAGS_gradient_cl_max_sample_count) {
+        return false;
+    }
+
+    if (_sw.succ_count > 0) {
+        const double failed_punish =
+            _sw.total_failed_us * FLAGS_gradient_cl_fail_punish_ratio;
+        UpdateMaxConcurrency(
+            std::ceil((failed_punish + _sw.total_succ_us) / _sw.succ_count));
+    } else {
+        // All requests failed, treat the server as overloaded.
+        UpdateMaxConcurrency(_long_rtt_us * 2 + 1);
+    }
+    ResetSampleWindow(sampling_time_us);
+    return true;
+}
+
+void GradientConcurrencyLimiter::ResetSampleWindow(int64_t sampling_time_us) {
+    _sw.start_time_us = sampling_time_us;
+    _sw.succ_count = 0;
+    _sw.failed_count = 0;
+    _sw.total_failed_us = 0;
+    _sw.total_succ_us = 0;
+    _max_inflight.store(0, butil::memory_order_relaxed);
+}
+
+void GradientConcurrencyLimiter::UpdateMaxConcurrency(int64_t short_rtt_us) {
+    const double tolerance = FLAGS_gradient_cl_rtt_tolerance;
+    if (_long_rtt_us <= 0) {
+        _long_rtt_us = short_rtt_us;
+    } else {
+        double alpha = 2.0 / (std::max(FLAGS_gradient_cl_long_window, 1) + 1);
+        if (short_rtt_us > _long_rtt_us * tolerance) {
+            // Latencies are dominated by queueing, follow them much slower,
+            // otherwise the baseline creeps up under sustained overload.
+            alpha /= 10;
+        }
+        _long_rtt_us = _long_rtt_us * (1 - alpha) + short_rtt_us * alpha;
+        if (_long_rtt_us > short_rtt_us * 2) {
+            // Latencies dropped a lot, e.g. after the server recovered,
+            // catch up faster.
+            _long_rtt_us *= 0.95;
+        }
+    }
+    // Don't grow the limit when the server is not busy enough to verify it.
+    const int max_inflight = _max_inflight.load(butil::memory_order_relaxed);
+    if (max_inflight < _limit / 2) {
+        return;
+    }
+    const double gradient = std::max(
+        0.5, std::min(1.0, tolerance * _long_rtt_us / short_rtt_us));
+    const double new_limit = _limit * gradient + FLAGS_gradient_cl_queue_size;
+    const double smoothing = FLAGS_gradient_cl_smoothing;
+    _limit = _limit * (1 - smoothing) + new_limit * smoothing;
+    _limit = std::max(_limit, (double)FLAGS_gradient_cl_min_concurrency);
+    _limit = std::min(_limit, (double)FLAGS_gradient_cl_max_concurrency);
+    _max_concurrency.store((int)_limit, butil::memory_order_relaxed);
+}
+
+}  // namespace policy
+}  // namespace brpc
@@ -0,0 +1,95 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_POLICY_GRADIENT_CONCURRENCY_LIMITER_H
+#define BRPC_POLICY_GRADIENT_CONCURRENCY_LIMITER_H
+
+#include "butil/time.h"
+#include "brpc/concurrency_limiter.h"
+
+namespace brpc {
+namespace policy {
+
+// Adjusts max_concurrency continuously by the gradient between the long-term
+// and the short-term average latency, in the style of gradient2 of Netflix's
+// concurrency-limits:
+//   gradient = clamp(rtt_tolerance * long_rtt / short_rtt, 0.5, 1)
+//   max_concurrency = max_concurrency * gradient + queue_size  (smoothed)
+// Unlike AutoConcurrencyLimiter, no-load latency is never remeasured by
+// halving max_concurrency, so there're no periodic dips of throughput.
+// When the concurrency is close to the limit, requests with negative
+// Controller::request_priority() are rejected first.
+class GradientConcurrencyLimiter : public ConcurrencyLimiter {
+public:
+    GradientConcurrencyLimiter();
+
+    bool OnRequested(int current_concurrency, Controller* cntl) override;
+
+    void OnResponded(int error_code, int64_t latency_us) override;
+
+    int MaxConcurrency() override;
+
+    GradientConcurrencyLimiter* New(
+        const AdaptiveMaxConcurrency&) const override;
+
+protected:
+    // Clock of sampling windows, overridable to run the limiter in
+    // simulated time.
+    virtual int64_t NowUs() const { return butil::gettimeofday_us(); }
+
+private:
+    struct SampleWindow {
+        SampleWindow()
+            : start_time_us(0)
+            , succ_count(0)
+            , failed_count(0)
+            , total_failed_us(0)
+            , total_succ_us(0) {}
+        int64_t start_time_us;
+        int32_t succ_count;
+        int32_t failed_count;
+        int64_t total_failed_us;
+        int64_t total_succ_us;
+    };
+
+    bool AddSample(int error_code, int64_t latency_us,
+                   int64_t sampling_time_us);
+
+    // The following methods are not thread safe and can only be called
+    // in AddSample()
+    void UpdateMaxConcurrency(int64_t short_rtt_us);
+    void ResetSampleWindow(int64_t sampling_time_us);
+
+    // modified per sample-window.
+    double _long_rtt_us;
+    double _limit;
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<int> _max_concurrency;
+
+    // modified per sample.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<int64_t> _last_sampling_time_us;
+    butil::Mutex _sw_mutex;
+    SampleWindow _sw;
+
+    // modified per request.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<int> _max_inflight;
+};
+
+}  // namespace policy
+}  // namespace brpc
+
+
+#endif // BRPC_POLICY_GRADIENT_CONCURRENCY_LIMITER_H
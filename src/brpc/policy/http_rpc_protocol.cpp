@@ -650,13 +650,19 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
     }
 
     Span* span = accessor.span();
-    if (span) {
+    if (span && span->sampled()) {
         hreq.SetHeader("x-bd-trace-id", butil::string_printf(
                            "%llu", (unsigned long long)span->trace_id()));
         hreq.SetHeader("x-bd-span-id", butil::string_printf(
                            "%llu", (unsigned long long)span->span_id()));
         hreq.SetHeader("x-bd-parent-span-id", butil::string_printf(
                            "%llu", (unsigned long long)span->parent_span_id()));
+        // W3C trace context for servers and proxies not knowing x-bd-*.
+        hreq.SetHeader("traceparent", butil::string_printf(
+                           "00-%016llx%016llx-%016llx-01",
+                           (unsigned long long)span->trace_id_high(),
+                           (unsigned long long)span->trace_id(),
+                           (unsigned long long)span->span_id()));
     }
 }
 
@@ -997,6 +1003,32 @@ static void FillUnresolvedPath(std::string* unresolved_path,
     }
 }
 
+// Parse `traceparent' of W3C trace context, in the form of
+// "00-<32 hex trace-id>-<16 hex parent-id>-<2 hex flags>". trace ids of brpc
+// are 64-bit: the lower 64 bits of trace-id go to `trace_id' and the higher
+// 64 bits to `trace_id_high', which is carried by spans and sent to
+// downstream as is.
+// Values of version 00 must be exactly 55 chars.
+// Returns true if the header is valid and the upstream span is sampled.
+static bool ParseTraceparent(const std::string& value, uint64_t* trace_id,
+                             uint64_t* trace_id_high,
+                             uint64_t* parent_span_id) {
+    if (value.size() != 55 || value.compare(0, 3, "00-") != 0 ||
+        value[35] != '-' || value[52] != '-') {
+        return false;
+    }
+    for (size_t i = 3; i < 55; ++i) {
+        if (i != 35 && i != 52 && !isxdigit(value[i])) {
+            return false;
+        }
+    }
+    const uint64_t flags = strtoull(value.substr(53, 2).c_str(), NULL, 16);
+    *trace_id_high = strtoull(value.substr(3, 16).c_str(), NULL, 16);
+    *trace_id = strtoull(value.substr(19, 16).c_str(), NULL, 16);
+    *parent_span_id = strtoull(value.substr(36, 16).c_str(), NULL, 16);
+    return (flags & 0x1) && *trace_id != 0 && *parent_span_id != 0;
+}
+
 inline const Server::MethodProperty*
 FindMethodPropertyByURIImpl(const std::string& uri_path, const Server* server,
                             std::string* unresolved_path) {
@@ -1340,25 +1372,50 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     Span* span = NULL;
     const std::string& path = req_header.uri().path();
     const std::string* trace_id_str = req_header.GetHeader("x-bd-trace-id");
-    if (IsTraceable(trace_id_str)) {
-        uint64_t trace_id = 0;
+    const std::string* traceparent = req_header.GetHeader("traceparent");
+    uint64_t trace_id = 0;
+    uint64_t trace_id_high = 0;
+    uint64_t span_id = 0;
+    uint64_t parent_span_id = 0;
+    // The span of upstream becomes parent of the server span, which gets a
+    // new span_id. traceparent is sent by any OpenTelemetry-instrumented
+    // client, only honor it when rpcz is enabled locally, otherwise such
+    // clients could force span creation on this server.
+    const bool traceparent_valid =
+        (FLAGS_enable_rpcz && traceparent != NULL &&
+         ParseTraceparent(*traceparent, &trace_id, &trace_id_high,
+                          &parent_span_id));
+    if (!traceparent_valid) {
+        trace_id = 0;
+        trace_id_high = 0;
+        parent_span_id = 0;
+    }
+    const bool upstream_traced = (trace_id_str != NULL || traceparent_valid);
+    if (IsTraceable(upstream_traced)) {
         if (trace_id_str) {
+            const uint64_t tp_trace_id = trace_id;
             trace_id = strtoull(trace_id_str->c_str(), NULL, 10);
-        }
-        uint64_t span_id = 0;
-        const std::string* span_id_str = req_header.GetHeader("x-bd-span-id");
-        if (span_id_str) {
-            span_id = strtoull(span_id_str->c_str(), NULL, 10);
-        }
-        uint64_t parent_span_id = 0;
-        const std::string* parent_span_id_str =
-            req_header.GetHeader("x-bd-parent-span-id");
-        if (parent_span_id_str) {
-            parent_span_id = strtoull(parent_span_id_str->c_str(), NULL, 10);
+            // x-bd-* wins, the higher bits of traceparent are kept if it
+            // refers to the same trace.
+            if (tp_trace_id != trace_id) {
+                trace_id_high = 0;
+            }
+            parent_span_id = 0;
+            const std::string* span_id_str =
+                req_header.GetHeader("x-bd-span-id");
+            if (span_id_str) {
+                span_id = strtoull(span_id_str->c_str(), NULL, 10);
+            }
+            const std::string* parent_span_id_str =
+                req_header.GetHeader("x-bd-parent-span-id");
+            if (parent_span_id_str) {
+                parent_span_id = strtoull(parent_span_id_str->c_str(), NULL, 10);
+            }
         }
         span = Span::CreateServerSpan(
             path, trace_id, span_id, parent_span_id, msg->base_real_us());
         accessor.set_span(span);
+        span->set_trace_id_high(trace_id_high);
         span->set_log_id(cntl->log_id());
         span->set_remote_side(user_addr);
         span->set_received_us(msg->received_us());
@@ -1424,6 +1481,9 @@ void ProcessHttpRequest(InputMessageBase *msg) {
             return;
         }
     }
+    // Attribute cpu time of processing the request to the method.
+    bthread::ScopedCpuUsageAttribution cpu_usage_scope(
+        method_status ? method_status->cpu_usage_counter() : NULL);
     
     if (span) {
         span->ResetServerSpanName(sp->method->full_name());
@@ -465,6 +465,9 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
                 break;
             }
         }
+        // Attribute cpu time of processing the request to the method.
+        bthread::ScopedCpuUsageAttribution cpu_usage_scope(
+            method_status ? method_status->cpu_usage_counter() : NULL);
         
         google::protobuf::Service* svc = sp->service;
         const google::protobuf::MethodDescriptor* method = sp->method;
@@ -681,7 +684,7 @@ void PackHuluRequest(butil::IOBuf* req_buf,
     // existing hulu-pbrpc server may complain about empty attachment.
 
     Span* span = ControllerPrivateAccessor(cntl).span();
-    if (span) {
+    if (span && span->sampled()) {
         meta.set_trace_id(span->trace_id());
         meta.set_span_id(span->span_id());
         meta.set_parent_span_id(span->parent_span_id());
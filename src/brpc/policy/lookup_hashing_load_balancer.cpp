@@ -0,0 +1,418 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <math.h>                                              // sqrt
+#include <algorithm>                                           // std::sort
+#include <gflags/gflags.h>
+#include "butil/containers/flat_map.h"
+#include "butil/errno.h"
+#include "butil/strings/string_number_conversions.h"
+#include "butil/time.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "bvar/bvar.h"
+#include "brpc/socket.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/lookup_hashing_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+static bool IsPrime(size_t n) {
+    if (n < 2) {
+        return false;
+    }
+    for (size_t i = 2; i * i <= n; ++i) {
+        if (n % i == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ValidateMaglevTableSize(const char*, int32_t val) {
+    return IsPrime(val);
+}
+DEFINE_int32(chash_maglev_table_size, 65537,
+             "default size of the lookup table in c_maglev, must be a prime. "
+             "Loads are balanced within 1% when it's larger than 100 times "
+             "of the number of servers, the table is enlarged to keep that");
+BRPC_VALIDATE_GFLAG(chash_maglev_table_size, ValidateMaglevTableSize);
+
+// Number of keys sampled to compute remap fraction after each modification.
+static const size_t REMAP_SAMPLE_KEYS = 4096;
+// Number of rehashed retries before walking through servers in order when
+// the chosen server is unavailable.
+static const size_t MAX_REHASH_TIMES = 3;
+// Entries of the maglev table per server to balance loads within 1%.
+static const size_t MIN_ENTRIES_PER_SERVER = 100;
+
+// Lookups and rebuilds of all c_maglev and c_jump.
+static bvar::Adder<int64_t>* g_lookup_count = NULL;
+static bvar::LatencyRecorder* g_rebuild_latency = NULL;
+
+static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
+
+static void CreateVars() {
+    g_lookup_count = new bvar::Adder<int64_t>("lookup_hashing_lb_lookup_count");
+    new bvar::PerSecond<bvar::Adder<int64_t> >(
+        "lookup_hashing_lb_lookup_second", g_lookup_count);
+    // Rebuilding time in microseconds.
+    g_rebuild_latency = new bvar::LatencyRecorder("lookup_hashing_lb_rebuild");
+}
+
+// Smallest prime >= n.
+static size_t NextPrime(size_t n) {
+    while (!IsPrime(n)) {
+        ++n;
+    }
+    return n;
+}
+
+// "A Fast, Minimal Memory, Consistent Hash Algorithm" by John Lamping and
+// Eric Veach.
+static int32_t JumpConsistentHash(uint64_t key, int32_t num_buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+    }
+    return b;
+}
+
+// Keys of retries after the chosen server is unavailable, being stable for
+// the same request_code.
+inline uint64_t NextKey(uint64_t key) {
+    return butil::fmix64(key + 0x9e3779b97f4a7c15ULL);
+}
+
+LookupHashingLoadBalancer::LookupHashingLoadBalancer(
+    LookupHashingLoadBalancerType type)
+    : _type(type)
+    , _table_size(FLAGS_chash_maglev_table_size)
+    , _last_remap_fraction(0) {
+    pthread_once(&s_create_vars_once, CreateVars);
+}
+
+bool LookupHashingLoadBalancer::BuildNode(const ServerId& server, Node* node) {
+    SocketUniquePtr ptr;
+    if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
+        return false;
+    }
+    node->server_sock = server;
+    node->server_addr = ptr->remote_side();
+    const std::string addr = endpoint2str(ptr->remote_side()).c_str();
+    uint64_t h[2];
+    butil::MurmurHash3_x64_128(addr.data(), addr.size(), 0, h);
+    node->hash = h[0] ^ h[1];
+    return true;
+}
+
+size_t LookupHashingLoadBalancer::Lookup(const Table& t, uint64_t key) {
+    if (!t.lookup.empty()) {
+        return t.lookup[butil::fmix64(key) % t.lookup.size()];
+    }
+    return JumpConsistentHash(butil::fmix64(key), t.nodes.size());
+}
+
+void LookupHashingLoadBalancer::Rebuild(Table* t) const {
+    t->lookup.clear();
+    if (_type != LOOKUP_HASH_LB_MAGLEV || t->nodes.empty()) {
+        return;
+    }
+    // "Maglev: A Fast and Reliable Software Network Load Balancer" 3.4.
+    // Each node fills the table in the order of its own permutation of
+    // entries, taking turns with other nodes, until the table is full.
+    // The size only depends on the number of nodes, so that all clients
+    // with the same servers build the same table. It's doubled rather than
+    // grown by each node, since keys are remapped entirely when it changes.
+    const size_t N = t->nodes.size();
+    size_t M = _table_size;
+    while (M < N * MIN_ENTRIES_PER_SERVER) {
+        M = NextPrime(M * 2);
+    }
+    std::vector<uint64_t> next(N);
+    std::vector<uint64_t> skip(N);
+    for (size_t i = 0; i < N; ++i) {
+        const uint64_t h = t->nodes[i].hash;
+        next[i] = (h >> 32) % M;
+        skip[i] = (h & 0xFFFFFFFFULL) % (M - 1) + 1;
+    }
+    t->lookup.assign(M, (uint32_t)-1);
+    size_t nfilled = 0;
+    while (true) {
+        for (size_t i = 0; i < N; ++i) {
+            uint64_t c = next[i];
+            while (t->lookup[c] != (uint32_t)-1) {
+                c += skip[i];
+                if (c >= M) {
+                    c -= M;
+                }
+            }
+            t->lookup[c] = i;
+            c += skip[i];
+            next[i] = (c >= M ? c - M : c);
+            if (++nfilled == M) {
+                return;
+            }
+        }
+    }
+}
+
+void LookupHashingLoadBalancer::UpdateRemapFraction(
+    const Table& old_table, const Table& new_table) {
+    double fraction = 1.0;
+    if (!old_table.nodes.empty() && !new_table.nodes.empty()) {
+        size_t nremap = 0;
+        for (size_t i = 0; i < REMAP_SAMPLE_KEYS; ++i) {
+            const uint64_t key = butil::fmix64(i + 1);
+            if (old_table.nodes[Lookup(old_table, key)].server_sock !=
+                new_table.nodes[Lookup(new_table, key)].server_sock) {
+                ++nremap;
+            }
+        }
+        fraction = (double)nremap / REMAP_SAMPLE_KEYS;
+    }
+    _last_remap_fraction.store(fraction, butil::memory_order_relaxed);
+}
+
+void LookupHashingLoadBalancer::RebuildAndRecord(
+    const Table& old_table, Table* new_table) {
+    const int64_t start_us = butil::cpuwide_time_us();
+    Rebuild(new_table);
+    *g_rebuild_latency << (butil::cpuwide_time_us() - start_us);
+    UpdateRemapFraction(old_table, *new_table);
+}
+
+size_t LookupHashingLoadBalancer::AddBatch(
+    Table& bg, const Table& fg, const std::vector<Node>& servers,
+    Modification* m) {
+    if (m->executed) {
+        // Hack DBD, bg is rebuilt from fg in next modification.
+        return fg.nodes.size() - bg.nodes.size();
+    }
+    m->executed = true;
+    // Nodes are sorted by addresses so that clients with the same servers
+    // build the same table, no matter in which order servers were added.
+    bg.nodes.resize(fg.nodes.size() + servers.size());
+    bg.nodes.resize(std::set_union(fg.nodes.begin(), fg.nodes.end(),
+                                   servers.begin(), servers.end(),
+                                   bg.nodes.begin()) - bg.nodes.begin());
+    const size_t n = bg.nodes.size() - fg.nodes.size();
+    if (n != 0) {
+        m->lb->RebuildAndRecord(fg, &bg);
+    }
+    return n;
+}
+
+size_t LookupHashingLoadBalancer::RemoveBatch(
+    Table& bg, const Table& fg, const std::vector<ServerId>& servers,
+    Modification* m) {
+    if (m->executed) {
+        return bg.nodes.size() - fg.nodes.size();
+    }
+    m->executed = true;
+    butil::FlatSet<ServerId> id_set;
+    CHECK_EQ(0, id_set.init(servers.size() * 2 + 1));
+    for (size_t i = 0; i < servers.size(); ++i) {
+        id_set.insert(servers[i]);
+    }
+    bg.nodes.clear();
+    for (size_t i = 0; i < fg.nodes.size(); ++i) {
+        if (id_set.seek(fg.nodes[i].server_sock) == NULL) {
+            bg.nodes.push_back(fg.nodes[i]);
+        }
+    }
+    const size_t n = fg.nodes.size() - bg.nodes.size();
+    if (n != 0) {
+        m->lb->RebuildAndRecord(fg, &bg);
+    }
+    return n;
+}
+
+bool LookupHashingLoadBalancer::AddServer(const ServerId& server) {
+    std::vector<ServerId> servers(1, server);
+    return AddServersInBatch(servers) == 1;
+}
+
+size_t LookupHashingLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId> &servers) {
+    std::vector<Node> add_nodes;
+    add_nodes.reserve(servers.size());
+    for (size_t i = 0; i < servers.size(); ++i) {
+        Node node;
+        if (BuildNode(servers[i], &node)) {
+            add_nodes.push_back(node);
+        }
+    }
+    std::sort(add_nodes.begin(), add_nodes.end());
+    Modification m = { this, false };
+    const size_t n = _db_table.ModifyWithForeground(AddBatch, add_nodes, &m);
+    LOG_IF(ERROR, n != servers.size() && servers.size() != 1)
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+bool LookupHashingLoadBalancer::RemoveServer(const ServerId& server) {
+    std::vector<ServerId> servers(1, server);
+    return RemoveServersInBatch(servers) == 1;
+}
+
+size_t LookupHashingLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId> &servers) {
+    Modification m = { this, false };
+    const size_t n = _db_table.ModifyWithForeground(RemoveBatch, servers, &m);
+    LOG_IF(ERROR, n != servers.size() && servers.size() != 1)
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+LoadBalancer *LookupHashingLoadBalancer::New(
+    const butil::StringPiece& params) const {
+    LookupHashingLoadBalancer* lb =
+        new (std::nothrow) LookupHashingLoadBalancer(_type);
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = nullptr;
+    }
+    return lb;
+}
+
+void LookupHashingLoadBalancer::Destroy() {
+    delete this;
+}
+
+int LookupHashingLoadBalancer::SelectServer(
+    const SelectIn &in, SelectOut *out) {
+    if (!in.has_request_code) {
+        LOG(ERROR) << "Controller.set_request_code() is required";
+        return EINVAL;
+    }
+    butil::DoublyBufferedData<Table>::ScopedPtr s;
+    if (_db_table.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->nodes.size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    uint64_t key = in.request_code;
+    size_t index = Lookup(*s, key);
+    *g_lookup_count << 1;
+    for (size_t i = 0; i < n; ++i) {
+        const SocketId id = s->nodes[index].server_sock.id;
+        if (((i + 1) == n // always take last chance
+             || !ExcludedServers::IsExcluded(in.excluded, id))
+            && Socket::Address(id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            return 0;
+        }
+        if (i < MAX_REHASH_TIMES) {
+            // Rehash to spread keys of the unavailable server over others.
+            key = NextKey(key);
+            index = Lookup(*s, key);
+            *g_lookup_count << 1;
+        } else if (++index == n) {
+            // Rehashed keys may not visit all servers, walk through them.
+            index = 0;
+        }
+    }
+    return EHOSTDOWN;
+}
+
+double LookupHashingLoadBalancer::LoadDeviation() {
+    butil::DoublyBufferedData<Table>::ScopedPtr s;
+    if (_db_table.Read(&s) != 0 || s->nodes.empty()) {
+        return 0;
+    }
+    const size_t n = s->nodes.size();
+    std::vector<size_t> counts(n, 0);
+    size_t nsample = 0;
+    if (!s->lookup.empty()) {
+        // The table is exactly the distribution of keys.
+        for (size_t i = 0; i < s->lookup.size(); ++i) {
+            ++counts[s->lookup[i]];
+        }
+        nsample = s->lookup.size();
+    } else {
+        nsample = std::min(std::max(n * 1000, (size_t)65536), (size_t)(1 << 24));
+        for (size_t i = 0; i < nsample; ++i) {
+            ++counts[Lookup(*s, butil::fmix64(i + 1))];
+        }
+    }
+    const double avg = (double)nsample / n;
+    double sqr_sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sqr_sum += (counts[i] - avg) * (counts[i] - avg);
+    }
+    return sqrt(sqr_sum / n) / avg;
+}
+
+void LookupHashingLoadBalancer::Describe(
+    std::ostream &os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << (_type == LOOKUP_HASH_LB_MAGLEV ? "c_maglev" : "c_jump");
+        return;
+    }
+    size_t n = 0;
+    size_t table_size = 0;
+    {
+        butil::DoublyBufferedData<Table>::ScopedPtr s;
+        if (_db_table.Read(&s) == 0) {
+            n = s->nodes.size();
+            table_size = s->lookup.size();
+        }
+    }
+    os << "LookupHashingLoadBalancer {\n"
+       << "  algorithm: "
+       << (_type == LOOKUP_HASH_LB_MAGLEV ? "maglev" : "jump") << '\n';
+    if (_type == LOOKUP_HASH_LB_MAGLEV) {
+        os << "  table size: " << table_size << '\n';
+    }
+    os << "  number of hosts: " << n << '\n'
+       << "  last remap fraction: " << LastRemapFraction() << '\n'
+       << "}\n";
+}
+
+bool LookupHashingLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "table_size") {
+            if (!butil::StringToSizeT(sp.value(), &_table_size)) {
+                return false;
+            }
+            continue;
+        }
+        LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+    }
+    if (_type == LOOKUP_HASH_LB_MAGLEV && !IsPrime(_table_size)) {
+        LOG(ERROR) << "table_size=" << _table_size << " is not a prime";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,118 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BRPC_LOOKUP_HASHING_LOAD_BALANCER_H
+#define  BRPC_LOOKUP_HASHING_LOAD_BALANCER_H
+
+#include <stdint.h>                                     // uint32_t
+#include <vector>                                       // std::vector
+#include "butil/atomicops.h"
+#include "butil/endpoint.h"                              // butil::EndPoint
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+enum LookupHashingLoadBalancerType {
+    // Maglev hashing: keys are mapped to servers by a lookup table in which
+    // every server takes nearly the same number of entries. Selection is
+    // O(1), each server changes about 1/N entries of the table.
+    LOOKUP_HASH_LB_MAGLEV = 0,
+    // Jump consistent hash: keys are mapped to slots [0, N) in O(logN)
+    // without any memory. Servers take slots in the order of addresses, so
+    // all clients with the same servers map keys to the same servers. Only
+    // about 1/N keys move when the server with the largest address is added
+    // or removed, but changes of other servers shift slots after them and
+    // move much more keys, use maglev if servers change arbitrarily.
+    LOOKUP_HASH_LB_JUMP = 1,
+};
+
+// Consistent hashing without the hash ring of ConsistentHashingLoadBalancer,
+// which costs memory and rebuilding time proportional to number of replicas
+// and balances loads poorly with few replicas. Like "c_murmurhash", the
+// server is chosen by Controller.set_request_code(), but 64-bit codes are
+// allowed.
+class LookupHashingLoadBalancer : public LoadBalancer {
+public:
+    explicit LookupHashingLoadBalancer(LookupHashingLoadBalancerType type);
+    bool AddServer(const ServerId& server);
+    bool RemoveServer(const ServerId& server);
+    size_t AddServersInBatch(const std::vector<ServerId> &servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId> &servers);
+    LoadBalancer *New(const butil::StringPiece& params) const;
+    void Destroy();
+    int SelectServer(const SelectIn &in, SelectOut *out);
+    void Describe(std::ostream &os, const DescribeOptions& options);
+
+    // Standard deviation of loads of servers divided by the average, namely
+    // 0 is perfectly balanced. Loads are estimated by sampling keys, don't
+    // call this function frequently.
+    double LoadDeviation();
+
+    // Fraction of keys mapped to different servers by last modification.
+    double LastRemapFraction() const
+    { return _last_remap_fraction.load(butil::memory_order_relaxed); }
+
+private:
+    struct Node {
+        ServerId server_sock;
+        butil::EndPoint server_addr;  // To make ordering stable among all clients
+        // Hash of server_addr.
+        uint64_t hash;
+        bool operator<(const Node& rhs) const {
+            if (server_addr < rhs.server_addr) { return true; }
+            if (rhs.server_addr < server_addr) { return false; }
+            return server_sock.id < rhs.server_sock.id;
+        }
+    };
+    struct Table {
+        // Sorted by addresses, which are also slots of jump.
+        std::vector<Node> nodes;
+        // Indexes of nodes, maglev only.
+        std::vector<uint32_t> lookup;
+    };
+    struct Modification {
+        LookupHashingLoadBalancer* lb;
+        bool executed;
+    };
+    bool SetParameters(const butil::StringPiece& params);
+    // Index of the node that `key' is mapped to.
+    static size_t Lookup(const Table& t, uint64_t key);
+    void Rebuild(Table* t) const;
+    void UpdateRemapFraction(const Table& old_table, const Table& new_table);
+    void RebuildAndRecord(const Table& old_table, Table* new_table);
+    static size_t AddBatch(Table& bg, const Table& fg,
+                           const std::vector<Node>& servers, Modification* m);
+    static size_t RemoveBatch(Table& bg, const Table& fg,
+                              const std::vector<ServerId>& servers,
+                              Modification* m);
+    static bool BuildNode(const ServerId& server, Node* node);
+
+    LookupHashingLoadBalancerType _type;
+    size_t _table_size;
+    butil::atomic<double> _last_remap_fraction;
+    butil::DoublyBufferedData<Table> _db_table;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  //BRPC_LOOKUP_HASHING_LOAD_BALANCER_H
@@ -253,6 +253,9 @@ void ProcessMongoRequest(InputMessageBase* msg_base) {
                 break;
             }
         }
+        // Attribute cpu time of processing the request to the method.
+        bthread::ScopedCpuUsageAttribution cpu_usage_scope(
+            method_status ? method_status->cpu_usage_counter() : NULL);
         
         if (!MongoOp_IsValid(header->op_code)) {
             mongo_done->cntl.SetFailed(EREQUEST, "Unknown op_code:%d", header->op_code);
@@ -247,6 +247,9 @@ void ProcessNsheadRequest(InputMessageBase* msg_base) {
     if (method_status) {
         CHECK(method_status->OnRequested());
     }
+    // Attribute cpu time of processing the request to the method.
+    bthread::ScopedCpuUsageAttribution cpu_usage_scope(
+        method_status ? method_status->cpu_usage_counter() : NULL);
     
     void* sub_space = NULL;
     if (service->_additional_space) {
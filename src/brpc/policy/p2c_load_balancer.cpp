@@ -0,0 +1,297 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <gflags/gflags.h>
+#include "butil/macros.h"
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "brpc/socket.h"
+#include "brpc/controller.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/p2c_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+DEFINE_double(p2c_latency_ewma_alpha, 0.1,
+              "Weight of a new latency sample in the EWMA of latencies in "
+              "p2c load balancer in (0, 1], larger values react to changes "
+              "faster");
+BRPC_VALIDATE_GFLAG(p2c_latency_ewma_alpha, PassValidate);
+
+const uint32_t prime_offset[] = {
+#include "bthread/offset_inl.list"
+};
+
+inline uint32_t GenRandomStride() {
+    return prime_offset[butil::fast_rand_less_than(ARRAY_SIZE(prime_offset))];
+}
+
+bool P2CLoadBalancer::Add(Servers& bg, const Servers& fg, const ServerId& id) {
+    if (bg.server_map.find(id.id) != bg.server_map.end()) {
+        return false;
+    }
+    std::shared_ptr<ServerStat> stat;
+    std::map<SocketId, size_t>::const_iterator it = fg.server_map.find(id.id);
+    if (it != fg.server_map.end()) {
+        // The other buffer was modified, share the stat.
+        stat = fg.stats[it->second];
+    } else {
+        stat = std::make_shared<ServerStat>();
+    }
+    bg.server_map[id.id] = bg.server_list.size();
+    bg.server_list.push_back(id);
+    bg.stats.push_back(stat);
+    return true;
+}
+
+bool P2CLoadBalancer::Remove(Servers& bg, const ServerId& id) {
+    std::map<SocketId, size_t>::iterator it = bg.server_map.find(id.id);
+    if (it == bg.server_map.end()) {
+        return false;
+    }
+    const size_t index = it->second;
+    bg.server_list[index] = bg.server_list.back();
+    bg.stats[index] = bg.stats.back();
+    bg.server_map[bg.server_list[index].id] = index;
+    bg.server_list.pop_back();
+    bg.stats.pop_back();
+    bg.server_map.erase(it);
+    return true;
+}
+
+size_t P2CLoadBalancer::BatchAdd(
+    Servers& bg, const Servers& fg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Add(bg, fg, servers[i]);
+    }
+    return count;
+}
+
+size_t P2CLoadBalancer::BatchRemove(
+    Servers& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Remove(bg, servers[i]);
+    }
+    return count;
+}
+
+bool P2CLoadBalancer::AddServer(const ServerId& id) {
+    return _db_servers.ModifyWithForeground(Add, id);
+}
+
+bool P2CLoadBalancer::RemoveServer(const ServerId& id) {
+    return _db_servers.Modify(Remove, id);
+}
+
+size_t P2CLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.ModifyWithForeground(BatchAdd, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t P2CLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.Modify(BatchRemove, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+inline bool P2CLoadBalancer::IsUsable(
+    const Servers& s, size_t index, const SelectIn& in,
+    bool ignore_excluded, SocketUniquePtr* ptr) {
+    const SocketId id = s.server_list[index].id;
+    return (ignore_excluded || !ExcludedServers::IsExcluded(in.excluded, id))
+        && Socket::Address(id, ptr) == 0
+        && (*ptr)->IsAvailable();
+}
+
+inline bool P2CLoadBalancer::LessLoaded(const ServerStat& a,
+                                        const ServerStat& b) {
+    // Feedback() of calls to a removed-and-added server may decrease
+    // inflight of the new stat, ignore negative values.
+    const int64_t a_inflight =
+        std::max(a.inflight.load(butil::memory_order_relaxed), (int64_t)0);
+    const int64_t b_inflight =
+        std::max(b.inflight.load(butil::memory_order_relaxed), (int64_t)0);
+    const int64_t a_latency = a.latency_us.load(butil::memory_order_relaxed);
+    const int64_t b_latency = b.latency_us.load(butil::memory_order_relaxed);
+    if (a_latency == 0 || b_latency == 0) {
+        // Latency of a new server is unknown, compare inflight only.
+        return a_inflight < b_inflight;
+    }
+    return (a_inflight + 1) * a_latency < (b_inflight + 1) * b_latency;
+}
+
+int P2CLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->server_list.size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    if (_cluster_recover_policy && _cluster_recover_policy->StopRecoverIfNecessary()) {
+        if (_cluster_recover_policy->DoReject(s->server_list)) {
+            return EREJECT;
+        }
+    }
+    size_t chosen = n;
+    if (n >= 2) {
+        const size_t i = butil::fast_rand_less_than(n);
+        size_t j = butil::fast_rand_less_than(n - 1);
+        if (j >= i) {
+            ++j;
+        }
+        SocketUniquePtr ptr_i;
+        SocketUniquePtr ptr_j;
+        const bool usable_i = IsUsable(*s, i, in, false, &ptr_i);
+        const bool usable_j = IsUsable(*s, j, in, false, &ptr_j);
+        if (usable_i && usable_j) {
+            if (LessLoaded(*s->stats[j], *s->stats[i])) {
+                chosen = j;
+                *out->ptr = std::move(ptr_j);
+            } else {
+                chosen = i;
+                *out->ptr = std::move(ptr_i);
+            }
+        } else if (usable_i) {
+            chosen = i;
+            *out->ptr = std::move(ptr_i);
+        } else if (usable_j) {
+            chosen = j;
+            *out->ptr = std::move(ptr_j);
+        }
+    }
+    if (chosen == n) {
+        // Both choices are unusable, find one in the way of
+        // RandomizedLoadBalancer.
+        uint32_t stride = 0;
+        size_t offset = butil::fast_rand_less_than(n);
+        for (size_t i = 0; i < n; ++i) {
+            // always take last chance
+            if (IsUsable(*s, offset, in, (i + 1) == n, out->ptr)) {
+                chosen = offset;
+                break;
+            }
+            if (stride == 0) {
+                stride = GenRandomStride();
+            }
+            offset = (offset + stride) % n;
+        }
+    }
+    if (chosen == n) {
+        if (_cluster_recover_policy) {
+            _cluster_recover_policy->StartRecover();
+        }
+        return EHOSTDOWN;
+    }
+    s->stats[chosen]->inflight.fetch_add(1, butil::memory_order_relaxed);
+    out->need_feedback = true;
+    return 0;
+}
+
+void P2CLoadBalancer::Feedback(const CallInfo& info) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return;
+    }
+    std::map<SocketId, size_t>::const_iterator it =
+        s->server_map.find(info.server_id);
+    if (it == s->server_map.end()) {
+        return;
+    }
+    ServerStat* stat = s->stats[it->second].get();
+    stat->inflight.fetch_sub(1, butil::memory_order_relaxed);
+
+    int64_t latency = butil::gettimeofday_us() - info.begin_time_us;
+    if (latency <= 0) {
+        // time skews, ignore the sample.
+        return;
+    }
+    if (info.error_code != 0 && info.controller != NULL &&
+        info.controller->timeout_ms() > 0) {
+        // Failed calls are as bad as timedout ones, otherwise a server
+        // failing fast attracts more traffic.
+        latency = std::max(latency, info.controller->timeout_ms() * 1000L);
+    }
+    // Concurrent updates may lose some samples, which is fine for an
+    // estimation and cheaper than CAS.
+    const int64_t old_latency = stat->latency_us.load(butil::memory_order_relaxed);
+    int64_t new_latency = latency;
+    if (old_latency != 0) {
+        const double alpha =
+            std::min(std::max(FLAGS_p2c_latency_ewma_alpha, 0.001), 1.0);
+        new_latency = old_latency + (int64_t)((latency - old_latency) * alpha);
+        if (new_latency <= 0) {
+            new_latency = 1;
+        }
+    }
+    stat->latency_us.store(new_latency, butil::memory_order_relaxed);
+}
+
+P2CLoadBalancer* P2CLoadBalancer::New(const butil::StringPiece& params) const {
+    P2CLoadBalancer* lb = new (std::nothrow) P2CLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+void P2CLoadBalancer::Destroy() {
+    delete this;
+}
+
+void P2CLoadBalancer::Describe(
+    std::ostream &os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "p2c";
+        return;
+    }
+    os << "P2C{";
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << "fail to read _db_servers";
+    } else {
+        os << "n=" << s->server_list.size() << ':';
+        for (size_t i = 0; i < s->server_list.size(); ++i) {
+            const ServerStat& stat = *s->stats[i];
+            os << ' ' << s->server_list[i] << "(inflight="
+               << stat.inflight.load(butil::memory_order_relaxed)
+               << " latency=" << stat.latency_us.load(butil::memory_order_relaxed)
+               << ')';
+        }
+    }
+    os << '}';
+}
+
+bool P2CLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    return GetRecoverPolicyByParams(params, &_cluster_recover_policy);
+}
+
+}  // namespace policy
+} // namespace brpc
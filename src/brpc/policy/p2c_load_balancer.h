@@ -0,0 +1,84 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_P2C_LOAD_BALANCER_H
+#define BRPC_POLICY_P2C_LOAD_BALANCER_H
+
+#include <vector>                                      // std::vector
+#include <map>                                         // std::map
+#include <memory>                                      // std::shared_ptr
+#include "butil/atomicops.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+#include "brpc/cluster_recover_policy.h"
+
+namespace brpc {
+namespace policy {
+
+// Power of two choices: sample two servers randomly and select the one with
+// less load, which is estimated as (inflight requests + 1) * EWMA of latency.
+// Selection is O(1) and Feedback() only touches the cacheline of the chosen
+// server, making it much cheaper than LocalityAwareLoadBalancer for large
+// clusters while still avoiding slow servers.
+class P2CLoadBalancer : public LoadBalancer {
+public:
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    P2CLoadBalancer* New(const butil::StringPiece&) const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    // Load of a server, shared by both buffers of _db_servers.
+    struct BAIDU_CACHELINE_ALIGNMENT ServerStat {
+        ServerStat() : inflight(0), latency_us(0) {}
+        butil::atomic<int64_t> inflight;
+        // EWMA of latencies, 0 means no response is received yet.
+        butil::atomic<int64_t> latency_us;
+    };
+    struct Servers {
+        // Separated from `stats' to be passed to ClusterRecoverPolicy.
+        std::vector<ServerId> server_list;
+        std::vector<std::shared_ptr<ServerStat> > stats;
+        std::map<SocketId, size_t> server_map;
+    };
+    bool SetParameters(const butil::StringPiece& params);
+    static bool Add(Servers& bg, const Servers& fg, const ServerId& id);
+    static bool Remove(Servers& bg, const ServerId& id);
+    static size_t BatchAdd(Servers& bg, const Servers& fg,
+                           const std::vector<ServerId>& servers);
+    static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
+    // True if server at `index' is usable, addressed into `ptr'.
+    static bool IsUsable(const Servers& s, size_t index, const SelectIn& in,
+                         bool ignore_excluded, SocketUniquePtr* ptr);
+    // True if `a' is less loaded than `b'.
+    static bool LessLoaded(const ServerStat& a, const ServerStat& b);
+
+    butil::DoublyBufferedData<Servers> _db_servers;
+    std::shared_ptr<ClusterRecoverPolicy> _cluster_recover_policy;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_P2C_LOAD_BALANCER_H
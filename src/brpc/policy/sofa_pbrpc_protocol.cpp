@@ -417,6 +417,9 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
                 break;
             }
         }
+        // Attribute cpu time of processing the request to the method.
+        bthread::ScopedCpuUsageAttribution cpu_usage_scope(
+            method_status ? method_status->cpu_usage_counter() : NULL);
         google::protobuf::Service* svc = sp->service;
         const google::protobuf::MethodDescriptor* method = sp->method;
         accessor.set_method(method);
@@ -509,6 +509,9 @@ void ProcessThriftRequest(InputMessageBase* msg_base) {
                             method_status->MaxConcurrency());
         }
     }
+    // Attribute cpu time of processing the request to the method.
+    bthread::ScopedCpuUsageAttribution cpu_usage_scope(
+        method_status ? method_status->cpu_usage_counter() : NULL);
 
     // Tag the bthread with this server's key for thread_local_data().
     if (server->thread_local_options().thread_local_data_factory) {
@@ -0,0 +1,448 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/strings/string_number_conversions.h"
+#include "butil/strings/string_split.h"
+#include "butil/time.h"
+#include "brpc/socket.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+DEFINE_string(local_zone, "", "Zone of this process, servers in the same "
+              "zone are preferred by zone-aware load balancers");
+DEFINE_int32(zone_lb_max_inflight_per_server, 32,
+             "Calls are spilled over to other zones when average in-flight "
+             "calls of servers in local zone exceed this value, 0 to disable");
+DEFINE_double(zone_lb_max_error_rate, 0.1,
+              "Calls are spilled over to other zones when error rate of "
+              "calls to local zone exceeds this value, 0 to disable");
+
+// Error rate of local calls is computed in windows of this size.
+static const int64_t ERROR_WINDOW_US = 1000000L;
+// Windows with fewer calls are too noisy to trigger spillover.
+static const int64_t MIN_CALLS_IN_ERROR_WINDOW = 10;
+
+ZoneAwareLoadBalancer::ZoneAwareLoadBalancer()
+    : _inner_name("rr")
+    , _max_inflight(0)
+    , _max_error_rate(0)
+    , _local(NULL)
+    , _remote(NULL)
+    , _inner_need_feedback(false)
+    , _nlocal(0)
+    , _nremote(0)
+    , _local_inflight(0)
+    , _window_start_us(0)
+    , _window_ncall(0)
+    , _window_nerror(0)
+    , _local_error_rate(0)
+    , _nspilled(0) {
+}
+
+ZoneAwareLoadBalancer::~ZoneAwareLoadBalancer() {
+    if (_local) {
+        _local->Destroy();
+    }
+    if (_remote) {
+        _remote->Destroy();
+    }
+}
+
+void ZoneAwareLoadBalancer::ParseTag(const std::string& tag, std::string* zone,
+                                     std::string* inner_tag) {
+    zone->clear();
+    inner_tag->clear();
+    for (butil::StringSplitter sp(tag.c_str(), ' '); sp; ++sp) {
+        const butil::StringPiece token(sp.field(), sp.length());
+        if (token.starts_with("zone=")) {
+            token.substr(5).CopyToString(zone);
+            continue;
+        }
+        if (!inner_tag->empty()) {
+            inner_tag->push_back(' ');
+        }
+        token.AppendToString(inner_tag);
+    }
+}
+
+bool ZoneAwareLoadBalancer::IsLocal(const ServerId& id,
+                                    ServerId* inner_id) const {
+    std::string zone;
+    ParseTag(id.tag, &zone, &inner_id->tag);
+    inner_id->id = id.id;
+    return _local_zone.empty() || zone == _local_zone;
+}
+
+void ZoneAwareLoadBalancer::Split(const std::vector<ServerId>& servers,
+                                  std::vector<ServerId>* local,
+                                  std::vector<ServerId>* remote) const {
+    for (size_t i = 0; i < servers.size(); ++i) {
+        ServerId inner_id;
+        if (IsLocal(servers[i], &inner_id)) {
+            local->push_back(inner_id);
+        } else {
+            remote->push_back(inner_id);
+        }
+    }
+}
+
+size_t ZoneAwareLoadBalancer::AddStats(StatMap& bg, const StatMap& fg,
+                                       const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        const SocketId id = servers[i].id;
+        if (bg.find(id) != bg.end()) {
+            continue;
+        }
+        StatMap::const_iterator it = fg.find(id);
+        if (it != fg.end()) {
+            // The other buffer was modified, share the stat.
+            bg[id] = it->second;
+        } else {
+            bg[id] = std::make_shared<ServerStat>();
+        }
+        ++count;
+    }
+    return count;
+}
+
+size_t ZoneAwareLoadBalancer::RemoveStats(
+    StatMap& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += bg.erase(servers[i].id);
+    }
+    return count;
+}
+
+void ZoneAwareLoadBalancer::AddLocalStats(const std::vector<ServerId>& servers) {
+    if (!servers.empty()) {
+        _db_stats.ModifyWithForeground(AddStats, servers);
+    }
+}
+
+void ZoneAwareLoadBalancer::RemoveLocalStats(
+    const std::vector<ServerId>& servers) {
+    if (servers.empty()) {
+        return;
+    }
+    {
+        // Calls to removed servers won't be fed back, forget them.
+        butil::DoublyBufferedData<StatMap>::ScopedPtr s;
+        if (_db_stats.Read(&s) == 0) {
+            for (size_t i = 0; i < servers.size(); ++i) {
+                StatMap::const_iterator it = s->find(servers[i].id);
+                if (it != s->end()) {
+                    _local_inflight.fetch_sub(
+                        it->second->inflight.load(butil::memory_order_relaxed),
+                        butil::memory_order_relaxed);
+                }
+            }
+        }
+    }
+    _db_stats.Modify(RemoveStats, servers);
+}
+
+bool ZoneAwareLoadBalancer::AddServer(const ServerId& id) {
+    ServerId inner_id;
+    if (!IsLocal(id, &inner_id)) {
+        if (!_remote->AddServer(inner_id)) {
+            return false;
+        }
+        _nremote.fetch_add(1, butil::memory_order_relaxed);
+        return true;
+    }
+    if (!_local->AddServer(inner_id)) {
+        return false;
+    }
+    AddLocalStats(std::vector<ServerId>(1, inner_id));
+    _nlocal.fetch_add(1, butil::memory_order_relaxed);
+    return true;
+}
+
+bool ZoneAwareLoadBalancer::RemoveServer(const ServerId& id) {
+    ServerId inner_id;
+    if (!IsLocal(id, &inner_id)) {
+        if (!_remote->RemoveServer(inner_id)) {
+            return false;
+        }
+        _nremote.fetch_sub(1, butil::memory_order_relaxed);
+        return true;
+    }
+    if (!_local->RemoveServer(inner_id)) {
+        return false;
+    }
+    RemoveLocalStats(std::vector<ServerId>(1, inner_id));
+    _nlocal.fetch_sub(1, butil::memory_order_relaxed);
+    return true;
+}
+
+size_t ZoneAwareLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    size_t nadded = 0;
+    size_t nremoved = 0;
+    UpdateServersInBatch(servers, std::vector<ServerId>(), &nadded, &nremoved);
+    return nadded;
+}
+
+size_t ZoneAwareLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    size_t nadded = 0;
+    size_t nremoved = 0;
+    UpdateServersInBatch(std::vector<ServerId>(), servers, &nadded, &nremoved);
+    return nremoved;
+}
+
+void ZoneAwareLoadBalancer::UpdateServersInBatch(
+    const std::vector<ServerId>& added,
+    const std::vector<ServerId>& removed,
+    size_t* nadded, size_t* nremoved) {
+    std::vector<ServerId> local_added;
+    std::vector<ServerId> remote_added;
+    std::vector<ServerId> local_removed;
+    std::vector<ServerId> remote_removed;
+    Split(added, &local_added, &remote_added);
+    Split(removed, &local_removed, &remote_removed);
+    size_t nlocal_added = 0;
+    size_t nlocal_removed = 0;
+    size_t nremote_added = 0;
+    size_t nremote_removed = 0;
+    if (!local_added.empty() || !local_removed.empty()) {
+        _local->UpdateServersInBatch(local_added, local_removed,
+                                     &nlocal_added, &nlocal_removed);
+        RemoveLocalStats(local_removed);
+        AddLocalStats(local_added);
+    }
+    if (!remote_added.empty() || !remote_removed.empty()) {
+        _remote->UpdateServersInBatch(remote_added, remote_removed,
+                                      &nremote_added, &nremote_removed);
+    }
+    _nlocal.fetch_add((int64_t)nlocal_added - (int64_t)nlocal_removed,
+                      butil::memory_order_relaxed);
+    _nremote.fetch_add((int64_t)nremote_added - (int64_t)nremote_removed,
+                       butil::memory_order_relaxed);
+    *nadded = nlocal_added + nremote_added;
+    *nremoved = nlocal_removed + nremote_removed;
+}
+
+double ZoneAwareLoadBalancer::SpilloverRatio() const {
+    const int64_t nlocal = _nlocal.load(butil::memory_order_relaxed);
+    if (nlocal <= 0) {
+        return 1.0;
+    }
+    // Spill over proportionally to the excess over thresholds, all calls
+    // are spilled when the excess reaches the threshold itself.
+    double ratio = 0;
+    if (_max_inflight > 0) {
+        const double inflight = std::max(
+            _local_inflight.load(butil::memory_order_relaxed), (int64_t)0)
+            / (double)nlocal;
+        ratio = std::max(ratio, (inflight - _max_inflight) / _max_inflight);
+    }
+    // The error rate is outdated if the local zone has not been called for
+    // a while(e.g. all calls were spilled), ignore it to probe the zone again.
+    if (_max_error_rate > 0 &&
+        butil::gettimeofday_us() - _window_start_us.load(butil::memory_order_relaxed)
+        < 2 * ERROR_WINDOW_US) {
+        const double error_rate =
+            _local_error_rate.load(butil::memory_order_relaxed);
+        ratio = std::max(ratio, (error_rate - _max_error_rate) / _max_error_rate);
+    }
+    return std::min(ratio, 1.0);
+}
+
+void ZoneAwareLoadBalancer::UpdateErrorRate(bool failed) {
+    _window_ncall.fetch_add(1, butil::memory_order_relaxed);
+    if (failed) {
+        _window_nerror.fetch_add(1, butil::memory_order_relaxed);
+    }
+    const int64_t now = butil::gettimeofday_us();
+    int64_t start = _window_start_us.load(butil::memory_order_relaxed);
+    if (now - start < ERROR_WINDOW_US ||
+        !_window_start_us.compare_exchange_strong(
+            start, now, butil::memory_order_relaxed)) {
+        return;
+    }
+    const int64_t ncall = _window_ncall.exchange(0, butil::memory_order_relaxed);
+    const int64_t nerror = _window_nerror.exchange(0, butil::memory_order_relaxed);
+    _local_error_rate.store(
+        ncall >= MIN_CALLS_IN_ERROR_WINDOW ? (double)nerror / ncall : 0,
+        butil::memory_order_relaxed);
+}
+
+int ZoneAwareLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    const int64_t nlocal = _nlocal.load(butil::memory_order_relaxed);
+    const int64_t nremote = _nremote.load(butil::memory_order_relaxed);
+    bool spill = (nlocal <= 0);
+    if (!spill && nremote > 0) {
+        const double ratio = SpilloverRatio();
+        spill = (ratio > 0 && butil::fast_rand_double() < ratio);
+    }
+    SelectOut inner_out(out->ptr);
+    int rc = (spill ? _remote : _local)->SelectServer(in, &inner_out);
+    if (rc != 0) {
+        // No server is available in the chosen side, try the other one.
+        if ((spill ? nlocal : nremote) <= 0) {
+            return rc;
+        }
+        spill = !spill;
+        inner_out.need_feedback = false;
+        rc = (spill ? _remote : _local)->SelectServer(in, &inner_out);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    if (inner_out.need_feedback &&
+        !_inner_need_feedback.load(butil::memory_order_relaxed)) {
+        _inner_need_feedback.store(true, butil::memory_order_relaxed);
+    }
+    out->need_feedback = inner_out.need_feedback;
+    if (spill) {
+        _nspilled.fetch_add(1, butil::memory_order_relaxed);
+        return 0;
+    }
+    butil::DoublyBufferedData<StatMap>::ScopedPtr s;
+    if (_db_stats.Read(&s) != 0) {
+        return 0;
+    }
+    StatMap::const_iterator it = s->find((*out->ptr)->id());
+    if (it != s->end()) {
+        it->second->inflight.fetch_add(1, butil::memory_order_relaxed);
+        _local_inflight.fetch_add(1, butil::memory_order_relaxed);
+        out->need_feedback = true;
+    }
+    return 0;
+}
+
+void ZoneAwareLoadBalancer::Feedback(const CallInfo& info) {
+    bool local = false;
+    {
+        butil::DoublyBufferedData<StatMap>::ScopedPtr s;
+        if (_db_stats.Read(&s) == 0) {
+            StatMap::const_iterator it = s->find(info.server_id);
+            if (it != s->end()) {
+                local = true;
+                it->second->inflight.fetch_sub(1, butil::memory_order_relaxed);
+                _local_inflight.fetch_sub(1, butil::memory_order_relaxed);
+            }
+        }
+    }
+    if (local) {
+        UpdateErrorRate(info.error_code != 0);
+    }
+    // Calls are fed back to inner lbs only if they asked for it. Calls to
+    // removed local servers go to _remote, which ignores unknown servers.
+    if (_inner_need_feedback.load(butil::memory_order_relaxed)) {
+        if (local) {
+            _local->Feedback(info);
+        } else {
+            _remote->Feedback(info);
+        }
+    }
+}
+
+ZoneAwareLoadBalancer* ZoneAwareLoadBalancer::New(
+    const butil::StringPiece& params) const {
+    ZoneAwareLoadBalancer* lb = new (std::nothrow) ZoneAwareLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+void ZoneAwareLoadBalancer::Destroy() {
+    delete this;
+}
+
+void ZoneAwareLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "zone";
+        return;
+    }
+    os << "ZoneAware{local_zone=" << _local_zone
+       << " local=" << _nlocal.load(butil::memory_order_relaxed)
+       << " remote=" << _nremote.load(butil::memory_order_relaxed)
+       << " local_inflight=" << _local_inflight.load(butil::memory_order_relaxed)
+       << " local_error_rate="
+       << _local_error_rate.load(butil::memory_order_relaxed)
+       << " spillover_ratio=" << SpilloverRatio()
+       << " spilled=" << _nspilled.load(butil::memory_order_relaxed);
+    if (_local) {
+        os << " local_lb=";
+        _local->Describe(os, options);
+    }
+    if (_remote) {
+        os << " remote_lb=";
+        _remote->Describe(os, options);
+    }
+    os << '}';
+}
+
+bool ZoneAwareLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    _local_zone = FLAGS_local_zone;
+    _max_inflight = FLAGS_zone_lb_max_inflight_per_server;
+    _max_error_rate = FLAGS_zone_lb_max_error_rate;
+    std::string inner_params;
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "inner") {
+            sp.value().CopyToString(&_inner_name);
+        } else if (sp.key() == "local_zone") {
+            sp.value().CopyToString(&_local_zone);
+        } else if (sp.key() == "max_inflight") {
+            if (!butil::StringToInt64(sp.value(), &_max_inflight)) {
+                return false;
+            }
+        } else if (sp.key() == "max_error_rate") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_max_error_rate)) {
+                return false;
+            }
+        } else {
+            if (!inner_params.empty()) {
+                inner_params.push_back(' ');
+            }
+            sp.key_and_value().AppendToString(&inner_params);
+        }
+    }
+    const LoadBalancer* inner = LoadBalancerExtension()->Find(_inner_name.c_str());
+    if (inner == NULL) {
+        LOG(ERROR) << "Fail to find LoadBalancer by `" << _inner_name << "'";
+        return false;
+    }
+    if (dynamic_cast<const ZoneAwareLoadBalancer*>(inner) != NULL) {
+        LOG(ERROR) << "inner=" << _inner_name << " can't be zone-aware";
+        return false;
+    }
+    _local = inner->New(inner_params);
+    _remote = inner->New(inner_params);
+    return _local != NULL && _remote != NULL;
+}
+
+}  // namespace policy
+} // namespace brpc
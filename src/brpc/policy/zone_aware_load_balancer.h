@@ -0,0 +1,119 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+#define BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+// Prefer servers in the same zone with this process and spill calls over to
+// servers in other zones only when the local zone is overloaded, namely
+// in-flight calls per local server or error rate of local calls exceeds the
+// thresholds. Servers in each side are selected by an inner load balancer
+// of any registered name.
+//
+// Zone of a server is a `zone=<name>' token in the tag of ServerNode, other
+// tokens of the tag are passed to the inner load balancer, e.g. servers
+// tagged "zone=az1 10" are in zone az1 with weight 10 in "wrr".
+//
+// Parameters (space-separated, unknown ones are passed to the inner lb):
+//   inner=<lb_name>       load balancer in each side, "rr" by default
+//   local_zone=<zone>     -local_zone by default. If it's empty, all servers
+//                         are treated as local
+//   max_inflight=<n>      -zone_lb_max_inflight_per_server by default
+//   max_error_rate=<r>    -zone_lb_max_error_rate by default
+class ZoneAwareLoadBalancer : public LoadBalancer {
+public:
+    ZoneAwareLoadBalancer();
+    ~ZoneAwareLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    void UpdateServersInBatch(const std::vector<ServerId>& added,
+                              const std::vector<ServerId>& removed,
+                              size_t* nadded, size_t* nremoved);
+    ZoneAwareLoadBalancer* New(const butil::StringPiece& params) const;
+    void Destroy();
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    void Describe(std::ostream& os, const DescribeOptions& options);
+
+    // Split `tag' of ServerNode into zone and the tag for inner lb.
+    static void ParseTag(const std::string& tag, std::string* zone,
+                         std::string* inner_tag);
+
+    // Fraction of calls that should be sent to other zones now.
+    double SpilloverRatio() const;
+
+private:
+    struct ServerStat {
+        ServerStat() : inflight(0) {}
+        butil::atomic<int64_t> inflight;
+    };
+    // Stats of local servers.
+    typedef std::map<SocketId, std::shared_ptr<ServerStat> > StatMap;
+
+    bool SetParameters(const butil::StringPiece& params);
+    bool IsLocal(const ServerId& id, ServerId* inner_id) const;
+    void Split(const std::vector<ServerId>& servers,
+               std::vector<ServerId>* local,
+               std::vector<ServerId>* remote) const;
+    void AddLocalStats(const std::vector<ServerId>& servers);
+    void RemoveLocalStats(const std::vector<ServerId>& servers);
+    void UpdateErrorRate(bool failed);
+    static size_t AddStats(StatMap& bg, const StatMap& fg,
+                           const std::vector<ServerId>& servers);
+    static size_t RemoveStats(StatMap& bg,
+                              const std::vector<ServerId>& servers);
+
+    std::string _local_zone;
+    std::string _inner_name;
+    int64_t _max_inflight;
+    double _max_error_rate;
+    LoadBalancer* _local;
+    LoadBalancer* _remote;
+    // Set when the inner lb ever asked for feedback.
+    butil::atomic<bool> _inner_need_feedback;
+    butil::atomic<int64_t> _nlocal;
+    butil::atomic<int64_t> _nremote;
+    // Sum of in-flight calls to local servers.
+    butil::atomic<int64_t> _local_inflight;
+    // Error rate of local calls in last window.
+    butil::atomic<int64_t> _window_start_us;
+    butil::atomic<int64_t> _window_ncall;
+    butil::atomic<int64_t> _window_nerror;
+    butil::atomic<double> _local_error_rate;
+    butil::atomic<int64_t> _nspilled;
+    butil::DoublyBufferedData<StatMap> _db_stats;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
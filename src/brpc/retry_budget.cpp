@@ -0,0 +1,80 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <pthread.h>
+#include "butil/logging.h"
+#include "bvar/bvar.h"
+#include "brpc/retry_budget.h"
+
+
+namespace brpc {
+
+// Retries rejected by all budgets.
+static bvar::Adder<int64_t>* g_retry_budget_exhausted = NULL;
+// Times of budgets being halved by the circuit breaker.
+static bvar::Adder<int64_t>* g_retry_budget_isolation_cut = NULL;
+
+static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
+
+static void CreateVars() {
+    g_retry_budget_exhausted =
+        new bvar::Adder<int64_t>("rpc_retry_budget_exhausted");
+    new bvar::PerSecond<bvar::Adder<int64_t> >(
+        "rpc_retry_budget_exhausted_second", g_retry_budget_exhausted);
+    g_retry_budget_isolation_cut =
+        new bvar::Adder<int64_t>("rpc_retry_budget_isolation_cut");
+}
+
+RetryBudgetOptions::RetryBudgetOptions()
+    : max_retry_ratio(0.1)
+    , max_burst(10) {
+}
+
+RetryBudget::RetryBudget()
+    : RetryBudget(RetryBudgetOptions()) {
+}
+
+RetryBudget::RetryBudget(const RetryBudgetOptions& options)
+    : _tokens(options.max_retry_ratio, options.max_burst)
+    , _exhausted_count(0) {
+    CHECK_EQ(0, pthread_once(&s_create_vars_once, CreateVars));
+}
+
+bool RetryBudget::TryRetry() {
+    if (_tokens.Withdraw()) {
+        return true;
+    }
+    _exhausted_count.fetch_add(1, butil::memory_order_relaxed);
+    *g_retry_budget_exhausted << 1;
+    return false;
+}
+
+void RetryBudget::OnSuccess() {
+    _tokens.Deposit();
+}
+
+void RetryBudget::OnServerIsolated() {
+    _tokens.Halve();
+    *g_retry_budget_isolation_cut << 1;
+}
+
+double RetryBudget::tokens() const {
+    return _tokens.tokens();
+}
+
+} // namespace brpc
@@ -0,0 +1,85 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RETRY_BUDGET_H
+#define BRPC_RETRY_BUDGET_H
+
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "brpc/details/token_bucket.h"
+
+
+namespace brpc {
+
+struct RetryBudgetOptions {
+    // Constructed with default values.
+    RetryBudgetOptions();
+
+    // Retries are limited to this ratio of successful RPCs in the long run.
+    // Every successful RPC adds this number of tokens into a bucket and
+    // every retry takes one.
+    // Default: 0.1
+    double max_retry_ratio;
+
+    // Capacity of the token bucket, namely the max retries in a burst. The
+    // bucket is full initially so that channels with few RPCs still retry.
+    // Default: 10
+    int max_burst;
+};
+
+// Limits retries of all RPCs sharing this object, so that a brownout of the
+// backend is not amplified by every client retrying max_retry times.
+// Set ChannelOptions.retry_budget to an instance of this class. Share one
+// instance between channels accessing the same cluster.
+// RetryPolicy still decides whether an RPC is retriable, the budget decides
+// whether the retry can be afforded. Besides, the budget is halved when a
+// server is isolated by the circuit breaker, which is usually a sign of
+// overloading.
+class RetryBudget {
+public:
+    RetryBudget();
+    explicit RetryBudget(const RetryBudgetOptions& options);
+
+    // Take a token for a retry. Returns false if the budget is exhausted.
+    bool TryRetry();
+
+    // Called when an RPC succeeded.
+    void OnSuccess();
+
+    // Called when a server is isolated by the circuit breaker.
+    void OnServerIsolated();
+
+    // Number of retries that can be done right now.
+    double tokens() const;
+
+    // Number of retries rejected by this budget.
+    int64_t exhausted_count() const {
+        return _exhausted_count.load(butil::memory_order_relaxed);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RetryBudget);
+
+    TokenBucket _tokens;
+    butil::atomic<int64_t> _exhausted_count;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_RETRY_BUDGET_H
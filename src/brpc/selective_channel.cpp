@@ -561,7 +561,9 @@ void SelectiveChannel::CallMethod(
     _chan.CallMethod(method, cntl, request, response, sndr);
     if (user_done == NULL) {
         Join(cid);
-        cntl->OnRPCEnd(butil::gettimeofday_us());
+        // OnRPCEnd() was called before running `sndr', just count in the
+        // context-switch without notifying policies again.
+        cntl->_end_time_us = butil::gettimeofday_us();
     }
 }
 
@@ -63,6 +63,7 @@
 #include "brpc/builtin/ids_service.h"          // IdsService
 #include "brpc/builtin/sockets_service.h"      // SocketsService
 #include "brpc/builtin/hotspots_service.h"     // HotspotsService
+#include "brpc/builtin/flamegraph_service.h"   // FlameGraphService
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/details/method_status.h"
 #include "brpc/load_balancer.h"
@@ -489,6 +490,10 @@ int Server::AddBuiltinServices() {
         LOG(ERROR) << "Fail to add HotspotsService";
         return -1;
     }
+    if (AddBuiltinService(new (std::nothrow) FlameGraphService)) {
+        LOG(ERROR) << "Fail to add FlameGraphService";
+        return -1;
+    }
     if (AddBuiltinService(new (std::nothrow) IndexService)) {
         LOG(ERROR) << "Fail to add IndexService";
         return -1;
@@ -30,6 +30,7 @@
 #include "butil/containers/doubly_buffered_data.h"   // DoublyBufferedData
 #include "bvar/bvar.h"
 #include "butil/containers/case_ignored_flat_map.h"  // [CaseIgnored]FlatMap
+#include "butil/containers/swiss_map.h"          // SwissMap
 #include "butil/ptr_container.h"
 #include "brpc/controller.h"                   // brpc::Controller
 #include "brpc/ssl_options.h"                  // ServerSSLOptions
@@ -363,7 +364,8 @@ public:
 
         const std::string& service_name() const;
     };
-    typedef butil::FlatMap<std::string, ServiceProperty> ServiceMap;
+    // Searched for every request, SwissMap is faster than FlatMap on lookups.
+    typedef butil::SwissMap<std::string, ServiceProperty> ServiceMap;
 
     struct MethodProperty {
         bool is_builtin_service;
@@ -390,7 +392,7 @@ public:
 
         MethodProperty();
     };
-    typedef butil::FlatMap<std::string, MethodProperty> MethodMap;
+    typedef butil::SwissMap<std::string, MethodProperty> MethodMap;
 
     struct ThreadLocalOptions {
         bthread_key_t tls_key;
@@ -1007,12 +1007,14 @@ int Socket::SetFailed() {
     return SetFailed(EFAILEDSOCKET, NULL);
 }
 
-void Socket::FeedbackCircuitBreaker(int error_code, int64_t latency_us) {
+bool Socket::FeedbackCircuitBreaker(int error_code, int64_t latency_us) {
     if (!GetOrNewSharedPart()->circuit_breaker.OnCallEnd(error_code, latency_us)) {
         if (SetFailed(main_socket_id()) == 0) {
             LOG(ERROR) << "Socket[" << *this << "] isolated by circuit breaker";
+            return true;
         }
     }
+    return false;
 }
 
 int Socket::ReleaseReferenceIfIdle(int idle_seconds) {
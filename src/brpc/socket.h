@@ -404,7 +404,9 @@ public:
 
     int isolated_times() const;
 
-    void FeedbackCircuitBreaker(int error_code, int64_t latency_us);
+    // Returns true if the socket is isolated by the circuit breaker because
+    // of this call.
+    bool FeedbackCircuitBreaker(int error_code, int64_t latency_us);
 
     bool Failed() const;
 
@@ -17,6 +17,9 @@
 
 
 #include <netinet/in.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
 #include <gflags/gflags.h>
 #include <leveldb/db.h>
 #include <leveldb/comparator.h>
@@ -29,9 +32,14 @@
 #include "butil/object_pool.h"
 #include "butil/fast_rand.h"
 #include "butil/file_util.h"
+#include "bvar/reducer.h"
+#include "bvar/window.h"
 #include "brpc/shared_object.h"
+#include "brpc/periodic_task.h"
 #include "brpc/reloadable_flags.h"
 #include "brpc/span.h"
+#include "brpc/details/span_db.h"
+#include "brpc/details/otlp_exporter.h"
 
 #define BRPC_SPAN_INFO_SEP "\1"
 
@@ -59,6 +67,36 @@ BRPC_VALIDATE_GFLAG(rpcz_keep_span_seconds, PositiveInteger);
 
 DEFINE_bool(rpcz_keep_span_db, false, "Don't remove DB of rpcz at program's exit");
 
+DEFINE_string(rpcz_storage, "memory", "Where to keep spans of rpcz: "
+              "`memory' keeps recent spans in a ring of fixed size, "
+              "`leveldb' keeps spans in -rpcz_keep_span_seconds in leveldb "
+              "under -rpcz_database_dir");
+
+DEFINE_bool(rpcz_persist_spans, false, "Map the memory of -rpcz_storage="
+            "memory to a file under -rpcz_database_dir");
+
+DEFINE_int32(rpcz_max_spans_in_memory, 131072,
+             "Max number of spans kept by -rpcz_storage=memory");
+
+DEFINE_int32(rpcz_span_memory_mb, 64,
+             "Megabytes of serialized spans kept by -rpcz_storage=memory");
+
+DEFINE_bool(rpcz_tail_sampling, false, "Create spans for all requests and "
+            "keep sampled ones as well as slow or failed ones");
+BRPC_VALIDATE_GFLAG(rpcz_tail_sampling, PassValidate);
+
+DEFINE_int32(rpcz_tail_latency_percentile, 99, "With -rpcz_tail_sampling, "
+             "spans slower than this percentile of their methods are kept");
+static bool validate_rpcz_tail_latency_percentile(const char*, int32_t val) {
+    return val >= 1 && val <= 99;
+}
+BRPC_VALIDATE_GFLAG(rpcz_tail_latency_percentile,
+                    validate_rpcz_tail_latency_percentile);
+
+DEFINE_int32(rpcz_max_tail_spans_per_second, 500, "With -rpcz_tail_sampling, "
+             "keep at most so many slow or failed spans per second");
+BRPC_VALIDATE_GFLAG(rpcz_max_tail_spans_per_second, NonNegativeInteger);
+
 struct IdGen {
     bool init;
     uint16_t seq;
@@ -89,6 +127,13 @@ inline uint64_t GenerateSpanId() {
     return (g->current_random & 0xFFFFFFFFFFFF0000ULL) | g->seq++;
 }
 
+// Decide whether a span without sampled parent or upstream is sampled.
+// Without -rpcz_tail_sampling, the span was sampled by IsTraceable().
+inline bool SampleNewSpan() {
+    extern bvar::CollectorSpeedLimit g_span_sl;
+    return !FLAGS_rpcz_tail_sampling || bvar::is_collectable(&g_span_sl);
+}
+
 inline uint64_t GenerateTraceId() {
     // 0 is an invalid Id
     IdGen* g = &tls_trace_id_gen;
@@ -110,6 +155,8 @@ Span* Span::CreateClientSpan(const std::string& full_method_name,
     span->_ending_cid = INVALID_BTHREAD_ID;
     span->_type = SPAN_TYPE_CLIENT;
     span->_async = false;
+    span->_tail_client = false;
+    span->_shared_span_id = false;
     span->_protocol = PROTOCOL_UNKNOWN;
     span->_error_code = 0;
     span->_request_size = 0;
@@ -127,14 +174,18 @@ Span* Span::CreateClientSpan(const std::string& full_method_name,
     Span* parent = (Span*)bthread::tls_bls.rpcz_parent_span;
     if (parent) {
         span->_trace_id = parent->trace_id();
+        span->_trace_id_high = parent->trace_id_high();
         span->_parent_span_id = parent->span_id();
         span->_local_parent = parent;
         span->_next_client = parent->_next_client;
         parent->_next_client = span;
+        span->_sampled = parent->_sampled;
     } else {
         span->_trace_id = GenerateTraceId();
+        span->_trace_id_high = 0;
         span->_parent_span_id = 0;
         span->_local_parent = NULL;
+        span->_sampled = SampleNewSpan();
     }
     span->_span_id = GenerateSpanId();
     return span;
@@ -155,13 +206,18 @@ Span* Span::CreateServerSpan(
         return NULL;
     }
     span->_trace_id = (trace_id ? trace_id : GenerateTraceId());
+    span->_trace_id_high = 0;
     span->_span_id = (span_id ? span_id : GenerateSpanId());
+    span->_shared_span_id = (span_id != 0);
     span->_parent_span_id = parent_span_id;
+    // Upstream passes trace_id only when its span is sampled.
+    span->_sampled = (trace_id != 0 || SampleNewSpan());
     span->_log_id = 0;
     span->_base_cid = INVALID_BTHREAD_ID;
     span->_ending_cid = INVALID_BTHREAD_ID;
     span->_type = SPAN_TYPE_SERVER;
     span->_async = false;
+    span->_tail_client = false;
     span->_protocol = PROTOCOL_UNKNOWN;
     span->_error_code = 0;
     span->_request_size = 0;
@@ -303,27 +359,42 @@ void AnnotateSpan(const char* fmt, ...) {
     va_end(ap);
 }
 
-class SpanDB : public SharedObject {
+// Keep spans in two leveldb: id_db indexes RpczSpan by trace_id and span_id,
+// time_db indexes BriefSpan by starting time.
+class LevelDBSpanDB : public SpanDB {
 public:
     leveldb::DB* id_db;
     leveldb::DB* time_db;
     std::string id_db_name;
     std::string time_db_name;
 
-    SpanDB() : id_db(NULL), time_db(NULL) { }
-    static SpanDB* Open();
-    leveldb::Status Index(const Span* span, std::string* value_buf);
-    leveldb::Status RemoveSpansBefore(int64_t tm);
+    LevelDBSpanDB() : id_db(NULL), time_db(NULL) { }
+    static LevelDBSpanDB* Open(const std::string& dir);
+    int Index(const Span* span) override;
+    int RemoveSpansBefore(int64_t tm) override;
+    int FindSpan(uint64_t trace_id, uint64_t span_id,
+                 RpczSpan* span) override;
+    void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) override;
+    void ListSpans(int64_t before_this_time, size_t max_scan,
+                   std::deque<BriefSpan>* out, SpanFilter* filter) override;
+    void Describe(std::ostream& os) override;
 
 private:
-    static void Swap(SpanDB& db1, SpanDB& db2) {
+    leveldb::Status DoIndex(const Span* span, std::string* value_buf);
+    leveldb::Status DoRemoveSpansBefore(int64_t tm);
+    // Returns -1 if `st' means that the db is unusable.
+    static int CheckStatus(const leveldb::Status& st);
+
+    int64_t _last_time_key = 0;
+
+    static void Swap(LevelDBSpanDB& db1, LevelDBSpanDB& db2) {
         std::swap(db1.id_db, db2.id_db);
         std::swap(db1.id_db_name, db2.id_db_name);
         std::swap(db1.time_db, db2.time_db);
         std::swap(db1.time_db_name, db2.time_db_name);
     }
 
-    ~SpanDB() {
+    ~LevelDBSpanDB() {
         if (id_db == NULL && time_db == NULL) {
             return;
         }
@@ -340,7 +411,6 @@ private:
 
 static bool started_span_indexing = false;
 static pthread_once_t start_span_indexing_once = PTHREAD_ONCE_INIT;
-static int64_t g_last_time_key = 0;
 static int64_t g_last_delete_tm = 0;
 
 // Following variables are monitored by builtin services, thus non-static.
@@ -418,10 +488,208 @@ inline int GetSpanDB(butil::intrusive_ptr<SpanDB>* db) {
     return -1;
 }
 
+// Latency percentiles of methods estimated by -rpcz_tail_sampling, in
+// 1/256 microseconds. Methods are hashed into a fixed number of slots
+// without allocations, methods sharing a slot share the estimation.
+static const size_t TAIL_LATENCY_SLOTS = 1024;
+static butil::atomic<int64_t> g_tail_latency[TAIL_LATENCY_SLOTS];
+
+bool Span::IsSlowOrFailed(int64_t cpuwide_time_us) const {
+    int64_t start_real_us = _start_send_real_us;
+    if (_type == SPAN_TYPE_SERVER) {
+        start_real_us = (_received_real_us ? _received_real_us
+                         : _start_parse_real_us);
+    }
+    const int64_t latency = 256 * std::max(
+        cpuwide_time_us + _base_real_us - start_real_us, (int64_t)0);
+    butil::atomic<int64_t>& slot = g_tail_latency[
+        std::hash<std::string>()(_full_method_name) % TAIL_LATENCY_SLOTS];
+    // Move the estimation towards the latency by a step proportional to
+    // the estimation, the estimation stays where latencies exceed it with
+    // the probability of (100 - percentile)%. Concurrent updates may
+    // be lost, which is harmless.
+    const int64_t q = slot.load(butil::memory_order_relaxed);
+    const int64_t percentile = FLAGS_rpcz_tail_latency_percentile;
+    const int64_t step = q / 32 + 256;
+    if (q == 0) {
+        slot.store(latency, butil::memory_order_relaxed);
+    } else if (latency > q) {
+        slot.store(q + step * percentile / 100, butil::memory_order_relaxed);
+    } else {
+        slot.store(std::max(q - step * (100 - percentile) / 100, (int64_t)1),
+                   butil::memory_order_relaxed);
+    }
+    return _error_code != 0 || (q != 0 && latency > q);
+}
+
+static bvar::Adder<int64_t> g_tail_span_count;
+static bvar::PerSecond<bvar::Adder<int64_t> > g_tail_span_second(
+    "rpcz_tail_span_second", &g_tail_span_count);
+
+// Returns true if one more slow or failed span can be kept in current second.
+static bool AcquireTailQuota(int64_t cpuwide_time_us) {
+    static butil::static_atomic<int64_t> s_second = BUTIL_STATIC_ATOMIC_INIT(0);
+    static butil::static_atomic<int> s_count = BUTIL_STATIC_ATOMIC_INIT(0);
+    const int64_t second = cpuwide_time_us / 1000000L;
+    if (s_second.load(butil::memory_order_relaxed) != second) {
+        s_second.store(second, butil::memory_order_relaxed);
+        s_count.store(0, butil::memory_order_relaxed);
+    }
+    if (s_count.fetch_add(1, butil::memory_order_relaxed) >=
+        FLAGS_rpcz_max_tail_spans_per_second) {
+        return false;
+    }
+    g_tail_span_count << 1;
+    return true;
+}
+
 void Span::Submit(Span* span, int64_t cpuwide_time_us) {
-    if (span->local_parent() == NULL) {
+    if (!FLAGS_rpcz_tail_sampling && span->_sampled) {
+        if (span->local_parent() == NULL) {
+            span->submit(cpuwide_time_us);
+        }
+        return;
+    }
+    // Always estimate latencies of methods even if the span is sampled.
+    const bool slow_or_failed = span->IsSlowOrFailed(cpuwide_time_us);
+    Span* parent = span->local_parent();
+    if (parent != NULL) {
+        // Client spans are kept or discarded along with their parents.
+        if (slow_or_failed) {
+            parent->_tail_client = true;
+        }
+        return;
+    }
+    if (span->_sampled ||
+        ((slow_or_failed || span->_tail_client) &&
+         AcquireTailQuota(cpuwide_time_us))) {
         span->submit(cpuwide_time_us);
+    } else {
+        span->Discard();
+    }
+}
+
+// Spans discarded by a thread in current and previous round. Spans must
+// not be recycled immediately because asynchronous client spans may still
+// reference them as parents, which is also true for spans submitted to the
+// collecting thread. Spans in previous round are recycled after one more
+// round, so that each discarded span lives for at least
+// SPAN_DISCARD_ROUND_US just like submitted ones. Rounds are also advanced
+// by DiscardedSpansSweeper periodically, otherwise spans of idle or quitted
+// threads would never be recycled.
+struct DiscardedSpans {
+    // Uncontended unless the sweeper is visiting.
+    pthread_mutex_t mutex;
+    int64_t round_start_us;
+    Span* current;
+    Span* previous;
+    // The thread quit, deleted by the sweeper after recycling all spans.
+    bool orphan;
+
+    // Recycle spans in previous round if current round ends.
+    // Called with `mutex' held.
+    void AdvanceRound(int64_t now);
+};
+static const int64_t SPAN_DISCARD_ROUND_US = 1000000L;
+static __thread DiscardedSpans* tls_discarded = NULL;
+static pthread_mutex_t g_discarded_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<DiscardedSpans*>* g_discarded_lists = NULL;
+static pthread_once_t g_start_discarded_sweeper_once = PTHREAD_ONCE_INIT;
+static bvar::Adder<int64_t> g_discarded_span_count(
+    "rpcz_discarded_span_count");
+
+void DiscardedSpans::AdvanceRound(int64_t now) {
+    if (now - round_start_us < SPAN_DISCARD_ROUND_US) {
+        return;
     }
+    int64_t nrecycled = 0;
+    Span* p = previous;
+    while (p) {
+        Span* p_next = p->_tls_next;
+        p->destroy();
+        p = p_next;
+        ++nrecycled;
+    }
+    g_discarded_span_count << -nrecycled;
+    previous = current;
+    current = NULL;
+    round_start_us = now;
+}
+
+class DiscardedSpansSweeper : public PeriodicTask {
+public:
+    bool OnTriggeringTask(timespec* next_abstime) {
+        const int64_t now = butil::cpuwide_time_us();
+        BAIDU_SCOPED_LOCK(g_discarded_mutex);
+        std::vector<DiscardedSpans*>& lists = *g_discarded_lists;
+        for (size_t i = 0; i < lists.size();) {
+            DiscardedSpans* d = lists[i];
+            bool removable = false;
+            {
+                BAIDU_SCOPED_LOCK(d->mutex);
+                d->AdvanceRound(now);
+                removable = (d->orphan && d->current == NULL &&
+                             d->previous == NULL);
+            }
+            if (removable) {
+                pthread_mutex_destroy(&d->mutex);
+                delete d;
+                lists[i] = lists.back();
+                lists.pop_back();
+            } else {
+                ++i;
+            }
+        }
+        *next_abstime = butil::microseconds_from_now(SPAN_DISCARD_ROUND_US);
+        return true;
+    }
+    void OnDestroyingTask() {
+        delete this;
+    }
+};
+
+static void StartDiscardedSpansSweeper() {
+    g_discarded_lists = new std::vector<DiscardedSpans*>;
+    PeriodicTaskManager::StartTaskAt(
+        new DiscardedSpansSweeper,
+        butil::microseconds_from_now(SPAN_DISCARD_ROUND_US));
+}
+
+static void OrphanDiscardedSpans(void* arg) {
+    DiscardedSpans* d = static_cast<DiscardedSpans*>(arg);
+    BAIDU_SCOPED_LOCK(d->mutex);
+    d->orphan = true;
+}
+
+static DiscardedSpans* GetOrNewDiscardedSpans() {
+    DiscardedSpans* d = tls_discarded;
+    if (d != NULL) {
+        return d;
+    }
+    pthread_once(&g_start_discarded_sweeper_once, StartDiscardedSpansSweeper);
+    d = new DiscardedSpans;
+    pthread_mutex_init(&d->mutex, NULL);
+    d->round_start_us = 0;
+    d->current = NULL;
+    d->previous = NULL;
+    d->orphan = false;
+    {
+        BAIDU_SCOPED_LOCK(g_discarded_mutex);
+        g_discarded_lists->push_back(d);
+    }
+    butil::thread_atexit(OrphanDiscardedSpans, d);
+    tls_discarded = d;
+    return d;
+}
+
+void Span::Discard() {
+    EndAsParent();
+    DiscardedSpans* d = GetOrNewDiscardedSpans();
+    BAIDU_SCOPED_LOCK(d->mutex);
+    d->AdvanceRound(butil::cpuwide_time_us());
+    _tls_next = d->current;
+    d->current = this;
+    g_discarded_span_count << 1;
 }
 
 static void Span2Proto(const Span* span, RpczSpan* out) {
@@ -448,6 +716,19 @@ static void Span2Proto(const Span* span, RpczSpan* out) {
     out->set_error_code(span->error_code());
 }
 
+void SpanDB::SpanToProto(const Span* span, RpczSpan* out) {
+    Span2Proto(span, out);
+    // client spans should be reversed.
+    size_t client_span_count = span->CountClientSpans();
+    for (size_t i = 0; i < client_span_count; ++i) {
+        out->add_client_spans();
+    }
+    size_t i = 0;
+    for (const Span* p = span->_next_client; p; p = p->_next_client, ++i) {
+        Span2Proto(p, out->mutable_client_spans(client_span_count - i - 1));
+    }
+}
+
 inline void ToBigEndian(uint64_t n, uint32_t* buf) {
     buf[0] = htonl(n >> 32);
     buf[1] = htonl(n & 0xFFFFFFFFUL);
@@ -457,49 +738,27 @@ inline uint64_t ToLittleEndian(const uint32_t* buf) {
     return (((uint64_t)ntohl(buf[0])) << 32) | ntohl(buf[1]);
 }
 
-SpanDB* SpanDB::Open() {
-    SpanDB local;
+LevelDBSpanDB* LevelDBSpanDB::Open(const std::string& dir) {
+    LevelDBSpanDB local;
     leveldb::Status st;
-    char prefix[64];
-    time_t rawtime;
-    time(&rawtime);
-    struct tm lt_buf;
-    struct tm* timeinfo = localtime_r(&rawtime, &lt_buf);
-    const size_t nw = strftime(prefix, sizeof(prefix),
-                               "/%Y%m%d.%H%M%S", timeinfo);
-    const int nw2 = snprintf(prefix + nw, sizeof(prefix) - nw, ".%d",
-                             getpid());
     leveldb::Options options;
     options.create_if_missing = true;
     options.error_if_exists = true;
 
-    local.id_db_name.append(FLAGS_rpcz_database_dir);
-    local.id_db_name.append(prefix, nw + nw2);
-    // Create the dir first otherwise leveldb fails.
-    butil::File::Error error;
-    const butil::FilePath dir(local.id_db_name);
-    if (!butil::CreateDirectoryAndGetError(dir, &error)) {
-        LOG(ERROR) << "Fail to create directory=`" << dir.value() << ", "
-                   << error;
-        return NULL;
-    }
-
-    local.id_db_name.append("/id.db");
+    local.id_db_name = dir + "/id.db";
     st = leveldb::DB::Open(options, local.id_db_name.c_str(), &local.id_db);
     if (!st.ok()) {
         LOG(ERROR) << "Fail to open id_db: " << st.ToString();
         return NULL;
     }
 
-    local.time_db_name.append(FLAGS_rpcz_database_dir);
-    local.time_db_name.append(prefix, nw + nw2);
-    local.time_db_name.append("/time.db");
+    local.time_db_name = dir + "/time.db";
     st = leveldb::DB::Open(options, local.time_db_name.c_str(), &local.time_db);
     if (!st.ok()) {
         LOG(ERROR) << "Fail to open time_db: " << st.ToString();
         return NULL;
     }
-    SpanDB* db = new (std::nothrow) SpanDB;
+    LevelDBSpanDB* db = new (std::nothrow) LevelDBSpanDB;
     if (NULL == db) {
         return NULL;
     }
@@ -509,7 +768,23 @@ SpanDB* SpanDB::Open() {
     return db;
 }
 
-leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
+int LevelDBSpanDB::CheckStatus(const leveldb::Status& st) {
+    if (st.ok()) {
+        return 0;
+    }
+    LOG(WARNING) << st.ToString();
+    if (st.IsNotFound() || st.IsIOError() || st.IsCorruption()) {
+        return -1;
+    }
+    return 0;
+}
+
+int LevelDBSpanDB::Index(const Span* span) {
+    std::string value_buf;
+    return CheckStatus(DoIndex(span, &value_buf));
+}
+
+leveldb::Status LevelDBSpanDB::DoIndex(const Span* span, std::string* value_buf) {
     leveldb::WriteOptions options;
     options.sync = false;
 
@@ -552,10 +827,10 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
     // and it will finally catch up with our time key. (provided the flag
     // is less than 1000000).
     int64_t time_key = start_time;
-    if (time_key <= g_last_time_key) {
-        time_key = g_last_time_key + 1;
+    if (time_key <= _last_time_key) {
+        time_key = _last_time_key + 1;
     }
-    g_last_time_key = time_key;
+    _last_time_key = time_key;
     uint32_t time_data[2];
     ToBigEndian(time_key, time_data);
     st = time_db->Put(options,
@@ -570,16 +845,7 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
     ToBigEndian(span->span_id(), key_data + 2);
     leveldb::Slice key((char*)key_data, sizeof(key_data));
     RpczSpan value_proto;
-    Span2Proto(span, &value_proto);
-    // client spans should be reversed.
-    size_t client_span_count = span->CountClientSpans();
-    for (size_t i = 0; i < client_span_count; ++i) {
-        value_proto.add_client_spans();
-    }
-    size_t i = 0;
-    for (const Span* p = span->_next_client; p; p = p->_next_client, ++i) {
-        Span2Proto(p, value_proto.mutable_client_spans(client_span_count - i - 1));
-    }
+    SpanToProto(span, &value_proto);
     if (!value_proto.SerializeToString(value_buf)) {
         return leveldb::Status::InvalidArgument(
             leveldb::Slice("Fail to serialize RpczSpan"));
@@ -589,8 +855,12 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
     return st;
 }
 
+int LevelDBSpanDB::RemoveSpansBefore(int64_t tm) {
+    return CheckStatus(DoRemoveSpansBefore(tm));
+}
+
 // NOTE: may take more than 100ms
-leveldb::Status SpanDB::RemoveSpansBefore(int64_t tm) {
+leveldb::Status LevelDBSpanDB::DoRemoveSpansBefore(int64_t tm) {
     if (id_db == NULL || time_db == NULL) {
         return leveldb::Status::InvalidArgument(leveldb::Slice("NULL param"));
     }
@@ -632,65 +902,14 @@ leveldb::Status SpanDB::RemoveSpansBefore(int64_t tm) {
     return rc;
 }
 
-// Write span into leveldb.
-void Span::dump_and_destroy(size_t /*round*/) {
-    StartIndexingIfNeeded();
-
-    std::string value_buf;
-
-    butil::intrusive_ptr<SpanDB> db;
-    if (GetSpanDB(&db) != 0) {
-        if (g_span_ending) {
-            destroy();
-            return;
-        }
-        SpanDB* db2 = SpanDB::Open();
-        if (db2 == NULL) {
-            LOG(WARNING) << "Fail to open SpanDB";
-            destroy();
-            return;
-        }
-        ResetSpanDB(db2);
-        db.reset(db2);
-    }
-
-    leveldb::Status st = db->Index(this, &value_buf);
-    destroy();
-    if (!st.ok()) {
-        LOG(WARNING) << st.ToString();
-        if (st.IsNotFound() || st.IsIOError() || st.IsCorruption()) {
-            ResetSpanDB(NULL);
-            return;
-        }
-    }
-
-    // Remove old spans
-    const int64_t now = butil::gettimeofday_us();
-    if (now > g_last_delete_tm + SPAN_DELETE_INTERVAL_US) {
-        g_last_delete_tm = now;
-        leveldb::Status st = db->RemoveSpansBefore(
-            now - FLAGS_rpcz_keep_span_seconds * 1000000L);
-        if (!st.ok()) {
-            LOG(ERROR) << st.ToString();
-            if (st.IsNotFound() || st.IsIOError() || st.IsCorruption()) {
-                ResetSpanDB(NULL);
-                return;
-            }
-        }
-    }
-}
-
-int FindSpan(uint64_t trace_id, uint64_t span_id, RpczSpan* response) {
-    butil::intrusive_ptr<SpanDB> db;
-    if (GetSpanDB(&db) != 0) {
-        return -1;
-    }
+int LevelDBSpanDB::FindSpan(uint64_t trace_id, uint64_t span_id,
+                            RpczSpan* response) {
     uint32_t key_data[4];
     ToBigEndian(trace_id, key_data);
     ToBigEndian(span_id, key_data + 2);
     leveldb::Slice key((char*)key_data, sizeof(key_data));
     std::string value;
-    leveldb::Status st = db->id_db->Get(leveldb::ReadOptions(), key, &value);
+    leveldb::Status st = id_db->Get(leveldb::ReadOptions(), key, &value);
     if (!st.ok()) {
         return -1;
     }
@@ -701,13 +920,8 @@ int FindSpan(uint64_t trace_id, uint64_t span_id, RpczSpan* response) {
     return 0;
 }
 
-void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) {
-    out->clear();
-    butil::intrusive_ptr<SpanDB> db;
-    if (GetSpanDB(&db) != 0) {
-        return;
-    }
-    leveldb::Iterator* it = db->id_db->NewIterator(leveldb::ReadOptions());
+void LevelDBSpanDB::FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) {
+    leveldb::Iterator* it = id_db->NewIterator(leveldb::ReadOptions());
     uint32_t key_data[4];
     ToBigEndian(trace_id, key_data);
     ToBigEndian(0, key_data + 2);
@@ -732,14 +946,9 @@ void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) {
     delete it;
 }
 
-void ListSpans(int64_t starting_realtime, size_t max_scan,
-               std::deque<BriefSpan>* out, SpanFilter* filter) {
-    out->clear();
-    butil::intrusive_ptr<SpanDB> db;
-    if (GetSpanDB(&db) != 0) {
-        return;
-    }
-    leveldb::Iterator* it = db->time_db->NewIterator(leveldb::ReadOptions());
+void LevelDBSpanDB::ListSpans(int64_t starting_realtime, size_t max_scan,
+                              std::deque<BriefSpan>* out, SpanFilter* filter) {
+    leveldb::Iterator* it = time_db->NewIterator(leveldb::ReadOptions());
     uint32_t time_data[2];
     ToBigEndian(starting_realtime, time_data);
     leveldb::Slice key((char*)time_data, sizeof(time_data));
@@ -771,31 +980,171 @@ void ListSpans(int64_t starting_realtime, size_t max_scan,
     delete it;
 }
 
-void DescribeSpanDB(std::ostream& os) {
-    butil::intrusive_ptr<SpanDB> db;
-    if (GetSpanDB(&db) != 0) {
-        return;
-    }
-
-    if (db->id_db != NULL) {
+void LevelDBSpanDB::Describe(std::ostream& os) {
+    if (id_db != NULL) {
         std::string val;
-        if (db->id_db->GetProperty(leveldb::Slice("leveldb.stats"), &val)) {
-            os << "[ " << db->id_db_name << " ]\n" << val;
+        if (id_db->GetProperty(leveldb::Slice("leveldb.stats"), &val)) {
+            os << "[ " << id_db_name << " ]\n" << val;
         }
-        if (db->id_db->GetProperty(leveldb::Slice("leveldb.sstables"), &val)) {
+        if (id_db->GetProperty(leveldb::Slice("leveldb.sstables"), &val)) {
             os << '\n' << val;
         }
     }
     os << '\n';
-    if (db->time_db != NULL) {
+    if (time_db != NULL) {
         std::string val;
-        if (db->time_db->GetProperty(leveldb::Slice("leveldb.stats"), &val)) {
-            os << "[ " << db->time_db_name << " ]\n" << val;
+        if (time_db->GetProperty(leveldb::Slice("leveldb.stats"), &val)) {
+            os << "[ " << time_db_name << " ]\n" << val;
         }
-        if (db->time_db->GetProperty(leveldb::Slice("leveldb.sstables"), &val)) {
+        if (time_db->GetProperty(leveldb::Slice("leveldb.sstables"), &val)) {
             os << '\n' << val;
         }
     }
 }
 
+// Create the DB specified by -rpcz_storage.
+static SpanDB* OpenSpanDB() {
+    const bool use_leveldb = (FLAGS_rpcz_storage == "leveldb");
+    if (!use_leveldb && FLAGS_rpcz_storage != "memory") {
+        LOG(ERROR) << "Unknown -rpcz_storage=" << FLAGS_rpcz_storage;
+        return NULL;
+    }
+    const size_t max_spans = std::max(FLAGS_rpcz_max_spans_in_memory, 1);
+    const size_t data_bytes = std::max(FLAGS_rpcz_span_memory_mb, 1) * 1048576UL;
+    if (!use_leveldb && !FLAGS_rpcz_persist_spans) {
+        return MemorySpanDB::Open("", max_spans, data_bytes);
+    }
+
+    // Files are put in a directory named after time and pid.
+    char prefix[64];
+    time_t rawtime;
+    time(&rawtime);
+    struct tm lt_buf;
+    struct tm* timeinfo = localtime_r(&rawtime, &lt_buf);
+    const size_t nw = strftime(prefix, sizeof(prefix),
+                               "/%Y%m%d.%H%M%S", timeinfo);
+    const int nw2 = snprintf(prefix + nw, sizeof(prefix) - nw, ".%d",
+                             getpid());
+    std::string dir_name = FLAGS_rpcz_database_dir;
+    dir_name.append(prefix, nw + nw2);
+    // Create the dir first otherwise leveldb fails.
+    butil::File::Error error;
+    const butil::FilePath dir(dir_name);
+    if (!butil::CreateDirectoryAndGetError(dir, &error)) {
+        LOG(ERROR) << "Fail to create directory=`" << dir.value() << ", "
+                   << error;
+        return NULL;
+    }
+    if (use_leveldb) {
+        return LevelDBSpanDB::Open(dir_name);
+    }
+    const std::string path = dir_name + "/spans";
+    SpanDB* db = MemorySpanDB::Open(path, max_spans, data_bytes);
+    if (db != NULL) {
+        LOG(INFO) << "Opened " << path;
+    }
+    return db;
+}
+
+// Write span into SpanDB.
+void Span::dump_and_destroy(size_t /*round*/) {
+    OtlpExporter* exporter = OtlpExporter::GetInstance();
+    if (exporter) {
+        exporter->Export(this);
+    }
+    StartIndexingIfNeeded();
+
+    butil::intrusive_ptr<SpanDB> db;
+    if (GetSpanDB(&db) != 0) {
+        if (g_span_ending) {
+            destroy();
+            return;
+        }
+        SpanDB* db2 = OpenSpanDB();
+        if (db2 == NULL) {
+            LOG(WARNING) << "Fail to open SpanDB";
+            destroy();
+            return;
+        }
+        ResetSpanDB(db2);
+        db.reset(db2);
+    }
+
+    const int rc = db->Index(this);
+    destroy();
+    if (rc != 0) {
+        ResetSpanDB(NULL);
+        return;
+    }
+
+    // Remove old spans
+    const int64_t now = butil::gettimeofday_us();
+    if (now > g_last_delete_tm + SPAN_DELETE_INTERVAL_US) {
+        g_last_delete_tm = now;
+        if (db->RemoveSpansBefore(
+                now - FLAGS_rpcz_keep_span_seconds * 1000000L) != 0) {
+            ResetSpanDB(NULL);
+            return;
+        }
+    }
+}
+
+int FindSpan(uint64_t trace_id, uint64_t span_id, RpczSpan* response) {
+    butil::intrusive_ptr<SpanDB> db;
+    if (GetSpanDB(&db) != 0) {
+        return -1;
+    }
+    return db->FindSpan(trace_id, span_id, response);
+}
+
+void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) {
+    out->clear();
+    butil::intrusive_ptr<SpanDB> db;
+    if (GetSpanDB(&db) != 0) {
+        return;
+    }
+    db->FindSpans(trace_id, out);
+}
+
+void ListSpans(int64_t starting_realtime, size_t max_scan,
+               std::deque<BriefSpan>* out, SpanFilter* filter) {
+    out->clear();
+    butil::intrusive_ptr<SpanDB> db;
+    if (GetSpanDB(&db) != 0) {
+        return;
+    }
+    db->ListSpans(starting_realtime, max_scan, out, filter);
+}
+
+void DescribeSpanDB(std::ostream& os) {
+    butil::intrusive_ptr<SpanDB> db;
+    if (GetSpanDB(&db) != 0) {
+        return;
+    }
+    db->Describe(os);
+}
+
+SpanDB* LoadSpanDBFromFile(const char* filepath) {
+    SpanDB* db = MemorySpanDB::Load(filepath);
+    if (db != NULL) {
+        db->AddRefManually();
+    }
+    return db;
+}
+
+int FindSpan(SpanDB* db, uint64_t trace_id, uint64_t span_id, RpczSpan* span) {
+    return db->FindSpan(trace_id, span_id, span);
+}
+
+void FindSpans(SpanDB* db, uint64_t trace_id, std::deque<RpczSpan>* out) {
+    out->clear();
+    db->FindSpans(trace_id, out);
+}
+
+void ListSpans(SpanDB* db, int64_t before_this_time, size_t max_scan,
+               std::deque<BriefSpan>* out, SpanFilter* filter) {
+    out->clear();
+    db->ListSpans(before_this_time, max_scan, out, filter);
+}
+
 } // namespace brpc
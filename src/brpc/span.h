@@ -41,11 +41,14 @@ extern __thread bthread::LocalStorage tls_bls;
 namespace brpc {
 
 DECLARE_bool(enable_rpcz);
+DECLARE_bool(rpcz_tail_sampling);
 
 // Collect information required by /rpcz and tracing system whose idea is
 // described in http://static.googleusercontent.com/media/research.google.com/en//pubs/archive/36356.pdf
 class Span : public bvar::Collected {
 friend class SpanDB;
+friend class OtlpExporter;
+friend struct DiscardedSpans;
     struct Forbidden {};
 public:
     // Call CreateServerSpan/CreateClientSpan instead.
@@ -69,6 +72,9 @@ public:
     static Span* CreateClientSpan(const std::string& full_method_name,
                                   int64_t base_real_us);
 
+    // Submit a finished span. With -rpcz_tail_sampling, spans which were
+    // not sampled are kept only if they're slow or failed, or one of their
+    // client spans is, otherwise they're discarded.
     static void Submit(Span* span, int64_t cpuwide_time_us);
 
     // Set tls parent.
@@ -90,6 +96,7 @@ public:
     int64_t GetEndRealTimeUs() const;
 
     void set_log_id(uint64_t cid) { _log_id = cid; }
+    void set_trace_id_high(uint64_t id) { _trace_id_high = id; }
     void set_base_cid(bthread_id_t id) { _base_cid = id; }
     void set_ending_cid(bthread_id_t id) { _ending_cid = id; }
     void set_remote_side(const butil::EndPoint& pt) { _remote_side = pt; }
@@ -117,6 +124,9 @@ public:
     }
 
     uint64_t trace_id() const { return _trace_id; }
+    // Higher 64 bits of the 128-bit W3C trace-id received from upstream,
+    // 0 for trace ids generated by brpc.
+    uint64_t trace_id_high() const { return _trace_id_high; }
     uint64_t parent_span_id() const { return _parent_span_id; }
     uint64_t span_id() const { return _span_id; }
     uint64_t log_id() const { return _log_id; }
@@ -134,6 +144,10 @@ public:
     int64_t start_send_real_us() const { return _start_send_real_us; }
     int64_t sent_real_us() const { return _sent_real_us; }
     bool async() const { return _async; }
+    // True if the span is kept regardless of its latency and error. The
+    // decision is inherited by client spans and by servers receiving
+    // trace_id of the span.
+    bool sampled() const { return _sampled; }
     const std::string& full_method_name() const { return _full_method_name; }
     const std::string& info() const { return _info; }
     
@@ -151,7 +165,16 @@ private:
         }
     }
 
+    // Returns true if the span failed or its latency exceeds
+    // -rpcz_tail_latency_percentile of its method, whose estimation is
+    // updated with the latency as well.
+    bool IsSlowOrFailed(int64_t cpuwide_time_us) const;
+
+    // Recycle the span and its client spans which are not submitted.
+    void Discard();
+
     uint64_t _trace_id;
+    uint64_t _trace_id_high;
     uint64_t _span_id;
     uint64_t _parent_span_id;
     uint64_t _log_id;
@@ -160,6 +183,11 @@ private:
     butil::EndPoint _remote_side;
     SpanType _type;
     bool _async;
+    bool _sampled;
+    // Set when a client span is slow or failed.
+    bool _tail_client;
+    // Server span sharing span_id with the client span of upstream.
+    bool _shared_span_id;
     ProtocolType _protocol;
     int _error_code;
     int  _request_size;
@@ -179,6 +207,7 @@ private:
 
     Span* _local_parent;
     Span* _next_client;
+    // Linking spans discarded by a thread.
     Span* _tls_next;
 };
 
@@ -219,6 +248,10 @@ void ListSpans(int64_t before_this_time, size_t max_scan,
 
 void DescribeSpanDB(std::ostream& os);
 
+// Load spans saved by -rpcz_persist_spans (`spans' under
+// -rpcz_database_dir) for querying with following functions.
+// Returns NULL on error. Release the db with RemoveRefManually() defined
+// in brpc/details/span_db.h
 SpanDB* LoadSpanDBFromFile(const char* filepath);
 int FindSpan(SpanDB* db, uint64_t trace_id, uint64_t span_id, RpczSpan* span);
 void FindSpans(SpanDB* db, uint64_t trace_id, std::deque<RpczSpan>* out);
@@ -227,10 +260,13 @@ void ListSpans(SpanDB* db, int64_t before_this_time, size_t max_scan,
 
 // Check this function first before creating a span.
 // If rpcz of upstream is enabled, local rpcz is enabled automatically.
+// With -rpcz_tail_sampling, spans are created for all requests and sampled
+// in Span::CreateServerSpan/CreateClientSpan instead.
 inline bool IsTraceable(bool is_upstream_traced) {
     extern bvar::CollectorSpeedLimit g_span_sl;
     return is_upstream_traced ||
-        (FLAGS_enable_rpcz && bvar::is_collectable(&g_span_sl));
+        (FLAGS_enable_rpcz && (FLAGS_rpcz_tail_sampling ||
+                               bvar::is_collectable(&g_span_sl)));
 }
 
 } // namespace brpc
@@ -19,9 +19,11 @@
 
 // Date: Tue Jul 10 17:40:58 CST 2012
 
+#include <algorithm>                              // std::min, std::max
 #include <gflags/gflags.h>
 #include "butil/macros.h"                       // BAIDU_CASSERT
 #include "butil/logging.h"
+#include "butil/fast_rand.h"                    // fast_rand_less_than
 #include "bthread/task_group.h"                // TaskGroup
 #include "bthread/task_control.h"              // TaskControl
 #include "bthread/timer_thread.h"
@@ -145,6 +147,57 @@ start_from_non_worker(bthread_t* __restrict tid,
         tid, attr, fn, arg);
 }
 
+// Minimum number of bthreads pushed into one group by start_batch_from_non_worker
+// to make the locking of remote runqueues worthwhile.
+static const size_t MIN_BATCH_SIZE_PER_GROUP = 16;
+
+BUTIL_FORCE_INLINE int
+start_batch_from_non_worker(bthread_t* __restrict tids, size_t n,
+                            void* (* const* fns)(void*),
+                            void* const* args,
+                            const bthread_attr_t* __restrict attr) {
+    TaskControl* c = get_or_new_task_control();
+    if (NULL == c) {
+        return ENOMEM;
+    }
+    int nsignal = 0;
+    if (attr != NULL && (attr->flags & BTHREAD_NOSIGNAL)) {
+        // Insert into the same TaskGroup for bthread_flush(), see
+        // start_from_non_worker().
+        TaskGroup* g = tls_task_group_nosignal;
+        if (NULL == g) {
+            g = c->choose_one_group();
+            tls_task_group_nosignal = g;
+        }
+        return g->start_background_batch<true>(
+            tids, n, fns, args, attr, &nsignal);
+    }
+    // Spread bthreads over groups in round-robin so that the remote runqueue
+    // of one group is not overwhelmed.
+    const size_t ngroup = std::max(c->concurrency(), 1);
+    const size_t batch_size = std::max(MIN_BATCH_SIZE_PER_GROUP,
+                                       (n + ngroup - 1) / ngroup);
+    const size_t start_index = butil::fast_rand_less_than(ngroup);
+    int rc = 0;
+    int total_nsignal = 0;
+    for (size_t i = 0, j = 0; i < n; i += batch_size, ++j) {
+        const size_t size = std::min(batch_size, n - i);
+        const int rc2 = c->choose_group_at(start_index + j)->
+            start_background_batch<true>(tids + i, size, fns + i, args + i,
+                                         attr, &nsignal);
+        total_nsignal += nsignal;
+        if (rc2 != 0) {
+            rc = rc2;
+            for (size_t k = i + size; k < n; ++k) {
+                tids[k] = INVALID_BTHREAD;
+            }
+            break;
+        }
+    }
+    c->signal_task(total_nsignal, c->concurrency());
+    return rc;
+}
+
 struct TidTraits {
     static const size_t BLOCK_SIZE = 63;
     static const size_t MAX_ENTRIES = 65536;
@@ -193,6 +246,30 @@ int bthread_start_background(bthread_t* __restrict tid,
     return bthread::start_from_non_worker(tid, attr, fn, arg);
 }
 
+int bthread_start_batch(bthread_t* __restrict tids, size_t n,
+                        void* (* const* fns)(void*),
+                        void* const* args,
+                        const bthread_attr_t* __restrict attr) {
+    for (size_t i = 0; i < n; ++i) {
+        if (__builtin_expect(!fns[i], 0)) {
+            return EINVAL;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g) {
+        // start from worker
+        int nsignal = 0;
+        const int rc = g->start_background_batch<false>(
+            tids, n, fns, args, attr, &nsignal);
+        g->control()->signal_task(nsignal, g->control()->concurrency());
+        return rc;
+    }
+    return bthread::start_batch_from_non_worker(tids, n, fns, args, attr);
+}
+
 void bthread_flush() {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g) {
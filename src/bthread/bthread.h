@@ -55,6 +55,20 @@ extern int bthread_start_background(bthread_t* __restrict tid,
                                     void * (*fn)(void*),
                                     void* __restrict args);
 
+// Create `n' bthreads running `fns[i](args[i])' (0 <= i < n) with attributes
+// `attr' and put identifiers into `tids'. Behaves like calling
+// bthread_start_background() `n' times, but TaskMetas are allocated in one
+// go, the bthreads are pushed into runqueues in one go(spread over worker
+// groups in round-robin when called from non-worker pthreads) and workers
+// are woken up once according to `n', which is much cheaper for fan-outs.
+// Return 0 on success, errno otherwise. When errno is returned, some bthreads
+// may be created and running, identifiers of bthreads not created are set to
+// INVALID_BTHREAD.
+extern int bthread_start_batch(bthread_t* __restrict tids, size_t n,
+                               void* (* const* fns)(void*),
+                               void* const* args,
+                               const bthread_attr_t* __restrict attr);
+
 // Wake up operations blocking the thread. Different functions may behave
 // differently:
 //   bthread_usleep(): returns -1 and sets errno to ESTOP if bthread_stop()
@@ -633,6 +633,10 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     return rc;
 }
 
+// Defined in mutex.cpp
+size_t is_blocking_sampled();
+void submit_blocking(size_t sampling_range, int64_t start_ns);
+
 int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
     if (b->value.load(butil::memory_order_relaxed) != expected_value) {
@@ -673,11 +677,19 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     num_waiters << 1;
 #endif
 
+    // Ask the blocking profiler (if it's on) whether to sample this wait.
+    const size_t sampling_range = is_blocking_sampled();
+    const int64_t block_start_ns =
+        (sampling_range ? butil::cpuwide_time_ns() : 0);
+
     // release fence matches with acquire fence in interrupt_and_consume_waiters
     // in task_group.cpp to guarantee visibility of `interrupted'.
     bbw.task_meta->current_waiter.store(&bbw, butil::memory_order_release);
     g->set_remained(wait_for_butex, &bbw);
     TaskGroup::sched(&g);
+    if (sampling_range) {
+        submit_blocking(sampling_range, block_start_ns);
+    }
 
     // erase_from_butex_and_wakeup (called by TimerThread) is possibly still
     // running and using bbw. The chance is small, just spin until it's done.
@@ -0,0 +1,45 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+#include <errno.h>
+#include "bthread/task_group.h"
+#include "bthread/cpu_usage.h"
+
+namespace bthread {
+
+extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+
+int set_cpu_usage_counter(CpuUsageCounter* counter) {
+    TaskGroup* g = tls_task_group;
+    if (NULL == g || g->is_current_main_task()) {
+        return EPERM;
+    }
+    g->set_cpu_usage_counter(counter);
+    return 0;
+}
+
+CpuUsageCounter* get_cpu_usage_counter() {
+    TaskGroup* g = tls_task_group;
+    if (NULL == g) {
+        return NULL;
+    }
+    return g->current_task()->cpu_usage;
+}
+
+}  // namespace bthread
@@ -0,0 +1,114 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_CPU_USAGE_H
+#define BTHREAD_CPU_USAGE_H
+
+#include "butil/macros.h"                 // DISALLOW_COPY_AND_ASSIGN
+#include "butil/atomicops.h"              // butil::atomic
+#include "bvar/reducer.h"                 // bvar::Adder
+
+namespace bthread {
+
+// Accumulates cpu time of bthreads attributed to it. The time is measured
+// with cpuwide_time_ns() when bthreads are switched in and out by workers,
+// which is cheap and counts time spent in running the bthreads only, no
+// matter how many times they were suspended or which workers resumed them.
+// Time of bthreads running in pthreads other than workers is not counted.
+// Bthreads hold references to the counter, which is deleted when the
+// last reference is removed.
+class CpuUsageCounter {
+public:
+    // The creator holds the first reference.
+    CpuUsageCounter() : _nref(1) {}
+
+    void AddRef() { _nref.fetch_add(1, butil::memory_order_relaxed); }
+    void RemoveRef() {
+        if (_nref.fetch_sub(1, butil::memory_order_release) == 1) {
+            butil::atomic_thread_fence(butil::memory_order_acquire);
+            delete this;
+        }
+    }
+
+    // Accumulated cpu time in nanoseconds.
+    int64_t cputime_ns() const { return _cputime_ns.get_value(); }
+
+    // Called by workers. [Threadsafe]
+    void add_cputime_ns(int64_t ns) { _cputime_ns << ns; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CpuUsageCounter);
+    ~CpuUsageCounter() {}
+
+    butil::atomic<int> _nref;
+    bvar::Adder<int64_t> _cputime_ns;
+};
+
+// Remove the reference held by a smart pointer, e.g.
+//   std::unique_ptr<CpuUsageCounter, CpuUsageCounterDeref> counter;
+struct CpuUsageCounterDeref {
+    void operator()(CpuUsageCounter* counter) const {
+        counter->RemoveRef();
+    }
+};
+
+// Attribute cpu time of the calling bthread from now on to `counter',
+// NULL stops the attribution. Bthreads created by the calling bthread
+// afterwards are attributed to the same counter until they set their own.
+// Returns 0 on success, EPERM when the caller is not a bthread.
+int set_cpu_usage_counter(CpuUsageCounter* counter);
+
+// Get the counter that the calling bthread is attributed to, NULL when the
+// caller is not attributed or not a bthread. The returned pointer is valid
+// until the calling bthread sets another counter or quits.
+CpuUsageCounter* get_cpu_usage_counter();
+
+// Attribute the calling bthread to `counter' in the scope and restore the
+// previous attribution at the end of the scope. Nothing is changed when
+// `counter' is NULL.
+class ScopedCpuUsageAttribution {
+public:
+    explicit ScopedCpuUsageAttribution(CpuUsageCounter* counter)
+        : _counter(counter), _prev(NULL) {
+        if (_counter) {
+            _prev = get_cpu_usage_counter();
+            if (_prev) {
+                _prev->AddRef();
+            }
+            set_cpu_usage_counter(_counter);
+        }
+    }
+    ~ScopedCpuUsageAttribution() {
+        if (_counter) {
+            set_cpu_usage_counter(_prev);
+            if (_prev) {
+                _prev->RemoveRef();
+            }
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedCpuUsageAttribution);
+    CpuUsageCounter* _counter;
+    CpuUsageCounter* _prev;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_CPU_USAGE_H
@@ -380,6 +380,15 @@ inline bool TaskIteratorBase::should_break_for_high_priority_tasks() {
     return false;
 }
 
+inline bool TaskIteratorBase::should_break_for_batch_size() {
+    const int max_tasks = _q->_options.max_tasks_per_execute;
+    if (max_tasks > 0 && _num_iterated >= max_tasks) {
+        _should_break = true;
+        return true;
+    }
+    return false;
+}
+
 void TaskIteratorBase::operator++() {
     if (!(*this)) {
         return;
@@ -390,6 +399,10 @@ void TaskIteratorBase::operator++() {
     if (should_break_for_high_priority_tasks()) {
         return;
     }  // else the next high_priority_task would be delayed for at most one task
+    if (should_break_for_batch_size()) {
+        // Remaining tasks are iterated in next call to execute.
+        return;
+    }
 
     while (_cur_node && !_cur_node->stop_task) {
         if (_high_priority == _cur_node->high_priority) {
@@ -62,6 +62,7 @@ protected:
 private:
     int num_iterated() const { return _num_iterated; }
     bool should_break_for_high_priority_tasks();
+    bool should_break_for_batch_size();
 
     TaskNode*               _cur_node;
     TaskNode*               _head;
@@ -149,6 +150,13 @@ struct ExecutionQueueOptions {
     // Note that TaskOptions.in_place_if_possible = false will not work, if implementation of
     // Executor is in-place(synchronous).
     Executor * executor;
+
+    // Max number of tasks iterated in one call to |execute|, remaining tasks
+    // are passed to following calls. Smaller batches make |execute| return
+    // more often, which is useful when the executor is shared with other
+    // work(e.g. ExecutionQueues in ShardedExecutionQueue). 0 means unlimited.
+    // default: 0
+    int max_tasks_per_execute;
 };
 
 // Start an ExecutionQueue. If |options| is NULL, the queue will be created with
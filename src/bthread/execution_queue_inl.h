@@ -331,6 +331,7 @@ public:
 
 inline ExecutionQueueOptions::ExecutionQueueOptions()
     : bthread_attr(BTHREAD_ATTR_NORMAL), executor(NULL)
+    , max_tasks_per_execute(0)
 {}
 
 template <typename T>
@@ -54,6 +54,8 @@ const int ALLOW_UNUSED dummy_bt = backtrace(dummy_buf, arraysize(dummy_buf));
 
 // For controlling contentions collected per second.
 static bvar::CollectorSpeedLimit g_cp_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
+// For controlling blockings of bthreads collected per second.
+static bvar::CollectorSpeedLimit g_bp_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
 
 const size_t MAX_CACHED_CONTENTIONS = 512;
 // Skip frames which are always same: the unlock function and submit_contention()
@@ -65,12 +67,15 @@ struct SampledContention : public bvar::Collected {
     // number of samples, normalized according to to sampling_range
     double count;
     int nframes;          // #elements in stack
+    bool blocking;        // collected by blocking profiler.
     void* stack[26];      // backtrace.
 
     // Implement bvar::Collected
     void dump_and_destroy(size_t round) override;
     void destroy() override;
-    bvar::CollectorSpeedLimit* speed_limit() override { return &g_cp_sl; }
+    bvar::CollectorSpeedLimit* speed_limit() override {
+        return blocking ? &g_bp_sl : &g_cp_sl;
+    }
 
     // For combining samples with hashmap.
     size_t hash_code() const {
@@ -257,7 +262,10 @@ BAIDU_CACHELINE_ALIGNMENT static ContentionProfiler* g_cp = NULL;
 // Need this version to solve an issue that non-empty entries left by
 // previous contention profilers should be detected and overwritten.
 static uint64_t g_cp_version = 0;
-// Protecting accesss to g_cp.
+// Same as g_cp, but for the profiler of blocking bthreads, whose results
+// are in the same format as contentions.
+BAIDU_CACHELINE_ALIGNMENT static ContentionProfiler* g_bp = NULL;
+// Protecting accesss to g_cp and g_bp.
 static pthread_mutex_t g_cp_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // The map storing information for profiling pthread_mutex. Different from
@@ -280,13 +288,14 @@ struct BAIDU_CACHELINE_ALIGNMENT MutexMapEntry {
 static MutexMapEntry g_mutex_map[MUTEX_MAP_SIZE] = {}; // zero-initialize
 
 void SampledContention::dump_and_destroy(size_t /*round*/) {
-    if (g_cp) {
+    ContentionProfiler** const pctx = (blocking ? &g_bp : &g_cp);
+    if (*pctx) {
         // Must be protected with mutex to avoid race with deletion of ctx.
         // dump_and_destroy is called from dumping thread only so this mutex
         // is not contended at most of time.
         BAIDU_SCOPED_LOCK(g_cp_mutex);
-        if (g_cp) {
-            g_cp->dump_and_destroy(this);
+        if (*pctx) {
+            (*pctx)->dump_and_destroy(this);
             return;
         }
     }
@@ -354,6 +363,45 @@ void ContentionProfilerStop() {
     LOG(ERROR) << "Contention profiler is not started!";
 }
 
+// Start profiling blocking of bthreads.
+bool BlockingProfilerStart(const char* filename) {
+    if (filename == NULL) {
+        LOG(ERROR) << "Parameter [filename] is NULL";
+        return false;
+    }
+    if (g_bp) {
+        return false;
+    }
+    static bvar::DisplaySamplingRatio g_sampling_ratio_var(
+        "blocking_profiler_sampling_ratio", &g_bp_sl);
+
+    std::unique_ptr<ContentionProfiler> ctx(new ContentionProfiler(filename));
+    {
+        BAIDU_SCOPED_LOCK(g_cp_mutex);
+        if (g_bp) {
+            return false;
+        }
+        g_bp = ctx.release();
+    }
+    return true;
+}
+
+// Stop blocking profiler.
+void BlockingProfilerStop() {
+    ContentionProfiler* ctx = NULL;
+    {
+        BAIDU_SCOPED_LOCK(g_cp_mutex);
+        ctx = g_bp;
+        g_bp = NULL;
+    }
+    if (ctx == NULL) {
+        LOG(ERROR) << "Blocking profiler is not started!";
+        return;
+    }
+    ctx->init_if_needed();
+    delete ctx;
+}
+
 BUTIL_FORCE_INLINE bool
 is_contention_site_valid(const bthread_contention_site_t& cs) {
     return cs.sampling_range;
@@ -519,6 +567,30 @@ void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns) {
     sc->duration_ns = csite.duration_ns * bvar::COLLECTOR_SAMPLING_BASE
         / csite.sampling_range;
     sc->count = bvar::COLLECTOR_SAMPLING_BASE / (double)csite.sampling_range;
+    sc->blocking = false;
+    sc->nframes = backtrace(sc->stack, arraysize(sc->stack)); // may lock
+    sc->submit(now_ns / 1000);  // may lock
+    tls_inside_lock = false;
+}
+
+// Called before a bthread blocks. Returns non-zero sampling range if the
+// blocking should be submitted by submit_blocking() after waking up.
+size_t is_blocking_sampled() {
+    return g_bp ? bvar::is_collectable(&g_bp_sl) : 0;
+}
+
+// Submit the blocking started at `start_ns' along with the stacktrace.
+// Stack of the bthread does not change during blocking, capturing it after
+// waking up is same as before blocking, and does not sample blockings that
+// are never woken up.
+void submit_blocking(size_t sampling_range, int64_t start_ns) {
+    const int64_t now_ns = butil::cpuwide_time_ns();
+    tls_inside_lock = true;
+    SampledContention* sc = butil::get_object<SampledContention>();
+    sc->duration_ns = (now_ns - start_ns) * bvar::COLLECTOR_SAMPLING_BASE
+        / sampling_range;
+    sc->count = bvar::COLLECTOR_SAMPLING_BASE / (double)sampling_range;
+    sc->blocking = true;
     sc->nframes = backtrace(sc->stack, arraysize(sc->stack)); // may lock
     sc->submit(now_ns / 1000);  // may lock
     tls_inside_lock = false;
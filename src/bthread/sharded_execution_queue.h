@@ -0,0 +1,314 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+#ifndef  BTHREAD_SHARDED_EXECUTION_QUEUE_H
+#define  BTHREAD_SHARDED_EXECUTION_QUEUE_H
+
+#include <errno.h>                         // EINVAL, ENOMEM
+#include <algorithm>                       // std::max
+#include <new>                             // std::nothrow
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
+#include "bthread/execution_queue.h"
+
+namespace bthread {
+
+// ShardedExecutionQueue hashes tasks by keys onto N ExecutionQueues: tasks
+// with the same key are executed in the order of submissions(same with one
+// ExecutionQueue) while tasks with different keys may run in parallel. It
+// replaces hand-written arrays of ExecutionQueues for per-session state
+// machines or per-partition write paths.
+//
+// |execute| is called on each shard in the same way as ExecutionQueue, except
+// that the call with TaskIterator::is_queue_stopped() being true happens
+// exactly once after all shards are stopped and all pending tasks are
+// executed, after which it's ok to release resources referenced by |meta|.
+//
+// Example:
+//   int execute(void* meta, bthread::TaskIterator<Request>& iter) {
+//       if (iter.is_queue_stopped()) {
+//           // destroy meta and related resources
+//           return 0;
+//       }
+//       for (; iter; ++iter) {
+//           // handle *iter, requests of one session are in order.
+//       }
+//       return 0;
+//   }
+//
+//   bthread::ShardedExecutionQueue<Request> q;
+//   q.start(8, NULL, execute, meta);
+//   q.execute(request.session_id, request);
+//   ...
+//   q.stop();
+//   q.join();
+template <typename T>
+class ShardedExecutionQueue {
+public:
+    typedef int (*execute_func_t)(void* meta, TaskIterator<T>& iter);
+
+    ShardedExecutionQueue();
+    // Stop and join the queue if it's still running.
+    ~ShardedExecutionQueue();
+
+    // Start `nshard' ExecutionQueues with `options'. Set
+    // ExecutionQueueOptions::max_tasks_per_execute to bound number of tasks
+    // handled in one call to |execute|. On failure, shards already started
+    // are stopped without calling |execute| and start() can be called again.
+    // Returns 0 on success, errno otherwise.
+    int start(size_t nshard, const ExecutionQueueOptions* options,
+              execute_func_t execute, void* meta);
+
+    // Execute `task' in the shard chosen by `key'. Tasks with the same key
+    // are executed in order. Thread-safe and wait-free.
+    // Returns 0 on success, errno otherwise.
+    int execute(uint64_t key, typename butil::add_const_reference<T>::type task,
+                const TaskOptions* options = NULL, TaskHandle* handle = NULL);
+    int execute(uint64_t key, T&& task,
+                const TaskOptions* options = NULL, TaskHandle* handle = NULL);
+
+    // Stop all shards, following execute() fail immediately. Thread-safe,
+    // calls after the first one do nothing.
+    // Returns 0 on success, errno otherwise.
+    int stop();
+
+    // Wait until all shards are stopped and |execute| has been called with
+    // the stopped iterator. Thread-safe and can be called more than once.
+    // Returns 0 on success, errno otherwise.
+    int join();
+
+    size_t shard_count() const { return _shards.size(); }
+
+    // Index of the shard that tasks of `key' go to.
+    size_t shard_of(uint64_t key) const
+    { return butil::fmix64(key) % _shards.size(); }
+
+    // Number of tasks successfully submitted to each shard since start().
+    // Used for telling whether keys are balanced over shards: since keys are
+    // bound to shards to keep ordering, rebalancing is done by changing the
+    // number of shards or the keys.
+    void get_shard_task_counts(std::vector<int64_t>* counts) const;
+
+    // max(count) / avg(count) of get_shard_task_counts(), 1 is perfectly
+    // balanced. Returns 0 when no tasks were submitted.
+    double imbalance() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ShardedExecutionQueue);
+
+    struct BAIDU_CACHELINE_ALIGNMENT Shard {
+        ExecutionQueueId<T> id;
+        ShardedExecutionQueue* owner;
+        butil::atomic<int64_t> ntask;
+    };
+
+    static int execute_shard(void* meta, TaskIterator<T>& iter);
+    // Stop, join and remove shards started by a failed start().
+    void rollback();
+
+    std::vector<Shard*> _shards;
+    execute_func_t _execute;
+    void* _meta;
+    // Number of shards whose stop task is not executed yet.
+    butil::atomic<int> _nrunning;
+    // Shards are being stopped by rollback(), don't tell user.
+    butil::atomic<bool> _rollingback;
+    butil::atomic<bool> _stopped;
+    butil::atomic<bool> _joined;
+};
+
+template <typename T>
+ShardedExecutionQueue<T>::ShardedExecutionQueue()
+    : _execute(NULL)
+    , _meta(NULL)
+    , _nrunning(0)
+    , _rollingback(false)
+    , _stopped(false)
+    , _joined(false) {}
+
+template <typename T>
+ShardedExecutionQueue<T>::~ShardedExecutionQueue() {
+    if (!_shards.empty()) {
+        stop();
+        join();
+    }
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        delete _shards[i];
+    }
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::start(size_t nshard,
+                                    const ExecutionQueueOptions* options,
+                                    execute_func_t execute, void* meta) {
+    if (nshard == 0 || execute == NULL) {
+        return EINVAL;
+    }
+    if (!_shards.empty()) {
+        // Already started.
+        return EINVAL;
+    }
+    _execute = execute;
+    _meta = meta;
+    _shards.reserve(nshard);
+    for (size_t i = 0; i < nshard; ++i) {
+        Shard* s = new (std::nothrow) Shard;
+        if (s == NULL) {
+            rollback();
+            return ENOMEM;
+        }
+        s->owner = this;
+        s->ntask.store(0, butil::memory_order_relaxed);
+        const int rc = execution_queue_start(&s->id, options, execute_shard, s);
+        if (rc != 0) {
+            delete s;
+            rollback();
+            return rc;
+        }
+        _shards.push_back(s);
+        _nrunning.fetch_add(1, butil::memory_order_relaxed);
+    }
+    return 0;
+}
+
+template <typename T>
+void ShardedExecutionQueue<T>::rollback() {
+    // No task was submitted, user should see nothing started.
+    _rollingback.store(true, butil::memory_order_relaxed);
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        execution_queue_stop(_shards[i]->id);
+    }
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        execution_queue_join(_shards[i]->id);
+        delete _shards[i];
+    }
+    _shards.clear();
+    _rollingback.store(false, butil::memory_order_relaxed);
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::execute_shard(void* meta, TaskIterator<T>& iter) {
+    Shard* s = static_cast<Shard*>(meta);
+    ShardedExecutionQueue* q = s->owner;
+    if (iter.is_queue_stopped()) {
+        // Only the last stopped shard tells user.
+        if (q->_nrunning.fetch_sub(1, butil::memory_order_acq_rel) == 1 &&
+            !q->_rollingback.load(butil::memory_order_relaxed)) {
+            return q->_execute(q->_meta, iter);
+        }
+        return 0;
+    }
+    return q->_execute(q->_meta, iter);
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::execute(
+    uint64_t key, typename butil::add_const_reference<T>::type task,
+    const TaskOptions* options, TaskHandle* handle) {
+    if (_shards.empty()) {
+        return EINVAL;
+    }
+    Shard* s = _shards[shard_of(key)];
+    const int rc = execution_queue_execute(s->id, task, options, handle);
+    if (rc == 0) {
+        s->ntask.fetch_add(1, butil::memory_order_relaxed);
+    }
+    return rc;
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::execute(uint64_t key, T&& task,
+                                      const TaskOptions* options,
+                                      TaskHandle* handle) {
+    if (_shards.empty()) {
+        return EINVAL;
+    }
+    Shard* s = _shards[shard_of(key)];
+    const int rc = execution_queue_execute(s->id, std::forward<T>(task),
+                                           options, handle);
+    if (rc == 0) {
+        s->ntask.fetch_add(1, butil::memory_order_relaxed);
+    }
+    return rc;
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::stop() {
+    if (_stopped.exchange(true, butil::memory_order_relaxed)) {
+        return 0;
+    }
+    int rc = 0;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        const int rc2 = execution_queue_stop(_shards[i]->id);
+        if (rc2 != 0) {
+            rc = rc2;
+        }
+    }
+    return rc;
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::join() {
+    if (_joined.load(butil::memory_order_acquire)) {
+        return 0;
+    }
+    // Concurrent joins are fine since execution_queue_join() waits for the
+    // same stopped queue until it's joined.
+    int rc = 0;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        const int rc2 = execution_queue_join(_shards[i]->id);
+        if (rc2 != 0) {
+            rc = rc2;
+        }
+    }
+    if (rc == 0) {
+        _joined.store(true, butil::memory_order_release);
+    }
+    return rc;
+}
+
+template <typename T>
+void ShardedExecutionQueue<T>::get_shard_task_counts(
+    std::vector<int64_t>* counts) const {
+    counts->resize(_shards.size());
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        (*counts)[i] = _shards[i]->ntask.load(butil::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+double ShardedExecutionQueue<T>::imbalance() const {
+    int64_t sum = 0;
+    int64_t max_count = 0;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        const int64_t n = _shards[i]->ntask.load(butil::memory_order_relaxed);
+        sum += n;
+        max_count = std::max(max_count, n);
+    }
+    if (sum == 0) {
+        return 0;
+    }
+    return (double)max_count * _shards.size() / sum;
+}
+
+}  // namespace bthread
+
+#endif  // BTHREAD_SHARDED_EXECUTION_QUEUE_H
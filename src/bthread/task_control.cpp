@@ -225,6 +225,15 @@ TaskGroup* TaskControl::choose_one_group() {
     return NULL;
 }
 
+TaskGroup* TaskControl::choose_group_at(size_t index) {
+    const size_t ngroup = _ngroup.load(butil::memory_order_acquire);
+    if (ngroup != 0) {
+        return _groups[index % ngroup];
+    }
+    CHECK(false) << "Impossible: ngroup is 0";
+    return NULL;
+}
+
 extern int stop_and_join_epoll_threads();
 
 void TaskControl::stop_and_join() {
@@ -367,7 +376,7 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     return stolen;
 }
 
-void TaskControl::signal_task(int num_task) {
+void TaskControl::signal_task(int num_task, int max_signal) {
     if (num_task <= 0) {
         return;
     }
@@ -375,17 +384,21 @@ void TaskControl::signal_task(int num_task) {
     // be created to match caller's requests. But in another side, there's also
     // many useless signalings according to current impl. Capping the concurrency
     // is a good balance between performance and timeliness of scheduling.
-    if (num_task > 2) {
-        num_task = 2;
+    if (num_task > max_signal) {
+        num_task = max_signal;
     }
+    // Spread wakeups over parking lots, one per lot unless a batch of tasks
+    // is signalled.
+    const int nsignal_per_lot = (num_task + PARKING_LOT_NUM - 1) / PARKING_LOT_NUM;
     int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM;
-    num_task -= _pl[start_index].signal(1);
+    num_task -= _pl[start_index].signal(nsignal_per_lot);
     if (num_task > 0) {
         for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
             if (++start_index >= PARKING_LOT_NUM) {
                 start_index = 0;
             }
-            num_task -= _pl[start_index].signal(1);
+            num_task -= _pl[start_index].signal(
+                std::min(num_task, nsignal_per_lot));
         }
     }
     if (num_task > 0 &&
@@ -54,8 +54,9 @@ public:
     // Steal a task from a "random" group.
     bool steal_task(bthread_t* tid, size_t* seed, size_t offset);
 
-    // Tell other groups that `n' tasks was just added to caller's runqueue
-    void signal_task(int num_task);
+    // Tell other groups that `n' tasks was just added to caller's runqueue.
+    // At most `max_signal' workers are woken up.
+    void signal_task(int num_task, int max_signal = 2);
 
     // Stop and join worker threads in TaskControl.
     void stop_and_join();
@@ -78,6 +79,11 @@ public:
     // If this method is called after init(), it never returns NULL.
     TaskGroup* choose_one_group();
 
+    // Choose the TaskGroup at `index' modulo number of groups, for spreading
+    // tasks over groups in round-robin order.
+    // If this method is called after init(), it never returns NULL.
+    TaskGroup* choose_group_at(size_t index);
+
 private:
     // Add/Remove a TaskGroup.
     // Returns 0 on success, -1 otherwise.
@@ -34,6 +34,7 @@
 #include "bthread/processor.h"              // cpu_relax
 #include "bthread/task_control.h"
 #include "bthread/task_group.h"
+#include "bthread/cpu_usage.h"
 #include "bthread/timer_thread.h"
 #include "bthread/errno.h"
 
@@ -181,6 +182,7 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _nsignaled(0)
     , _last_run_ns(butil::cpuwide_time_ns())
     , _cumulated_cputime_ns(0)
+    , _last_cpu_usage_ns(_last_run_ns)
     , _nswitch(0)
     , _last_context_remained(NULL)
     , _last_context_remained_arg(NULL)
@@ -237,6 +239,7 @@ int TaskGroup::init(size_t runqueue_capacity) {
     m->local_storage = LOCAL_STORAGE_INIT;
     m->cpuwide_start_ns = butil::cpuwide_time_ns();
     m->stat = EMPTY_STAT;
+    m->cpu_usage = NULL;
     m->attr = BTHREAD_ATTR_TASKGROUP;
     m->tid = make_tid(*m->version_butex, slot);
     m->set_stack(stk);
@@ -245,6 +248,7 @@ int TaskGroup::init(size_t runqueue_capacity) {
     _main_tid = m->tid;
     _main_stack = stk;
     _last_run_ns = butil::cpuwide_time_ns();
+    _last_cpu_usage_ns = _last_run_ns;
     return 0;
 }
 
@@ -346,6 +350,11 @@ void TaskGroup::task_runner(intptr_t skip_remained) {
 
 void TaskGroup::_release_last_context(void* arg) {
     TaskMeta* m = static_cast<TaskMeta*>(arg);
+    // Cpu time of the task was counted in sched_to().
+    if (m->cpu_usage) {
+        m->cpu_usage->RemoveRef();
+        m->cpu_usage = NULL;
+    }
     if (m->stack_type() != STACK_TYPE_PTHREAD) {
         return_stack(m->release_stack()/*may be NULL*/);
     } else {
@@ -355,21 +364,29 @@ void TaskGroup::_release_last_context(void* arg) {
     return_resource(get_slot(m->tid));
 }
 
-int TaskGroup::start_foreground(TaskGroup** pg,
-                                bthread_t* __restrict th,
-                                const bthread_attr_t* __restrict attr,
-                                void * (*fn)(void*),
-                                void* __restrict arg) {
-    if (__builtin_expect(!fn, 0)) {
-        return EINVAL;
+void TaskGroup::set_cpu_usage_counter(CpuUsageCounter* counter) {
+    TaskMeta* const m = _cur_meta;
+    if (counter == m->cpu_usage) {
+        return;
     }
-    const int64_t start_ns = butil::cpuwide_time_ns();
-    const bthread_attr_t using_attr = (attr ? *attr : BTHREAD_ATTR_NORMAL);
-    butil::ResourceId<TaskMeta> slot;
-    TaskMeta* m = butil::get_resource(&slot);
-    if (__builtin_expect(!m, 0)) {
-        return ENOMEM;
+    const int64_t now = butil::cpuwide_time_ns();
+    if (m->cpu_usage) {
+        m->cpu_usage->add_cputime_ns(now - _last_cpu_usage_ns);
+        m->cpu_usage->RemoveRef();
     }
+    _last_cpu_usage_ns = now;
+    if (counter) {
+        counter->AddRef();
+    }
+    m->cpu_usage = counter;
+}
+
+// Initialize `m' got from the resource pool at `slot' to run fn(arg).
+// `cpu_usage' is the counter inherited from the creating bthread.
+static void init_task_meta(TaskMeta* m, butil::ResourceId<TaskMeta> slot,
+                           void* (*fn)(void*), void* arg,
+                           const bthread_attr_t& attr, int64_t start_ns,
+                           CpuUsageCounter* cpu_usage) {
     CHECK(m->current_waiter.load(butil::memory_order_relaxed) == NULL);
     m->stop = false;
     m->interrupted = false;
@@ -377,20 +394,43 @@ int TaskGroup::start_foreground(TaskGroup** pg,
     m->fn = fn;
     m->arg = arg;
     CHECK(m->stack == NULL);
-    m->attr = using_attr;
+    m->attr = attr;
     m->local_storage = LOCAL_STORAGE_INIT;
-    if (using_attr.flags & BTHREAD_INHERIT_SPAN) {
+    if (attr.flags & BTHREAD_INHERIT_SPAN) {
         m->local_storage.rpcz_parent_span = tls_bls.rpcz_parent_span;
     }
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
+    m->cpu_usage = cpu_usage;
+    if (m->cpu_usage) {
+        m->cpu_usage->AddRef();
+    }
     m->tid = make_tid(*m->version_butex, slot);
-    *th = m->tid;
-    if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
+    if (attr.flags & BTHREAD_LOG_START_AND_FINISH) {
         LOG(INFO) << "Started bthread " << m->tid;
     }
+}
 
+int TaskGroup::start_foreground(TaskGroup** pg,
+                                bthread_t* __restrict th,
+                                const bthread_attr_t* __restrict attr,
+                                void * (*fn)(void*),
+                                void* __restrict arg) {
+    if (__builtin_expect(!fn, 0)) {
+        return EINVAL;
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const bthread_attr_t using_attr = (attr ? *attr : BTHREAD_ATTR_NORMAL);
+    butil::ResourceId<TaskMeta> slot;
+    TaskMeta* m = butil::get_resource(&slot);
+    if (__builtin_expect(!m, 0)) {
+        return ENOMEM;
+    }
     TaskGroup* g = *pg;
+    init_task_meta(m, slot, fn, arg, using_attr, start_ns,
+                   g->_cur_meta->cpu_usage);
+    *th = m->tid;
+
     g->_control->_nbthreads << 1;
     if (g->is_current_pthread_task()) {
         // never create foreground task in pthread.
@@ -428,25 +468,10 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     if (__builtin_expect(!m, 0)) {
         return ENOMEM;
     }
-    CHECK(m->current_waiter.load(butil::memory_order_relaxed) == NULL);
-    m->stop = false;
-    m->interrupted = false;
-    m->about_to_quit = false;
-    m->fn = fn;
-    m->arg = arg;
-    CHECK(m->stack == NULL);
-    m->attr = using_attr;
-    m->local_storage = LOCAL_STORAGE_INIT;
-    if (using_attr.flags & BTHREAD_INHERIT_SPAN) {
-        m->local_storage.rpcz_parent_span = tls_bls.rpcz_parent_span;
-    }
-    m->cpuwide_start_ns = start_ns;
-    m->stat = EMPTY_STAT;
-    m->tid = make_tid(*m->version_butex, slot);
+    // Remote callers are not bthreads.
+    init_task_meta(m, slot, fn, arg, using_attr, start_ns,
+                   REMOTE ? NULL : _cur_meta->cpu_usage);
     *th = m->tid;
-    if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
-        LOG(INFO) << "Started bthread " << m->tid;
-    }
     _control->_nbthreads << 1;
     if (REMOTE) {
         ready_to_run_remote(m->tid, (using_attr.flags & BTHREAD_NOSIGNAL));
@@ -456,8 +481,84 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     return 0;
 }
 
+template <bool REMOTE>
+int TaskGroup::start_background_batch(bthread_t* __restrict tids, size_t n,
+                                      void* (* const* fns)(void*),
+                                      void* const* args,
+                                      const bthread_attr_t* __restrict attr,
+                                      int* nsignal) {
+    *nsignal = 0;
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const bthread_attr_t using_attr = (attr ? *attr : BTHREAD_ATTR_NORMAL);
+    int rc = 0;
+    size_t ncreated = 0;
+    for (; ncreated < n; ++ncreated) {
+        butil::ResourceId<TaskMeta> slot;
+        TaskMeta* m = butil::get_resource(&slot);
+        if (__builtin_expect(!m, 0)) {
+            rc = ENOMEM;
+            break;
+        }
+        init_task_meta(m, slot, fns[ncreated], args[ncreated], using_attr,
+                       start_ns, REMOTE ? NULL : _cur_meta->cpu_usage);
+        tids[ncreated] = m->tid;
+    }
+    for (size_t i = ncreated; i < n; ++i) {
+        tids[i] = INVALID_BTHREAD;
+    }
+    if (ncreated == 0) {
+        return rc;
+    }
+    _control->_nbthreads << ncreated;
+    const bool nosignal = (using_attr.flags & BTHREAD_NOSIGNAL);
+    if (REMOTE) {
+        _remote_rq._mutex.lock();
+        for (size_t i = 0; i < ncreated; ++i) {
+            while (!_remote_rq.push_locked(tids[i])) {
+                flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
+                LOG_EVERY_SECOND(ERROR) << "_remote_rq is full, capacity="
+                                        << _remote_rq.capacity();
+                ::usleep(1000);
+                _remote_rq._mutex.lock();
+            }
+        }
+        if (nosignal) {
+            _remote_num_nosignal += ncreated;
+        } else {
+            *nsignal = ncreated + _remote_num_nosignal;
+            _remote_num_nosignal = 0;
+            _remote_nsignaled += *nsignal;
+        }
+        _remote_rq._mutex.unlock();
+    } else {
+        for (size_t i = 0; i < ncreated; ++i) {
+            push_rq(tids[i]);
+        }
+        if (nosignal) {
+            _num_nosignal += ncreated;
+        } else {
+            *nsignal = ncreated + _num_nosignal;
+            _num_nosignal = 0;
+            _nsignaled += *nsignal;
+        }
+    }
+    return rc;
+}
+
 // Explicit instantiations.
 template int
+TaskGroup::start_background_batch<true>(bthread_t* __restrict tids, size_t n,
+                                        void* (* const* fns)(void*),
+                                        void* const* args,
+                                        const bthread_attr_t* __restrict attr,
+                                        int* nsignal);
+template int
+TaskGroup::start_background_batch<false>(bthread_t* __restrict tids, size_t n,
+                                         void* (* const* fns)(void*),
+                                         void* const* args,
+                                         const bthread_attr_t* __restrict attr,
+                                         int* nsignal);
+template int
 TaskGroup::start_background<true>(bthread_t* __restrict th,
                                   const bthread_attr_t* __restrict attr,
                                   void * (*fn)(void*),
@@ -587,6 +688,10 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta) {
     if (cur_meta->tid != g->main_tid()) {
         g->_cumulated_cputime_ns += elp_ns;
     }
+    if (cur_meta->cpu_usage) {
+        cur_meta->cpu_usage->add_cputime_ns(now - g->_last_cpu_usage_ns);
+    }
+    g->_last_cpu_usage_ns = now;
     ++cur_meta->stat.nswitch;
     ++ g->_nswitch;
     // Switch to the task
@@ -783,6 +888,10 @@ void TaskGroup::_add_sleep_event(void* void_args) {
     }
 }
 
+// Defined in mutex.cpp
+size_t is_blocking_sampled();
+void submit_blocking(size_t sampling_range, int64_t start_ns);
+
 // To be consistent with sys_usleep, set errno and return -1 on error.
 int TaskGroup::usleep(TaskGroup** pg, uint64_t timeout_us) {
     if (0 == timeout_us) {
@@ -793,9 +902,15 @@ int TaskGroup::usleep(TaskGroup** pg, uint64_t timeout_us) {
     // We have to schedule timer after we switched to next bthread otherwise
     // the timer may wake up(jump to) current still-running context.
     SleepArgs e = { timeout_us, g->current_tid(), g->current_task(), g };
+    const size_t sampling_range = is_blocking_sampled();
+    const int64_t sleep_start_ns =
+        (sampling_range ? butil::cpuwide_time_ns() : 0);
     g->set_remained(_add_sleep_event, &e);
     sched(pg);
     g = *pg;
+    if (sampling_range) {
+        submit_blocking(sampling_range, sleep_start_ns);
+    }
     e.meta->current_sleep = 0;
     if (e.meta->interrupted) {
         // Race with set and may consume multiple interruptions, which are OK.
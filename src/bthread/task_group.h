@@ -74,6 +74,23 @@ public:
                          void * (*fn)(void*),
                          void* __restrict arg);
 
+    // Create tasks `fns[i](args[i])' (0 <= i < n) with attributes `attr' in
+    // this TaskGroup and put identifiers into `tids'. Tasks are pushed into
+    // the runqueue in one go and nothing is signalled. Unless BTHREAD_NOSIGNAL
+    // is set, number of tasks to signal(including pending NOSIGNAL tasks) is
+    // written into `*nsignal', caller shall pass the sum of them to
+    // TaskControl::signal_task() so that workers are woken up only once.
+    //   Called from worker: start_background_batch<false>
+    //   Called from non-worker: start_background_batch<true>
+    // Return 0 on success, errno otherwise. Identifiers of tasks not created
+    // are set to INVALID_BTHREAD.
+    template <bool REMOTE>
+    int start_background_batch(bthread_t* __restrict tids, size_t n,
+                               void* (* const* fns)(void*),
+                               void* const* args,
+                               const bthread_attr_t* __restrict attr,
+                               int* nsignal);
+
     // Suspend caller and run next bthread in TaskGroup *pg.
     static void sched(TaskGroup** pg);
     static void ending_sched(TaskGroup** pg);
@@ -150,6 +167,9 @@ public:
     // Active time in nanoseconds spent by this TaskGroup.
     int64_t cumulated_cputime_ns() const { return _cumulated_cputime_ns; }
 
+    // Attribute cpu time of current task from now on to `counter'.
+    void set_cpu_usage_counter(CpuUsageCounter* counter);
+
     // Push a bthread into the runqueue
     void ready_to_run(bthread_t tid, bool nosignal = false);
     // Flush tasks pushed to rq but signalled.
@@ -230,6 +250,9 @@ friend class TaskControl;
     // last scheduling time
     int64_t _last_run_ns;
     int64_t _cumulated_cputime_ns;
+    // last time that cpu time of current task is counted into its
+    // CpuUsageCounter.
+    int64_t _last_cpu_usage_ns;
 
     size_t _nswitch;
     RemainedFn _last_context_remained;
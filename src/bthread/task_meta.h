@@ -37,6 +37,7 @@ struct TaskStatistics {
 
 class KeyTable;
 struct ButexWaiter;
+class CpuUsageCounter;
 
 struct LocalStorage {
     KeyTable* keytable;
@@ -86,6 +87,10 @@ struct TaskMeta {
     int64_t cpuwide_start_ns;
     TaskStatistics stat;
 
+    // Counter of cpu time that this task is attributed to, a reference is
+    // held by the task.
+    CpuUsageCounter* cpu_usage;
+
     // bthread local storage, sync with tls_bls (defined in task_group.cpp)
     // when the bthread is created or destroyed.
     // DO NOT use this field directly, use tls_bls instead.
@@ -97,7 +102,8 @@ public:
     TaskMeta()
         : current_waiter(NULL)
         , current_sleep(0)
-        , stack(NULL) {
+        , stack(NULL)
+        , cpu_usage(NULL) {
         pthread_spin_init(&version_lock, 0);
         version_butex = butex_create_checked<uint32_t>();
         *version_butex = 1;
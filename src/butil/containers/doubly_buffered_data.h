@@ -23,6 +23,8 @@
 #include <deque>
 #include <vector>                                       // std::vector
 #include <pthread.h>
+#include <sched.h>                                      // sched_yield
+#include <unistd.h>                                     // usleep
 #include "butil/scoped_lock.h"
 #include "butil/thread_local.h"
 #include "butil/logging.h"
@@ -76,9 +78,32 @@ namespace butil {
 // until thread-local reference counts which be protected by a thread-local
 // mutex become 0 to make sure all existing Read() finish and later Read()
 // see new foreground, then modify background(foreground before flip) again.
+//
+// --- `DOUBLY_BUFFERED_DATA_EPOCH' mode ---
+// Selected by passing DOUBLY_BUFFERED_DATA_EPOCH to the constructor. Modify()
+// of the mutex-based modes locks the mutex of every reading thread one by one,
+// which takes milliseconds when there're thousands of threads.
+//
+// Read(): Increment the thread-local atomic reference count of the foreground
+// instance without any lock. If the foreground was flipped concurrently,
+// undo and retry. Bthreads are allowed to be suspended while reading.
+//
+// Modify(): Modify background instance, flip foreground and background, then
+// wait until reference counts of the old foreground instance in all threads
+// become 0, namely a grace period in which all reads started before the flip
+// finish. Readers are never blocked by Modify() and Modify() only waits for
+// reads in progress instead of locking every thread, then modify background
+// again.
 
 class Void { };
 
+enum DoublyBufferedDataMode {
+    // Readers lock thread-local mutexes, see comments above.
+    DOUBLY_BUFFERED_DATA_MUTEX = 0,
+    // Readers publish thread-local reference counts lock-freely.
+    DOUBLY_BUFFERED_DATA_EPOCH = 1,
+};
+
 template <typename T> struct IsVoid : false_type { };
 template <> struct IsVoid<Void> : true_type { };
 
@@ -91,10 +116,12 @@ public:
     class ScopedPtr {
     friend class DoublyBufferedData;
     public:
-        ScopedPtr() : _data(NULL), _index(0), _w(NULL) {}
+        ScopedPtr() : _data(NULL), _index(0), _epoch(false), _w(NULL) {}
         ~ScopedPtr() {
             if (_w) {
-                if (AllowBthreadSuspended) {
+                if (_epoch) {
+                    _w->EndEpochRead(_index);
+                } else if (AllowBthreadSuspended) {
                     _w->EndRead(_index);
                 } else {
                     _w->EndRead();
@@ -111,12 +138,17 @@ public:
         const T* _data;
         // Index of foreground instance used by ScopedPtr.
         int _index;
+        // Read() in `DOUBLY_BUFFERED_DATA_EPOCH' mode.
+        bool _epoch;
         Wrapper* _w;
     };
     
-    DoublyBufferedData();
+    explicit DoublyBufferedData(
+        DoublyBufferedDataMode mode = DOUBLY_BUFFERED_DATA_MUTEX);
     ~DoublyBufferedData();
 
+    DoublyBufferedDataMode mode() const { return _mode; }
+
     // Put foreground instance into ptr. The instance will not be changed until
     // ptr is destructed.
     // This function is not blocked by Read() and Modify() in other threads.
@@ -224,11 +256,23 @@ private:
     // All thread-local instances.
     std::vector<Wrapper*> _wrappers;
 
+    // Copy of _wrappers waited by Modify() without holding _wrappers_mutex,
+    // removed wrappers are set to NULL. Protected by _wrappers_mutex.
+    std::vector<Wrapper*> _waiting_wrappers;
+
     // Sequence access to _wrappers.
     pthread_mutex_t _wrappers_mutex{};
 
+    // Wrapper being waited by Modify(), protected by _wrappers_mutex.
+    // RemoveWrapper() of it waits on _wrapper_waited_cond until Modify()
+    // is done with it.
+    Wrapper* _waiting_wrapper;
+    pthread_cond_t _wrapper_waited_cond{};
+
     // Sequence modifications.
     pthread_mutex_t _modify_mutex{};
+
+    const DoublyBufferedDataMode _mode;
 };
 
 static const pthread_key_t INVALID_PTHREAD_KEY = (pthread_key_t)-1;
@@ -366,6 +410,8 @@ public:
     explicit Wrapper()
         : _control(NULL)
         , _modify_wait(false) {
+        _epoch_ref[0].store(0, butil::memory_order_relaxed);
+        _epoch_ref[1].store(0, butil::memory_order_relaxed);
         pthread_mutex_init(&_mutex, NULL);
         if (AllowBthreadSuspended) {
             pthread_cond_init(&_cond[0], NULL);
@@ -385,6 +431,9 @@ public:
             pthread_cond_destroy(&_cond[0]);
             pthread_cond_destroy(&_cond[1]);
         }
+        // Reads suspended in bthreads may end in other threads.
+        WaitEpochReadDone(0);
+        WaitEpochReadDone(1);
 
         pthread_mutex_destroy(&_mutex);
     }
@@ -446,6 +495,45 @@ public:
     void SubRef(int index) {
         --_ref[index];
     }
+
+    // For `DOUBLY_BUFFERED_DATA_EPOCH'.
+    // Returns index of the foreground instance being referenced.
+    inline int BeginEpochRead(const butil::atomic<int>& fg_index) {
+        int index = fg_index.load(butil::memory_order_relaxed);
+        while (true) {
+            // The seq_cst RMW and load pair with the seq_cst store and load
+            // in WaitEpochReadDone() and Modify(): either Modify() sees the
+            // incremented reference, or this thread sees the flipped index
+            // and retries.
+            _epoch_ref[index].fetch_add(1, butil::memory_order_seq_cst);
+            const int index2 = fg_index.load(butil::memory_order_seq_cst);
+            if (BAIDU_LIKELY(index2 == index)) {
+                return index;
+            }
+            _epoch_ref[index].fetch_sub(1, butil::memory_order_release);
+            index = index2;
+        }
+    }
+
+    // For `DOUBLY_BUFFERED_DATA_EPOCH'.
+    inline void EndEpochRead(int index) {
+        _epoch_ref[index].fetch_sub(1, butil::memory_order_release);
+    }
+
+    // For `DOUBLY_BUFFERED_DATA_EPOCH'.
+    // Wait until reads of instance at `index' started in this thread done.
+    void WaitEpochReadDone(int index) {
+        for (int i = 0; _epoch_ref[index].load(butil::memory_order_seq_cst) != 0;
+             ++i) {
+            // Reads are short unless bthreads are suspended, spin for a while
+            // before sleeping.
+            if (i < 64) {
+                sched_yield();
+            } else {
+                usleep(100);
+            }
+        }
+    }
     
 private:
     DoublyBufferedData* _control;
@@ -460,6 +548,9 @@ private:
     // For `AllowBthreadSuspended=true'.
     // Whether there is a Modify() waiting for _ref0/_ref1.
     bool _modify_wait;
+    // For `DOUBLY_BUFFERED_DATA_EPOCH'.
+    // Reference counts of _data[0] and _data[1] read by this thread.
+    butil::atomic<int> _epoch_ref[2];
 };
 
 // Called when thread initializes thread-local wrapper.
@@ -494,26 +585,39 @@ void DoublyBufferedData<T, TLS, AllowBthreadSuspended>::RemoveWrapper(
     if (NULL == w) {
         return;
     }
-    BAIDU_SCOPED_LOCK(_wrappers_mutex);
+    pthread_mutex_lock(&_wrappers_mutex);
     for (size_t i = 0; i < _wrappers.size(); ++i) {
         if (_wrappers[i] == w) {
             _wrappers[i] = _wrappers.back();
             _wrappers.pop_back();
-            return;
+            break;
         }
     }
+    for (size_t i = 0; i < _waiting_wrappers.size(); ++i) {
+        if (_waiting_wrappers[i] == w) {
+            _waiting_wrappers[i] = NULL;
+        }
+    }
+    while (_waiting_wrapper == w) {
+        pthread_cond_wait(&_wrapper_waited_cond, &_wrappers_mutex);
+    }
+    pthread_mutex_unlock(&_wrappers_mutex);
 }
 
 template <typename T, typename TLS, bool AllowBthreadSuspended>
-DoublyBufferedData<T, TLS, AllowBthreadSuspended>::DoublyBufferedData()
+DoublyBufferedData<T, TLS, AllowBthreadSuspended>::DoublyBufferedData(
+    DoublyBufferedDataMode mode)
     : _index(0)
-    , _wrapper_key(0) {
+    , _wrapper_key(0)
+    , _waiting_wrapper(NULL)
+    , _mode(mode) {
     BAIDU_CASSERT(!(AllowBthreadSuspended && !IsVoid<TLS>::value),
                   "Forbidden to allow bthread suspended with non-Void TLS");
 
     _wrappers.reserve(64);
     pthread_mutex_init(&_modify_mutex, NULL);
     pthread_mutex_init(&_wrappers_mutex, NULL);
+    pthread_cond_init(&_wrapper_waited_cond, NULL);
     _wrapper_key = WrapperTLSGroup::key_create();
     // Initialize _data for some POD types. This is essential for pointer
     // types because they should be Read() as NULL before any Modify().
@@ -540,6 +644,7 @@ DoublyBufferedData<T, TLS, AllowBthreadSuspended>::~DoublyBufferedData() {
     _wrapper_key = -1;
     pthread_mutex_destroy(&_modify_mutex);
     pthread_mutex_destroy(&_wrappers_mutex);
+    pthread_cond_destroy(&_wrapper_waited_cond);
 }
 
 template <typename T, typename TLS, bool AllowBthreadSuspended>
@@ -548,7 +653,13 @@ int DoublyBufferedData<T, TLS, AllowBthreadSuspended>::Read(
     Wrapper* p = WrapperTLSGroup::get_or_create_tls_data(_wrapper_key);
     Wrapper* w = AddWrapper(p);
     if (BAIDU_LIKELY(w != NULL)) {
-        if (AllowBthreadSuspended) {
+        if (_mode == DOUBLY_BUFFERED_DATA_EPOCH) {
+            const int index = w->BeginEpochRead(_index);
+            ptr->_data = _data + index;
+            ptr->_index = index;
+            ptr->_epoch = true;
+            ptr->_w = w;
+        } else if (AllowBthreadSuspended) {
             // Use reference count instead of mutex to indicate read of
             // foreground instance, so during the read process, there is
             // no need to lock mutex and bthread is allowed to be suspended.
@@ -575,7 +686,7 @@ template <typename Fn>
 size_t DoublyBufferedData<T, TLS, AllowBthreadSuspended>::Modify(Fn& fn) {
     // _modify_mutex sequences modifications. Using a separate mutex rather
     // than _wrappers_mutex is to avoid blocking threads calling
-    // AddWrapper() or RemoveWrapper() too long. Most of the time, modifications
+    // AddWrapper() too long. Most of the time, modifications
     // are done by one thread, contention should be negligible.
     BAIDU_SCOPED_LOCK(_modify_mutex);
     int bg_index = !_index.load(butil::memory_order_relaxed);
@@ -590,21 +701,47 @@ size_t DoublyBufferedData<T, TLS, AllowBthreadSuspended>::Modify(Fn& fn) {
     // The release fence matches with the acquire fence in UnsafeRead() to
     // make readers which just begin to read the new foreground instance see
     // all changes made in fn.
-    _index.store(bg_index, butil::memory_order_release);
+    // In `DOUBLY_BUFFERED_DATA_EPOCH' mode, the store must be seq_cst to be
+    // ordered with loads of reference counts, see Wrapper::BeginEpochRead().
+    _index.store(bg_index, _mode == DOUBLY_BUFFERED_DATA_EPOCH ?
+                 butil::memory_order_seq_cst : butil::memory_order_release);
     bg_index = !bg_index;
     
     // Wait until all threads finishes current reading. When they begin next
-    // read, they should see updated _index.
+    // read, they should see updated _index. Wrappers are copied and waited
+    // without holding _wrappers_mutex, otherwise threads reading for the
+    // first time would be blocked in AddWrapper() by slow reads of others.
+    // Wrappers added after copying read the new foreground.
     {
         BAIDU_SCOPED_LOCK(_wrappers_mutex);
-        for (size_t i = 0; i < _wrappers.size(); ++i) {
-            // Wait read of old foreground instance done.
-            if (AllowBthreadSuspended) {
-                _wrappers[i]->WaitReadDone(bg_index);
-            } else {
-                _wrappers[i]->WaitReadDone();
-            }
+        _waiting_wrappers = _wrappers;
+    }
+    for (size_t i = 0; i < _waiting_wrappers.size(); ++i) {
+        Wrapper* w = NULL;
+        {
+            BAIDU_SCOPED_LOCK(_wrappers_mutex);
+            w = _waiting_wrappers[i];
+            _waiting_wrapper = w;
+        }
+        if (w == NULL) {
+            // Removed.
+            continue;
+        }
+        // Wait read of old foreground instance done.
+        if (_mode == DOUBLY_BUFFERED_DATA_EPOCH) {
+            w->WaitEpochReadDone(bg_index);
+        } else if (AllowBthreadSuspended) {
+            w->WaitReadDone(bg_index);
+        } else {
+            w->WaitReadDone();
         }
+        BAIDU_SCOPED_LOCK(_wrappers_mutex);
+        _waiting_wrapper = NULL;
+        pthread_cond_broadcast(&_wrapper_waited_cond);
+    }
+    {
+        BAIDU_SCOPED_LOCK(_wrappers_mutex);
+        _waiting_wrappers.clear();
     }
 
     const size_t ret2 = fn(_data[bg_index]);
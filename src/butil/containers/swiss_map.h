@@ -0,0 +1,212 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// This open addressing hash-map stores elements in one flat array and keeps
+// one control byte per slot in a separate array. The control byte holds 7
+// bits of the hash code of a full slot, so that a probe compares 16 control
+// bytes at once(with SSE2) and rarely touches keys which do not match. Unlike
+// FlatMap, there's no linked node, a seek touches at most a few cachelines
+// even if the map is crowded, which makes it faster on missed lookups and on
+// maps much bigger than CPU caches.
+//
+// The interfaces are compatible with FlatMap: init/insert/seek/erase/
+// operator[]/iterators are used in the same way, so that switching between
+// them is a matter of changing typedefs. Notable differences:
+//  * Addresses of values are invalidated by insertions that resize the map.
+//    FlatMap has the same issue, but buckets not resized keep addresses.
+//  * Erasing during iteration is not supported.
+//  * save_iterator/restore_iterator are not provided.
+//
+// Check SwissMapTest.perf_cmp_with_flat_map in test/swiss_map_unittest.cpp
+// for performance comparisons with FlatMap.
+
+#ifndef BUTIL_SWISS_MAP_H
+#define BUTIL_SWISS_MAP_H
+
+#include <stdint.h>
+#include <stdlib.h>                               // malloc, free
+#include <iterator>                               // std::forward_iterator_tag
+#include <utility>                                // std::pair
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "butil/type_traits.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
+#include "butil/containers/flat_map.h"            // DefaultHasher, DefaultEqualTo
+
+namespace butil {
+
+template <typename _Map, typename _Value> class SwissMapIterator;
+
+// Values of control bytes. A full slot has a non-negative control byte which
+// is the lower 7 bits of the hash code.
+static const int8_t SWISS_CTRL_EMPTY = -128;
+static const int8_t SWISS_CTRL_DELETED = -2;
+static const int8_t SWISS_CTRL_SENTINEL = -1;
+// Number of control bytes compared at once.
+static const size_t SWISS_GROUP_WIDTH = 16;
+
+// 16 consecutive control bytes. Results of match*() are bitmasks in which
+// bit i is set if the i-th control byte matches.
+class SwissMapGroup {
+public:
+    explicit SwissMapGroup(const int8_t* pos);
+    uint32_t match(int8_t h2) const;
+    uint32_t match_empty() const;
+    uint32_t match_empty_or_deleted() const;
+    // Number of leading empty or deleted control bytes.
+    uint32_t count_leading_empty_or_deleted() const;
+
+private:
+#if defined(__SSE2__)
+    __m128i _ctrl;
+#else
+    int8_t _ctrl[SWISS_GROUP_WIDTH];
+#endif
+};
+
+// NOTE: Objects stored in SwissMap MUST be copyable.
+template <typename _K, typename _T,
+          // Compute hash code from key. The code is mixed again inside,
+          // so hashers with poor distributions(e.g. the identical hash of
+          // integers) are fine.
+          typename _Hash = DefaultHasher<_K>,
+          // Test equivalence between stored-key and passed-key.
+          // stored-key is always on LHS, passed-key is always on RHS.
+          typename _Equal = DefaultEqualTo<_K> >
+class SwissMap {
+public:
+    typedef _K key_type;
+    typedef _T mapped_type;
+    typedef std::pair<const _K, _T> value_type;
+    typedef SwissMapIterator<SwissMap, value_type> iterator;
+    typedef SwissMapIterator<SwissMap, const value_type> const_iterator;
+    typedef _Hash hasher;
+    typedef _Equal key_equal;
+
+    SwissMap(const hasher& hashfn = hasher(),
+             const key_equal& eql = key_equal());
+    ~SwissMap();
+    SwissMap(const SwissMap& rhs);
+    void operator=(const SwissMap& rhs);
+    void swap(SwissMap& rhs);
+
+    // Initialize this map with space for at least `nbucket' elements.
+    // Unlike FlatMap, insert()/operator[] initialize the map with default
+    // parameters if this function was not called.
+    // `load_factor' is the maximum value of size()*100/bucket_count(), if the
+    // value is reached, the map is resized. Values above 90 make probing
+    // much longer and are capped to 90.
+    // Returns 0 on success, -1 otherwise.
+    int init(size_t nbucket, u_int load_factor = 80);
+
+    // Insert a pair of |key| and |value|. Value of an existing key is
+    // overwritten.
+    // Returns address of the inserted value, NULL on error.
+    mapped_type* insert(const key_type& key, const mapped_type& value);
+
+    // Insert a pair of {key, value}.
+    // Returns address of the inserted value, NULL on error.
+    mapped_type* insert(const std::pair<key_type, mapped_type>& kv);
+
+    // Remove |key| and the associated value
+    // Returns: 1 on erased, 0 otherwise.
+    template <typename K2>
+    size_t erase(const K2& key, mapped_type* old_value = NULL);
+
+    // Remove all items. Allocated spaces are NOT returned by system.
+    void clear();
+
+    // Remove all items and shrink the map to the size given to init().
+    void clear_and_reset_pool();
+
+    // Search for the value associated with |key|
+    // Returns: address of the value
+    template <typename K2> mapped_type* seek(const K2& key) const;
+
+    // Get the value associated with |key|. If |key| does not exist,
+    // insert with a default-constructed value.
+    // Returns reference of the value
+    mapped_type& operator[](const key_type& key);
+
+    // Resize this map to hold at least `nbucket' elements without resizing
+    // again. Returns successful or not.
+    bool resize(size_t nbucket);
+
+    // Iterators
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    // True if init() was successfully called.
+    bool initialized() const { return _ctrl != NULL; }
+
+    bool empty() const { return _size == 0; }
+    size_t size() const { return _size; }
+    // Number of slots.
+    size_t bucket_count() const { return _capacity; }
+    u_int load_factor() const { return _load_factor; }
+
+private:
+template <typename _Map, typename _Value> friend class SwissMapIterator;
+
+    static const size_t npos = (size_t)-1;
+
+    template <typename K2>
+    size_t hash_of(const K2& key) const { return fmix64(_hashfn(key)); }
+
+    value_type* slot_at(size_t i) const { return _slots + i; }
+
+    // Max number of elements that `capacity' slots can hold.
+    size_t capacity_to_growth(size_t capacity) const;
+    // Set control byte at `i' as well as the cloned byte.
+    void set_ctrl(size_t i, int8_t h);
+    void reset_ctrl();
+    template <typename K2>
+    size_t find_index(const K2& key, size_t hash) const;
+    size_t find_first_non_full(size_t hash) const;
+    // Returns index of a slot for inserting an element with `hash' and
+    // marks it as full, npos on error.
+    size_t prepare_insert(size_t hash);
+    // Rebuild the map into `capacity' slots.
+    bool rehash(size_t capacity);
+    void destroy_all();
+
+    // Number of slots, always 2^n-1 so that probing with `& _capacity'
+    // visits the sentinel as well.
+    size_t _capacity;
+    size_t _size;
+    // Number of elements that can be inserted into empty slots before
+    // resizing. Reusing deleted slots does not consume it.
+    size_t _growth_left;
+    size_t _init_capacity;
+    // _capacity + SWISS_GROUP_WIDTH bytes: control bytes of slots, the
+    // sentinel and clones of first SWISS_GROUP_WIDTH-1 bytes so that groups
+    // can be loaded at any slot without wrapping.
+    int8_t* _ctrl;
+    value_type* _slots;
+    u_int _load_factor;
+    hasher _hashfn;
+    key_equal _eql;
+};
+
+}  // namespace butil
+
+#include "butil/containers/swiss_map_inl.h"
+
+#endif  // BUTIL_SWISS_MAP_H
@@ -0,0 +1,519 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BUTIL_SWISS_MAP_INL_H
+#define BUTIL_SWISS_MAP_INL_H
+
+#include <string.h>                               // memset, memcpy
+#include <algorithm>                              // std::swap
+
+namespace butil {
+
+// Implement SwissMapGroup
+#if defined(__SSE2__)
+inline SwissMapGroup::SwissMapGroup(const int8_t* pos)
+    : _ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+inline uint32_t SwissMapGroup::match(int8_t h2) const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), _ctrl));
+}
+
+inline uint32_t SwissMapGroup::match_empty() const {
+    return match(SWISS_CTRL_EMPTY);
+}
+
+inline uint32_t SwissMapGroup::match_empty_or_deleted() const {
+    return _mm_movemask_epi8(
+        _mm_cmpgt_epi8(_mm_set1_epi8(SWISS_CTRL_SENTINEL), _ctrl));
+}
+#else
+inline SwissMapGroup::SwissMapGroup(const int8_t* pos) {
+    memcpy(_ctrl, pos, sizeof(_ctrl));
+}
+
+inline uint32_t SwissMapGroup::match(int8_t h2) const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < SWISS_GROUP_WIDTH; ++i) {
+        mask |= ((uint32_t)(_ctrl[i] == h2) << i);
+    }
+    return mask;
+}
+
+inline uint32_t SwissMapGroup::match_empty() const {
+    return match(SWISS_CTRL_EMPTY);
+}
+
+inline uint32_t SwissMapGroup::match_empty_or_deleted() const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < SWISS_GROUP_WIDTH; ++i) {
+        mask |= ((uint32_t)(_ctrl[i] < SWISS_CTRL_SENTINEL) << i);
+    }
+    return mask;
+}
+#endif  // __SSE2__
+
+inline uint32_t SwissMapGroup::count_leading_empty_or_deleted() const {
+    // Bits above SWISS_GROUP_WIDTH are always set in the inverted mask.
+    return __builtin_ctz(~match_empty_or_deleted());
+}
+
+// Iterate SwissMap
+template <typename Map, typename Value> class SwissMapIterator {
+public:
+    typedef Value value_type;
+    typedef Value& reference;
+    typedef Value* pointer;
+    typedef typename add_const<Value>::type ConstValue;
+    typedef ConstValue& const_reference;
+    typedef ConstValue* const_pointer;
+    typedef std::forward_iterator_tag iterator_category;
+    typedef ptrdiff_t difference_type;
+    typedef typename remove_const<Value>::type NonConstValue;
+
+    SwissMapIterator() : _ctrl(NULL), _slot(NULL) {}
+    SwissMapIterator(const Map* map, size_t pos) {
+        if (map->initialized()) {
+            _ctrl = map->_ctrl + pos;
+            _slot = map->_slots + pos;
+            skip_empty_or_deleted();
+        } else {
+            _ctrl = NULL;
+            _slot = NULL;
+        }
+    }
+    SwissMapIterator(const SwissMapIterator<Map, NonConstValue>& rhs)
+        : _ctrl(rhs._ctrl), _slot(rhs._slot) {}
+    ~SwissMapIterator() {}  // required by style-checker
+
+    // *this == rhs
+    bool operator==(const SwissMapIterator& rhs) const
+    { return _ctrl == rhs._ctrl; }
+
+    // *this != rhs
+    bool operator!=(const SwissMapIterator& rhs) const
+    { return _ctrl != rhs._ctrl; }
+
+    // ++ it
+    SwissMapIterator& operator++() {
+        ++_ctrl;
+        ++_slot;
+        skip_empty_or_deleted();
+        return *this;
+    }
+
+    // it ++
+    SwissMapIterator operator++(int) {
+        SwissMapIterator tmp = *this;
+        this->operator++();
+        return tmp;
+    }
+
+    reference operator*() { return *_slot; }
+    pointer operator->() { return _slot; }
+    const_reference operator*() const { return *_slot; }
+    const_pointer operator->() const { return _slot; }
+
+private:
+friend class SwissMapIterator<Map, ConstValue>;
+friend class SwissMap<typename Map::key_type, typename Map::mapped_type,
+                      typename Map::hasher, typename Map::key_equal>;
+
+    void skip_empty_or_deleted() {
+        // Stops at full slots or the sentinel.
+        while (*_ctrl < SWISS_CTRL_SENTINEL) {
+            const uint32_t shift =
+                SwissMapGroup(_ctrl).count_leading_empty_or_deleted();
+            _ctrl += shift;
+            _slot += shift;
+        }
+    }
+
+    const int8_t* _ctrl;
+    Value* _slot;
+};
+
+// Implement SwissMap
+template <typename _K, typename _T, typename _H, typename _E>
+SwissMap<_K, _T, _H, _E>::SwissMap(const hasher& hashfn, const key_equal& eql)
+    : _capacity(0)
+    , _size(0)
+    , _growth_left(0)
+    , _init_capacity(0)
+    , _ctrl(NULL)
+    , _slots(NULL)
+    , _load_factor(0)
+    , _hashfn(hashfn)
+    , _eql(eql) {}
+
+template <typename _K, typename _T, typename _H, typename _E>
+SwissMap<_K, _T, _H, _E>::~SwissMap() {
+    destroy_all();
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+SwissMap<_K, _T, _H, _E>::SwissMap(const SwissMap& rhs)
+    : _capacity(0)
+    , _size(0)
+    , _growth_left(0)
+    , _init_capacity(0)
+    , _ctrl(NULL)
+    , _slots(NULL)
+    , _load_factor(rhs._load_factor)
+    , _hashfn(rhs._hashfn)
+    , _eql(rhs._eql) {
+    operator=(rhs);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissMap<_K, _T, _H, _E>::operator=(const SwissMap& rhs) {
+    if (this == &rhs) {
+        return;
+    }
+    destroy_all();
+    _hashfn = rhs._hashfn;
+    _eql = rhs._eql;
+    _load_factor = rhs._load_factor;
+    _init_capacity = rhs._init_capacity;
+    if (!rhs.initialized()) {
+        return;
+    }
+    const size_t ctrl_size = rhs._capacity + SWISS_GROUP_WIDTH;
+    _ctrl = (int8_t*)malloc(ctrl_size);
+    _slots = (value_type*)malloc(sizeof(value_type) * rhs._capacity);
+    if (NULL == _ctrl || NULL == _slots) {
+        LOG(ERROR) << "Fail to allocate " << rhs._capacity << " slots";
+        free(_ctrl);
+        _ctrl = NULL;
+        free(_slots);
+        _slots = NULL;
+        return;
+    }
+    // Slots are copied to the same positions, control bytes are unchanged.
+    memcpy(_ctrl, rhs._ctrl, ctrl_size);
+    for (size_t i = 0; i < rhs._capacity; ++i) {
+        if (rhs._ctrl[i] >= 0) {
+            new (slot_at(i)) value_type(*rhs.slot_at(i));
+        }
+    }
+    _capacity = rhs._capacity;
+    _size = rhs._size;
+    _growth_left = rhs._growth_left;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissMap<_K, _T, _H, _E>::swap(SwissMap& rhs) {
+    std::swap(rhs._capacity, _capacity);
+    std::swap(rhs._size, _size);
+    std::swap(rhs._growth_left, _growth_left);
+    std::swap(rhs._init_capacity, _init_capacity);
+    std::swap(rhs._ctrl, _ctrl);
+    std::swap(rhs._slots, _slots);
+    std::swap(rhs._load_factor, _load_factor);
+    std::swap(rhs._hashfn, _hashfn);
+    std::swap(rhs._eql, _eql);
+}
+
+// Round `nbucket' to 2^n-1, no less than SWISS_GROUP_WIDTH-1 which is
+// required by set_ctrl().
+inline size_t swiss_map_round(size_t nbucket) {
+    size_t capacity = SWISS_GROUP_WIDTH - 1;
+    while (capacity < nbucket) {
+        capacity = capacity * 2 + 1;
+    }
+    return capacity;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+size_t SwissMap<_K, _T, _H, _E>::capacity_to_growth(size_t capacity) const {
+    // At least one empty slot is required to stop probing.
+    const size_t growth = capacity * _load_factor / 100;
+    return growth < capacity ? growth : capacity - 1;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+int SwissMap<_K, _T, _H, _E>::init(size_t nbucket, u_int load_factor) {
+    if (initialized()) {
+        LOG(ERROR) << "Already initialized";
+        return -1;
+    }
+    if (load_factor < 10) {
+        load_factor = 10;
+    } else if (load_factor > 90) {
+        load_factor = 90;
+    }
+    _load_factor = load_factor;
+    _init_capacity = swiss_map_round(nbucket * 100 / load_factor);
+    return rehash(_init_capacity) ? 0 : -1;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissMap<_K, _T, _H, _E>::set_ctrl(size_t i, int8_t h) {
+    _ctrl[i] = h;
+    _ctrl[((i - (SWISS_GROUP_WIDTH - 1)) & _capacity) +
+          (SWISS_GROUP_WIDTH - 1)] = h;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissMap<_K, _T, _H, _E>::reset_ctrl() {
+    memset(_ctrl, SWISS_CTRL_EMPTY, _capacity + SWISS_GROUP_WIDTH);
+    _ctrl[_capacity] = SWISS_CTRL_SENTINEL;
+    _growth_left = capacity_to_growth(_capacity) - _size;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+size_t SwissMap<_K, _T, _H, _E>::find_index(const K2& key, size_t hash) const {
+    const int8_t h2 = (int8_t)(hash & 0x7F);
+    size_t pos = (hash >> 7) & _capacity;
+    // Triangular probing visits every group when the number of positions
+    // is a power of 2.
+    for (size_t step = SWISS_GROUP_WIDTH; ; step += SWISS_GROUP_WIDTH) {
+        const SwissMapGroup g(_ctrl + pos);
+        for (uint32_t m = g.match(h2); m; m &= m - 1) {
+            const size_t i = (pos + __builtin_ctz(m)) & _capacity;
+            if (_eql(slot_at(i)->first, key)) {
+                return i;
+            }
+        }
+        if (g.match_empty()) {
+            return npos;
+        }
+        pos = (pos + step) & _capacity;
+    }
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+size_t SwissMap<_K, _T, _H, _E>::find_first_non_full(size_t hash) const {
+    size_t pos = (hash >> 7) & _capacity;
+    for (size_t step = SWISS_GROUP_WIDTH; ; step += SWISS_GROUP_WIDTH) {
+        const uint32_t m = SwissMapGroup(_ctrl + pos).match_empty_or_deleted();
+        if (m) {
+            return (pos + __builtin_ctz(m)) & _capacity;
+        }
+        pos = (pos + step) & _capacity;
+    }
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+size_t SwissMap<_K, _T, _H, _E>::prepare_insert(size_t hash) {
+    size_t i = find_first_non_full(hash);
+    if (_growth_left == 0 && _ctrl[i] != SWISS_CTRL_DELETED) {
+        // Drop deleted slots if they take much space, grow otherwise.
+        const size_t new_capacity =
+            (_size * 2 <= capacity_to_growth(_capacity) ?
+             _capacity : _capacity * 2 + 1);
+        if (!rehash(new_capacity)) {
+            return npos;
+        }
+        i = find_first_non_full(hash);
+    }
+    if (_ctrl[i] == SWISS_CTRL_EMPTY) {
+        --_growth_left;
+    }
+    set_ctrl(i, (int8_t)(hash & 0x7F));
+    ++_size;
+    return i;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+bool SwissMap<_K, _T, _H, _E>::rehash(size_t capacity) {
+    int8_t* new_ctrl = (int8_t*)malloc(capacity + SWISS_GROUP_WIDTH);
+    value_type* new_slots = (value_type*)malloc(sizeof(value_type) * capacity);
+    if (NULL == new_ctrl || NULL == new_slots) {
+        LOG(ERROR) << "Fail to allocate " << capacity << " slots";
+        free(new_ctrl);
+        free(new_slots);
+        return false;
+    }
+    int8_t* const old_ctrl = _ctrl;
+    value_type* const old_slots = _slots;
+    const size_t old_capacity = _capacity;
+    _ctrl = new_ctrl;
+    _slots = new_slots;
+    _capacity = capacity;
+    reset_ctrl();
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_ctrl[i] < 0) {
+            continue;
+        }
+        value_type* old_slot = old_slots + i;
+        const size_t hash = hash_of(old_slot->first);
+        const size_t j = find_first_non_full(hash);
+        set_ctrl(j, (int8_t)(hash & 0x7F));
+        new (slot_at(j)) value_type(*old_slot);
+        old_slot->~value_type();
+    }
+    _growth_left = capacity_to_growth(_capacity) - _size;
+    free(old_ctrl);
+    free(old_slots);
+    return true;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+bool SwissMap<_K, _T, _H, _E>::resize(size_t nbucket) {
+    if (!initialized()) {
+        return init(nbucket) == 0;
+    }
+    size_t capacity = swiss_map_round(nbucket * 100 / _load_factor);
+    while (capacity_to_growth(capacity) < _size) {
+        capacity = capacity * 2 + 1;
+    }
+    if (capacity == _capacity) {
+        return true;
+    }
+    return rehash(capacity);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+_T* SwissMap<_K, _T, _H, _E>::insert(const key_type& key,
+                                     const mapped_type& value) {
+    mapped_type* p = &operator[](key);
+    if (p != NULL) {
+        *p = value;
+    }
+    return p;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+_T* SwissMap<_K, _T, _H, _E>::insert(
+    const std::pair<key_type, mapped_type>& kv) {
+    return insert(kv.first, kv.second);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+_T& SwissMap<_K, _T, _H, _E>::operator[](const key_type& key) {
+    if (!initialized() && init(0) != 0) {
+        // Same as FlatMap::operator[] which crashes on uninitialized maps.
+        CHECK(false) << "Fail to initialize SwissMap";
+    }
+    const size_t hash = hash_of(key);
+    size_t i = find_index(key, hash);
+    if (i != npos) {
+        return slot_at(i)->second;
+    }
+    i = prepare_insert(hash);
+    CHECK(i != npos) << "Fail to insert into SwissMap";
+    // NOTE: Initialize value in this way which zeroizes POD values, same
+    // with FlatMapElement.
+    return (new (slot_at(i)) value_type(key, _T()))->second;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+_T* SwissMap<_K, _T, _H, _E>::seek(const K2& key) const {
+    if (!initialized()) {
+        return NULL;
+    }
+    const size_t i = find_index(key, hash_of(key));
+    return i != npos ? &slot_at(i)->second : NULL;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+size_t SwissMap<_K, _T, _H, _E>::erase(const K2& key, _T* old_value) {
+    if (!initialized()) {
+        return 0;
+    }
+    const size_t i = find_index(key, hash_of(key));
+    if (i == npos) {
+        return 0;
+    }
+    value_type* p = slot_at(i);
+    if (old_value) {
+        *old_value = p->second;
+    }
+    p->~value_type();
+    --_size;
+    // If there's an empty slot in every group covering slot i, no probing
+    // ever passed slot i, marking it as empty is safe. Otherwise mark it as
+    // deleted to keep probing sequences of other keys.
+    const size_t before = (i - SWISS_GROUP_WIDTH) & _capacity;
+    const uint32_t empty_after = SwissMapGroup(_ctrl + i).match_empty();
+    const uint32_t empty_before = SwissMapGroup(_ctrl + before).match_empty();
+    if (empty_before && empty_after &&
+        (size_t)(__builtin_ctz(empty_after) +
+                 __builtin_clz(empty_before) - (32 - SWISS_GROUP_WIDTH))
+        < SWISS_GROUP_WIDTH) {
+        set_ctrl(i, SWISS_CTRL_EMPTY);
+        ++_growth_left;
+    } else {
+        set_ctrl(i, SWISS_CTRL_DELETED);
+    }
+    return 1;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissMap<_K, _T, _H, _E>::clear() {
+    if (_size == 0) {
+        if (initialized()) {
+            reset_ctrl();
+        }
+        return;
+    }
+    for (size_t i = 0; i < _capacity; ++i) {
+        if (_ctrl[i] >= 0) {
+            slot_at(i)->~value_type();
+        }
+    }
+    _size = 0;
+    reset_ctrl();
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissMap<_K, _T, _H, _E>::clear_and_reset_pool() {
+    clear();
+    if (initialized() && _capacity > _init_capacity) {
+        rehash(_init_capacity);
+    }
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissMap<_K, _T, _H, _E>::destroy_all() {
+    clear();
+    free(_ctrl);
+    _ctrl = NULL;
+    free(_slots);
+    _slots = NULL;
+    _capacity = 0;
+    _growth_left = 0;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissMap<_K, _T, _H, _E>::iterator SwissMap<_K, _T, _H, _E>::begin() {
+    return iterator(this, 0);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissMap<_K, _T, _H, _E>::iterator SwissMap<_K, _T, _H, _E>::end() {
+    return iterator(this, _capacity);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissMap<_K, _T, _H, _E>::const_iterator
+SwissMap<_K, _T, _H, _E>::begin() const {
+    return const_iterator(this, 0);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissMap<_K, _T, _H, _E>::const_iterator
+SwissMap<_K, _T, _H, _E>::end() const {
+    return const_iterator(this, _capacity);
+}
+
+}  // namespace butil
+
+#endif  // BUTIL_SWISS_MAP_INL_H
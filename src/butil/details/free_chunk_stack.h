@@ -0,0 +1,236 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BUTIL_DETAILS_FREE_CHUNK_STACK_H
+#define BUTIL_DETAILS_FREE_CHUNK_STACK_H
+
+#include <stdint.h>                       // uint32_t, uint64_t
+#include <pthread.h>                      // pthread_mutex_t
+#include <new>                            // std::nothrow
+#include <vector>                         // std::vector
+#include "butil/atomicops.h"              // butil::atomic
+#include "butil/macros.h"                 // BAIDU_CACHELINE_ALIGNMENT
+
+namespace butil {
+namespace details {
+
+// Number of shards of a FreeChunkStack. Threads are spread over the shards
+// so that pushing/popping from different threads rarely touch the same
+// cacheline.
+static const size_t FCS_NSHARD = 4;
+static const size_t FCS_SEGMENT_NNODE_NBIT = 6;
+static const size_t FCS_SEGMENT_NNODE = (1UL << FCS_SEGMENT_NNODE_NBIT);
+static const size_t FCS_MAX_NSEGMENT = 4096;
+
+// Lock-free sharded stacks of free chunks, used as the global free lists of
+// ObjectPool and ResourcePool.
+//
+// Chunks are copied into nodes which are allocated in segments and never
+// freed before the stack is destroyed, so that a thread reading the `next'
+// of a node which was just popped by another thread always reads valid
+// memory. Heads are tagged with a version which is increased by every
+// modification to avoid the ABA problem. When all nodes are in use, chunks
+// are copied into an unbounded list guarded by a mutex instead, which is
+// slower but never loses a chunk.
+template <typename Chunk>
+class FreeChunkStack {
+public:
+    FreeChunkStack() : _nnode(0), _noverflow(0) {
+        for (size_t i = 0; i < FCS_NSHARD; ++i) {
+            _heads[i].value.store(0, butil::memory_order_relaxed);
+        }
+        _spare.value.store(0, butil::memory_order_relaxed);
+        for (size_t i = 0; i < FCS_MAX_NSEGMENT; ++i) {
+            _segments[i].store(NULL, butil::memory_order_relaxed);
+        }
+        pthread_mutex_init(&_segment_mutex, NULL);
+        pthread_mutex_init(&_overflow_mutex, NULL);
+    }
+
+    ~FreeChunkStack() {
+        for (size_t i = 0; i < FCS_MAX_NSEGMENT; ++i) {
+            delete _segments[i].load(butil::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < _overflow.size(); ++i) {
+            delete _overflow[i];
+        }
+        pthread_mutex_destroy(&_segment_mutex);
+        pthread_mutex_destroy(&_overflow_mutex);
+    }
+
+    // Copy `c' into the stack of `shard'.
+    // Returns false when memory is exhausted.
+    bool push(const Chunk& c, size_t shard) {
+        uint32_t index = 0;
+        if (!pop_index(_spare, &index) && !new_node(&index)) {
+            return push_overflow(c);
+        }
+        Node* n = address_node(index);
+        n->chunk = c;
+        push_index(_heads[shard % FCS_NSHARD], index);
+        return true;
+    }
+
+    // Pop a chunk into `c', chunks in `shard' are preferred.
+    // Returns false when all shards are empty.
+    bool pop(Chunk& c, size_t shard) {
+        for (size_t i = 0; i < FCS_NSHARD; ++i) {
+            Head& head = _heads[(shard + i) % FCS_NSHARD];
+            // Critical for the case that most return_object are called in
+            // different threads of get_object.
+            if ((uint32_t)head.value.load(butil::memory_order_relaxed) == 0) {
+                continue;
+            }
+            uint32_t index = 0;
+            if (pop_index(head, &index)) {
+                c = address_node(index)->chunk;
+                push_index(_spare, index);
+                return true;
+            }
+        }
+        return pop_overflow(c);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FreeChunkStack);
+
+    struct Node {
+        butil::atomic<uint32_t> next;
+        Chunk chunk;
+    };
+
+    struct Segment {
+        Node nodes[FCS_SEGMENT_NNODE];
+    };
+
+    // Low 32 bits: index of the top node plus one, 0 means empty.
+    // High 32 bits: version to avoid ABA problem.
+    struct BAIDU_CACHELINE_ALIGNMENT Head {
+        butil::atomic<uint64_t> value;
+    };
+
+    Node* address_node(uint32_t index) const {
+        return _segments[index >> FCS_SEGMENT_NNODE_NBIT]
+            .load(butil::memory_order_consume)->nodes +
+            (index & (FCS_SEGMENT_NNODE - 1));
+    }
+
+    static uint64_t make_head(uint64_t old_head, uint32_t top_plus_one) {
+        return (((old_head >> 32) + 1) << 32) | top_plus_one;
+    }
+
+    void push_index(Head& head, uint32_t index) {
+        Node* const n = address_node(index);
+        uint64_t old_head = head.value.load(butil::memory_order_relaxed);
+        do {
+            n->next.store((uint32_t)old_head, butil::memory_order_relaxed);
+        } while (!head.value.compare_exchange_weak(
+                     old_head, make_head(old_head, index + 1),
+                     butil::memory_order_release, butil::memory_order_relaxed));
+    }
+
+    bool pop_index(Head& head, uint32_t* index) {
+        uint64_t old_head = head.value.load(butil::memory_order_acquire);
+        while (true) {
+            const uint32_t top_plus_one = (uint32_t)old_head;
+            if (top_plus_one == 0) {
+                return false;
+            }
+            // The node may be popped and pushed again by other threads
+            // during reading, the version in head fails the CAS then.
+            *index = top_plus_one - 1;
+            const uint32_t next = address_node(*index)->next.load(
+                butil::memory_order_relaxed);
+            if (head.value.compare_exchange_weak(
+                    old_head, make_head(old_head, next),
+                    butil::memory_order_acquire, butil::memory_order_acquire)) {
+                return true;
+            }
+        }
+    }
+
+    bool new_node(uint32_t* index) {
+        if (_nnode.load(butil::memory_order_relaxed) >=
+            FCS_MAX_NSEGMENT * FCS_SEGMENT_NNODE) {
+            return false;
+        }
+        const size_t i = _nnode.fetch_add(1, butil::memory_order_relaxed);
+        const size_t iseg = (i >> FCS_SEGMENT_NNODE_NBIT);
+        if (iseg >= FCS_MAX_NSEGMENT) {
+            return false;
+        }
+        if (_segments[iseg].load(butil::memory_order_consume) == NULL) {
+            pthread_mutex_lock(&_segment_mutex);
+            if (_segments[iseg].load(butil::memory_order_relaxed) == NULL) {
+                Segment* seg = new (std::nothrow) Segment;
+                if (seg == NULL) {
+                    pthread_mutex_unlock(&_segment_mutex);
+                    return false;
+                }
+                _segments[iseg].store(seg, butil::memory_order_release);
+            }
+            pthread_mutex_unlock(&_segment_mutex);
+        }
+        *index = (uint32_t)i;
+        return true;
+    }
+
+    bool push_overflow(const Chunk& c) {
+        Chunk* p = new (std::nothrow) Chunk(c);
+        if (p == NULL) {
+            return false;
+        }
+        pthread_mutex_lock(&_overflow_mutex);
+        _overflow.push_back(p);
+        _noverflow.store(_overflow.size(), butil::memory_order_relaxed);
+        pthread_mutex_unlock(&_overflow_mutex);
+        return true;
+    }
+
+    bool pop_overflow(Chunk& c) {
+        if (_noverflow.load(butil::memory_order_relaxed) == 0) {
+            return false;
+        }
+        pthread_mutex_lock(&_overflow_mutex);
+        if (_overflow.empty()) {
+            pthread_mutex_unlock(&_overflow_mutex);
+            return false;
+        }
+        Chunk* p = _overflow.back();
+        _overflow.pop_back();
+        _noverflow.store(_overflow.size(), butil::memory_order_relaxed);
+        pthread_mutex_unlock(&_overflow_mutex);
+        c = *p;
+        delete p;
+        return true;
+    }
+
+    Head _heads[FCS_NSHARD];
+    Head _spare;
+    butil::atomic<size_t> _nnode;
+    butil::atomic<Segment*> _segments[FCS_MAX_NSEGMENT];
+    pthread_mutex_t _segment_mutex;
+    // Chunks pushed when all nodes are in use.
+    butil::atomic<size_t> _noverflow;
+    std::vector<Chunk*> _overflow;
+    pthread_mutex_t _overflow_mutex;
+};
+
+}  // namespace details
+}  // namespace butil
+
+#endif  // BUTIL_DETAILS_FREE_CHUNK_STACK_H
@@ -29,6 +29,7 @@
 #include "butil/macros.h"                 // BAIDU_CACHELINE_ALIGNMENT
 #include "butil/scoped_lock.h"            // BAIDU_SCOPED_LOCK
 #include "butil/thread_local.h"           // BAIDU_THREAD_LOCAL
+#include "butil/details/free_chunk_stack.h"
 #include <vector>
 
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
@@ -71,7 +72,6 @@ struct ObjectPoolInfo {
 static const size_t OP_MAX_BLOCK_NGROUP = 65536;
 static const size_t OP_GROUP_NBLOCK_NBIT = 16;
 static const size_t OP_GROUP_NBLOCK = (1UL << OP_GROUP_NBLOCK_NBIT);
-static const size_t OP_INITIAL_FREE_LIST_SIZE = 1024;
 
 template <typename T>
 class ObjectPoolBlockItemNum {
@@ -91,7 +91,6 @@ public:
     // Free objects are batched in a FreeChunk before they're added to
     // global list(_free_chunks).
     typedef ObjectPoolFreeChunk<T, FREE_CHUNK_NITEM>    FreeChunk;
-    typedef ObjectPoolFreeChunk<T, 0> DynamicFreeChunk;
 
     // When a thread needs memory, it allocates a Block. To improve locality,
     // items in the Block are only used by the thread.
@@ -124,14 +123,16 @@ public:
         explicit LocalPool(ObjectPool* pool)
             : _pool(pool)
             , _cur_block(NULL)
-            , _cur_block_index(0) {
+            , _cur_block_index(0)
+            , _shard(_nshard_assigned.fetch_add(
+                         1, butil::memory_order_relaxed)) {
             _cur_free.nfree = 0;
         }
 
         ~LocalPool() {
             // Add to global _free if there're some free objects
             if (_cur_free.nfree) {
-                _pool->push_free_chunk(_cur_free);
+                _pool->push_free_chunk(_cur_free, _shard);
             }
 
             _pool->clear_from_destructor_of_local_pool();
@@ -154,7 +155,7 @@ public:
         /* Fetch a FreeChunk from global.                               \
            TODO: Popping from _free needs to copy a FreeChunk which is  \
            costly, but hardly impacts amortized performance. */         \
-        if (_pool->pop_free_chunk(_cur_free)) {                         \
+        if (_pool->pop_free_chunk(_cur_free, _shard)) {                 \
             BAIDU_OBJECT_POOL_FREE_ITEM_NUM_SUB1;                       \
             return _cur_free.ptrs[--_cur_free.nfree];                   \
         }                                                               \
@@ -207,7 +208,7 @@ public:
             }
             // Local free list is full, return it to global.
             // For copying issue, check comment in upper get()
-            if (_pool->push_free_chunk(_cur_free)) {
+            if (_pool->push_free_chunk(_cur_free, _shard)) {
                 _cur_free.nfree = 1;
                 _cur_free.ptrs[0] = ptr;
                 BAIDU_OBJECT_POOL_FREE_ITEM_NUM_ADD1;
@@ -220,6 +221,8 @@ public:
         ObjectPool* _pool;
         Block* _cur_block;
         size_t _cur_block_index;
+        // Preferred shard of the global free list.
+        size_t _shard;
         FreeChunk _cur_free;
     };
 
@@ -319,14 +322,9 @@ public:
     }
 
 private:
-    ObjectPool() {
-        _free_chunks.reserve(OP_INITIAL_FREE_LIST_SIZE);
-        pthread_mutex_init(&_free_chunks_mutex, NULL);
-    }
+    ObjectPool() {}
 
-    ~ObjectPool() {
-        pthread_mutex_destroy(&_free_chunks_mutex);
-    }
+    ~ObjectPool() {}
 
     // Create a Block and append it to right-most BlockGroup.
     static Block* add_block(size_t* index) {
@@ -420,7 +418,7 @@ private:
 
         // Clear global free list.
         FreeChunk dummy;
-        while (pop_free_chunk(dummy));
+        while (pop_free_chunk(dummy, 0));
 
         // Delete all memory
         const size_t ngroup = _ngroup.exchange(0, butil::memory_order_relaxed);
@@ -450,40 +448,14 @@ private:
     }
 
 private:
-    bool pop_free_chunk(FreeChunk& c) {
-        // Critical for the case that most return_object are called in
-        // different threads of get_object.
-        if (_free_chunks.empty()) {
-            return false;
-        }
-        pthread_mutex_lock(&_free_chunks_mutex);
-        if (_free_chunks.empty()) {
-            pthread_mutex_unlock(&_free_chunks_mutex);
-            return false;
-        }
-        DynamicFreeChunk* p = _free_chunks.back();
-        _free_chunks.pop_back();
-        pthread_mutex_unlock(&_free_chunks_mutex);
-        c.nfree = p->nfree;
-        memcpy(c.ptrs, p->ptrs, sizeof(*p->ptrs) * p->nfree);
-        free(p);
-        return true;
+    bool pop_free_chunk(FreeChunk& c, size_t shard) {
+        return _free_chunks.pop(c, shard);
     }
 
-    bool push_free_chunk(const FreeChunk& c) {
-        DynamicFreeChunk* p = (DynamicFreeChunk*)malloc(
-            offsetof(DynamicFreeChunk, ptrs) + sizeof(*c.ptrs) * c.nfree);
-        if (!p) {
-            return false;
-        }
-        p->nfree = c.nfree;
-        memcpy(p->ptrs, c.ptrs, sizeof(*c.ptrs) * c.nfree);
-        pthread_mutex_lock(&_free_chunks_mutex);
-        _free_chunks.push_back(p);
-        pthread_mutex_unlock(&_free_chunks_mutex);
-        return true;
+    bool push_free_chunk(const FreeChunk& c, size_t shard) {
+        return _free_chunks.push(c, shard);
     }
-    
+
     static butil::static_atomic<ObjectPool*> _singleton;
     static pthread_mutex_t _singleton_mutex;
     static BAIDU_THREAD_LOCAL LocalPool* _local_pool;
@@ -492,9 +464,9 @@ private:
     static pthread_mutex_t _block_group_mutex;
     static pthread_mutex_t _change_thread_mutex;
     static butil::static_atomic<BlockGroup*> _block_groups[OP_MAX_BLOCK_NGROUP];
+    static butil::static_atomic<size_t> _nshard_assigned;
 
-    std::vector<DynamicFreeChunk*> _free_chunks;
-    pthread_mutex_t _free_chunks_mutex;
+    butil::details::FreeChunkStack<FreeChunk> _free_chunks;
 
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
     static butil::static_atomic<size_t> _global_nfree;
@@ -532,6 +504,10 @@ template <typename T>
 butil::static_atomic<typename ObjectPool<T>::BlockGroup*>
 ObjectPool<T>::_block_groups[OP_MAX_BLOCK_NGROUP] = {};
 
+template <typename T>
+butil::static_atomic<size_t> ObjectPool<T>::_nshard_assigned =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
 template <typename T>
 butil::static_atomic<size_t> ObjectPool<T>::_global_nfree = BUTIL_STATIC_ATOMIC_INIT(0);
@@ -84,6 +84,21 @@ template <typename T> struct ResourcePoolValidator {
     static bool validate(const T*) { return true; }
 };
 
+// Memory of returned objects is kept by ResourcePool forever unless this
+// class is specialized with value = true, which allows trim_resources<T>()
+// to release blocks whose objects are all returned. Do it only if:
+//  - Objects are destructible after being returned, namely T::~T() does not
+//    free anything still referenced by others.
+//  - Identifiers of returned objects are addressed only by
+//    address_resource<T>(), which returns NULL for them after their block is
+//    released, and pointers returned by it are used shortly, e.g. to check
+//    the version of the object like SocketId does.
+//  - The identifier space is large enough, since identifiers of released
+//    blocks are never reused.
+template <typename T> struct ResourcePoolTrimmable {
+    static const bool value = false;
+};
+
 }  // namespace butil
 
 #include "butil/resource_pool_inl.h"
@@ -136,6 +151,18 @@ template <typename T> inline void clear_resources() {
     ResourcePool<T>::singleton()->clear_resources();
 }
 
+// Release blocks whose objects are all returned to the global free list,
+// to give memory back after a spike of usage. Does nothing unless
+// ResourcePoolTrimmable<T>::value is true. Released blocks are removed from
+// addressing at once, while their objects are destroyed and their memory is
+// freed by a later call at least RP_RETIRED_BLOCK_DELAY_US later, when no
+// thread reads them any more. Call this function periodically, e.g. from a
+// background thread.
+// Returns number of blocks removed by this call.
+template <typename T> inline size_t trim_resources() {
+    return ResourcePool<T>::singleton()->trim_resources();
+}
+
 // Get description of resources typed T.
 // This function is possibly slow because it iterates internal structures.
 // Don't use it frequently like a "getter" function.
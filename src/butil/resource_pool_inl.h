@@ -25,10 +25,13 @@
 #include <iostream>                      // std::ostream
 #include <pthread.h>                     // pthread_mutex_t
 #include <algorithm>                     // std::max, std::min
+#include <limits>                        // std::numeric_limits
 #include "butil/atomicops.h"              // butil::atomic
 #include "butil/macros.h"                 // BAIDU_CACHELINE_ALIGNMENT
 #include "butil/scoped_lock.h"            // BAIDU_SCOPED_LOCK
 #include "butil/thread_local.h"           // thread_atexit
+#include "butil/time.h"                   // gettimeofday_us
+#include "butil/details/free_chunk_stack.h"
 #include <vector>
 
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
@@ -86,7 +89,9 @@ struct ResourcePoolInfo {
 static const size_t RP_MAX_BLOCK_NGROUP = 65536;
 static const size_t RP_GROUP_NBLOCK_NBIT = 16;
 static const size_t RP_GROUP_NBLOCK = (1UL << RP_GROUP_NBLOCK_NBIT);
-static const size_t RP_INITIAL_FREE_LIST_SIZE = 1024;
+// Blocks released by trim_resources() are freed after so long, when threads
+// which got them from address_resource() before have finished reading.
+static const int64_t RP_RETIRED_BLOCK_DELAY_US = 1000000L;
 
 template <typename T>
 class ResourcePoolBlockItemNum {
@@ -107,7 +112,6 @@ public:
     // Free identifiers are batched in a FreeChunk before they're added to
     // global list(_free_chunks).
     typedef ResourcePoolFreeChunk<T, FREE_CHUNK_NITEM>      FreeChunk;
-    typedef ResourcePoolFreeChunk<T, 0> DynamicFreeChunk;
 
     // When a thread needs memory, it allocates a Block. To improve locality,
     // items in the Block are only used by the thread.
@@ -141,14 +145,16 @@ public:
         explicit LocalPool(ResourcePool* pool)
             : _pool(pool)
             , _cur_block(NULL)
-            , _cur_block_index(0) {
+            , _cur_block_index(0)
+            , _shard(_nshard_assigned.fetch_add(
+                         1, butil::memory_order_relaxed)) {
             _cur_free.nfree = 0;
         }
 
         ~LocalPool() {
             // Add to global _free_chunks if there're some free resources
             if (_cur_free.nfree) {
-                _pool->push_free_chunk(_cur_free);
+                _pool->push_free_chunk(_cur_free, _shard);
             }
 
             _pool->clear_from_destructor_of_local_pool();
@@ -173,7 +179,7 @@ public:
         /* Fetch a FreeChunk from global.                               \
            TODO: Popping from _free needs to copy a FreeChunk which is  \
            costly, but hardly impacts amortized performance. */         \
-        if (_pool->pop_free_chunk(_cur_free)) {                         \
+        if (_pool->pop_free_chunk(_cur_free, _shard)) {                 \
             --_cur_free.nfree;                                          \
             const ResourceId<T> free_id =  _cur_free.ids[_cur_free.nfree]; \
             *id = free_id;                                              \
@@ -188,7 +194,10 @@ public:
                 p->~T();                                                \
                 return NULL;                                            \
             }                                                           \
-            ++_cur_block->nitem;                                        \
+            if (++_cur_block->nitem == BLOCK_NITEM) {                   \
+                /* Full blocks may be released by trim_resources(). */  \
+                _cur_block = NULL;                                      \
+            }                                                           \
             return p;                                                   \
         }                                                               \
         /* Fetch a Block from global */                                 \
@@ -200,7 +209,10 @@ public:
                 p->~T();                                                \
                 return NULL;                                            \
             }                                                           \
-            ++_cur_block->nitem;                                        \
+            if (++_cur_block->nitem == BLOCK_NITEM) {                   \
+                /* Full blocks may be released by trim_resources(). */  \
+                _cur_block = NULL;                                      \
+            }                                                           \
             return p;                                                   \
         }                                                               \
         return NULL;                                                    \
@@ -231,7 +243,7 @@ public:
             }
             // Local free list is full, return it to global.
             // For copying issue, check comment in upper get()
-            if (_pool->push_free_chunk(_cur_free)) {
+            if (_pool->push_free_chunk(_cur_free, _shard)) {
                 _cur_free.nfree = 1;
                 _cur_free.ids[0] = id;
                 BAIDU_RESOURCE_POOL_FREE_ITEM_NUM_ADD1;
@@ -244,6 +256,8 @@ public:
         ResourcePool* _pool;
         Block* _cur_block;
         size_t _cur_block_index;
+        // Preferred shard of the global free list.
+        size_t _shard;
         FreeChunk _cur_free;
     };
 
@@ -345,10 +359,10 @@ public:
             }
             size_t nblock = std::min(bg->nblock.load(butil::memory_order_relaxed),
                                      RP_GROUP_NBLOCK);
-            info.block_num += nblock;
             for (size_t j = 0; j < nblock; ++j) {
                 Block* b = bg->blocks[j].load(butil::memory_order_consume);
                 if (NULL != b) {
+                    ++info.block_num;
                     info.item_num += b->nitem;
                 }
             }
@@ -372,14 +386,110 @@ public:
         return p;
     }
 
+    size_t trim_resources() {
+        if (!ResourcePoolTrimmable<T>::value) {
+            return 0;
+        }
+        BAIDU_SCOPED_LOCK(_trim_mutex);
+        const int64_t now_us = butil::gettimeofday_us();
+        delete_retired_blocks(now_us - RP_RETIRED_BLOCK_DELAY_US);
+
+        // Take all free identifiers from the global list. Threads calling
+        // get_resource() meanwhile allocate from new blocks.
+        std::vector<ResourceId<T> > ids;
+        FreeChunk c;
+        while (pop_free_chunk(c, 0)) {
+            ids.insert(ids.end(), c.ids, c.ids + c.nfree);
+        }
+        if (ids.empty()) {
+            return 0;
+        }
+        size_t nblock_slot = 0;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            nblock_slot = std::max(nblock_slot, ids[i].value / BLOCK_NITEM + 1);
+        }
+        std::vector<uint32_t> nfree(nblock_slot, 0);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            ++nfree[ids[i].value / BLOCK_NITEM];
+        }
+
+        // A block is released if all of its items are in the global list.
+        // Full blocks are not referenced by any LocalPool and all items of
+        // them were allocated, no thread is going to touch them except
+        // by address_resource() with identifiers of returned objects.
+        size_t nretired = 0;
+        for (size_t i = 0; i < nblock_slot; ++i) {
+            if (nfree[i] != BLOCK_NITEM) {
+                continue;
+            }
+            BlockGroup* bg = _block_groups[i >> RP_GROUP_NBLOCK_NBIT]
+                .load(butil::memory_order_consume);
+            butil::atomic<Block*>& slot = bg->blocks[i & (RP_GROUP_NBLOCK - 1)];
+            Block* b = slot.load(butil::memory_order_relaxed);
+            if (NULL == b || b->nitem != BLOCK_NITEM) {
+                nfree[i] = 0;
+                continue;
+            }
+            // The slot is never filled again, address_resource() returns
+            // NULL for identifiers in it from now on.
+            slot.store(NULL, butil::memory_order_release);
+            RetiredBlock rb = { b, now_us };
+            _retired_blocks.push_back(rb);
+            ++nretired;
+        }
+
+        // Give other identifiers back.
+        size_t shard = 0;
+        c.nfree = 0;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (nfree[ids[i].value / BLOCK_NITEM] == BLOCK_NITEM) {
+                continue;
+            }
+            c.ids[c.nfree++] = ids[i];
+            if (c.nfree == free_chunk_nitem()) {
+                push_free_chunk(c, shard++);
+                c.nfree = 0;
+            }
+        }
+        if (c.nfree) {
+            push_free_chunk(c, shard);
+        }
+#ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
+        _global_nfree.fetch_sub(nretired * BLOCK_NITEM,
+                                butil::memory_order_relaxed);
+#endif
+        return nretired;
+    }
+
 private:
+    struct RetiredBlock {
+        Block* block;
+        int64_t retired_us;
+    };
+
     ResourcePool() {
-        _free_chunks.reserve(RP_INITIAL_FREE_LIST_SIZE);
-        pthread_mutex_init(&_free_chunks_mutex, NULL);
+        pthread_mutex_init(&_trim_mutex, NULL);
     }
 
     ~ResourcePool() {
-        pthread_mutex_destroy(&_free_chunks_mutex);
+        pthread_mutex_destroy(&_trim_mutex);
+    }
+
+    // Destroy objects and free memory of blocks retired before `before_us'.
+    // Called with _trim_mutex held.
+    void delete_retired_blocks(int64_t before_us) {
+        size_t n = 0;
+        for (; n < _retired_blocks.size() &&
+                 _retired_blocks[n].retired_us <= before_us; ++n) {
+            Block* b = _retired_blocks[n].block;
+            T* const objs = (T*)b->items;
+            for (size_t k = 0; k < b->nitem; ++k) {
+                objs[k].~T();
+            }
+            delete b;
+        }
+        _retired_blocks.erase(_retired_blocks.begin(),
+                              _retired_blocks.begin() + n);
     }
 
     // Create a Block and append it to right-most BlockGroup.
@@ -475,7 +585,11 @@ private:
 
         // Clear global free list.
         FreeChunk dummy;
-        while (pop_free_chunk(dummy));
+        while (pop_free_chunk(dummy, 0));
+        {
+            BAIDU_SCOPED_LOCK(_trim_mutex);
+            delete_retired_blocks(std::numeric_limits<int64_t>::max());
+        }
 
         // Delete all memory
         const size_t ngroup = _ngroup.exchange(0, butil::memory_order_relaxed);
@@ -505,40 +619,14 @@ private:
     }
 
 private:
-    bool pop_free_chunk(FreeChunk& c) {
-        // Critical for the case that most return_object are called in
-        // different threads of get_object.
-        if (_free_chunks.empty()) {
-            return false;
-        }
-        pthread_mutex_lock(&_free_chunks_mutex);
-        if (_free_chunks.empty()) {
-            pthread_mutex_unlock(&_free_chunks_mutex);
-            return false;
-        }
-        DynamicFreeChunk* p = _free_chunks.back();
-        _free_chunks.pop_back();
-        pthread_mutex_unlock(&_free_chunks_mutex);
-        c.nfree = p->nfree;
-        memcpy(c.ids, p->ids, sizeof(*p->ids) * p->nfree);
-        free(p);
-        return true;
+    bool pop_free_chunk(FreeChunk& c, size_t shard) {
+        return _free_chunks.pop(c, shard);
     }
 
-    bool push_free_chunk(const FreeChunk& c) {
-        DynamicFreeChunk* p = (DynamicFreeChunk*)malloc(
-            offsetof(DynamicFreeChunk, ids) + sizeof(*c.ids) * c.nfree);
-        if (!p) {
-            return false;
-        }
-        p->nfree = c.nfree;
-        memcpy(p->ids, c.ids, sizeof(*c.ids) * c.nfree);
-        pthread_mutex_lock(&_free_chunks_mutex);
-        _free_chunks.push_back(p);
-        pthread_mutex_unlock(&_free_chunks_mutex);
-        return true;
+    bool push_free_chunk(const FreeChunk& c, size_t shard) {
+        return _free_chunks.push(c, shard);
     }
-    
+
     static butil::static_atomic<ResourcePool*> _singleton;
     static pthread_mutex_t _singleton_mutex;
     static BAIDU_THREAD_LOCAL LocalPool* _local_pool;
@@ -547,9 +635,14 @@ private:
     static pthread_mutex_t _block_group_mutex;
     static pthread_mutex_t _change_thread_mutex;
     static butil::static_atomic<BlockGroup*> _block_groups[RP_MAX_BLOCK_NGROUP];
+    static butil::static_atomic<size_t> _nshard_assigned;
+
+    butil::details::FreeChunkStack<FreeChunk> _free_chunks;
 
-    std::vector<DynamicFreeChunk*> _free_chunks;
-    pthread_mutex_t _free_chunks_mutex;
+    // Serialize trim_resources().
+    pthread_mutex_t _trim_mutex;
+    // Blocks released by trim_resources() in the order of retired_us.
+    std::vector<RetiredBlock> _retired_blocks;
 
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
     static butil::static_atomic<size_t> _global_nfree;
@@ -589,6 +682,10 @@ template <typename T>
 butil::static_atomic<typename ResourcePool<T>::BlockGroup*>
 ResourcePool<T>::_block_groups[RP_MAX_BLOCK_NGROUP] = {};
 
+template <typename T>
+butil::static_atomic<size_t> ResourcePool<T>::_nshard_assigned =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
 template <typename T>
 butil::static_atomic<size_t> ResourcePool<T>::_global_nfree = BUTIL_STATIC_ATOMIC_INIT(0);
@@ -784,8 +784,11 @@ static ATTRIBUTE_NOINLINE bool SymbolizeAndDemangle(void *pc, char *out,
       out_size -= num_bytes_written;
     }
   }
+  // Executable segments of DSOs and PIE executables are not necessarily
+  // at the beginning of the files, relocate symbols by the load address
+  // rather than the start address of the segment.
   if (!GetSymbolFromObjectFile(wrapped_object_fd.get(), pc0,
-                               out, out_size, start_address)) {
+                               out, out_size, base_address)) {
     return false;
   }
 
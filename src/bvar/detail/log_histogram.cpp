@@ -0,0 +1,365 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <math.h>                       // frexp, ldexp, exp2
+#include <algorithm>                    // std::lower_bound
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "bvar/detail/log_histogram.h"
+
+namespace bvar {
+
+DEFINE_int32(bvar_histogram_dump_schema, 0, "Buckets of histograms dumped as"
+             " text are merged into buckets whose upper bounds are powers of"
+             " 2^(2^-schema), in [0, 5]");
+
+static bool validate_histogram_dump_schema(const char*, int32_t v) {
+    return v >= 0 && v <= detail::HistogramBuckets::SCHEMA;
+}
+const bool ALLOW_UNUSED dummy_bvar_histogram_dump_schema =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_histogram_dump_schema,
+                                       validate_histogram_dump_schema);
+
+namespace detail {
+
+// BOUNDS[i] = 2^(i / BUCKETS_PER_OCTAVE) / 2, upper bounds of buckets in an
+// octave as fractions returned by frexp().
+struct OctaveBounds {
+    OctaveBounds() {
+        for (int i = 0; i < HistogramBuckets::BUCKETS_PER_OCTAVE; ++i) {
+            bounds[i] = exp2((double)i / HistogramBuckets::BUCKETS_PER_OCTAVE) / 2;
+        }
+    }
+    double bounds[HistogramBuckets::BUCKETS_PER_OCTAVE];
+};
+static const OctaveBounds s_octave_bounds;
+
+int HistogramBuckets::bucket_index(int64_t value) {
+    if (value > MAX_VALUE) {
+        value = MAX_VALUE;
+    }
+    int exp = 0;
+    // Exact since value is no more than 2^53.
+    const double frac = frexp((double)value, &exp);
+    const double* const bounds = s_octave_bounds.bounds;
+    const int i = std::lower_bound(bounds, bounds + BUCKETS_PER_OCTAVE, frac)
+        - bounds;
+    return i + (exp - 1) * BUCKETS_PER_OCTAVE;
+}
+
+double HistogramBuckets::bucket_upper_bound(int index) {
+    // Floor division, negative indexes are bounds of values below 1, e.g.
+    // bucket -1 is the lower bound of bucket 0.
+    int octave = index / BUCKETS_PER_OCTAVE;
+    int i = index % BUCKETS_PER_OCTAVE;
+    if (i < 0) {
+        i += BUCKETS_PER_OCTAVE;
+        --octave;
+    }
+    return ldexp(s_octave_bounds.bounds[i], octave + 1);
+}
+
+void HistogramBuckets::extend(int begin, int end) {
+    if (_counts.empty()) {
+        _offset = begin;
+        _counts.resize(end - begin, 0);
+        return;
+    }
+    if (begin < _offset) {
+        _counts.insert(_counts.begin(), _offset - begin, 0);
+        _offset = begin;
+    }
+    if (end > end_index()) {
+        _counts.resize(end - _offset, 0);
+    }
+}
+
+void HistogramBuckets::add_bucket(int index, int64_t n) {
+    extend(index, index + 1);
+    _counts[index - _offset] += n;
+    _count += n;
+}
+
+void HistogramBuckets::add_zero(int64_t n) {
+    _zero_count += n;
+    _count += n;
+}
+
+int64_t HistogramBuckets::get_number(double ratio) const {
+    if (_count <= 0) {
+        return 0;
+    }
+    int64_t rank = (int64_t)ceil(ratio * _count);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > _count) {
+        rank = _count;
+    }
+    if (rank <= _zero_count) {
+        return 0;
+    }
+    rank -= _zero_count;
+    size_t i = 0;
+    for (; i + 1 < _counts.size() && rank > _counts[i]; ++i) {
+        rank -= _counts[i];
+    }
+    const int index = _offset + (int)i;
+    const double upper = bucket_upper_bound(index);
+    const double lower = bucket_upper_bound(index - 1);
+    // The value with same relative errors to both bounds.
+    const int64_t value = llround(2 * lower * upper / (lower + upper));
+    // Buckets of small values hold only a few integers, return one of them
+    // so that small values are exact.
+    const int64_t min_value = (int64_t)floor(lower) + 1;
+    const int64_t max_value = (int64_t)floor(upper);
+    if (min_value > max_value) {
+        return value;
+    }
+    return std::max(min_value, std::min(value, max_value));
+}
+
+void HistogramBuckets::get_cumulative_counts(
+    int schema, std::vector<std::pair<double, int64_t> >* out) const {
+    out->clear();
+    if (_counts.empty()) {
+        return;
+    }
+    const int shift = SCHEMA - schema;
+    const int merged = 1 << shift;
+    int64_t cumulative = _zero_count;
+    // Bucket i is inside merged bucket ceil(i / merged).
+    int key = (_offset + merged - 1) >> shift;
+    for (size_t i = 0; i < _counts.size(); ++i) {
+        const int k = (_offset + (int)i + merged - 1) >> shift;
+        if (k != key) {
+            out->push_back(std::make_pair(bucket_upper_bound(key << shift),
+                                          cumulative));
+            key = k;
+        }
+        cumulative += _counts[i];
+    }
+    out->push_back(std::make_pair(bucket_upper_bound(key << shift), cumulative));
+}
+
+HistogramBuckets& HistogramBuckets::operator+=(const HistogramBuckets& rhs) {
+    if (!rhs._counts.empty()) {
+        extend(rhs.begin_index(), rhs.end_index());
+        const size_t base = rhs._offset - _offset;
+        for (size_t i = 0; i < rhs._counts.size(); ++i) {
+            _counts[base + i] += rhs._counts[i];
+        }
+    }
+    _zero_count += rhs._zero_count;
+    _count += rhs._count;
+    _sum += rhs._sum;
+    return *this;
+}
+
+HistogramBuckets& HistogramBuckets::operator-=(const HistogramBuckets& rhs) {
+    if (!rhs._counts.empty()) {
+        extend(rhs.begin_index(), rhs.end_index());
+        const size_t base = rhs._offset - _offset;
+        for (size_t i = 0; i < rhs._counts.size(); ++i) {
+            _counts[base + i] -= rhs._counts[i];
+        }
+        // Drop emptied buckets on both ends to keep windows small.
+        size_t begin = 0;
+        while (begin < _counts.size() && _counts[begin] == 0) {
+            ++begin;
+        }
+        size_t end = _counts.size();
+        while (end > begin && _counts[end - 1] == 0) {
+            --end;
+        }
+        _counts.erase(_counts.begin() + end, _counts.end());
+        _counts.erase(_counts.begin(), _counts.begin() + begin);
+        _offset = _counts.empty() ? 0 : _offset + (int)begin;
+    }
+    _zero_count -= rhs._zero_count;
+    _count -= rhs._count;
+    _sum -= rhs._sum;
+    return *this;
+}
+
+std::ostream& operator<<(std::ostream& os, const HistogramBuckets& b) {
+    return os << "{count=" << b.count() << " sum=" << b.sum()
+              << " p50=" << b.get_number(0.5)
+              << " p99=" << b.get_number(0.99)
+              << " p999=" << b.get_number(0.999) << '}';
+}
+
+LogHistogram::Agent::Agent()
+    : histogram(NULL), zero_count(0), sum(0) {
+    for (int i = 0; i < NUM_OCTAVES; ++i) {
+        octaves[i].store(NULL, butil::memory_order_relaxed);
+    }
+}
+
+LogHistogram::Agent::~Agent() {
+    if (histogram) {
+        histogram->commit_and_erase(this);
+        histogram = NULL;
+    }
+    clear();
+}
+
+void LogHistogram::Agent::add_to(HistogramBuckets* b) const {
+    b->add_zero(zero_count.load(butil::memory_order_relaxed));
+    b->add_sum(sum.load(butil::memory_order_relaxed));
+    for (int i = 0; i < NUM_OCTAVES; ++i) {
+        const Octave* o = octaves[i].load(butil::memory_order_acquire);
+        if (o == NULL) {
+            continue;
+        }
+        for (int j = 0; j < HistogramBuckets::BUCKETS_PER_OCTAVE; ++j) {
+            const int64_t n = o->counts[j].load(butil::memory_order_relaxed);
+            if (n != 0) {
+                b->add_bucket(i * HistogramBuckets::BUCKETS_PER_OCTAVE + j, n);
+            }
+        }
+    }
+}
+
+void LogHistogram::Agent::clear() {
+    zero_count.store(0, butil::memory_order_relaxed);
+    sum.store(0, butil::memory_order_relaxed);
+    for (int i = 0; i < NUM_OCTAVES; ++i) {
+        delete octaves[i].exchange(NULL, butil::memory_order_relaxed);
+    }
+}
+
+LogHistogram::LogHistogram()
+    : _id(AgentGroup::create_new_agent())
+    , _sampler(NULL) {
+}
+
+LogHistogram::~LogHistogram() {
+    // Have to destroy sampler first to avoid the race between destruction and
+    // sampler
+    if (_sampler != NULL) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+    if (_id >= 0) {
+        butil::AutoLock guard(_lock);
+        // The agents may be reused by another histogram getting the same id.
+        for (butil::LinkNode<Agent>* node = _agents.head();
+             node != _agents.end();) {
+            butil::LinkNode<Agent>* const saved_next = node->next();
+            node->value()->histogram = NULL;
+            node->value()->clear();
+            node->RemoveFromList();
+            node = saved_next;
+        }
+        AgentGroup::destroy_agent(_id);
+        _id = -1;
+    }
+}
+
+LogHistogram::Agent* LogHistogram::get_or_create_tls_agent() {
+    Agent* agent = AgentGroup::get_tls_agent(_id);
+    if (!agent) {
+        agent = AgentGroup::get_or_create_tls_agent(_id);
+        if (NULL == agent) {
+            LOG(FATAL) << "Fail to create agent";
+            return NULL;
+        }
+    }
+    if (agent->histogram) {
+        return agent;
+    }
+    agent->histogram = this;
+    butil::AutoLock guard(_lock);
+    _agents.Append(agent);
+    return agent;
+}
+
+void LogHistogram::commit_and_erase(Agent* agent) {
+    butil::AutoLock guard(_lock);
+    agent->add_to(&_global);
+    agent->RemoveFromList();
+}
+
+LogHistogram::value_type LogHistogram::get_value() const {
+    butil::AutoLock guard(_lock);
+    HistogramBuckets result = _global;
+    for (const butil::LinkNode<Agent>* node = _agents.head();
+         node != _agents.end(); node = node->next()) {
+        node->value()->add_to(&result);
+    }
+    result -= _reset_base;
+    return result;
+}
+
+LogHistogram::value_type LogHistogram::reset() {
+    butil::AutoLock guard(_lock);
+    HistogramBuckets result = _global;
+    for (const butil::LinkNode<Agent>* node = _agents.head();
+         node != _agents.end(); node = node->next()) {
+        node->value()->add_to(&result);
+    }
+    HistogramBuckets total = result;
+    result -= _reset_base;
+    _reset_base = total;
+    return result;
+}
+
+LogHistogram& LogHistogram::operator<<(int64_t value) {
+    Agent* agent = get_or_create_tls_agent();
+    if (BAIDU_UNLIKELY(!agent)) {
+        return *this;
+    }
+    if (value <= 0) {
+        if (value < 0) {
+            if (!_debug_name.empty()) {
+                LOG(WARNING) << "Input=" << value << " to `" << _debug_name
+                             << "' is negative, drop";
+            } else {
+                LOG(WARNING) << "Input=" << value << " to LogHistogram("
+                             << (void*)this << ") is negative, drop";
+            }
+            return *this;
+        }
+        agent->zero_count.store(
+            agent->zero_count.load(butil::memory_order_relaxed) + 1,
+            butil::memory_order_relaxed);
+        return *this;
+    }
+    // Only the owning thread modifies the agent, so load-and-store instead
+    // of the costly read-modify-write.
+    agent->sum.store(agent->sum.load(butil::memory_order_relaxed) + value,
+                     butil::memory_order_relaxed);
+    const int index = HistogramBuckets::bucket_index(value);
+    const int i = index / HistogramBuckets::BUCKETS_PER_OCTAVE;
+    Octave* o = agent->octaves[i].load(butil::memory_order_relaxed);
+    if (BAIDU_UNLIKELY(o == NULL)) {
+        o = new Octave;
+        for (int j = 0; j < HistogramBuckets::BUCKETS_PER_OCTAVE; ++j) {
+            o->counts[j].store(0, butil::memory_order_relaxed);
+        }
+        // Pairs with the acquire-load in add_to().
+        agent->octaves[i].store(o, butil::memory_order_release);
+    }
+    butil::atomic<int64_t>& n =
+        o->counts[index % HistogramBuckets::BUCKETS_PER_OCTAVE];
+    n.store(n.load(butil::memory_order_relaxed) + 1, butil::memory_order_relaxed);
+    return *this;
+}
+
+}  // namespace detail
+}  // namespace bvar
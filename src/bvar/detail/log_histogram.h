@@ -0,0 +1,212 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BVAR_DETAIL_LOG_HISTOGRAM_H
+#define  BVAR_DETAIL_LOG_HISTOGRAM_H
+
+#include <stdint.h>                     // int64_t
+#include <ostream>                      // std::ostream
+#include <string>
+#include <utility>                      // std::pair
+#include <vector>
+#include <gflags/gflags_declare.h>
+#include "butil/atomicops.h"
+#include "butil/containers/linked_list.h"
+#include "butil/synchronization/lock.h"
+#include "bvar/window.h"                // Window
+#include "bvar/detail/agent_group.h"    // AgentGroup
+#include "bvar/detail/sampler.h"        // ReducerSampler
+
+namespace bvar {
+
+DECLARE_int32(bvar_histogram_dump_schema);
+
+namespace detail {
+
+// Counts of values in logarithmic buckets. Bucket `i' counts values in
+// (BASE^(i-1), BASE^i] where BASE = 2^(2^-SCHEMA), which is the same layout
+// as native histograms of prometheus with the same schema. Non-positive
+// values are counted in a separate zero bucket.
+// Values estimated from buckets are at most (BASE-1)/(BASE+1) (~1.1%) away
+// from recorded values, and buckets of different histograms (of different
+// threads, seconds or processes) are merged without losing precision.
+class HistogramBuckets {
+public:
+    static const int SCHEMA = 5;
+    static const int BUCKETS_PER_OCTAVE = 1 << SCHEMA;
+    // Values larger than 2^MAX_OCTAVE (about 12 days in microseconds) are
+    // counted as 2^MAX_OCTAVE.
+    static const int MAX_OCTAVE = 40;
+    static const int64_t MAX_VALUE = 1LL << MAX_OCTAVE;
+    static const int NUM_BUCKETS = MAX_OCTAVE * BUCKETS_PER_OCTAVE + 1;
+
+    HistogramBuckets() : _zero_count(0), _count(0), _sum(0), _offset(0) {}
+
+    // Index of the bucket that the positive `value' falls in.
+    static int bucket_index(int64_t value);
+    // Inclusive upper bound of bucket `index'. The exclusive lower bound is
+    // the upper bound of bucket `index - 1'.
+    static double bucket_upper_bound(int index);
+
+    // Number of all values, including the ones in the zero bucket.
+    int64_t count() const { return _count; }
+    // Sum of all values.
+    int64_t sum() const { return _sum; }
+    int64_t zero_count() const { return _zero_count; }
+
+    // Non-empty buckets are in [begin_index(), end_index()).
+    int begin_index() const { return _offset; }
+    int end_index() const { return _offset + (int)_counts.size(); }
+    int64_t bucket_count(int index) const {
+        const int i = index - _offset;
+        return (i >= 0 && i < (int)_counts.size()) ? _counts[i] : 0;
+    }
+
+    // Add `n' values falling in bucket `index'.
+    void add_bucket(int index, int64_t n);
+    void add_zero(int64_t n);
+    void add_sum(int64_t sum) { _sum += sum; }
+
+    // Get the value at `ratio' (in [0, 1]) of all values in ascending order.
+    // E.g. 0.99 means 99%-ile.
+    int64_t get_number(double ratio) const;
+
+    // Merge buckets into buckets of a smaller `schema' (in [0, SCHEMA]),
+    // namely 2^(SCHEMA - schema) adjacent buckets become one, and put upper
+    // bounds and cumulative counts (including the zero bucket) of them from
+    // the first to the last non-empty one into `out'.
+    void get_cumulative_counts(
+        int schema, std::vector<std::pair<double, int64_t> >* out) const;
+
+    HistogramBuckets& operator+=(const HistogramBuckets& rhs);
+    // Remove values of `rhs' which must be recorded before, namely buckets
+    // of the same histogram at an earlier time.
+    HistogramBuckets& operator-=(const HistogramBuckets& rhs);
+
+private:
+    // Make [begin, end) inside the range of _counts.
+    void extend(int begin, int end);
+
+    int64_t _zero_count;
+    int64_t _count;
+    int64_t _sum;
+    int _offset;
+    std::vector<int64_t> _counts;
+};
+
+std::ostream& operator<<(std::ostream& os, const HistogramBuckets& b);
+
+// Record values into HistogramBuckets. Values are counted in buckets of the
+// calling thread with plain stores, no locks or atomic instructions are
+// involved. Counts only grow and windows are the difference between samples,
+// so thread-local buckets are never reset by other threads.
+// Compared to Percentile, memory is bounded by the bucket layout rather than
+// the sample size, and high percentiles are not affected by sampling.
+class LogHistogram {
+public:
+    struct AddBuckets {
+        void operator()(HistogramBuckets& b1, const HistogramBuckets& b2) const {
+            b1 += b2;
+        }
+    };
+    struct SubtractBuckets {
+        void operator()(HistogramBuckets& b1, const HistogramBuckets& b2) const {
+            b1 -= b2;
+        }
+    };
+
+    typedef HistogramBuckets                                value_type;
+    typedef ReducerSampler<LogHistogram, HistogramBuckets,
+                           AddBuckets, SubtractBuckets>     sampler_type;
+
+    LogHistogram();
+    ~LogHistogram();
+
+    AddBuckets op() const { return AddBuckets(); }
+    SubtractBuckets inv_op() const { return SubtractBuckets(); }
+
+    // The sampler for windows over the histogram.
+    sampler_type* get_sampler() {
+        if (NULL == _sampler) {
+            _sampler = new sampler_type(this);
+            _sampler->schedule();
+        }
+        return _sampler;
+    }
+
+    // Get all values recorded since creation or last reset(). [Threadsafe]
+    value_type get_value() const;
+
+    // Get values like get_value() and start over. [Threadsafe]
+    value_type reset();
+
+    LogHistogram& operator<<(int64_t value);
+
+    bool valid() const { return _id >= 0; }
+
+    // This name is useful for warning negative values in operator<<
+    void set_debug_name(const butil::StringPiece& name) {
+        _debug_name.assign(name.data(), name.size());
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LogHistogram);
+
+    struct Octave {
+        butil::atomic<int64_t> counts[HistogramBuckets::BUCKETS_PER_OCTAVE];
+    };
+    static const int NUM_OCTAVES = HistogramBuckets::MAX_OCTAVE + 1;
+
+    // Modified by the owning thread only, read by others.
+    struct Agent : public butil::LinkNode<Agent> {
+        Agent();
+        ~Agent();
+        void add_to(HistogramBuckets* b) const;
+        void clear();
+
+        LogHistogram* histogram;
+        butil::atomic<int64_t> zero_count;
+        butil::atomic<int64_t> sum;
+        // Allocated on first value in the octave, freed with the thread or
+        // the histogram.
+        butil::atomic<Octave*> octaves[NUM_OCTAVES];
+    };
+    typedef detail::AgentGroup<Agent> AgentGroup;
+
+    Agent* get_or_create_tls_agent();
+    // Called from the thread owning the agent.
+    void commit_and_erase(Agent* agent);
+
+    AgentId _id;
+    sampler_type* _sampler;
+    std::string _debug_name;
+    mutable butil::Lock _lock;
+    // Values of exited threads.
+    HistogramBuckets _global;
+    // Values before last reset(), thread-local buckets are not reset to keep
+    // them modified by owning threads only.
+    HistogramBuckets _reset_base;
+    butil::LinkedList<Agent> _agents;
+};
+
+typedef Window<LogHistogram, SERIES_IN_SECOND> HistogramWindow;
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  //BVAR_DETAIL_LOG_HISTOGRAM_H
@@ -17,8 +17,14 @@
 
 // Date: Tue Jul 28 18:14:40 CST 2015
 
+#include <pthread.h>
+#include <algorithm>
+#include <typeinfo>
+#include <vector>
 #include <gflags/gflags.h>
+#include "butil/atomicops.h"
 #include "butil/threading/platform_thread.h"
+#include "butil/thread_local.h"
 #include "butil/time.h"
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "bvar/reducer.h"
@@ -30,6 +36,22 @@ namespace bvar {
 namespace detail {
 
 const int WARN_NOSLEEP_THRESHOLD = 2;
+const int MAX_SAMPLER_THREADS = 64;
+
+DEFINE_int32(bvar_sampler_thread_num, 1, "Number of threads calling "
+             "take_sample() of bvar, samplers are spread evenly to the threads");
+
+// validator (to make the gflag reloadable in brpc)
+static bool validate_bvar_sampler_thread_num(const char*, int32_t v) {
+    if (v < 1 || v > MAX_SAMPLER_THREADS) {
+        LOG(ERROR) << "Invalid bvar_sampler_thread_num=" << v;
+        return false;
+    }
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bvar_sampler_thread_num =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_sampler_thread_num,
+                                       validate_bvar_sampler_thread_num);
 
 // Combine two circular linked list into one.
 struct CombineSampler {
@@ -49,6 +71,83 @@ struct CombineSampler {
 // of child as well, no need to register in the child again.
 static bool registered_atfork = false;
 
+// Time of the batch being sampled in this thread, 0 outside batches.
+static BAIDU_THREAD_LOCAL int64_t tls_sample_time_us = 0;
+
+int64_t sample_time_us() {
+    return tls_sample_time_us ? tls_sample_time_us : butil::gettimeofday_us();
+}
+
+// Samplers of the same type, which run same code on similar data and are
+// sampled in a batch sharing one timestamp.
+struct SamplerBatch {
+    const std::type_info* type;
+    bool take_first;
+    std::vector<Sampler*> samplers;
+};
+
+// Samplers sampled by one thread.
+struct SamplerShard {
+    SamplerShard() : nsampler(0), cumulated_time_us(0) {}
+
+    void add(Sampler* s);
+    // Take samples of batches whose take_first equals to `take_first',
+    // and delete destroyed samplers.
+    void take_samples(bool take_first);
+
+    std::vector<SamplerBatch> batches;
+    size_t nsampler;
+    butil::atomic<int64_t> cumulated_time_us;
+};
+
+void SamplerShard::add(Sampler* s) {
+    const std::type_info* type = &typeid(*s);
+    // Samplers are mostly created in groups of the same type, search
+    // from the latest batch.
+    for (size_t i = batches.size(); i > 0; --i) {
+        if (*batches[i - 1].type == *type) {
+            batches[i - 1].samplers.push_back(s);
+            ++nsampler;
+            return;
+        }
+    }
+    batches.push_back(SamplerBatch());
+    batches.back().type = type;
+    batches.back().take_first = s->_take_first;
+    batches.back().samplers.push_back(s);
+    ++nsampler;
+}
+
+void SamplerShard::take_samples(bool take_first) {
+    const int64_t begin_us = butil::gettimeofday_us();
+    for (size_t i = 0; i < batches.size(); ++i) {
+        SamplerBatch& batch = batches[i];
+        if (batch.take_first != take_first) {
+            continue;
+        }
+        tls_sample_time_us = butil::gettimeofday_us();
+        std::vector<Sampler*>& samplers = batch.samplers;
+        size_t nkept = 0;
+        for (size_t j = 0; j < samplers.size(); ++j) {
+            Sampler* s = samplers[j];
+            s->_mutex.lock();
+            if (!s->_used) {
+                s->_mutex.unlock();
+                delete s;
+            } else {
+                s->take_sample();
+                s->_mutex.unlock();
+                samplers[nkept++] = s;
+            }
+        }
+        nsampler -= samplers.size() - nkept;
+        samplers.resize(nkept);
+    }
+    tls_sample_time_us = 0;
+    cumulated_time_us.fetch_add(butil::gettimeofday_us() - begin_us,
+                                butil::memory_order_relaxed);
+}
+
 // Call take_sample() of all scheduled samplers.
 // This can be done with regular timer thread, but it's way too slow(global
 // contention + log(N) heap manipulations). We need it to be super fast so that
@@ -57,15 +156,25 @@ static bool registered_atfork = false;
 // doubly linked, thus we can reduce multiple Samplers into one cicurlarly
 // doubly linked list, and multiple lists into larger lists. We create a
 // dedicated thread to periodically get_value() which is just the combined
-// list of Samplers. Waking through the list and call take_sample().
+// list of Samplers. The samplers are moved into shards and grouped by types,
+// the dedicated thread samples the first shard and wakes up
+// -bvar_sampler_thread_num - 1 threads to sample the others in parallel.
+// Samplers of reducers are sampled before others in each round since
+// samplers of Window<> and series read them.
 // If a Sampler needs to be deleted, we just mark it as unused and the
-// deletion is taken place in the thread as well.
+// deletion is taken place in the sampling threads as well.
 class SamplerCollector : public bvar::Reducer<Sampler*, CombineSampler> {
 public:
     SamplerCollector()
         : _created(false)
         , _stop(false)
-        , _cumulated_time_us(0) {
+        , _nworker(0)
+        , _task_seq(0)
+        , _task_take_first(false)
+        , _npending(0)
+        , _lag_us(0) {
+        init_worker_sync();
+        _shards.push_back(new SamplerShard);
         create_sampling_thread();
     }
     ~SamplerCollector() {
@@ -102,11 +211,27 @@ private:
     }
 
     void after_forked_as_child() {
+        // Workers are gone in the child, and the mutex might be locked
+        // by one of them. Samplers of their shards are kept.
+        init_worker_sync();
+        _nworker = 0;
+        _task_seq = 0;
+        _npending = 0;
         _created = false;
         create_sampling_thread();
     }
 
+    void init_worker_sync() {
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_task_cond, NULL);
+        pthread_cond_init(&_done_cond, NULL);
+    }
+
     void run();
+    void add_worker_if_needed();
+    void rebalance(size_t nshard);
+    void take_samples(bool take_first);
+    void run_worker(size_t index, uint64_t seen_seq);
 
     static void* sampling_thread(void* arg) {
         butil::PlatformThread::SetName("bvar_sampler");
@@ -114,24 +239,158 @@ private:
         return NULL;
     }
 
+    struct WorkerArg {
+        SamplerCollector* collector;
+        size_t index;
+        // Rounds dispatched before creation of the worker.
+        uint64_t task_seq;
+    };
+
+    static void* worker_thread(void* arg) {
+        butil::PlatformThread::SetName("bvar_sampler");
+        WorkerArg* warg = static_cast<WorkerArg*>(arg);
+        SamplerCollector* c = warg->collector;
+        const size_t index = warg->index;
+        const uint64_t task_seq = warg->task_seq;
+        delete warg;
+        c->run_worker(index, task_seq);
+        return NULL;
+    }
+
     static double get_cumulated_time(void* arg) {
-        return static_cast<SamplerCollector*>(arg)->_cumulated_time_us / 1000.0 / 1000.0;
+        SamplerCollector* c = static_cast<SamplerCollector*>(arg);
+        int64_t cumulated_time_us = 0;
+        BAIDU_SCOPED_LOCK(c->_mutex);
+        for (size_t i = 0; i < c->_shards.size(); ++i) {
+            cumulated_time_us += c->_shards[i]->cumulated_time_us.load(
+                butil::memory_order_relaxed);
+        }
+        return cumulated_time_us / 1000.0 / 1000.0;
+    }
+
+    static int64_t get_lag_us(void* arg) {
+        SamplerCollector* c = static_cast<SamplerCollector*>(arg);
+        BAIDU_SCOPED_LOCK(c->_mutex);
+        return c->_lag_us;
     }
 
 private:
     bool _created;
     bool _stop;
-    int64_t _cumulated_time_us;
     pthread_t _tid;
+    // Modified by the dedicated thread only, when workers are idle.
+    std::vector<SamplerShard*> _shards;
+    size_t _nworker;
+    // Following fields are protected by _mutex.
+    pthread_mutex_t _mutex;
+    pthread_cond_t _task_cond;
+    pthread_cond_t _done_cond;
+    uint64_t _task_seq;
+    bool _task_take_first;
+    size_t _npending;
+    // How late the last round finished, compared to the time it should
+    // start at.
+    int64_t _lag_us;
 };
 
 #ifndef UNIT_TEST
 static PassiveStatus<double>* s_cumulated_time_bvar = NULL;
 static bvar::PerSecond<bvar::PassiveStatus<double> >* s_sampling_thread_usage_bvar = NULL;
+static PassiveStatus<int64_t>* s_sampling_lag_bvar = NULL;
 #endif
 
 DEFINE_int32(bvar_sampler_thread_start_delay_us, 10000, "bvar sampler thread start delay us");
 
+void SamplerCollector::add_worker_if_needed() {
+    const size_t nshard = std::max(1, std::min(FLAGS_bvar_sampler_thread_num,
+                                               MAX_SAMPLER_THREADS));
+    while (_nworker + 1 < nshard) {
+        if (_shards.size() <= _nworker + 1) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            _shards.push_back(new SamplerShard);
+        }
+        WorkerArg* arg = new WorkerArg;
+        arg->collector = this;
+        arg->index = _nworker + 1;
+        arg->task_seq = _task_seq;
+        pthread_t th;
+        const int rc = pthread_create(&th, NULL, worker_thread, arg);
+        if (rc != 0) {
+            LOG(ERROR) << "Fail to create sampling thread, " << berror(rc);
+            delete arg;
+            break;
+        }
+        pthread_detach(th);
+        ++_nworker;
+    }
+    // Workers are never quit, shards beyond -bvar_sampler_thread_num are
+    // just emptied.
+    const size_t nactive = std::min(nshard, _nworker + 1);
+    bool balanced = true;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        if (i >= nactive ? _shards[i]->nsampler != 0 :
+            _shards[i]->nsampler * 2 + 64 < _shards[0]->nsampler) {
+            balanced = false;
+        }
+    }
+    if (!balanced) {
+        rebalance(nactive);
+    }
+}
+
+void SamplerCollector::rebalance(size_t nshard) {
+    std::vector<Sampler*> all;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        SamplerShard* shard = _shards[i];
+        for (size_t j = 0; j < shard->batches.size(); ++j) {
+            std::vector<Sampler*>& samplers = shard->batches[j].samplers;
+            all.insert(all.end(), samplers.begin(), samplers.end());
+        }
+        shard->batches.clear();
+        shard->nsampler = 0;
+    }
+    // Keep samplers of the same type together in each shard.
+    for (size_t i = 0; i < all.size(); ++i) {
+        _shards[i * nshard / all.size()]->add(all[i]);
+    }
+}
+
+void SamplerCollector::take_samples(bool take_first) {
+    pthread_mutex_lock(&_mutex);
+    _task_take_first = take_first;
+    _npending = _nworker;
+    ++_task_seq;
+    pthread_cond_broadcast(&_task_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    _shards[0]->take_samples(take_first);
+
+    pthread_mutex_lock(&_mutex);
+    while (_npending != 0) {
+        pthread_cond_wait(&_done_cond, &_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void SamplerCollector::run_worker(size_t index, uint64_t seen_seq) {
+    pthread_mutex_lock(&_mutex);
+    while (true) {
+        while (_task_seq == seen_seq) {
+            pthread_cond_wait(&_task_cond, &_mutex);
+        }
+        seen_seq = _task_seq;
+        const bool take_first = _task_take_first;
+        pthread_mutex_unlock(&_mutex);
+
+        _shards[index]->take_samples(take_first);
+
+        pthread_mutex_lock(&_mutex);
+        if (--_npending == 0) {
+            pthread_cond_signal(&_done_cond);
+        }
+    }
+}
+
 void SamplerCollector::run() {
     ::usleep(FLAGS_bvar_sampler_thread_start_delay_us);
     
@@ -150,34 +409,42 @@ void SamplerCollector::run() {
             new bvar::PerSecond<bvar::PassiveStatus<double> >(
                     "bvar_sampler_collector_usage", s_cumulated_time_bvar, 10);
     }
+    if (s_sampling_lag_bvar == NULL) {
+        s_sampling_lag_bvar = new PassiveStatus<int64_t>(
+            "bvar_sampler_collector_lag_us", get_lag_us, this);
+    }
 #endif
 
-    butil::LinkNode<Sampler> root;
     int consecutive_nosleep = 0;
+    int64_t abstime = butil::gettimeofday_us();
     while (!_stop) {
-        int64_t abstime = butil::gettimeofday_us();
+        add_worker_if_needed();
         Sampler* s = this->reset();
         if (s) {
+            // Move new samplers into the shards with fewest samplers.
+            butil::LinkNode<Sampler> root;
             s->InsertBeforeAsList(&root);
-        }
-        for (butil::LinkNode<Sampler>* p = root.next(); p != &root;) {
-            // We may remove p from the list, save next first.
-            butil::LinkNode<Sampler>* saved_next = p->next();
-            Sampler* s = p->value();
-            s->_mutex.lock();
-            if (!s->_used) {
-                s->_mutex.unlock();
+            for (butil::LinkNode<Sampler>* p = root.next(); p != &root;) {
+                butil::LinkNode<Sampler>* saved_next = p->next();
                 p->RemoveFromList();
-                delete s;
-            } else {
-                s->take_sample();
-                s->_mutex.unlock();
+                SamplerShard* shard = _shards[0];
+                for (size_t i = 1; i <= _nworker &&
+                         (int)i < FLAGS_bvar_sampler_thread_num; ++i) {
+                    if (_shards[i]->nsampler < shard->nsampler) {
+                        shard = _shards[i];
+                    }
+                }
+                shard->add(p->value());
+                p = saved_next;
             }
-            p = saved_next;
         }
+        take_samples(true);
+        take_samples(false);
         bool slept = false;
         int64_t now = butil::gettimeofday_us();
-        _cumulated_time_us += now - abstime;
+        pthread_mutex_lock(&_mutex);
+        _lag_us = now - abstime;
+        pthread_mutex_unlock(&_mutex);
         abstime += 1000000L;
         while (abstime > now) {
             ::usleep(abstime - now);
@@ -187,6 +454,8 @@ void SamplerCollector::run() {
         if (slept) {
             consecutive_nosleep = 0;
         } else {            
+            // Don't catch up missed rounds.
+            abstime = now;
             if (++consecutive_nosleep >= WARN_NOSLEEP_THRESHOLD) {
                 consecutive_nosleep = 0;
                 LOG(WARNING) << "bvar is busy at sampling for "
@@ -196,7 +465,7 @@ void SamplerCollector::run() {
     }
 }
 
-Sampler::Sampler() : _used(true) {}
+Sampler::Sampler() : _used(true), _take_first(false) {}
 
 Sampler::~Sampler() {}
 
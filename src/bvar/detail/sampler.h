@@ -62,11 +62,20 @@ protected:
     virtual ~Sampler();
     
 friend class SamplerCollector;
+friend struct SamplerShard;
     bool _used;
+    // Samplers of reducers set this to be sampled before others in each
+    // round, since other samplers may read the samples.
+    bool _take_first;
     // Sync destroy() and take_sample().
     butil::Mutex _mutex;
 };
 
+// Timestamp for samples taken in take_sample(). Samplers of the same type
+// are sampled in batches sharing one timestamp, gettimeofday_us() is
+// returned if the calling thread is not sampling a batch.
+int64_t sample_time_us();
+
 // Representing a non-existing operator so that we can test
 // is_same<Op, VoidOp>::value to write code for different branches.
 // The false branch should be removed by compiler at compile-time.
@@ -92,7 +101,8 @@ public:
     explicit ReducerSampler(R* reducer)
         : _reducer(reducer)
         , _window_size(1) {
-        
+        _take_first = true;
+
         // Invoked take_sample at begining so the value of the first second
         // would not be ignored
         take_sample();
@@ -136,7 +146,7 @@ public:
             // get_value() of _reducer can still be called.
             latest.data = _reducer->get_value();
         }
-        latest.time_us = butil::gettimeofday_us();
+        latest.time_us = sample_time_us();
         _q.elim_push(latest);
     }
 
@@ -28,6 +28,10 @@ namespace bvar {
 DEFINE_int32(bvar_latency_p1, 80, "First latency percentile");
 DEFINE_int32(bvar_latency_p2, 90, "Second latency percentile");
 DEFINE_int32(bvar_latency_p3, 99, "Third latency percentile");
+DEFINE_bool(bvar_latency_histogram, false, "Record latencies of LatencyRecorders"
+            " created afterwards into log-bucketed histograms instead of"
+            " sampled percentiles, high percentiles are more accurate and"
+            " the buckets can be exported");
 
 static bool valid_percentile(const char*, int32_t v) {
     return v > 0 && v < 100;
@@ -43,7 +47,7 @@ namespace detail {
 
 typedef PercentileSamples<1022> CombinedPercentileSamples;
 
-CDF::CDF(PercentileWindow* w) : _w(w) {}
+CDF::CDF(PercentileWindow* w, HistogramWindow* hw) : _w(w), _hw(hw) {}
 
 CDF::~CDF() {
     hide();
@@ -61,22 +65,34 @@ int CDF::describe_series(
     if (options.test_only) {
         return 0;
     }
-    std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
-    std::vector<GlobalPercentileSamples> buckets;
-    _w->get_samples(&buckets);
-    for (size_t i = 0; i < buckets.size(); ++i) {
-        cb->combine_of(buckets.begin(), buckets.end());
-    }
     std::pair<int, int> values[20];
     size_t n = 0;
-    for (int i = 1; i < 10; ++i) {
-        values[n++] = std::make_pair(i*10, cb->get_number(i * 0.1));
-    }
-    for (int i = 91; i < 100; ++i) {
-        values[n++] = std::make_pair(i, cb->get_number(i * 0.01));
+    if (_hw != NULL) {
+        const HistogramBuckets hb = _hw->get_value();
+        for (int i = 1; i < 10; ++i) {
+            values[n++] = std::make_pair(i*10, hb.get_number(i * 0.1));
+        }
+        for (int i = 91; i < 100; ++i) {
+            values[n++] = std::make_pair(i, hb.get_number(i * 0.01));
+        }
+        values[n++] = std::make_pair(100, hb.get_number(0.999));
+        values[n++] = std::make_pair(101, hb.get_number(0.9999));
+    } else {
+        std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
+        std::vector<GlobalPercentileSamples> buckets;
+        _w->get_samples(&buckets);
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            cb->combine_of(buckets.begin(), buckets.end());
+        }
+        for (int i = 1; i < 10; ++i) {
+            values[n++] = std::make_pair(i*10, cb->get_number(i * 0.1));
+        }
+        for (int i = 91; i < 100; ++i) {
+            values[n++] = std::make_pair(i, cb->get_number(i * 0.01));
+        }
+        values[n++] = std::make_pair(100, cb->get_number(0.999));
+        values[n++] = std::make_pair(101, cb->get_number(0.9999));
     }
-    values[n++] = std::make_pair(100, cb->get_number(0.999));
-    values[n++] = std::make_pair(101, cb->get_number(0.9999));
     CHECK_EQ(n, arraysize(values));
     os << "{\"label\":\"cdf\",\"data\":[";
     for (size_t i = 0; i < n; ++i) {
@@ -89,6 +105,23 @@ int CDF::describe_series(
     return 0;
 }
 
+LatencyHistogram::~LatencyHistogram() {
+    hide();
+}
+
+void LatencyHistogram::describe(std::ostream& os, bool quote_string) const {
+    if (quote_string) {
+        os << '"' << _h->get_value() << '"';
+    } else {
+        os << _h->get_value();
+    }
+}
+
+bool LatencyHistogram::get_histogram(HistogramBuckets* buckets) const {
+    *buckets = _h->get_value();
+    return true;
+}
+
 // Return random int value with expectation = `dval'
 static int64_t double_to_random_int(double dval) {
     int64_t ival = static_cast<int64_t>(dval);
@@ -141,17 +174,7 @@ static int64_t get_p3(void* arg) {
 }
 
 static Vector<int64_t, 4> get_latencies(void *arg) {
-    std::unique_ptr<CombinedPercentileSamples> cb(
-        combine((PercentileWindow*)arg));
-    // NOTE: We don't show 99.99% since it's often significantly larger than
-    // other values and make other curves on the plotted graph small and
-    // hard to read.
-    Vector<int64_t, 4> result;
-    result[0] = cb->get_number(FLAGS_bvar_latency_p1 / 100.0);
-    result[1] = cb->get_number(FLAGS_bvar_latency_p2 / 100.0);
-    result[2] = cb->get_number(FLAGS_bvar_latency_p3 / 100.0);
-    result[3] = cb->get_number(0.999);
-    return result;
+    return static_cast<LatencyRecorder*>(arg)->latency_percentiles();
 }
 
 LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
@@ -161,21 +184,48 @@ LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
     , _count(get_recorder_count, &_latency)
     , _qps(get_window_recorder_qps, &_latency_window)
     , _latency_percentile_window(&_latency_percentile, window_size)
+    , _latency_histogram(FLAGS_bvar_latency_histogram ? new LogHistogram : NULL)
+    , _latency_histogram_window(_latency_histogram ?
+          new HistogramWindow(_latency_histogram, window_size) : NULL)
     , _latency_p1(get_p1, this)
     , _latency_p2(get_p2, this)
     , _latency_p3(get_p3, this)
     , _latency_999(get_percetile<999, 1000>, this)
     , _latency_9999(get_percetile<9999, 10000>, this)
-    , _latency_cdf(&_latency_percentile_window)
-    , _latency_percentiles(get_latencies, &_latency_percentile_window)
+    , _latency_cdf(&_latency_percentile_window, _latency_histogram_window)
+    , _latency_percentiles(get_latencies, this)
+    , _latency_histogram_var(_latency_histogram)
 {}
 
+LatencyRecorderBase::~LatencyRecorderBase() {
+    // The window samples the histogram.
+    delete _latency_histogram_window;
+    delete _latency_histogram;
+}
+
 }  // namespace detail
 
 Vector<int64_t, 4> LatencyRecorder::latency_percentiles() const {
+    // NOTE: We don't show 99.99% since it's often significantly larger than
+    // other values and make other curves on the plotted graph small and
+    // hard to read.
+    Vector<int64_t, 4> result;
+    if (_latency_histogram_window) {
+        const detail::HistogramBuckets hb = _latency_histogram_window->get_value();
+        result[0] = hb.get_number(FLAGS_bvar_latency_p1 / 100.0);
+        result[1] = hb.get_number(FLAGS_bvar_latency_p2 / 100.0);
+        result[2] = hb.get_number(FLAGS_bvar_latency_p3 / 100.0);
+        result[3] = hb.get_number(0.999);
+        return result;
+    }
     // const_cast here is just to adapt parameter type and safe.
-    return detail::get_latencies(
-        const_cast<detail::PercentileWindow*>(&_latency_percentile_window));
+    std::unique_ptr<detail::CombinedPercentileSamples> cb(
+        combine(const_cast<detail::PercentileWindow*>(&_latency_percentile_window)));
+    result[0] = cb->get_number(FLAGS_bvar_latency_p1 / 100.0);
+    result[1] = cb->get_number(FLAGS_bvar_latency_p2 / 100.0);
+    result[2] = cb->get_number(FLAGS_bvar_latency_p3 / 100.0);
+    result[3] = cb->get_number(0.999);
+    return result;
 }
 
 int64_t LatencyRecorder::qps(time_t window_size) const {
@@ -215,6 +265,9 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
     // set debug names for printing helpful error log.
     _latency.set_debug_name(prefix);
     _latency_percentile.set_debug_name(prefix);
+    if (_latency_histogram) {
+        _latency_histogram->set_debug_name(prefix);
+    }
 
     if (_latency_window.expose_as(prefix, "latency") != 0) {
         return -1;
@@ -253,6 +306,11 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
     if (_latency_percentiles.expose_as(prefix, "latency_percentiles", DISPLAY_ON_HTML) != 0) {
         return -1;
     }
+    if (_latency_histogram &&
+        _latency_histogram_var.expose_as(prefix, "latency_histogram",
+                                         DISPLAY_ON_PLAIN_TEXT) != 0) {
+        return -1;
+    }
     snprintf(namebuf, sizeof(namebuf), "%d%%,%d%%,%d%%,99.9%%",
              (int)FLAGS_bvar_latency_p1, (int)FLAGS_bvar_latency_p2,
              (int)FLAGS_bvar_latency_p3);
@@ -261,11 +319,31 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 }
 
 int64_t LatencyRecorder::latency_percentile(double ratio) const {
+    if (_latency_histogram_window) {
+        return _latency_histogram_window->get_value().get_number(ratio);
+    }
     std::unique_ptr<detail::CombinedPercentileSamples> cb(
         combine((detail::PercentileWindow*)&_latency_percentile_window));
     return cb->get_number(ratio);
 }
 
+bool LatencyRecorder::latency_histogram(detail::HistogramBuckets* buckets) const {
+    if (_latency_histogram_window == NULL) {
+        return false;
+    }
+    *buckets = _latency_histogram_window->get_value();
+    return true;
+}
+
+bool LatencyRecorder::total_latency_histogram(
+    detail::HistogramBuckets* buckets) const {
+    if (_latency_histogram == NULL) {
+        return false;
+    }
+    *buckets = _latency_histogram->get_value();
+    return true;
+}
+
 void LatencyRecorder::hide() {
     _latency_window.hide();
     _max_latency_window.hide();
@@ -278,12 +356,17 @@ void LatencyRecorder::hide() {
     _latency_9999.hide();
     _latency_cdf.hide();
     _latency_percentiles.hide();
+    _latency_histogram_var.hide();
 }
 
 LatencyRecorder& LatencyRecorder::operator<<(int64_t latency) {
     _latency << latency;
     _max_latency << latency;
-    _latency_percentile << latency;
+    if (_latency_histogram) {
+        *_latency_histogram << latency;
+    } else {
+        _latency_percentile << latency;
+    }
     return *this;
 }
 
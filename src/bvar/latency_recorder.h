@@ -24,6 +24,7 @@
 #include "bvar/reducer.h"
 #include "bvar/passive_status.h"
 #include "bvar/detail/percentile.h"
+#include "bvar/detail/log_histogram.h"
 
 namespace bvar {
 namespace detail {
@@ -37,18 +38,33 @@ typedef Window<Percentile, SERIES_IN_SECOND> PercentileWindow;
 
 class CDF : public Variable {
 public:
-    explicit CDF(PercentileWindow* w);
+    // `hw' is used instead of `w' when it's not NULL.
+    CDF(PercentileWindow* w, HistogramWindow* hw);
     ~CDF();
     void describe(std::ostream& os, bool quote_string) const override;
     int describe_series(std::ostream& os, const SeriesOptions& options) const override;
 private:
     PercentileWindow* _w; 
+    HistogramWindow* _hw;
+};
+
+// Exposes all latencies recorded into a LogHistogram, which can be dumped
+// as buckets by Dumper::dump_histogram().
+class LatencyHistogram : public Variable {
+public:
+    explicit LatencyHistogram(LogHistogram* h) : _h(h) {}
+    ~LatencyHistogram();
+    void describe(std::ostream& os, bool quote_string) const override;
+    bool get_histogram(HistogramBuckets* buckets) const override;
+private:
+    LogHistogram* _h;
 };
 
 // For mimic constructor inheritance.
 class LatencyRecorderBase {
 public:
     explicit LatencyRecorderBase(time_t window_size);
+    ~LatencyRecorderBase();
     time_t window_size() const { return _latency_window.window_size(); }
 protected:
     IntRecorder _latency;
@@ -60,6 +76,10 @@ protected:
     PassiveStatus<int64_t> _count;
     PassiveStatus<int64_t> _qps;
     PercentileWindow _latency_percentile_window;
+    // Replace _latency_percentile when -bvar_latency_histogram is true at
+    // construction, NULL otherwise.
+    LogHistogram* _latency_histogram;
+    HistogramWindow* _latency_histogram_window;
     PassiveStatus<int64_t> _latency_p1;
     PassiveStatus<int64_t> _latency_p2;
     PassiveStatus<int64_t> _latency_p3;
@@ -67,6 +87,7 @@ protected:
     PassiveStatus<int64_t> _latency_9999; // 99.99%
     CDF _latency_cdf;
     PassiveStatus<Vector<int64_t, 4> > _latency_percentiles;
+    LatencyHistogram _latency_histogram_var;
 };
 } // namespace detail
 
@@ -104,6 +125,8 @@ public:
     // Example:
     //   LatencyRecorder rec;
     //   rec.expose("foo_bar_write");     // foo_bar_write_latency
+    //                                    // foo_bar_write_latency_histogram
+    //                                    //   (with -bvar_latency_histogram)
     //                                    // foo_bar_write_max_latency
     //                                    // foo_bar_write_count
     //                                    // foo_bar_write_qps
@@ -146,6 +169,16 @@ public:
     // E.g. 0.99 means 99%-ile
     int64_t latency_percentile(double ratio) const;
 
+    // Get buckets of latencies in recent window_size-to-ctor seconds.
+    // Returns false if latencies are not recorded into histograms, see
+    // -bvar_latency_histogram.
+    bool latency_histogram(detail::HistogramBuckets* buckets) const;
+
+    // Get buckets of all latencies recorded since creation, which are
+    // mergeable across processes and summable over time.
+    // Returns false if latencies are not recorded into histograms.
+    bool total_latency_histogram(detail::HistogramBuckets* buckets) const;
+
     // Get name of a sub-bvar.
     const std::string& latency_name() const { return _latency_window.name(); }
     const std::string& latency_percentiles_name() const
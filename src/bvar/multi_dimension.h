@@ -20,8 +20,12 @@
 #ifndef BVAR_MULTI_DIMENSION_H
 #define BVAR_MULTI_DIMENSION_H
 
+#include <deque>
 #include "butil/logging.h"                           // LOG
 #include "butil/macros.h"                            // BAIDU_CASSERT
+#include "butil/atomicops.h"                         // butil::atomic
+#include "butil/time.h"                              // cpuwide_time_ms
+#include "butil/synchronization/lock.h"              // butil::Mutex
 #include "butil/scoped_lock.h"                       // BAIDU_SCOPE_LOCK
 #include "butil/containers/doubly_buffered_data.h"   // DBD
 #include "butil/containers/flat_map.h"               // butil::FlatMap
@@ -31,6 +35,10 @@ namespace bvar {
 
 constexpr uint64_t MAX_MULTI_DIMENSION_STATS_COUNT = 20000;
 
+// Label value of the stats that others are routed into, see
+// MultiDimension::OVERFLOW_TO_OTHER.
+constexpr const char* MULTI_DIMENSION_OTHER_LABEL_VALUE = "other";
+
 template <typename  T>
 class MultiDimension : public MVariable {
 public:
@@ -40,6 +48,21 @@ public:
         READ_OR_INSERT,
     };
 
+    // What get_stats() does with label values not seen before when there
+    // are already max_stats_count() stats.
+    enum OVERFLOW_POLICY {
+        // Return NULL.
+        OVERFLOW_REJECT,
+        // Delete the least recently got stats to make room. Evicted stats
+        // are deleted -bvar_evicted_stats_delete_delay_s later, so pointers
+        // returned by get_stats() can be used shortly but should not be
+        // kept.
+        OVERFLOW_EVICT,
+        // Return the stats whose label values are all
+        // MULTI_DIMENSION_OTHER_LABEL_VALUE, which is not limited.
+        OVERFLOW_TO_OTHER,
+    };
+
     typedef MVariable Base;
     typedef std::list<std::string> key_type;
     typedef T value_type;
@@ -47,15 +70,23 @@ public:
 
     struct KeyHash {
         size_t operator() (const key_type& key) const {
+            // Order matters, {"a", "b"} and {"b", "a"} are different keys.
             size_t hash_value = 0;
             for (auto &k : key) {
-                hash_value += std::hash<std::string>()(k);
+                hash_value = hash_value * 31 + std::hash<std::string>()(k);
             }
             return hash_value;
         }
     };
-    
-    typedef value_ptr_type op_value_type;
+
+    struct Stats {
+        Stats() : last_access_ms(0) {}
+        T value;
+        // Updated by get_stats() with OVERFLOW_EVICT only.
+        butil::atomic<int64_t> last_access_ms;
+    };
+
+    typedef Stats* op_value_type;
     typedef typename butil::FlatMap<key_type, op_value_type, KeyHash> MetricMap;
 
     typedef typename MetricMap::const_iterator MetricMapConstIterator;
@@ -94,6 +125,24 @@ public:
     // Get number of stats
     size_t count_stats();
 
+    // Limit the number of stats to `max_stats_count' (the default is
+    // MAX_MULTI_DIMENSION_STATS_COUNT) and handle labels beyond the limit
+    // with `policy' (the default is OVERFLOW_REJECT). Labels like caller
+    // addresses or user ids should be bounded this way, otherwise the
+    // stats grow without bound.
+    // Call this before any get_stats().
+    void set_max_stats_count(size_t max_stats_count, OVERFLOW_POLICY policy);
+    size_t max_stats_count() const { return _max_stats_count; }
+
+    // Number of stats deleted by OVERFLOW_EVICT.
+    int64_t evicted_count() const
+    { return _evicted_count.load(butil::memory_order_relaxed); }
+
+    // Number of get_stats() with new label values beyond the limit, namely
+    // rejected ones, ones making room and ones routed to the other stats.
+    int64_t overflow_count() const
+    { return _overflow_count.load(butil::memory_order_relaxed); }
+
     // Put name of all stats label into `names'
     void list_stats(std::vector<key_type>* names);
     
@@ -118,24 +167,40 @@ private:
 
     T* get_stats_impl(const key_type& labels_value, STATS_OP stats_op, bool* do_write = NULL);
 
+    // `extra_label' is appended to the labels if it's not empty, like
+    // quantile="0.99".
     void make_dump_key(std::ostream& os, 
                        const key_type& labels_value, 
                        const std::string& suffix = "", 
-                       const int quantile = 0);
+                       const std::string& extra_label = "");
 
     void make_labels_kvpair_string(std::ostream& os, 
                        const key_type& labels_value, 
-                       const int quantile);
+                       const std::string& extra_label);
 
     bool is_valid_lables_value(const key_type& labels_value) const;
     
     // Remove all stats so those not count and dump
     void delete_stats();
+
+    // Remove least recently got stats from a full map.
+    void evict_stats();
+
+    // Delete evicted stats retired long enough, or all of them if `all'.
+    void delete_retired_stats(bool all);
     
     static size_t init_flatmap(MetricMap& bg);
     
 private:
     MetricMapDBD _metric_map;
+    size_t _max_stats_count;
+    OVERFLOW_POLICY _overflow_policy;
+    butil::atomic<int64_t> _evicted_count;
+    butil::atomic<int64_t> _overflow_count;
+    // Evicted stats with the time they were removed from _metric_map, in
+    // time order.
+    butil::Mutex _retired_mutex;
+    std::deque<std::pair<int64_t, op_value_type> > _retired_stats;
 };
 
 } // namespace bvar
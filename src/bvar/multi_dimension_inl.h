@@ -20,6 +20,7 @@
 #ifndef BVAR_MULTI_DIMENSION_INL_H
 #define BVAR_MULTI_DIMENSION_INL_H
 
+#include <algorithm>                                 // std::nth_element
 #include <gflags/gflags_declare.h>
 
 namespace bvar {
@@ -27,6 +28,7 @@ namespace bvar {
 DECLARE_int32(bvar_latency_p1);
 DECLARE_int32(bvar_latency_p2);
 DECLARE_int32(bvar_latency_p3);
+DECLARE_int32(bvar_evicted_stats_delete_delay_s);
 
 static const std::string ALLOW_UNUSED METRIC_TYPE_COUNTER = "counter";
 static const std::string ALLOW_UNUSED METRIC_TYPE_SUMMARY = "summary";
@@ -37,6 +39,11 @@ template <typename T>
 inline
 MultiDimension<T>::MultiDimension(const key_type& labels)
     : Base(labels)
+    , _metric_map(butil::DOUBLY_BUFFERED_DATA_EPOCH)
+    , _max_stats_count(MAX_MULTI_DIMENSION_STATS_COUNT)
+    , _overflow_policy(OVERFLOW_REJECT)
+    , _evicted_count(0)
+    , _overflow_count(0)
 {
     _metric_map.Modify(init_flatmap);
 }
@@ -46,6 +53,11 @@ inline
 MultiDimension<T>::MultiDimension(const butil::StringPiece& name,
                                   const key_type& labels)
     : Base(labels)
+    , _metric_map(butil::DOUBLY_BUFFERED_DATA_EPOCH)
+    , _max_stats_count(MAX_MULTI_DIMENSION_STATS_COUNT)
+    , _overflow_policy(OVERFLOW_REJECT)
+    , _evicted_count(0)
+    , _overflow_count(0)
 {
     _metric_map.Modify(init_flatmap);
     this->expose(name);
@@ -57,6 +69,11 @@ MultiDimension<T>::MultiDimension(const butil::StringPiece& prefix,
                                   const butil::StringPiece& name,
                                   const key_type& labels)
     : Base(labels)
+    , _metric_map(butil::DOUBLY_BUFFERED_DATA_EPOCH)
+    , _max_stats_count(MAX_MULTI_DIMENSION_STATS_COUNT)
+    , _overflow_policy(OVERFLOW_REJECT)
+    , _evicted_count(0)
+    , _overflow_count(0)
 {
     _metric_map.Modify(init_flatmap);
     this->expose_as(prefix, name);
@@ -66,6 +83,15 @@ template <typename T>
 MultiDimension<T>::~MultiDimension() {
     hide();
     delete_stats();
+    delete_retired_stats(true);
+}
+
+template <typename T>
+inline
+void MultiDimension<T>::set_max_stats_count(size_t max_stats_count,
+                                            OVERFLOW_POLICY policy) {
+    _max_stats_count = max_stats_count;
+    _overflow_policy = policy;
 }
 
 template <typename T>
@@ -167,7 +193,7 @@ T* MultiDimension<T>::get_stats_impl(const key_type& labels_value) {
     if (it == nullptr) {
         return nullptr;
     }
-    return (*it);
+    return &(*it)->value;
 }
 
 template <typename T>
@@ -176,6 +202,7 @@ T* MultiDimension<T>::get_stats_impl(const key_type& labels_value, STATS_OP stat
     if (!is_valid_lables_value(labels_value)) {
         return nullptr;
     }
+    bool full = false;
     {
         MetricMapScopedPtr metric_map_ptr;
         if (_metric_map.Read(&metric_map_ptr) != 0) {
@@ -185,13 +212,37 @@ T* MultiDimension<T>::get_stats_impl(const key_type& labels_value, STATS_OP stat
 
         auto it = metric_map_ptr->seek(labels_value);
         if (it != NULL) {
-            return (*it);
+            Stats* stats = *it;
+            if (_overflow_policy == OVERFLOW_EVICT) {
+                const int64_t now_ms = butil::cpuwide_time_ms();
+                // Don't write the cacheline shared by threads unless changed.
+                if (stats->last_access_ms.load(butil::memory_order_relaxed) != now_ms) {
+                    stats->last_access_ms.store(now_ms, butil::memory_order_relaxed);
+                }
+            }
+            return &stats->value;
         } else if (READ_ONLY == stats_op) {
             return nullptr;
         }
+        full = metric_map_ptr->size() >= _max_stats_count;
+    }
 
-        if (metric_map_ptr->size() > MAX_MULTI_DIMENSION_STATS_COUNT) {
-            LOG(ERROR) << "Too many stats seen, overflow detected, max stats count:" << MAX_MULTI_DIMENSION_STATS_COUNT;
+    if (full) {
+        if (_overflow_policy == OVERFLOW_TO_OTHER) {
+            const key_type other_labels(labels_value.size(),
+                                        MULTI_DIMENSION_OTHER_LABEL_VALUE);
+            if (labels_value != other_labels) {
+                _overflow_count.fetch_add(1, butil::memory_order_relaxed);
+                return get_stats_impl(other_labels, stats_op, do_write);
+            }
+            // The other stats is beyond the limit.
+        } else if (_overflow_policy == OVERFLOW_EVICT) {
+            _overflow_count.fetch_add(1, butil::memory_order_relaxed);
+            evict_stats();
+        } else {
+            _overflow_count.fetch_add(1, butil::memory_order_relaxed);
+            LOG_EVERY_SECOND(ERROR) << "Too many stats seen, overflow detected, max stats count:"
+                                    << _max_stats_count;
             return nullptr;
         }
     }
@@ -200,7 +251,8 @@ T* MultiDimension<T>::get_stats_impl(const key_type& labels_value, STATS_OP stat
     // In order to avoid new duplicate bvar object, need use cache_metric to cache the new bvar object,
     // In this way, when modifying the second copy, can directly use the cache_metric bvar object.
     op_value_type cache_metric = NULL;
-    auto insert_fn = [&labels_value, &cache_metric, &do_write](MetricMap& bg) {
+    const int64_t now_ms = butil::cpuwide_time_ms();
+    auto insert_fn = [&labels_value, &cache_metric, &do_write, now_ms](MetricMap& bg) {
         auto bg_metric = bg.seek(labels_value);
         if (NULL != bg_metric) {
             cache_metric = *bg_metric;
@@ -212,14 +264,93 @@ T* MultiDimension<T>::get_stats_impl(const key_type& labels_value, STATS_OP stat
         if (NULL != cache_metric) {
             bg.insert(labels_value, cache_metric);
         } else {
-            T* add_metric = new T();
+            op_value_type add_metric = new Stats;
+            add_metric->last_access_ms.store(now_ms, butil::memory_order_relaxed);
             bg.insert(labels_value, add_metric);
             cache_metric = add_metric;
         }
         return 1;
     };
     _metric_map.Modify(insert_fn);
-    return cache_metric;
+    return &cache_metric->value;
+}
+
+template <typename T>
+inline
+void MultiDimension<T>::evict_stats() {
+    // Like delete_stats(), both copies in DBD must erase the same stats, so
+    // choose them when modifying the first copy. Evict 1/16 more than
+    // needed so that following insertions don't scan the map again.
+    std::vector<key_type> evicted_keys;
+    std::vector<op_value_type> evicted;
+    bool chosen = false;
+    const size_t max_stats_count = _max_stats_count;
+    auto evict_fn = [&](MetricMap& bg) {
+        if (!chosen) {
+            chosen = true;
+            if (bg.size() < max_stats_count) {
+                // Evicted by another thread.
+                return (size_t)0;
+            }
+            const size_t n = std::min(bg.size() - max_stats_count + 1 + max_stats_count / 16,
+                                      bg.size());
+            std::vector<std::pair<int64_t, const key_type*> > candidates;
+            candidates.reserve(bg.size());
+            for (auto it = bg.begin(); it != bg.end(); ++it) {
+                candidates.emplace_back(
+                    it->second->last_access_ms.load(butil::memory_order_relaxed), &it->first);
+            }
+            std::nth_element(candidates.begin(), candidates.begin() + (n - 1), candidates.end());
+            for (size_t i = 0; i < n; ++i) {
+                evicted_keys.push_back(*candidates[i].second);
+                evicted.push_back(*bg.seek(evicted_keys.back()));
+            }
+        }
+        size_t erased = 0;
+        for (auto &key : evicted_keys) {
+            erased += bg.erase(key);
+        }
+        return erased;
+    };
+    _metric_map.Modify(evict_fn);
+    if (evicted.empty()) {
+        return;
+    }
+    _evicted_count.fetch_add(evicted.size(), butil::memory_order_relaxed);
+    // Modify() changes the foreground copy only after its readers have gone,
+    // so no reader of the map sees the evicted stats once it returns. But
+    // pointers returned by get_stats() outlive reads of the map, retire the
+    // stats and delete them -bvar_evicted_stats_delete_delay_s later.
+    const int64_t now_us = butil::cpuwide_time_us();
+    {
+        BAIDU_SCOPED_LOCK(_retired_mutex);
+        for (auto stats : evicted) {
+            _retired_stats.emplace_back(now_us, stats);
+        }
+    }
+    delete_retired_stats(false);
+}
+
+template <typename T>
+inline
+void MultiDimension<T>::delete_retired_stats(bool all) {
+    const int64_t deadline_us = butil::cpuwide_time_us() -
+        FLAGS_bvar_evicted_stats_delete_delay_s * 1000000L;
+    std::vector<op_value_type> deleted;
+    {
+        BAIDU_SCOPED_LOCK(_retired_mutex);
+        // Retired in time order.
+        size_t n = 0;
+        while (n < _retired_stats.size() &&
+               (all || _retired_stats[n].first <= deadline_us)) {
+            deleted.push_back(_retired_stats[n].second);
+            ++n;
+        }
+        _retired_stats.erase(_retired_stats.begin(), _retired_stats.begin() + n);
+    }
+    for (auto stats : deleted) {
+        delete stats;
+    }
 }
 
 template <typename T>
@@ -263,76 +394,119 @@ size_t MultiDimension<bvar::LatencyRecorder>::dump(Dumper* dumper, const DumpOpt
         return 0;
     }
     size_t n = 0;
+    // Lines of a metric family must be consecutive, dump families one by one.
+    // latency: summary of recent latencies
+    if (dumper->dump_comment(name() + "_latency", METRIC_TYPE_SUMMARY)) {
+        const int latency_percentiles[3] {
+            FLAGS_bvar_latency_p1, FLAGS_bvar_latency_p2, FLAGS_bvar_latency_p3};
+        for (auto &label_name : label_names) {
+            bvar::LatencyRecorder* bvar = get_stats_impl(label_name);
+            if (!bvar) {
+                continue;
+            }
+            char quantile[32];
+            for (auto lp : latency_percentiles) {
+                snprintf(quantile, sizeof(quantile), "quantile=\"%g\"", lp / 100.0);
+                std::ostringstream oss_lp_key;
+                make_dump_key(oss_lp_key, label_name, "_latency", quantile);
+                if (dumper->dump(oss_lp_key.str(), std::to_string(bvar->latency_percentile(lp / 100.0)))) {
+                    n++;
+                }
+            }
+            std::ostringstream oss_p999_key;
+            make_dump_key(oss_p999_key, label_name, "_latency", "quantile=\"0.999\"");
+            if (dumper->dump(oss_p999_key.str(), std::to_string(bvar->latency_percentile(0.999)))) {
+                n++;
+            }
+            std::ostringstream oss_p9999_key;
+            make_dump_key(oss_p9999_key, label_name, "_latency", "quantile=\"0.9999\"");
+            if (dumper->dump(oss_p9999_key.str(), std::to_string(bvar->latency_percentile(0.9999)))) {
+                n++;
+            }
+            // Sum of latencies is only tracked by histograms, use average *
+            // count as approximation otherwise.
+            const int64_t count = bvar->count();
+            int64_t sum = bvar->latency() * count;
+            detail::HistogramBuckets buckets;
+            if (bvar->total_latency_histogram(&buckets)) {
+                sum = buckets.sum();
+            }
+            std::ostringstream oss_sum_key;
+            make_dump_key(oss_sum_key, label_name, "_latency_sum");
+            if (dumper->dump(oss_sum_key.str(), std::to_string(sum))) {
+                n++;
+            }
+            std::ostringstream oss_count_key;
+            make_dump_key(oss_count_key, label_name, "_latency_count");
+            if (dumper->dump(oss_count_key.str(), std::to_string(count))) {
+                n++;
+            }
+        }
+    }
+
+    // latency_histogram: buckets of all latencies, with -bvar_latency_histogram
+    bool has_histogram = false;
+    detail::HistogramBuckets buckets;
     for (auto &label_name : label_names) {
         bvar::LatencyRecorder* bvar = get_stats_impl(label_name);
-        if (!bvar) {
+        if (!bvar || !bvar->total_latency_histogram(&buckets)) {
             continue;
         }
-
-        // latency comment
-        if (!dumper->dump_comment(name() + "_latency", METRIC_TYPE_GAUGE)) {
-            continue;
+        if (!has_histogram) {
+            if (!dumper->dump_comment(name() + "_latency_histogram", METRIC_TYPE_HISTOGRAM)) {
+                break;
+            }
+            has_histogram = true;
         }
-        // latency
-        std::ostringstream oss_latency_key;
-        make_dump_key(oss_latency_key, label_name, "_latency");
-        if (dumper->dump(oss_latency_key.str(), std::to_string(bvar->latency()))) {
+        std::ostringstream oss_labels;
+        make_labels_kvpair_string(oss_labels, label_name, "");
+        if (dumper->dump_histogram(name() + "_latency_histogram", oss_labels.str(), buckets)) {
             n++;
         }
-        // latency_percentiles
-        // p1/p2/p3
-        int latency_percentiles[3] {FLAGS_bvar_latency_p1, FLAGS_bvar_latency_p2, FLAGS_bvar_latency_p3};
-        for (auto lp : latency_percentiles) {
-            std::ostringstream oss_lp_key;
-            make_dump_key(oss_lp_key, label_name, "_latency", lp);
-            if (dumper->dump(oss_lp_key.str(), std::to_string(bvar->latency_percentile(lp / 100.0)))) {
+    }
+
+    // max_latency
+    if (dumper->dump_comment(name() + "_max_latency", METRIC_TYPE_GAUGE)) {
+        for (auto &label_name : label_names) {
+            bvar::LatencyRecorder* bvar = get_stats_impl(label_name);
+            if (!bvar) {
+                continue;
+            }
+            std::ostringstream oss_max_latency_key;
+            make_dump_key(oss_max_latency_key, label_name, "_max_latency");
+            if (dumper->dump(oss_max_latency_key.str(), std::to_string(bvar->max_latency()))) {
                 n++;
             }
         }
-        // 999
-        std::ostringstream oss_p999_key;
-        make_dump_key(oss_p999_key, label_name, "_latency", 999);
-        if (dumper->dump(oss_p999_key.str(), std::to_string(bvar->latency_percentile(0.999)))) {
-            n++;
-        }
-        // 9999
-        std::ostringstream oss_p9999_key;
-        make_dump_key(oss_p9999_key, label_name, "_latency", 9999);
-        if (dumper->dump(oss_p9999_key.str(), std::to_string(bvar->latency_percentile(0.9999)))) {
-            n++;
-        }
+    }
 
-        // max_latency comment
-        if (!dumper->dump_comment(name() + "_max_latency", METRIC_TYPE_GAUGE)) {
-            continue;
-        }
-        // max_latency
-        std::ostringstream oss_max_latency_key;
-        make_dump_key(oss_max_latency_key, label_name, "_max_latency");
-        if (dumper->dump(oss_max_latency_key.str(), std::to_string(bvar->max_latency()))) {
-            n++;
-        }
-        
-        // qps comment
-        if (!dumper->dump_comment(name() + "_qps", METRIC_TYPE_GAUGE)) {
-            continue;
-        }
-        // qps
-        std::ostringstream oss_qps_key;
-        make_dump_key(oss_qps_key, label_name, "_qps");
-        if (dumper->dump(oss_qps_key.str(), std::to_string(bvar->qps()))) {
-            n++;
+    // qps
+    if (dumper->dump_comment(name() + "_qps", METRIC_TYPE_GAUGE)) {
+        for (auto &label_name : label_names) {
+            bvar::LatencyRecorder* bvar = get_stats_impl(label_name);
+            if (!bvar) {
+                continue;
+            }
+            std::ostringstream oss_qps_key;
+            make_dump_key(oss_qps_key, label_name, "_qps");
+            if (dumper->dump(oss_qps_key.str(), std::to_string(bvar->qps()))) {
+                n++;
+            }
         }
+    }
 
-        // qps comment
-        if (!dumper->dump_comment(name() + "_count", METRIC_TYPE_COUNTER)) {
-            continue;
-        }
-        // count
-        std::ostringstream oss_count_key;
-        make_dump_key(oss_count_key, label_name, "_count");
-        if (dumper->dump(oss_count_key.str(), std::to_string(bvar->count()))) {
-            n++;
+    // count
+    if (dumper->dump_comment(name() + "_count", METRIC_TYPE_COUNTER)) {
+        for (auto &label_name : label_names) {
+            bvar::LatencyRecorder* bvar = get_stats_impl(label_name);
+            if (!bvar) {
+                continue;
+            }
+            std::ostringstream oss_count_key;
+            make_dump_key(oss_count_key, label_name, "_count");
+            if (dumper->dump(oss_count_key.str(), std::to_string(bvar->count()))) {
+                n++;
+            }
         }
     }
     return n;
@@ -343,30 +517,40 @@ inline
 void MultiDimension<T>::make_dump_key(std::ostream& os, 
                                       const key_type& labels_value,
                                       const std::string& suffix,
-                                      const int quantile) {
+                                      const std::string& extra_label) {
     os << name();
     if (!suffix.empty()) {
         os << suffix;
     }
-    make_labels_kvpair_string(os, labels_value, quantile);
+    make_labels_kvpair_string(os, labels_value, extra_label);
 }
 
 template <typename T>
 inline
 void MultiDimension<T>::make_labels_kvpair_string(std::ostream& os, 
                                                   const key_type& labels_value, 
-                                                  const int quantile) {
+                                                  const std::string& extra_label) {
     os << "{";
     auto label_key = _labels.cbegin();
     auto label_value = labels_value.cbegin();
     char comma[2] = {'\0', '\0'};
     for (; label_key != _labels.cend() && label_value != labels_value.cend();
         label_key++, label_value++) {
-        os << comma << label_key->c_str() << "=\"" << label_value->c_str() << "\"";
+        os << comma << label_key->c_str() << "=\"";
+        // Escape the value as the text format of prometheus requires.
+        for (char c : *label_value) {
+            switch (c) {
+            case '\\': os << "\\\\"; break;
+            case '"': os << "\\\""; break;
+            case '\n': os << "\\n"; break;
+            default: os << c; break;
+            }
+        }
+        os << "\"";
         comma[0] = ',';
     }
-    if (quantile > 0) {
-        os << ",quantile=\"" << quantile << "\"";
+    if (!extra_label.empty()) {
+        os << comma << extra_label;
     }
     os << "}";
 }
@@ -390,7 +574,9 @@ void MultiDimension<T>::describe(std::ostream& os) {
         os << comma << "\"" << label << "\"";
         comma[0] = ',';
     }
-    os << "], \"stats_count\" : " << count_stats() <<  "}";
+    os << "], \"stats_count\" : " << count_stats()
+       << ", \"overflow_count\" : " << overflow_count()
+       << ", \"evicted_count\" : " << evicted_count() << "}";
 }
 
 } // namespace bvar
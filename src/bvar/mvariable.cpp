@@ -38,6 +38,9 @@ extern bool s_bvar_may_abort;
 DEFINE_int32(bvar_max_multi_dimension_metric_number, 1024, "Max number of multi dimension");
 DEFINE_int32(bvar_max_dump_multi_dimension_metric_number, 1024,
     "Max number of multi dimension metric number to dump by prometheus rpc service");
+DEFINE_int32(bvar_evicted_stats_delete_delay_s, 10,
+    "Stats evicted from multi dimension bvars are deleted after so many seconds, "
+    "since pointers returned by get_stats() may be still in use");
 
 static bool validator_bvar_max_multi_dimension_metric_number(const char*, int32_t v) {
     if (v < 1) {
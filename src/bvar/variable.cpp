@@ -30,9 +30,11 @@
 #include "butil/time.h"                          // milliseconds_from_now
 #include "butil/file_util.h"                     // butil::FilePath
 #include "butil/threading/platform_thread.h"
+#include "butil/atomicops.h"
 #include "bvar/gflag.h"
 #include "bvar/variable.h"
 #include "bvar/mvariable.h"
+#include "bvar/detail/log_histogram.h"
 
 namespace bvar {
 
@@ -118,6 +120,8 @@ inline VarMapWithLock& get_var_map(const std::string& name) {
     return m;
 }
 
+static butil::atomic<int64_t> s_exposed_version(0);
+
 Variable::~Variable() {
     CHECK(!hide()) << "Subclass of Variable MUST call hide() manually in their"
         " dtors to avoid displaying a variable that is just destructing";
@@ -159,6 +163,7 @@ int Variable::expose_impl(const butil::StringPiece& prefix,
             entry = &m[_name];
             entry->var = this;
             entry->display_filter = display_filter;
+            s_exposed_version.fetch_add(1, butil::memory_order_relaxed);
             return 0;
         }
     }
@@ -190,6 +195,7 @@ bool Variable::hide() {
     VarEntry* entry = m.seek(_name);
     if (entry) {
         CHECK_EQ(1UL, m.erase(_name));
+        s_exposed_version.fetch_add(1, butil::memory_order_relaxed);
     } else {
         CHECK(false) << "`" << _name << "' must exist";
     }
@@ -197,6 +203,10 @@ bool Variable::hide() {
     return true;
 }
 
+int64_t Variable::exposed_version() {
+    return s_exposed_version.load(butil::memory_order_relaxed);
+}
+
 void Variable::list_exposed(std::vector<std::string>* names,
                             DisplayFilter display_filter) {
     if (names == NULL) {
@@ -258,6 +268,42 @@ int Variable::describe_exposed(const std::string& name, std::ostream& os,
     return 0;
 }
 
+int Variable::get_exposed_histogram(const std::string& name,
+                                    detail::HistogramBuckets* buckets) {
+    VarMapWithLock& m = get_var_map(name);
+    BAIDU_SCOPED_LOCK(m.mutex);
+    VarEntry* p = m.seek(name);
+    if (p == NULL) {
+        return -1;
+    }
+    return p->var->get_histogram(buckets) ? 0 : -1;
+}
+
+bool Dumper::dump_histogram(const std::string& name,
+                            const std::string& labels,
+                            const detail::HistogramBuckets& buckets) {
+    // Insert le="..." into the labels.
+    std::string prefix = name + "_bucket{";
+    if (labels.size() > 2) {
+        prefix.append(labels, 1, labels.size() - 2);
+        prefix.push_back(',');
+    }
+    prefix.append("le=\"");
+    std::vector<std::pair<double, int64_t> > cumulative;
+    buckets.get_cumulative_counts(FLAGS_bvar_histogram_dump_schema, &cumulative);
+    std::ostringstream os;
+    for (size_t i = 0; i < cumulative.size(); ++i) {
+        os.str("");
+        os << prefix << cumulative[i].first << "\"}";
+        if (!dump(os.str(), std::to_string(cumulative[i].second))) {
+            return false;
+        }
+    }
+    return dump(prefix + "+Inf\"}", std::to_string(buckets.count())) &&
+        dump(name + "_sum" + labels, std::to_string(buckets.sum())) &&
+        dump(name + "_count" + labels, std::to_string(buckets.count()));
+}
+
 std::string Variable::describe_exposed(const std::string& name,
                                        bool quote_string,
                                        DisplayFilter display_filter) {
@@ -26,6 +26,7 @@
 #include <gflags/gflags_declare.h>
 #include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
 #include "butil/strings/string_piece.h" // butil::StringPiece
+#include <stdint.h>                    // int64_t
 
 #ifdef BAIDU_INTERNAL
 #include <boost/any.hpp>
@@ -39,6 +40,10 @@ namespace bvar {
 
 DECLARE_bool(save_series);
 
+namespace detail {
+class HistogramBuckets;
+}
+
 // Bitwise masks of displayable targets 
 enum DisplayFilter {
     DISPLAY_ON_HTML = 1,
@@ -56,6 +61,13 @@ public:
     virtual bool dump_comment(const std::string&, const std::string& /*type*/) {
         return true;
     }
+    // Dump buckets of a histogram. `labels' is empty or like {a="b"}.
+    // The default implementation calls dump() with cumulative counts of
+    // buckets as `name'_bucket{le="upper bound"}, and `name'_sum and
+    // `name'_count, namely the text format of prometheus.
+    virtual bool dump_histogram(const std::string& name,
+                                const std::string& labels,
+                                const detail::HistogramBuckets& buckets);
 };
 
 // Options for Variable::dump_exposed().
@@ -123,6 +135,13 @@ public:
     virtual int describe_series(std::ostream&, const SeriesOptions&) const
     { return 1; }
 
+    // Put buckets of all values recorded into `buckets' if this variable
+    // is a histogram.
+    // Returns true on success, false otherwise(this variable is not a
+    // histogram).
+    virtual bool get_histogram(detail::HistogramBuckets*) const
+    { return false; }
+
     // Expose this variable globally so that it's counted in following
     // functions:
     //   list_exposed
@@ -180,6 +199,10 @@ public:
     // Get number of exposed variables.
     static size_t count_exposed();
 
+    // Changed whenever a variable is exposed or hidden, results derived
+    // from list_exposed() can be cached until it changes.
+    static int64_t exposed_version();
+
     // Find an exposed variable by `name' and put its description into `os'.
     // Returns 0 on found, -1 otherwise.
     static int describe_exposed(const std::string& name,
@@ -199,6 +222,12 @@ public:
                                        std::ostream&,
                                        const SeriesOptions&);
 
+    // Find an exposed histogram by `name' and put its buckets into
+    // `buckets'.
+    // Returns 0 on found, -1 otherwise (not found or not a histogram).
+    static int get_exposed_histogram(const std::string& name,
+                                     detail::HistogramBuckets* buckets);
+
 #ifdef BAIDU_INTERNAL
     // Find an exposed variable by `name' and put its value into `value'.
     // Returns 0 on found, -1 otherwise.
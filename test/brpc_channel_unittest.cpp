@@ -2563,6 +2563,267 @@ TEST_F(ChannelTest, retry_backoff) {
     }
 }
 
+TEST_F(ChannelTest, retry_budget_sanity) {
+    brpc::RetryBudgetOptions options;
+    options.max_retry_ratio = 0.1;
+    options.max_burst = 4;
+    brpc::RetryBudget budget(options);
+    ASSERT_EQ(4.0, budget.tokens());
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(budget.TryRetry());
+    }
+    ASSERT_FALSE(budget.TryRetry());
+    ASSERT_EQ(1, budget.exhausted_count());
+    // Every 10 successful RPCs earn one retry.
+    for (int i = 0; i < 10; ++i) {
+        budget.OnSuccess();
+    }
+    ASSERT_TRUE(budget.TryRetry());
+    ASSERT_FALSE(budget.TryRetry());
+    // Never exceeds the burst.
+    for (int i = 0; i < 1000; ++i) {
+        budget.OnSuccess();
+    }
+    ASSERT_EQ(4.0, budget.tokens());
+    budget.OnServerIsolated();
+    ASSERT_EQ(2.0, budget.tokens());
+}
+
+TEST_F(ChannelTest, retry_budget) {
+    brpc::RetryBudgetOptions budget_options;
+    budget_options.max_retry_ratio = 0;
+    budget_options.max_burst = 2;
+    brpc::RetryBudget budget(budget_options);
+    brpc::ChannelOptions opt;
+    opt.max_retry = 3;
+    opt.retry_budget = &budget;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_ep, &opt));
+
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(__FUNCTION__);
+    // The server is not started, the budget is used up by the first RPC.
+    brpc::Controller cntl;
+    CallMethod(&channel, &cntl, &req, &res, false);
+    ASSERT_TRUE(cntl.Failed());
+    ASSERT_EQ(2, cntl.retried_count());
+    ASSERT_EQ(1, budget.exhausted_count());
+
+    cntl.Reset();
+    CallMethod(&channel, &cntl, &req, &res, true);
+    ASSERT_TRUE(cntl.Failed());
+    ASSERT_EQ(0, cntl.retried_count());
+    ASSERT_EQ(2, budget.exhausted_count());
+}
+
+TEST_F(ChannelTest, adaptive_throttle_sanity) {
+    brpc::AdaptiveThrottleOptions options;
+    options.multiplier = 2;
+    brpc::AdaptiveThrottle throttle(options);
+    const brpc::SocketId healthy = 1;
+    const brpc::SocketId overloaded = 2;
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(throttle.OnRequest(healthy));
+        throttle.OnResponse(healthy, 0, true);
+    }
+    ASSERT_EQ(0, throttle.drop_probability(healthy));
+
+    // The server can only accept 1/4 of requests from the client.
+    int ndropped = 0;
+    int naccepted = 0;
+    for (int i = 0; i < 10000; ++i) {
+        if (!throttle.OnRequest(overloaded)) {
+            ++ndropped;
+            continue;
+        }
+        if (naccepted * 4 < i + 1) {
+            ++naccepted;
+            throttle.OnResponse(overloaded, 0, true);
+        } else {
+            throttle.OnResponse(overloaded, brpc::ELIMIT, true);
+        }
+    }
+    // Requests seen by the server converge to 2 times of accepted ones,
+    // namely half of requests are dropped.
+    ASSERT_GT(ndropped, 4000);
+    ASSERT_LT(ndropped, 6000);
+    ASSERT_NEAR(0.5, throttle.drop_probability(overloaded), 0.1);
+    // Servers do not affect each other.
+    ASSERT_EQ(0, throttle.drop_probability(healthy));
+
+    // Requests never replied by the server are not accepted.
+    const brpc::SocketId unreachable = 3;
+    for (int i = 0; i < 1000; ++i) {
+        if (throttle.OnRequest(unreachable)) {
+            throttle.OnResponse(unreachable, ECONNREFUSED, false);
+        }
+    }
+    ASSERT_GT(throttle.drop_probability(unreachable), 0.9);
+}
+
+TEST_F(ChannelTest, adaptive_throttle) {
+    ASSERT_EQ(0, StartAccept(_ep));
+    brpc::AdaptiveThrottle throttle;
+    brpc::ChannelOptions opt;
+    opt.max_retry = 0;
+    opt.throttle = &throttle;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_ep, &opt));
+
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(__FUNCTION__);
+    req.set_server_fail(brpc::ELIMIT);
+    int ndropped = 0;
+    for (int i = 0; i < 100; ++i) {
+        brpc::Controller cntl;
+        CallMethod(&channel, &cntl, &req, &res, i % 2);
+        ASSERT_EQ(brpc::ELIMIT, cntl.ErrorCode());
+        if (cntl.ErrorText().find("Throttled by client") != std::string::npos) {
+            ++ndropped;
+        }
+    }
+    // The server rejects everything, most requests are dropped locally.
+    ASSERT_GT(ndropped, 50);
+    StopAndJoin();
+}
+
+TEST_F(ChannelTest, adaptive_backup_request_policy) {
+    brpc::AdaptiveBackupRequestOptions options;
+    options.min_samples = 100;
+    options.max_backup_ratio = 0.1;
+    options.max_burst = 2;
+    brpc::AdaptiveBackupRequestPolicy policy(options);
+    brpc::Controller cntl;
+    cntl._method = test::EchoService::descriptor()->FindMethodByName("Echo");
+
+    // Not enough samples.
+    for (int i = 1; i <= 50; ++i) {
+        cntl.OnRPCBegin(0);
+        cntl.OnRPCEnd(i * 100);
+        policy.OnRPCEnd(&cntl);
+    }
+    ASSERT_EQ(-1, policy.GetBackupRequestMs(&cntl));
+    // Latencies are 0.1ms ~ 10ms evenly.
+    for (int i = 0; i < 1000; ++i) {
+        cntl.OnRPCBegin(0);
+        cntl.OnRPCEnd((i % 100 + 1) * 100);
+        policy.OnRPCEnd(&cntl);
+    }
+    // Wait for the percentile to be sampled and the cached value expired,
+    // the sampler may lag behind when the machine is busy.
+    int32_t backup_request_ms = -1;
+    for (int i = 0; i < 50 && backup_request_ms <= 1; ++i) {
+        usleep(200000);
+        backup_request_ms = policy.GetBackupRequestMs(&cntl);
+    }
+    ASSERT_GE(backup_request_ms, 9);
+    ASSERT_LE(backup_request_ms, 11);
+    // Failed RPCs are not counted.
+    cntl.SetFailed(brpc::ERPCTIMEDOUT, "timedout");
+    cntl.OnRPCEnd(1000000);
+    policy.OnRPCEnd(&cntl);
+
+    // The bucket is full.
+    ASSERT_EQ(2.0, policy.tokens());
+    ASSERT_TRUE(policy.DoBackup(&cntl));
+    ASSERT_TRUE(policy.DoBackup(&cntl));
+    ASSERT_FALSE(policy.DoBackup(&cntl));
+    // Every 10 RPCs earn one backup request.
+    for (int i = 0; i < 10; ++i) {
+        policy.OnRPCEnd(&cntl);
+    }
+    ASSERT_TRUE(policy.DoBackup(&cntl));
+    ASSERT_FALSE(policy.DoBackup(&cntl));
+}
+
+TEST_F(ChannelTest, adaptive_backup_request) {
+    ASSERT_EQ(0, StartAccept(_ep));
+    brpc::AdaptiveBackupRequestOptions backup_options;
+    backup_options.min_samples = 10;
+    backup_options.max_backup_ratio = 0;
+    backup_options.max_burst = 1;
+    brpc::AdaptiveBackupRequestPolicy policy(backup_options);
+    brpc::ChannelOptions opt;
+    opt.timeout_ms = 1000;
+    opt.max_retry = 1;
+    opt.backup_request_policy = &policy;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_ep, &opt));
+
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(__FUNCTION__);
+    for (int i = 0; i < 20; ++i) {
+        brpc::Controller cntl;
+        CallMethod(&channel, &cntl, &req, &res, false);
+        ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        // No backup request before enough samples.
+        ASSERT_FALSE(cntl.has_backup_request());
+    }
+    usleep(1200000);
+
+    // Calls much slower than usual are backed up.
+    req.set_sleep_us(50000);
+    brpc::Controller cntl;
+    CallMethod(&channel, &cntl, &req, &res, false);
+    ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+    ASSERT_TRUE(cntl.has_backup_request());
+    ASSERT_LT(cntl.backup_request_ms(), 50);
+
+    // Until the budget runs out.
+    cntl.Reset();
+    CallMethod(&channel, &cntl, &req, &res, true);
+    ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+    ASSERT_FALSE(cntl.has_backup_request());
+    ASSERT_EQ(0, cntl.retried_count());
+
+    // Controller.set_backup_request_ms() still works.
+    cntl.Reset();
+    cntl.set_backup_request_ms(-1);
+    CallMethod(&channel, &cntl, &req, &res, false);
+    ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+    ASSERT_EQ(-1, cntl.backup_request_ms());
+    StopAndJoin();
+}
+
+class CountingBackupRequestPolicy : public brpc::BackupRequestPolicy {
+public:
+    CountingBackupRequestPolicy() : nend(0) {}
+    int32_t GetBackupRequestMs(const brpc::Controller*) const override {
+        return -1;
+    }
+    bool DoBackup(const brpc::Controller*) const override { return false; }
+    void OnRPCEnd(const brpc::Controller*) override { ++nend; }
+    butil::atomic<int> nend;
+};
+
+TEST_F(ChannelTest, backup_request_policy_selective) {
+    ASSERT_EQ(0, StartAccept(_ep));
+    CountingBackupRequestPolicy policy;
+    brpc::SelectiveChannel channel;
+    brpc::ChannelOptions options;
+    options.max_retry = 0;
+    options.backup_request_policy = &policy;
+    ASSERT_EQ(0, channel.Init("rr", &options));
+    brpc::Channel* subchan = new brpc::Channel;
+    SetUpChannel(subchan, true, false);
+    ASSERT_EQ(0, channel.AddChannel(subchan, NULL));
+
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(__FUNCTION__);
+    // The policy sees one end of each RPC, sync or async.
+    for (int i = 0; i < 10; ++i) {
+        brpc::Controller cntl;
+        CallMethod(&channel, &cntl, &req, &res, i % 2);
+        ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        ASSERT_EQ(i + 1, policy.nend.load());
+    }
+    StopAndJoin();
+}
+
 TEST_F(ChannelTest, multiple_threads_single_channel) {
     srand(time(NULL));
     ASSERT_EQ(0, StartAccept(_ep));
@@ -0,0 +1,210 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include "brpc/controller.h"
+#include "brpc/errno.pb.h"
+#include "brpc/policy/gradient_concurrency_limiter.h"
+
+namespace brpc {
+namespace policy {
+DECLARE_double(gradient_cl_sampling_interval_ms);
+DECLARE_int32(gradient_cl_initial_max_concurrency);
+}  // namespace policy
+}  // namespace brpc
+
+namespace {
+
+// Drives synthetic load through OnRequested/OnResponded in virtual time.
+// The simulated server processes `capacity' requests in parallel with
+// latency `base_latency_us', requests beyond that are queued and the
+// latency grows proportionally.
+class LoadSimulator {
+public:
+    struct Result {
+        Result() : admitted(), rejected(), total_latency_us(0) {}
+        // Indexed by priority class, see Run().
+        int64_t admitted[2];
+        int64_t rejected[2];
+        int64_t total_latency_us;
+        // max_concurrency after each virtual millisecond.
+        std::vector<int> limits;
+
+        double avg_latency_us() const {
+            return total_latency_us / (double)std::max<int64_t>(
+                admitted[0] + admitted[1], 1);
+        }
+        double reject_ratio(int i) const {
+            return rejected[i] / (double)std::max<int64_t>(
+                admitted[i] + rejected[i], 1);
+        }
+    };
+
+    LoadSimulator(int capacity, int64_t base_latency_us)
+        : _capacity(capacity)
+        , _base_latency_us(base_latency_us)
+        // Limiters take 0 as unset time.
+        , _now_us(1000000)
+        , _inflight(0) {}
+
+    // Send a request every `interval_us' for `duration_us'. If
+    // `low_priority' is not 0, every other request carries it.
+    Result Run(brpc::ConcurrencyLimiter* limiter, int64_t duration_us,
+               int64_t interval_us, int low_priority) {
+        Result r;
+        brpc::Controller cntl[2];
+        cntl[1].set_request_priority(low_priority);
+        const int64_t end_us = _now_us + duration_us;
+        int64_t next_ms = _now_us / 1000 + 1;
+        for (int64_t n = 0; _now_us < end_us; ++n, _now_us += interval_us) {
+            while (!_finish.empty() && _finish.top().first <= _now_us) {
+                --_inflight;
+                limiter->OnResponded(0, _finish.top().second);
+                _finish.pop();
+            }
+            const int cls = (low_priority != 0 && n % 2 == 1) ? 1 : 0;
+            if (!limiter->OnRequested(_inflight + 1, &cntl[cls])) {
+                ++r.rejected[cls];
+                limiter->OnResponded(brpc::ELIMIT, 0);
+            } else {
+                ++_inflight;
+                const int64_t latency_us = _base_latency_us *
+                    std::max(_inflight, _capacity) / _capacity;
+                _finish.push(std::make_pair(_now_us + latency_us, latency_us));
+                ++r.admitted[cls];
+                r.total_latency_us += latency_us;
+            }
+            for (; next_ms * 1000 <= _now_us; ++next_ms) {
+                r.limits.push_back(limiter->MaxConcurrency());
+            }
+        }
+        return r;
+    }
+
+    void set_base_latency_us(int64_t latency_us) {
+        _base_latency_us = latency_us;
+    }
+
+    int64_t now_us() const { return _now_us; }
+
+private:
+    typedef std::pair<int64_t, int64_t> Finish;  // (finish time, latency)
+    const int _capacity;
+    int64_t _base_latency_us;
+    int64_t _now_us;
+    int _inflight;
+    std::priority_queue<Finish, std::vector<Finish>,
+                        std::greater<Finish> > _finish;
+};
+
+// Samples responses at the virtual time of `sim'.
+class SimulatedLimiter : public brpc::policy::GradientConcurrencyLimiter {
+public:
+    explicit SimulatedLimiter(const LoadSimulator* sim) : _sim(sim) {}
+
+protected:
+    int64_t NowUs() const override { return _sim->now_us(); }
+
+private:
+    const LoadSimulator* _sim;
+};
+
+class GradientConcurrencyLimiterTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        // Sample every response, many of them finish at the same virtual
+        // time.
+        brpc::policy::FLAGS_gradient_cl_sampling_interval_ms = 0;
+    }
+    void TearDown() override {
+        brpc::policy::FLAGS_gradient_cl_sampling_interval_ms = 0.1;
+    }
+};
+
+const int CAPACITY = 50;
+const int64_t BASE_LATENCY_US = 10000;
+// Interval of requests that saturates the server exactly.
+const int64_t FULL_LOAD_INTERVAL_US = BASE_LATENCY_US / CAPACITY;
+
+TEST_F(GradientConcurrencyLimiterTest, no_rejection_under_light_load) {
+    LoadSimulator sim(CAPACITY, BASE_LATENCY_US);
+    SimulatedLimiter limiter(&sim);
+    LoadSimulator::Result r =
+        sim.Run(&limiter, 20000000, FULL_LOAD_INTERVAL_US * 2, 0);
+    ASSERT_EQ(0, r.rejected[0]);
+    ASSERT_EQ(BASE_LATENCY_US, r.avg_latency_us());
+    // The limit does not shrink without queueing.
+    ASSERT_GE(limiter.MaxConcurrency(),
+              brpc::policy::FLAGS_gradient_cl_initial_max_concurrency);
+}
+
+TEST_F(GradientConcurrencyLimiterTest, converge_under_overload) {
+    LoadSimulator sim(CAPACITY, BASE_LATENCY_US);
+    SimulatedLimiter limiter(&sim);
+    // Twice of the capacity.
+    sim.Run(&limiter, 10000000, FULL_LOAD_INTERVAL_US / 2, 0);
+    LoadSimulator::Result r =
+        sim.Run(&limiter, 50000000, FULL_LOAD_INTERVAL_US / 2, 0);
+    const int min_limit = *std::min_element(r.limits.begin(), r.limits.end());
+    const int max_limit = *std::max_element(r.limits.begin(), r.limits.end());
+    LOG(INFO) << "limit=[" << min_limit << ", " << max_limit
+              << "] avg_latency_us=" << r.avg_latency_us()
+              << " reject_ratio=" << r.reject_ratio(0);
+    // Enough to saturate the server, queueing is bounded by the tolerance
+    // of latency.
+    ASSERT_GE(min_limit, CAPACITY);
+    ASSERT_LE(max_limit, CAPACITY * 5 / 2);
+    ASSERT_LT(r.avg_latency_us(), BASE_LATENCY_US * 2);
+    // Smooth, no periodic dips.
+    ASSERT_GT(min_limit, max_limit * 0.75);
+    // About half of requests are beyond the capacity.
+    ASSERT_GT(r.reject_ratio(0), 0.4);
+    ASSERT_LT(r.reject_ratio(0), 0.6);
+}
+
+TEST_F(GradientConcurrencyLimiterTest, shed_low_priority_first) {
+    LoadSimulator sim(CAPACITY, BASE_LATENCY_US);
+    SimulatedLimiter limiter(&sim);
+    // Requests of each priority fill up the capacity alone.
+    sim.Run(&limiter, 10000000, FULL_LOAD_INTERVAL_US / 2, -3);
+    LoadSimulator::Result r =
+        sim.Run(&limiter, 30000000, FULL_LOAD_INTERVAL_US / 2, -3);
+    LOG(INFO) << "reject_ratio=" << r.reject_ratio(0)
+              << "/" << r.reject_ratio(1);
+    ASSERT_LT(r.reject_ratio(0), 0.1);
+    ASSERT_GT(r.reject_ratio(1), 0.9);
+}
+
+TEST_F(GradientConcurrencyLimiterTest, recover_after_slowdown) {
+    LoadSimulator sim(CAPACITY, BASE_LATENCY_US);
+    SimulatedLimiter limiter(&sim);
+    sim.Run(&limiter, 10000000, FULL_LOAD_INTERVAL_US / 2, 0);
+    const int normal_limit = limiter.MaxConcurrency();
+    // The server slows down suddenly, e.g. a downstream service is slow.
+    sim.set_base_latency_us(BASE_LATENCY_US * 4);
+    sim.Run(&limiter, 2000000, FULL_LOAD_INTERVAL_US / 2, 0);
+    ASSERT_LT(limiter.MaxConcurrency(), normal_limit);
+    sim.set_base_latency_us(BASE_LATENCY_US);
+    sim.Run(&limiter, 20000000, FULL_LOAD_INTERVAL_US / 2, 0);
+    ASSERT_GE(limiter.MaxConcurrency(), CAPACITY);
+}
+
+} // namespace
@@ -21,10 +21,12 @@
 
 #include <sys/types.h>
 #include <map>
+#include <set>
 #include <gtest/gtest.h>
 #include "bthread/bthread.h"
 #include "butil/gperftools_profiler.h"
 #include "butil/containers/doubly_buffered_data.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
 #include "brpc/describable.h"
 #include "brpc/socket.h"
 #include "brpc/socket_map.h"
@@ -36,7 +38,10 @@
 #include "brpc/policy/weighted_randomized_load_balancer.h"
 #include "brpc/policy/randomized_load_balancer.h"
 #include "brpc/policy/locality_aware_load_balancer.h"
+#include "brpc/policy/p2c_load_balancer.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
+#include "brpc/policy/lookup_hashing_load_balancer.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
 #include "brpc/policy/hasher.h"
 #include "echo.pb.h"
 #include "brpc/channel.h"
@@ -81,7 +86,8 @@ bool AddN(Foo& f, int n) {
 }
 
 template <typename DBD>
-void test_doubly_buffered_data() {
+void test_doubly_buffered_data(
+    butil::DoublyBufferedDataMode mode = butil::DOUBLY_BUFFERED_DATA_MUTEX) {
     // test doubly_buffered_data TLS limits
     {
         std::cout << "current PTHREAD_KEYS_MAX: " << PTHREAD_KEYS_MAX << std::endl;
@@ -91,7 +97,8 @@ void test_doubly_buffered_data() {
         ASSERT_EQ(0, ptr->x);
     }
 
-    DBD d;
+    DBD d(mode);
+    ASSERT_EQ(mode, d.mode());
     {
         typename DBD::ScopedPtr ptr;
         ASSERT_EQ(0, d.Read(&ptr));
@@ -109,6 +116,14 @@ void test_doubly_buffered_data() {
         ASSERT_EQ(0, d.Read(&ptr));
         ASSERT_EQ(10, ptr->x);
     }
+    if (mode == butil::DOUBLY_BUFFERED_DATA_EPOCH) {
+        // Nested reads in one thread.
+        typename DBD::ScopedPtr ptr;
+        ASSERT_EQ(0, d.Read(&ptr));
+        typename DBD::ScopedPtr ptr2;
+        ASSERT_EQ(0, d.Read(&ptr2));
+        ASSERT_EQ(ptr.get(), ptr2.get());
+    }
 }
 
 TEST_F(LoadBalancerTest, doubly_buffered_data) {
@@ -118,6 +133,52 @@ TEST_F(LoadBalancerTest, doubly_buffered_data) {
     test_doubly_buffered_data<butil::DoublyBufferedData<Foo, butil::Void, true>>();
 }
 
+TEST_F(LoadBalancerTest, doubly_buffered_data_epoch) {
+    const butil::DoublyBufferedDataMode mode = butil::DOUBLY_BUFFERED_DATA_EPOCH;
+    test_doubly_buffered_data<butil::DoublyBufferedData<Foo>>(mode);
+    test_doubly_buffered_data<butil::DoublyBufferedData<Foo, UserTLS, false>>(mode);
+    test_doubly_buffered_data<butil::DoublyBufferedData<Foo, butil::Void, true>>(mode);
+}
+
+typedef butil::DoublyBufferedData<Foo> EpochDBD;
+butil::atomic<bool> g_epoch_modified(false);
+
+void* ModifyEpochDBD(void* arg) {
+    static_cast<EpochDBD*>(arg)->Modify(AddN, 1);
+    g_epoch_modified.store(true);
+    return NULL;
+}
+
+void* ReadEpochDBD(void* arg) {
+    EpochDBD::ScopedPtr ptr;
+    EXPECT_EQ(0, static_cast<EpochDBD*>(arg)->Read(&ptr));
+    EXPECT_EQ(2, ptr->x);
+    return NULL;
+}
+
+TEST_F(LoadBalancerTest, doubly_buffered_data_epoch_new_reader_during_modify) {
+    EpochDBD d(butil::DOUBLY_BUFFERED_DATA_EPOCH);
+    d.Modify(AddN, 1);
+    g_epoch_modified.store(false);
+    pthread_t modify_th;
+    {
+        EpochDBD::ScopedPtr ptr;
+        ASSERT_EQ(0, d.Read(&ptr));
+        ASSERT_EQ(1, ptr->x);
+        // Modify() waits for the read above.
+        ASSERT_EQ(0, pthread_create(&modify_th, NULL, ModifyEpochDBD, &d));
+        usleep(100 * 1000);
+        ASSERT_FALSE(g_epoch_modified.load());
+        // Threads reading for the first time are not blocked by the wait.
+        pthread_t read_th;
+        ASSERT_EQ(0, pthread_create(&read_th, NULL, ReadEpochDBD, &d));
+        ASSERT_EQ(0, pthread_join(read_th, NULL));
+        ASSERT_FALSE(g_epoch_modified.load());
+    }
+    ASSERT_EQ(0, pthread_join(modify_th, NULL));
+    ASSERT_TRUE(g_epoch_modified.load());
+}
+
 bool exitFlag = false;
 
 template <typename DBD>
@@ -135,8 +196,10 @@ void* DBDBthread(void* arg) {
 }
 
 template <typename DBD>
-void DBDMultiBthread() {
-    DBD d;
+void DBDMultiBthread(
+    butil::DoublyBufferedDataMode mode = butil::DOUBLY_BUFFERED_DATA_MUTEX) {
+    exitFlag = false;
+    DBD d(mode);
     d.Modify(AddN, 1);
     {
         typename DBD::ScopedPtr ptr;
@@ -173,6 +236,12 @@ TEST_F(LoadBalancerTest, doubly_buffered_data_bthread_multi_bthread) {
     DBDMultiBthread<butil::DoublyBufferedData<Foo, butil::Void, true>>();
 }
 
+// Bthreads are allowed to be suspended while reading in epoch mode.
+TEST_F(LoadBalancerTest, doubly_buffered_data_epoch_multi_bthread) {
+    DBDMultiBthread<butil::DoublyBufferedData<Foo>>(
+        butil::DOUBLY_BUFFERED_DATA_EPOCH);
+}
+
 
 bool g_started = false;
 bool g_stopped = false;
@@ -306,6 +375,81 @@ TEST_F(LoadBalancerTest, dbd_performance) {
 }
 
 
+template<typename DBD>
+void* bthread_read_dbd(void* void_arg) {
+    auto args = (PerfArgs<DBD>*)void_arg;
+    args->ready = true;
+    while (!g_stopped) {
+        {
+            typename DBD::ScopedPtr ptr;
+            args->dbd->Read(&ptr);
+        }
+        // Let other bthreads and the modifying pthread run.
+        if ((++args->counter & 1023) == 0) {
+            bthread_yield();
+        }
+    }
+    return NULL;
+}
+
+// Read throughput and latency of Modify() with many bthreads reading.
+template<typename DBD>
+void BthreadPerfTest(int bthread_num, butil::DoublyBufferedDataMode mode) {
+    g_stopped = false;
+    DBD dbd(mode);
+    for (int i = 0; i < 1024; ++i) {
+        dbd.Modify(AddMapN, i);
+    }
+    std::vector<bthread_t> tids(bthread_num);
+    std::vector<PerfArgs<DBD>> args(bthread_num);
+    butil::Timer total_tm;
+    total_tm.start();
+    for (int i = 0; i < bthread_num; ++i) {
+        args[i].dbd = &dbd;
+        ASSERT_EQ(0, bthread_start_background(
+                      &tids[i], NULL, bthread_read_dbd<DBD>, &args[i]));
+    }
+    usleep(100 * 1000);
+    butil::Timer tm;
+    int64_t modify_ns = 0;
+    int64_t max_modify_ns = 0;
+    const int nmodify = 20;
+    for (int i = 0; i < nmodify; ++i) {
+        tm.start();
+        ASSERT_TRUE(dbd.Modify(AddMapN, i));
+        tm.stop();
+        modify_ns += tm.n_elapsed();
+        max_modify_ns = std::max(max_modify_ns, tm.n_elapsed());
+        usleep(10 * 1000);
+    }
+    g_stopped = true;
+    int64_t count = 0;
+    for (int i = 0; i < bthread_num; ++i) {
+        bthread_join(tids[i], NULL);
+        count += args[i].counter;
+    }
+    total_tm.stop();
+    LOG(INFO) << butil::class_name<DBD>()
+              << " mode=" << (mode == butil::DOUBLY_BUFFERED_DATA_EPOCH ?
+                              "epoch" : "mutex")
+              << " bthread_num=" << bthread_num
+              << " read_count=" << count
+              << " read_qps=" << (double)count / total_tm.n_elapsed() * 1e9
+              << " average_modify_us=" << modify_ns / nmodify / 1000.0
+              << " max_modify_us=" << max_modify_ns / 1000.0;
+}
+
+TEST_F(LoadBalancerTest, dbd_performance_with_bthreads) {
+    const int bthread_num = 1000;
+    BthreadPerfTest<butil::DoublyBufferedData<PerfMap>>(
+        bthread_num, butil::DOUBLY_BUFFERED_DATA_MUTEX);
+    BthreadPerfTest<butil::DoublyBufferedData<PerfMap, butil::Void, true>>(
+        bthread_num, butil::DOUBLY_BUFFERED_DATA_MUTEX);
+    BthreadPerfTest<butil::DoublyBufferedData<PerfMap>>(
+        bthread_num, butil::DOUBLY_BUFFERED_DATA_EPOCH);
+}
+
+
 typedef brpc::policy::LocalityAwareLoadBalancer LALB;
 
 static void ValidateWeightTree(
@@ -801,6 +945,397 @@ TEST_F(LoadBalancerTest, consistent_hashing) {
     }
 }
 
+TEST_F(LoadBalancerTest, consistent_hashing_update_in_batch) {
+    std::vector<brpc::ServerId> ids;
+    for (int i = 0; i < 20; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.6.%d:8080", i + 100);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    const char* params[] = { "", "load_epsilon=0.5" };
+    for (size_t round = 0; round < ARRAY_SIZE(params); ++round) {
+        brpc::policy::ConsistentHashingLoadBalancer proto(
+            brpc::policy::CONS_HASH_LB_MURMUR3);
+        brpc::policy::ConsistentHashingLoadBalancer* lb1 =
+            (brpc::policy::ConsistentHashingLoadBalancer*)proto.New(params[round]);
+        brpc::policy::ConsistentHashingLoadBalancer* lb2 =
+            (brpc::policy::ConsistentHashingLoadBalancer*)proto.New(params[round]);
+        const std::vector<brpc::ServerId> init(ids.begin(), ids.begin() + 10);
+        ASSERT_EQ(10u, lb1->AddServersInBatch(init));
+        ASSERT_EQ(10u, lb2->AddServersInBatch(init));
+        // Remove 0-4, keep 5 which is added again and add 10-14.
+        const std::vector<brpc::ServerId> removed(ids.begin(), ids.begin() + 6);
+        const std::vector<brpc::ServerId> added(ids.begin() + 5, ids.begin() + 15);
+        size_t nadded = 0;
+        size_t nremoved = 0;
+        lb1->UpdateServersInBatch(added, removed, &nadded, &nremoved);
+        ASSERT_EQ(6u, nremoved);
+        ASSERT_EQ(6u, nadded);
+        // Same with removing and adding separately.
+        ASSERT_EQ(6u, lb2->RemoveServersInBatch(removed));
+        ASSERT_EQ(6u, lb2->AddServersInBatch(added));
+        ASSERT_EQ(10, lb1->_num_servers.load());
+        {
+            butil::DoublyBufferedData<std::vector<
+                brpc::policy::ConsistentHashingLoadBalancer::Node> >::ScopedPtr r1, r2;
+            ASSERT_EQ(0, lb1->_db_hash_ring.Read(&r1));
+            ASSERT_EQ(0, lb2->_db_hash_ring.Read(&r2));
+            ASSERT_EQ(r2->size(), r1->size());
+            for (size_t i = 0; i < r1->size(); ++i) {
+                ASSERT_EQ((*r2)[i].hash, (*r1)[i].hash);
+                ASSERT_EQ((*r2)[i].server_sock, (*r1)[i].server_sock);
+                ASSERT_EQ(round != 0, (*r1)[i].load != NULL);
+            }
+        }
+        // Selection works after the update.
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, true, 12345u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(0, lb1->SelectServer(in, &out));
+        lb1->Destroy();
+        lb2->Destroy();
+    }
+}
+
+TEST_F(LoadBalancerTest, consistent_hashing_with_bounded_load) {
+    const size_t NSERVER = 10;
+    const int NREQ = 1000;
+    const double EPSILON = 0.25;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.5.%d:8080", (int)i + 100);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    brpc::policy::ConsistentHashingLoadBalancer proto(
+        brpc::policy::CONS_HASH_LB_MURMUR3);
+    ASSERT_TRUE(proto.New("load_epsilon=-1") == NULL);
+    ASSERT_TRUE(proto.New("load_epsilon=abc") == NULL);
+    brpc::policy::ConsistentHashingLoadBalancer* lb =
+        (brpc::policy::ConsistentHashingLoadBalancer*)proto.New("load_epsilon=0.25");
+    brpc::policy::ConsistentHashingLoadBalancer* lb2 =
+        (brpc::policy::ConsistentHashingLoadBalancer*)proto.New("load_epsilon=0.25");
+    ASSERT_TRUE(lb && lb2);
+    for (size_t i = 0; i < NSERVER; ++i) {
+        ASSERT_TRUE(lb->AddServer(ids[i]));
+    }
+    ASSERT_FALSE(lb->AddServer(ids[0]));
+    ASSERT_EQ(NSERVER, lb2->AddServersInBatch(
+                  std::vector<brpc::ServerId>(ids.rbegin(), ids.rend())));
+
+    // All requests have the same code, without feedback they are spread
+    // over servers in the same order for both clients.
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, true, 12345u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    std::map<brpc::SocketId, int> count;
+    std::vector<brpc::SocketId> order;
+    for (int i = 0; i < NREQ; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        const brpc::SocketId id = ptr->id();
+        ++count[id];
+        if (order.empty() || order.back() != id) {
+            order.push_back(id);
+        }
+        ASSERT_EQ(0, lb2->SelectServer(in, &out));
+        ASSERT_EQ(id, ptr->id());
+        // Never more than (1 + EPSILON) times of the average.
+        ASSERT_LE(count[id], ceil((1 + EPSILON) * (i + 1) / NSERVER)) << i;
+    }
+    // Servers are filled to the capacity one by one.
+    ASSERT_EQ(ceil(NSERVER / (1 + EPSILON)), count.size());
+    // The home server is filled first and overflows.
+    ASSERT_EQ(ceil((1 + EPSILON) * NREQ / NSERVER), count[order[0]]);
+    std::map<butil::EndPoint, double> rates;
+    lb->GetOverflowRates(&rates);
+    ASSERT_EQ(NSERVER, rates.size());
+    brpc::SocketUniquePtr home;
+    ASSERT_EQ(0, brpc::Socket::Address(order[0], &home));
+    for (std::map<butil::EndPoint, double>::iterator
+             it = rates.begin(); it != rates.end(); ++it) {
+        if (it->first == home->remote_side()) {
+            ASSERT_GT(it->second, 0.8);
+        } else {
+            ASSERT_EQ(0, it->second);
+        }
+    }
+
+    // After all responses, requests go to the home server again.
+    for (std::map<brpc::SocketId, int>::iterator
+             it = count.begin(); it != count.end(); ++it) {
+        for (int i = 0; i < it->second; ++i) {
+            brpc::LoadBalancer::CallInfo info = {
+                butil::gettimeofday_us(), it->first, 0, NULL };
+            lb->Feedback(info);
+        }
+    }
+    ASSERT_EQ(0, lb->_total_inflight.load());
+    ASSERT_EQ(0, lb->SelectServer(in, &out));
+    ASSERT_EQ(order[0], ptr->id());
+
+    // Removing servers with in-flight requests.
+    ASSERT_TRUE(lb->RemoveServer(brpc::ServerId(ptr->id())));
+    ASSERT_EQ(0, lb->_total_inflight.load());
+    const brpc::SocketId left =
+        (ids.back().id == order[0] ? ids.front().id : ids.back().id);
+    std::vector<brpc::ServerId> removed;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        if (ids[i].id != left) {
+            removed.push_back(ids[i]);
+        }
+    }
+    ASSERT_EQ(NSERVER - 2, lb->RemoveServersInBatch(removed));
+    // Only one server left, it's never full.
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_EQ(left, ptr->id());
+    }
+    std::ostringstream os;
+    brpc::DescribeOptions opt;
+    opt.verbose = true;
+    lb->Describe(os, opt);
+    ASSERT_NE(std::string::npos, os.str().find("overflow rate of hosts"));
+    lb->Destroy();
+    lb2->Destroy();
+}
+
+TEST_F(LoadBalancerTest, lookup_hashing) {
+    const brpc::policy::LookupHashingLoadBalancerType types[] = {
+        brpc::policy::LOOKUP_HASH_LB_MAGLEV,
+        brpc::policy::LOOKUP_HASH_LB_JUMP
+    };
+    const size_t NSERVER = 32;
+    const size_t NKEY = 10000;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.4.%d:8080", (int)i + 100);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    for (size_t round = 0; round < ARRAY_SIZE(types); ++round) {
+        brpc::policy::LookupHashingLoadBalancer proto(types[round]);
+        ASSERT_TRUE(proto.New("table_size=100") == NULL || round != 0);
+        brpc::LoadBalancer* lb1 = proto.New("table_size=101");
+        ASSERT_TRUE(lb1);
+        lb1->Destroy();
+        brpc::policy::LookupHashingLoadBalancer* lb =
+            (brpc::policy::LookupHashingLoadBalancer*)proto.New("");
+        // Another client which adds servers in a different order.
+        brpc::policy::LookupHashingLoadBalancer* lb2 =
+            (brpc::policy::LookupHashingLoadBalancer*)proto.New("");
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+        // Odd servers first, then even ones.
+        for (size_t i = 1; i < NSERVER; i += 2) {
+            ASSERT_TRUE(lb->AddServer(ids[i]));
+        }
+        for (size_t i = 0; i < NSERVER; i += 2) {
+            ASSERT_TRUE(lb->AddServer(ids[i]));
+        }
+        ASSERT_FALSE(lb->AddServer(ids[0]));
+        ASSERT_EQ(NSERVER, lb2->AddServersInBatch(
+                      std::vector<brpc::ServerId>(ids.rbegin(), ids.rend())));
+        std::vector<brpc::SocketId> selected(NKEY);
+        for (size_t i = 0; i < NKEY; ++i) {
+            in.request_code = butil::fmix64(i);
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            selected[i] = ptr->id();
+            ASSERT_EQ(0, lb2->SelectServer(in, &out));
+            ASSERT_EQ(selected[i], ptr->id());
+        }
+        ASSERT_LT(lb->LoadDeviation(), 0.1);
+
+        // Excluded servers are avoided, and keys go to the same servers.
+        brpc::ExcludedServers* excluded = brpc::ExcludedServers::Create(1);
+        for (size_t i = 0; i < 100; ++i) {
+            in.request_code = butil::fmix64(i);
+            excluded->Add(selected[i]);
+            in.excluded = excluded;
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            ASSERT_NE(selected[i], ptr->id());
+            const brpc::SocketId second = ptr->id();
+            ASSERT_EQ(0, lb2->SelectServer(in, &out));
+            ASSERT_EQ(second, ptr->id());
+            in.excluded = NULL;
+        }
+        brpc::ExcludedServers::Destroy(excluded);
+
+        // Remove the server with the largest address, which is the last
+        // slot of jump hash. Only keys of the server should be moved.
+        ASSERT_TRUE(lb->RemoveServer(ids.back()));
+        ASSERT_FALSE(lb->RemoveServer(ids.back()));
+        LOG(INFO) << "remap_fraction=" << lb->LastRemapFraction();
+        ASSERT_LT(lb->LastRemapFraction(), 2.0 / NSERVER);
+        size_t nmoved = 0;
+        for (size_t i = 0; i < NKEY; ++i) {
+            in.request_code = butil::fmix64(i);
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            ASSERT_NE(ids.back().id, ptr->id());
+            if (selected[i] != ids.back().id) {
+                nmoved += (selected[i] != ptr->id());
+            }
+        }
+        LOG(INFO) << "moved keys of remaining servers=" << nmoved;
+        ASSERT_LT(nmoved, NKEY / NSERVER);
+
+        // Remove a server in the middle, keys of other servers stay except
+        // a part of keys of the last slot in jump hash.
+        for (size_t i = 0; i < NKEY; ++i) {
+            in.request_code = butil::fmix64(i);
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            selected[i] = ptr->id();
+        }
+        const brpc::SocketId middle = ids[NSERVER / 2].id;
+        ASSERT_TRUE(lb->RemoveServer(ids[NSERVER / 2]));
+        LOG(INFO) << "remap_fraction=" << lb->LastRemapFraction();
+        nmoved = 0;
+        for (size_t i = 0; i < NKEY; ++i) {
+            in.request_code = butil::fmix64(i);
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            ASSERT_NE(middle, ptr->id());
+            if (selected[i] != middle) {
+                nmoved += (selected[i] != ptr->id());
+            }
+        }
+        LOG(INFO) << "moved keys of remaining servers=" << nmoved;
+        if (types[round] == brpc::policy::LOOKUP_HASH_LB_MAGLEV) {
+            // Slots of jump after the removed one are shifted.
+            ASSERT_LT(lb->LastRemapFraction(), 3.0 / NSERVER);
+            ASSERT_LT(nmoved, 2 * NKEY / NSERVER);
+        }
+
+        // Removing the same servers in another order gives the same table.
+        ASSERT_TRUE(lb2->RemoveServer(ids[NSERVER / 2]));
+        ASSERT_TRUE(lb2->RemoveServer(ids.back()));
+        for (size_t i = 0; i < NKEY; ++i) {
+            in.request_code = butil::fmix64(i);
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            const brpc::SocketId id = ptr->id();
+            ASSERT_EQ(0, lb2->SelectServer(in, &out));
+            ASSERT_EQ(id, ptr->id());
+        }
+
+        ASSERT_EQ(NSERVER - 2, lb->RemoveServersInBatch(ids));
+        ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+        lb->Destroy();
+        lb2->Destroy();
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
+// Compare rebuilding time, selection latency and balance of c_murmurhash,
+// c_maglev and c_jump with 10k servers.
+TEST_F(LoadBalancerTest, lookup_hashing_perf_with_10k_servers) {
+    const size_t NSERVER = 10000;
+    const size_t NSELECT = 1000000;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "10.%d.%d.%d:8080", (int)(i >> 16),
+                 (int)((i >> 8) & 0xFF), (int)(i & 0xFF));
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    const char* names[] = { "c_murmurhash", "c_maglev", "c_jump" };
+    for (size_t round = 0; round < ARRAY_SIZE(names); ++round) {
+        brpc::LoadBalancer* lb = NULL;
+        if (round == 0) {
+            lb = new brpc::policy::ConsistentHashingLoadBalancer(
+                brpc::policy::CONS_HASH_LB_MURMUR3);
+        } else if (round == 1) {
+            // The table is enlarged to 100 * NSERVER to be balanced.
+            lb = new brpc::policy::LookupHashingLoadBalancer(
+                brpc::policy::LOOKUP_HASH_LB_MAGLEV);
+        } else {
+            lb = new brpc::policy::LookupHashingLoadBalancer(
+                brpc::policy::LOOKUP_HASH_LB_JUMP);
+        }
+        butil::Timer tm;
+        tm.start();
+        ASSERT_EQ(NSERVER, lb->AddServersInBatch(ids));
+        tm.stop();
+        const int64_t build_us = tm.u_elapsed();
+
+        tm.start();
+        ASSERT_TRUE(lb->RemoveServer(ids[NSERVER / 2]));
+        tm.stop();
+        const int64_t rebuild_us = tm.u_elapsed();
+
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        std::map<brpc::SocketId, size_t> count;
+        tm.start();
+        for (size_t i = 0; i < NSELECT; ++i) {
+            // c_murmurhash accepts 32-bit codes only.
+            in.request_code = (uint32_t)butil::fmix64(i);
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+        }
+        tm.stop();
+        const int64_t select_ns = tm.n_elapsed() / NSELECT;
+
+        double deviation = 0;
+        double remap_fraction = 0;
+        if (round == 0) {
+            std::map<butil::EndPoint, double> load_map;
+            ((brpc::policy::ConsistentHashingLoadBalancer*)lb)->GetLoads(&load_map);
+            const double avg = 1.0 / load_map.size();
+            double sqr_sum = 0;
+            for (std::map<butil::EndPoint, double>::iterator
+                     it = load_map.begin(); it != load_map.end(); ++it) {
+                sqr_sum += (it->second - avg) * (it->second - avg);
+            }
+            deviation = sqrt(sqr_sum / load_map.size()) / avg;
+        } else {
+            brpc::policy::LookupHashingLoadBalancer* llb =
+                (brpc::policy::LookupHashingLoadBalancer*)lb;
+            deviation = llb->LoadDeviation();
+            remap_fraction = llb->LastRemapFraction();
+        }
+        LOG(INFO) << names[round] << ": build=" << build_us
+                  << "us remove_one=" << rebuild_us
+                  << "us select=" << select_ns
+                  << "ns deviation=" << deviation
+                  << " remap_fraction=" << remap_fraction;
+        if (round == 1) {
+            ASSERT_LT(deviation, 0.05);
+            ASSERT_LT(remap_fraction, 0.01);
+        }
+        lb->Destroy();
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
 TEST_F(LoadBalancerTest, weighted_round_robin) {
     const char* servers[] = { 
             "10.92.115.19:8831", 
@@ -997,6 +1532,7 @@ TEST_F(LoadBalancerTest, health_check_no_valid_server) {
     lbs.push_back(new brpc::policy::RoundRobinLoadBalancer);
     lbs.push_back(new brpc::policy::RandomizedLoadBalancer);
     lbs.push_back(new brpc::policy::WeightedRoundRobinLoadBalancer);
+    lbs.push_back(new brpc::policy::P2CLoadBalancer);
 
     for (int i = 0; i < (int)lbs.size(); ++i) {
         brpc::LoadBalancer* lb = lbs[i];
@@ -1066,6 +1602,366 @@ TEST_F(LoadBalancerTest, health_check_no_valid_server) {
     }
 }
 
+TEST_F(LoadBalancerTest, p2c_sanity) {
+    brpc::policy::P2CLoadBalancer p2c;
+    brpc::LoadBalancer* lb = p2c.New("");
+    ASSERT_TRUE(lb);
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+
+    std::vector<brpc::ServerId> ids;
+    for (int i = 0; i < 4; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.2.%d:8080", i);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+    ASSERT_FALSE(lb->AddServer(ids[0]));
+
+    // Excluded servers are not selected unless there's no other choice.
+    brpc::ExcludedServers* excluded = brpc::ExcludedServers::Create(4);
+    excluded->Add(ids[0].id);
+    excluded->Add(ids[1].id);
+    excluded->Add(ids[2].id);
+    in.excluded = excluded;
+    for (int i = 0; i < 20; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ASSERT_EQ(ids[3].id, ptr->id());
+        brpc::LoadBalancer::CallInfo info = {
+            butil::gettimeofday_us() - 1000, ptr->id(), 0, NULL };
+        lb->Feedback(info);
+    }
+    excluded->Add(ids[3].id);
+    ASSERT_EQ(0, lb->SelectServer(in, &out));
+    brpc::LoadBalancer::CallInfo info = {
+        butil::gettimeofday_us() - 1000, ptr->id(), 0, NULL };
+    lb->Feedback(info);
+    brpc::ExcludedServers::Destroy(excluded);
+    in.excluded = NULL;
+
+    // Give servers latencies, ids[0] is 100 times slower than others.
+    // Feed each server enough times to make the EWMA converge, the slow
+    // server is not selected after its latency is known, excluding other
+    // servers to feed it.
+    for (int slow = 1; slow >= 0; --slow) {
+        brpc::ExcludedServers* excluded = brpc::ExcludedServers::Create(4);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if ((i == 0) != !!slow) {
+                excluded->Add(ids[i].id);
+            }
+        }
+        in.excluded = excluded;
+        std::map<brpc::SocketId, int> nfeedback;
+        size_t nconverged = 0;
+        const size_t nserver = (slow ? 1 : ids.size() - 1);
+        while (nconverged < nserver) {
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            ASSERT_EQ(!!slow, ptr->id() == ids[0].id);
+            brpc::LoadBalancer::CallInfo info = {
+                butil::gettimeofday_us() - (slow ? 100000 : 1000),
+                ptr->id(), 0, NULL };
+            lb->Feedback(info);
+            nconverged += (++nfeedback[ptr->id()] == 50);
+        }
+        in.excluded = NULL;
+        brpc::ExcludedServers::Destroy(excluded);
+    }
+    // Without feedback, inflight requests accumulate and slow server is
+    // selected only after other servers have about 100 times more inflight
+    // requests.
+    std::map<brpc::SocketId, int> count;
+    for (int i = 0; i < 150; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ++count[ptr->id()];
+    }
+    ASSERT_EQ(0, count[ids[0].id]);
+    std::ostringstream os;
+    brpc::DescribeOptions opt;
+    opt.verbose = true;
+    lb->Describe(os, opt);
+    LOG(INFO) << os.str();
+
+    ASSERT_TRUE(lb->RemoveServer(ids[0]));
+    ASSERT_FALSE(lb->RemoveServer(ids[0]));
+    ASSERT_EQ(3u, lb->RemoveServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin() + 1, ids.end())));
+    ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+    lb->Destroy();
+}
+
+struct LBSimulationArg {
+    brpc::LoadBalancer* lb;
+    // latency of each server indexed by SocketId.
+    const std::map<brpc::SocketId, int64_t>* latencies;
+    int64_t slow_latency_us;
+    int64_t nrequest;
+    int64_t nslow;
+    int64_t latency_sum;
+    int64_t max_latency;
+};
+
+volatile bool lb_simulation_stop = false;
+
+void* simulate_client(void* void_arg) {
+    LBSimulationArg* arg = (LBSimulationArg*)void_arg;
+    while (!lb_simulation_stop) {
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = {
+            butil::gettimeofday_us(), true, false, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        if (arg->lb->SelectServer(in, &out) != 0) {
+            bthread_usleep(1000);
+            continue;
+        }
+        const int64_t latency = arg->latencies->find(ptr->id())->second;
+        bthread_usleep(latency);
+        const int64_t end_us = butil::gettimeofday_us();
+        if (out.need_feedback) {
+            brpc::LoadBalancer::CallInfo info = {
+                in.begin_time_us, ptr->id(), 0, NULL };
+            arg->lb->Feedback(info);
+        }
+        ++arg->nrequest;
+        arg->nslow += (latency == arg->slow_latency_us);
+        arg->latency_sum += end_us - in.begin_time_us;
+        arg->max_latency = std::max(arg->max_latency, end_us - in.begin_time_us);
+    }
+    return NULL;
+}
+
+// Compare p2c with la and rr by simulating a cluster in which 1/8 servers
+// are 10 times slower than others.
+TEST_F(LoadBalancerTest, p2c_simulation_with_skewed_latency) {
+    const size_t NSERVER = 64;
+    const int64_t FAST_LATENCY_US = 2000;
+    const int64_t SLOW_LATENCY_US = 20000;
+    const int NCLIENT = 64;
+    std::vector<brpc::ServerId> ids;
+    std::map<brpc::SocketId, int64_t> latencies;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.3.%d:8080", (int)i);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+        latencies[id.id] = (i % 8 == 0 ? SLOW_LATENCY_US : FAST_LATENCY_US);
+    }
+    const char* names[] = { "rr", "la", "p2c" };
+    double slow_ratio[ARRAY_SIZE(names)];
+    for (size_t round = 0; round < ARRAY_SIZE(names); ++round) {
+        brpc::LoadBalancer* lb = NULL;
+        if (round == 0) {
+            lb = new brpc::policy::RoundRobinLoadBalancer;
+        } else if (round == 1) {
+            lb = new LALB;
+        } else {
+            lb = new brpc::policy::P2CLoadBalancer;
+        }
+        ASSERT_EQ(NSERVER, lb->AddServersInBatch(ids));
+        lb_simulation_stop = false;
+        std::vector<LBSimulationArg> args(NCLIENT);
+        std::vector<bthread_t> th(NCLIENT);
+        for (int i = 0; i < NCLIENT; ++i) {
+            LBSimulationArg a = { lb, &latencies, SLOW_LATENCY_US, 0, 0, 0, 0 };
+            args[i] = a;
+            ASSERT_EQ(0, bthread_start_background(&th[i], NULL,
+                                                  simulate_client, &args[i]));
+        }
+        // Warm up so that la and p2c learn latencies.
+        bthread_usleep(500000);
+        for (int i = 0; i < NCLIENT; ++i) {
+            args[i].nrequest = 0;
+            args[i].nslow = 0;
+            args[i].latency_sum = 0;
+            args[i].max_latency = 0;
+        }
+        const int64_t start_us = butil::gettimeofday_us();
+        bthread_usleep(1000000);
+        lb_simulation_stop = true;
+        for (int i = 0; i < NCLIENT; ++i) {
+            bthread_join(th[i], NULL);
+        }
+        const int64_t elapse_us = butil::gettimeofday_us() - start_us;
+        int64_t nrequest = 0;
+        int64_t nslow = 0;
+        int64_t latency_sum = 0;
+        int64_t max_latency = 0;
+        for (int i = 0; i < NCLIENT; ++i) {
+            nrequest += args[i].nrequest;
+            nslow += args[i].nslow;
+            latency_sum += args[i].latency_sum;
+            max_latency = std::max(max_latency, args[i].max_latency);
+        }
+        ASSERT_GT(nrequest, 0);
+        slow_ratio[round] = (double)nslow / nrequest;
+        LOG(INFO) << names[round] << ": qps=" << nrequest * 1000000L / elapse_us
+                  << " avg_latency=" << latency_sum / nrequest
+                  << "us max_latency=" << max_latency
+                  << "us slow_ratio=" << slow_ratio[round];
+        delete lb;
+    }
+    // rr sends 1/8 requests to slow servers, p2c should send much less.
+    ASSERT_LT(slow_ratio[2], slow_ratio[0] / 2);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, zone_aware) {
+    brpc::GlobalInitializeOrDie();
+    std::string zone;
+    std::string inner_tag;
+    brpc::policy::ZoneAwareLoadBalancer::ParseTag("zone=az1 10", &zone, &inner_tag);
+    ASSERT_EQ("az1", zone);
+    ASSERT_EQ("10", inner_tag);
+    brpc::policy::ZoneAwareLoadBalancer::ParseTag("10", &zone, &inner_tag);
+    ASSERT_EQ("", zone);
+    ASSERT_EQ("10", inner_tag);
+
+    const brpc::LoadBalancer* proto = brpc::LoadBalancerExtension()->Find("zone");
+    ASSERT_TRUE(proto);
+    ASSERT_TRUE(proto->New("inner=not_exist") == NULL);
+    ASSERT_TRUE(proto->New("inner=zone") == NULL);
+
+    std::set<brpc::SocketId> local_ids;
+    std::vector<brpc::ServerId> local;
+    std::vector<brpc::ServerId> remote;
+    for (int i = 0; i < 6; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.4.%d:8080", i);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        // Weights for wrr follow zones.
+        id.tag = (i < 3 ? "zone=az1 1" : "zone=az2 1");
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        if (i < 3) {
+            local.push_back(id);
+            local_ids.insert(id.id);
+        } else {
+            remote.push_back(id);
+        }
+    }
+    std::vector<brpc::ServerId> all = local;
+    all.insert(all.end(), remote.begin(), remote.end());
+
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+
+    // Spill over by in-flight calls.
+    brpc::policy::ZoneAwareLoadBalancer* lb =
+        static_cast<brpc::policy::ZoneAwareLoadBalancer*>(proto->New(
+            "inner=wrr local_zone=az1 max_inflight=2 max_error_rate=0"));
+    ASSERT_TRUE(lb);
+    ASSERT_EQ(all.size(), lb->AddServersInBatch(all));
+    std::vector<brpc::SocketId> local_calls;
+    for (int i = 0; i < 6; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ASSERT_EQ(1u, local_ids.count(ptr->id()));
+        local_calls.push_back(ptr->id());
+    }
+    // Local servers are busier and busier without feedback, all calls are
+    // spilled after 4 in-flight calls per server.
+    size_t nlocal_selected = 0;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        if (local_ids.count(ptr->id())) {
+            ++nlocal_selected;
+            local_calls.push_back(ptr->id());
+        }
+    }
+    ASSERT_LE(nlocal_selected, 6u);
+    ASSERT_EQ(1.0, lb->SpilloverRatio());
+    for (size_t i = 0; i < local_calls.size(); ++i) {
+        brpc::LoadBalancer::CallInfo info = {
+            butil::gettimeofday_us() - 1000, local_calls[i], 0, NULL };
+        lb->Feedback(info);
+    }
+    ASSERT_EQ(0.0, lb->SpilloverRatio());
+    std::ostringstream os;
+    brpc::DescribeOptions opt;
+    opt.verbose = false;
+    lb->Describe(os, opt);
+    ASSERT_EQ("zone", os.str());
+    os.str("");
+    opt.verbose = true;
+    lb->Describe(os, opt);
+    ASSERT_NE(std::string::npos, os.str().find("local=3 remote=3")) << os.str();
+
+    // Calls go to other zones when no local server is left, and vice versa.
+    ASSERT_EQ(local.size(), lb->RemoveServersInBatch(local));
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_EQ(0u, local_ids.count(ptr->id()));
+    }
+    size_t nadded = 0;
+    size_t nremoved = 0;
+    lb->UpdateServersInBatch(local, remote, &nadded, &nremoved);
+    ASSERT_EQ(local.size(), nadded);
+    ASSERT_EQ(remote.size(), nremoved);
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_EQ(1u, local_ids.count(ptr->id()));
+    }
+    lb->Destroy();
+
+    // Spill over by errors.
+    lb = static_cast<brpc::policy::ZoneAwareLoadBalancer*>(proto->New(
+            "local_zone=az1 max_inflight=0 max_error_rate=0.2"));
+    ASSERT_TRUE(lb);
+    ASSERT_EQ(all.size(), lb->AddServersInBatch(all));
+    for (int i = 0; i < 21; ++i) {
+        if (i == 20) {
+            // Close the error window.
+            bthread_usleep(1100000);
+        }
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_EQ(1u, local_ids.count(ptr->id()));
+        brpc::LoadBalancer::CallInfo info = {
+            butil::gettimeofday_us() - 1000, ptr->id(), EHOSTDOWN, NULL };
+        lb->Feedback(info);
+    }
+    ASSERT_EQ(1.0, lb->SpilloverRatio());
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_FALSE(out.need_feedback);
+        ASSERT_EQ(0u, local_ids.count(ptr->id()));
+    }
+    lb->Destroy();
+
+    // All servers are local without the local zone.
+    lb = static_cast<brpc::policy::ZoneAwareLoadBalancer*>(proto->New(""));
+    ASSERT_TRUE(lb);
+    ASSERT_EQ(all.size(), lb->AddServersInBatch(all));
+    os.str("");
+    lb->Describe(os, opt);
+    ASSERT_NE(std::string::npos, os.str().find("local=6 remote=0")) << os.str();
+    lb->Destroy();
+    for (size_t i = 0; i < all.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(all[i].id));
+    }
+}
+
 TEST_F(LoadBalancerTest, revived_from_all_failed_sanity) {
     const char* servers[] = {
         "10.92.115.19:8832",
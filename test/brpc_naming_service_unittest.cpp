@@ -18,6 +18,8 @@
 #include <stdio.h>
 #include <gtest/gtest.h>
 #include <vector>
+#include <algorithm>
+#include <iterator>
 #include "butil/string_printf.h"
 #include "butil/strings/string_split.h"
 #include "butil/files/temp_file.h"
@@ -33,6 +35,10 @@
 #include "brpc/policy/remote_file_naming_service.h"
 #include "brpc/policy/discovery_naming_service.h"
 #include "brpc/policy/nacos_naming_service.h"
+#include "brpc/details/naming_service_thread.h"
+#include "brpc/details/server_subset.h"
+#include "brpc/socket_map.h"
+#include "brpc/channel.h"
 #include "echo.pb.h"
 #include "brpc/server.h"
 
@@ -838,4 +844,224 @@ TEST(NamingServiceTest, nacos) {
     }
 }
 
+// Gives initial servers and saves `actions' to push changes later.
+class PushNamingService : public brpc::NamingService {
+public:
+    static brpc::NamingServiceActions* actions;
+
+    int RunNamingService(const char*, brpc::NamingServiceActions* a) override {
+        actions = a;
+        std::vector<brpc::ServerNode> servers;
+        servers.push_back(brpc::ServerNode(butil::EndPoint(butil::my_ip(), 8001)));
+        servers.push_back(brpc::ServerNode(butil::EndPoint(butil::my_ip(), 8002)));
+        a->ResetServers(servers);
+        return 0;
+    }
+    bool RunNamingServiceReturnsQuickly() override { return true; }
+    brpc::NamingService* New() const override { return new PushNamingService; }
+    void Destroy() override { delete this; }
+};
+brpc::NamingServiceActions* PushNamingService::actions = NULL;
+
+class RecordingWatcher : public brpc::NamingServiceWatcher {
+public:
+    RecordingWatcher() : nchange(0) {}
+    void OnAddedServers(const std::vector<brpc::ServerId>& servers) override {
+        ++nchange;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            ASSERT_TRUE(ids.insert(servers[i].id).second);
+            tags[servers[i].id] = servers[i].tag;
+        }
+    }
+    void OnRemovedServers(const std::vector<brpc::ServerId>& servers) override {
+        ++nchange;
+        for (size_t i = 0; i < servers.size(); ++i) {
+            ASSERT_EQ(1u, ids.erase(servers[i].id));
+        }
+    }
+    std::set<brpc::SocketId> ids;
+    std::map<brpc::SocketId, std::string> tags;
+    int nchange;
+};
+
+class UpdatingWatcher : public RecordingWatcher {
+public:
+    UpdatingWatcher() : nupdate(0) {}
+    void OnServersChanged(const std::vector<brpc::ServerId>& added,
+                          const std::vector<brpc::ServerId>& removed) override {
+        ++nupdate;
+        RecordingWatcher::OnServersChanged(added, removed);
+    }
+    int nupdate;
+};
+
+TEST(NamingServiceTest, push_changes) {
+    static PushNamingService push_ns;
+    brpc::NamingServiceExtension()->RegisterOrDie("push_test", &push_ns);
+    butil::intrusive_ptr<brpc::NamingServiceThread> nsthread;
+    ASSERT_EQ(0, brpc::GetNamingServiceThread(&nsthread, "push_test://svc", NULL));
+    brpc::NamingServiceActions* actions = PushNamingService::actions;
+    ASSERT_TRUE(actions != NULL);
+    RecordingWatcher w1;
+    UpdatingWatcher w2;
+    ASSERT_EQ(0, nsthread->AddWatcher(&w1));
+    ASSERT_EQ(0, nsthread->AddWatcher(&w2));
+    ASSERT_EQ(2u, w1.ids.size());
+    ASSERT_EQ(2u, w2.ids.size());
+
+    const butil::EndPoint pt1(butil::my_ip(), 8001);
+    const butil::EndPoint pt3(butil::my_ip(), 8003);
+    std::vector<brpc::ServerNode> added;
+    std::vector<brpc::ServerNode> removed;
+    // Existing and duplicated servers are ignored.
+    added.push_back(brpc::ServerNode(pt3));
+    added.push_back(brpc::ServerNode(pt3));
+    added.push_back(brpc::ServerNode(pt1));
+    actions->AddServers(added);
+    ASSERT_EQ(3u, w1.ids.size());
+    ASSERT_EQ(3u, w2.ids.size());
+    ASSERT_EQ(1, w2.nupdate);
+
+    removed.push_back(brpc::ServerNode(butil::EndPoint(butil::my_ip(), 8002)));
+    removed.push_back(brpc::ServerNode(butil::EndPoint(butil::my_ip(), 8004)));
+    actions->RemoveServers(removed);
+    ASSERT_EQ(2u, w1.ids.size());
+    ASSERT_EQ(2, w2.nupdate);
+    // Nothing changed, watchers are not notified.
+    actions->RemoveServers(removed);
+    ASSERT_EQ(2, w2.nupdate);
+
+    // Change the tag(weight) of pt1 in one update.
+    added.clear();
+    removed.clear();
+    added.push_back(brpc::ServerNode(pt1, "2"));
+    removed.push_back(brpc::ServerNode(pt1));
+    const int nchange = w1.nchange;
+    actions->UpdateServers(added, removed);
+    ASSERT_EQ(3, w2.nupdate);
+    ASSERT_EQ(nchange + 2, w1.nchange);
+    ASSERT_EQ(2u, w1.ids.size());
+    ASSERT_EQ(w1.ids, w2.ids);
+    int ntagged = 0;
+    for (std::set<brpc::SocketId>::iterator it = w2.ids.begin();
+         it != w2.ids.end(); ++it) {
+        ntagged += (w2.tags[*it] == "2");
+    }
+    ASSERT_EQ(1, ntagged);
+
+    // Full lists still work.
+    std::vector<brpc::ServerNode> servers;
+    servers.push_back(brpc::ServerNode(pt1, "2"));
+    servers.push_back(brpc::ServerNode(butil::EndPoint(butil::my_ip(), 8005)));
+    actions->ResetServers(servers);
+    ASSERT_EQ(4, w2.nupdate);
+    ASSERT_EQ(2u, w2.ids.size());
+    ASSERT_EQ(w1.ids, w2.ids);
+
+    ASSERT_EQ(0, nsthread->RemoveWatcher(&w1));
+    ASSERT_EQ(0, nsthread->RemoveWatcher(&w2));
+}
+
+TEST(NamingServiceTest, server_subset) {
+    const size_t NSERVER = 100;
+    const size_t SUBSET_SIZE = 10;
+    std::vector<brpc::ServerId> servers;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        brpc::SocketId id;
+        ASSERT_EQ(0, brpc::SocketMapInsert(brpc::SocketMapKey(
+            butil::EndPoint(butil::IP_ANY, 9100 + i)), &id));
+        servers.push_back(brpc::ServerId(id));
+    }
+
+    // Same client ids choose same subsets.
+    RecordingWatcher w1;
+    RecordingWatcher w2;
+    brpc::ServerSubset s1(SUBSET_SIZE, "client", &w1);
+    brpc::ServerSubset s2(SUBSET_SIZE, "client", &w2);
+    s1.OnAddedServers(servers);
+    s2.OnAddedServers(servers);
+    ASSERT_EQ(SUBSET_SIZE, w1.ids.size());
+    ASSERT_EQ(w1.ids, w2.ids);
+    ASSERT_EQ(NSERVER, s1.server_count());
+    ASSERT_EQ(SUBSET_SIZE, s1.subset_count());
+
+    // Removing a server out of the subset changes nothing.
+    std::vector<brpc::ServerId> removed;
+    for (size_t i = 0; i < NSERVER && removed.empty(); ++i) {
+        if (w1.ids.count(servers[i].id) == 0) {
+            removed.push_back(servers[i]);
+        }
+    }
+    int nchange = w1.nchange;
+    s1.OnRemovedServers(removed);
+    ASSERT_EQ(nchange, w1.nchange);
+    s1.OnAddedServers(removed);
+    ASSERT_EQ(nchange, w1.nchange);
+
+    // Removing a server in the subset replaces it with exactly one server.
+    removed.clear();
+    removed.push_back(brpc::ServerId(*w1.ids.begin()));
+    const std::set<brpc::SocketId> old_ids = w1.ids;
+    s1.OnRemovedServers(removed);
+    ASSERT_EQ(SUBSET_SIZE, w1.ids.size());
+    std::vector<brpc::SocketId> diff;
+    std::set_difference(w1.ids.begin(), w1.ids.end(),
+                        old_ids.begin(), old_ids.end(),
+                        std::back_inserter(diff));
+    ASSERT_EQ(1u, diff.size());
+    ASSERT_EQ(0u, w1.ids.count(removed[0].id));
+    // And the subset is restored after adding it back.
+    s1.OnAddedServers(removed);
+    ASSERT_EQ(old_ids, w1.ids);
+
+    // Subsets of different clients spread over servers evenly.
+    const size_t NCLIENT = 1000;
+    std::map<brpc::SocketId, size_t> nclient;
+    for (size_t i = 0; i < NCLIENT; ++i) {
+        RecordingWatcher w;
+        brpc::ServerSubset s(SUBSET_SIZE, "client" + std::to_string(i), &w);
+        s.OnAddedServers(servers);
+        ASSERT_EQ(SUBSET_SIZE, w.ids.size());
+        for (std::set<brpc::SocketId>::iterator
+                 it = w.ids.begin(); it != w.ids.end(); ++it) {
+            ++nclient[*it];
+        }
+    }
+    const size_t expected = NCLIENT * SUBSET_SIZE / NSERVER;
+    size_t min_nclient = NCLIENT;
+    size_t max_nclient = 0;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        min_nclient = std::min(min_nclient, nclient[servers[i].id]);
+        max_nclient = std::max(max_nclient, nclient[servers[i].id]);
+    }
+    LOG(INFO) << "clients per server: min=" << min_nclient
+              << " max=" << max_nclient << " expected=" << expected;
+    ASSERT_GT(min_nclient, expected / 2);
+    ASSERT_LT(max_nclient, expected * 2);
+
+    // All servers are used if there're not enough servers.
+    RecordingWatcher w3;
+    brpc::ServerSubset s3(NSERVER + 1, "", &w3);
+    s3.OnAddedServers(servers);
+    ASSERT_EQ(NSERVER, w3.ids.size());
+
+    for (size_t i = 0; i < NSERVER; ++i) {
+        brpc::SocketMapRemove(brpc::SocketMapKey(
+            butil::EndPoint(butil::IP_ANY, 9100 + i)));
+    }
+}
+
+TEST(NamingServiceTest, channel_with_subset) {
+    brpc::ChannelOptions opt;
+    opt.subset_size = 2;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("list://127.0.0.1:9201,127.0.0.1:9202,"
+                              "127.0.0.1:9203,127.0.0.1:9204", "rr", &opt));
+    // Only servers in the subset are added into the load balancer.
+    ASSERT_EQ(2, channel.Weight());
+    std::ostringstream os;
+    channel.Describe(os, brpc::DescribeOptions());
+    ASSERT_NE(std::string::npos, os.str().find("subset=2/4")) << os.str();
+}
+
 } //namespace
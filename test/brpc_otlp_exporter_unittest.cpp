@@ -0,0 +1,374 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <map>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/synchronization/lock.h"
+#include "butil/time.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/span.h"
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/otlp_exporter.h"
+#include "echo.pb.h"
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+// Stand-in of OpenTelemetry collectors, accepting both OTLP/HTTP and
+// OTLP/gRPC.
+class MockCollector : public brpc::otlp::TraceService {
+public:
+    void Export(google::protobuf::RpcController*,
+                const brpc::otlp::ExportTraceServiceRequest* request,
+                brpc::otlp::ExportTraceServiceResponse*,
+                google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (int i = 0; i < request->resource_spans_size(); ++i) {
+            const brpc::otlp::ResourceSpans& rs = request->resource_spans(i);
+            _resource = rs.resource();
+            for (int j = 0; j < rs.scope_spans_size(); ++j) {
+                for (int k = 0; k < rs.scope_spans(j).spans_size(); ++k) {
+                    const brpc::otlp::Span& span = rs.scope_spans(j).spans(k);
+                    _spans[span.trace_id()].push_back(span);
+                }
+            }
+        }
+    }
+
+    std::vector<brpc::otlp::Span> FindSpans(uint64_t trace_id,
+                                            uint64_t trace_id_high = 0) {
+        std::string id;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            id.push_back((char)((trace_id_high >> shift) & 0xFF));
+        }
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            id.push_back((char)((trace_id >> shift) & 0xFF));
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _spans[id];
+    }
+
+    brpc::otlp::Resource resource() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _resource;
+    }
+
+private:
+    butil::Mutex _mutex;
+    brpc::otlp::Resource _resource;
+    std::map<std::string, std::vector<brpc::otlp::Span> > _spans;
+};
+
+// Forward "forward" to itself once and record traceparent received.
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        const std::string* traceparent =
+            cntl->http_request().GetHeader("traceparent");
+        if (traceparent) {
+            BAIDU_SCOPED_LOCK(mutex);
+            traceparents.push_back(*traceparent);
+        }
+        response->set_message(request->message());
+        if (request->message() == "forward") {
+            test::EchoRequest req;
+            req.set_message("leaf");
+            brpc::Controller sub_cntl;
+            test::EchoService_Stub stub(channel);
+            stub.Echo(&sub_cntl, &req, response, NULL);
+            if (sub_cntl.Failed()) {
+                cntl->SetFailed(sub_cntl.ErrorCode(), "%s",
+                                sub_cntl.ErrorText().c_str());
+            }
+        }
+    }
+
+    brpc::Channel* channel;
+    butil::Mutex mutex;
+    std::vector<std::string> traceparents;
+};
+
+std::string ToBytes(uint64_t id) {
+    std::string out;
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out.push_back((char)((id >> shift) & 0xFF));
+    }
+    return out;
+}
+
+class OtlpExporterTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        ASSERT_EQ(0, s_collector_server.AddService(
+                      &s_collector, brpc::SERVER_DOESNT_OWN_SERVICE,
+                      "/v1/traces => Export,"
+                      "/opentelemetry.proto.collector.trace.v1.TraceService"
+                      "/Export => Export"));
+        ASSERT_EQ(0, s_collector_server.Start("127.0.0.1:0", NULL));
+        const std::string endpoint =
+            butil::endpoint2str(s_collector_server.listen_address()).c_str();
+        ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                         "rpcz_otlp_endpoint", endpoint.c_str()).empty());
+        ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                         "rpcz_otlp_service_name", "otlp_test").empty());
+        ASSERT_TRUE(brpc::OtlpExporter::GetInstance());
+    }
+
+    // Flush until `n' spans of `trace_id' are received.
+    std::vector<brpc::otlp::Span> WaitForSpans(uint64_t trace_id, size_t n,
+                                               uint64_t trace_id_high = 0) {
+        std::vector<brpc::otlp::Span> spans;
+        for (int i = 0; i < 50; ++i) {
+            brpc::OtlpExporter::GetInstance()->Flush();
+            spans = s_collector.FindSpans(trace_id, trace_id_high);
+            if (spans.size() >= n) {
+                break;
+            }
+            usleep(100000);
+        }
+        return spans;
+    }
+
+    static MockCollector s_collector;
+    static brpc::Server s_collector_server;
+};
+
+MockCollector OtlpExporterTest::s_collector;
+brpc::Server OtlpExporterTest::s_collector_server;
+
+const brpc::otlp::Span* FindSpanById(
+    const std::vector<brpc::otlp::Span>& spans, const std::string& id) {
+    for (size_t i = 0; i < spans.size(); ++i) {
+        if (spans[i].span_id() == id) {
+            return &spans[i];
+        }
+    }
+    return NULL;
+}
+
+TEST_F(OtlpExporterTest, export_spans) {
+    EchoServiceImpl echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    ASSERT_EQ(0, channel.Init(server.listen_address(), &options));
+    echo_svc.channel = &channel;
+
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "true").empty());
+    test::EchoRequest req;
+    req.set_message("forward");
+    test::EchoResponse res;
+    brpc::Controller cntl;
+    test::EchoService_Stub stub(&channel);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ("leaf", res.message());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "false").empty());
+    // Servers got traceparent of the client spans, the first one is of
+    // the root span.
+    ASSERT_EQ(2u, echo_svc.traceparents.size());
+    unsigned long long trace_id = 0;
+    unsigned long long root_id = 0;
+    ASSERT_EQ(2, sscanf(echo_svc.traceparents[0].c_str(),
+                        "00-0000000000000000%16llx-%16llx-01",
+                        &trace_id, &root_id));
+
+    // client -> server -> client -> server
+    std::vector<brpc::otlp::Span> spans = WaitForSpans(trace_id, 4);
+    ASSERT_EQ(4u, spans.size());
+    const brpc::otlp::Span* root = FindSpanById(spans, ToBytes(root_id));
+    ASSERT_TRUE(root);
+    ASSERT_EQ(brpc::otlp::Span::SPAN_KIND_CLIENT, root->kind());
+    ASSERT_TRUE(root->parent_span_id().empty());
+    ASSERT_LE(root->start_time_unix_nano(), root->end_time_unix_nano());
+    ASSERT_FALSE(root->has_status());
+    // Each span except the root is a child of another span.
+    int nserver = 0;
+    for (size_t i = 0; i < spans.size(); ++i) {
+        if (spans[i].kind() == brpc::otlp::Span::SPAN_KIND_SERVER) {
+            ASSERT_EQ("test.EchoService.Echo", spans[i].name());
+            ++nserver;
+        }
+        if (&spans[i] != root) {
+            ASSERT_TRUE(FindSpanById(spans, spans[i].parent_span_id()))
+                << "span " << i << " has no parent";
+            ASSERT_NE(spans[i].span_id(), spans[i].parent_span_id());
+        }
+    }
+    ASSERT_EQ(2, nserver);
+
+    const brpc::otlp::Resource resource = s_collector.resource();
+    ASSERT_EQ("service.name", resource.attributes(0).key());
+    ASSERT_EQ("otlp_test", resource.attributes(0).value().string_value());
+    ASSERT_LT(0, brpc::OtlpExporter::GetInstance()->exported_count());
+}
+
+TEST_F(OtlpExporterTest, traceparent) {
+    brpc::Server server;
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    ASSERT_EQ(0, channel.Init(server.listen_address(), &options));
+    // Calls are not traced at client-side to act as clients instrumented by
+    // OpenTelemetry, whose traceparent is not overwritten.
+    // traceparent is ignored when rpcz is disabled.
+    brpc::Controller cntl0;
+    brpc::ControllerPrivateAccessor(&cntl0).disable_tracing();
+    cntl0.http_request().uri() = "/version";
+    cntl0.http_request().SetHeader(
+        "traceparent",
+        "00-0af7651916cd43dd8448eb211c80319b-b7ad6b7169203331-01");
+    channel.CallMethod(NULL, &cntl0, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl0.Failed()) << cntl0.ErrorText();
+
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "true").empty());
+    brpc::Controller cntl;
+    brpc::ControllerPrivateAccessor(&cntl).disable_tracing();
+    cntl.http_request().uri() = "/version";
+    cntl.http_request().SetHeader(
+        "traceparent",
+        "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01");
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    // Not sampled.
+    brpc::Controller cntl2;
+    brpc::ControllerPrivateAccessor(&cntl2).disable_tracing();
+    cntl2.http_request().uri() = "/version";
+    cntl2.http_request().SetHeader(
+        "traceparent",
+        "00-0af7651916cd43dd8448eb211c80319d-b7ad6b7169203331-00");
+    channel.CallMethod(NULL, &cntl2, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl2.Failed()) << cntl2.ErrorText();
+    // Values of version 00 longer than 55 chars are invalid.
+    brpc::Controller cntl3;
+    brpc::ControllerPrivateAccessor(&cntl3).disable_tracing();
+    cntl3.http_request().uri() = "/version";
+    cntl3.http_request().SetHeader(
+        "traceparent",
+        "00-0af7651916cd43dd8448eb211c80319e-b7ad6b7169203331-01-00");
+    channel.CallMethod(NULL, &cntl3, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl3.Failed()) << cntl3.ErrorText();
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "false").empty());
+
+    std::vector<brpc::otlp::Span> spans =
+        WaitForSpans(0x8448eb211c80319cULL, 1, 0x0af7651916cd43ddULL);
+    ASSERT_EQ(1u, spans.size());
+    ASSERT_EQ(brpc::otlp::Span::SPAN_KIND_SERVER, spans[0].kind());
+    ASSERT_EQ("brpc.version.default_method", spans[0].name());
+    ASSERT_EQ(ToBytes(0xb7ad6b7169203331ULL), spans[0].parent_span_id());
+    ASSERT_NE(spans[0].span_id(), spans[0].parent_span_id());
+    ASSERT_TRUE(s_collector.FindSpans(0x8448eb211c80319bULL,
+                                      0x0af7651916cd43ddULL).empty());
+    ASSERT_TRUE(s_collector.FindSpans(0x8448eb211c80319dULL,
+                                      0x0af7651916cd43ddULL).empty());
+    ASSERT_TRUE(s_collector.FindSpans(0x8448eb211c80319eULL,
+                                      0x0af7651916cd43ddULL).empty());
+    ASSERT_TRUE(s_collector.FindSpans(0x8448eb211c80319cULL).empty());
+}
+
+TEST_F(OtlpExporterTest, traceparent_forwarded) {
+    EchoServiceImpl echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    ASSERT_EQ(0, channel.Init(server.listen_address(), &options));
+    echo_svc.channel = &channel;
+
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "true").empty());
+    brpc::Controller cntl;
+    brpc::ControllerPrivateAccessor(&cntl).disable_tracing();
+    cntl.http_request().uri() = "/EchoService/Echo";
+    cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+    cntl.http_request().set_content_type("application/json");
+    cntl.http_request().SetHeader(
+        "traceparent",
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+    cntl.request_attachment().append("{\"message\":\"forward\"}");
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "false").empty());
+
+    // The downstream server got the whole 128-bit trace-id.
+    ASSERT_EQ(2u, echo_svc.traceparents.size());
+    ASSERT_EQ(0u, echo_svc.traceparents[1].find(
+                  "00-4bf92f3577b34da6a3ce929d0e0e4736-"))
+        << echo_svc.traceparents[1];
+    // server -> client -> server
+    std::vector<brpc::otlp::Span> spans =
+        WaitForSpans(0xa3ce929d0e0e4736ULL, 3, 0x4bf92f3577b34da6ULL);
+    ASSERT_EQ(3u, spans.size());
+}
+
+// Exporting inside a traced RPC does not create spans of exporting RPCs,
+// which would be exported again.
+TEST_F(OtlpExporterTest, exporting_not_traced) {
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "true").empty());
+    brpc::Span* span = brpc::Span::CreateServerSpan(
+        "test.EchoService.Echo", 3, 4, 0, butil::gettimeofday_us());
+    span->AsParent();
+    brpc::OtlpExporter::GetInstance()->Export(span);
+    brpc::OtlpExporter::GetInstance()->Flush();
+    ASSERT_EQ(span, brpc::Span::tls_parent());
+    ASSERT_EQ(0u, span->CountClientSpans());
+    bthread::tls_bls.rpcz_parent_span = NULL;
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "false").empty());
+}
+
+TEST_F(OtlpExporterTest, drop_when_full) {
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "rpcz_otlp_max_pending_spans", "1").empty());
+    brpc::OtlpExporter* exporter = brpc::OtlpExporter::GetInstance();
+    const int64_t ndropped = exporter->dropped_count();
+    // Spans are leaked since they're destroyed by the collecting thread only.
+    brpc::Span* span = brpc::Span::CreateServerSpan(
+        "test.EchoService.Echo", 1, 2, 0, butil::gettimeofday_us());
+    span->AsParent();
+    brpc::Span::CreateClientSpan("test.EchoService.Echo", 0);
+    bthread::tls_bls.rpcz_parent_span = NULL;
+    exporter->Export(span);
+    ASSERT_EQ(ndropped + 2, exporter->dropped_count());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "rpcz_otlp_max_pending_spans", "8192").empty());
+    exporter->Export(span);
+    ASSERT_EQ(2u, WaitForSpans(1, 2).size());
+}
+
+} // namespace
@@ -18,12 +18,23 @@
 // brpc - A framework to host and access services throughout Baidu.
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <google/protobuf/io/coded_stream.h>
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
+#include "brpc/prometheus_metrics.pb.h"
+#include "brpc/builtin/prometheus_metrics_service.h"
 #include "butil/strings/string_piece.h"
+#include "bvar/bvar.h"
+#include "bvar/multi_dimension.h"
 #include "echo.pb.h"
 
+namespace bvar {
+DECLARE_bool(bvar_latency_histogram);
+DECLARE_int32(bvar_max_dump_multi_dimension_metric_number);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -41,6 +52,12 @@ public:
     }
 };
 
+static std::string DumpMetrics() {
+    butil::IOBuf buf;
+    EXPECT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+    return buf.to_string();
+}
+
 enum STATE {
     HELP = 0,
     TYPE,
@@ -142,3 +159,176 @@ TEST(PrometheusMetrics, sanity) {
     ASSERT_EQ(0, server.Stop(0));
     ASSERT_EQ(0, server.Join());
 }
+
+TEST(PrometheusMetrics, cache_and_types) {
+    std::string output = DumpMetrics();
+    ASSERT_EQ(std::string::npos, output.find("prometheus_test_adder"));
+    {
+        bvar::Adder<int> adder("prometheus_test_adder");
+        adder << 3;
+        bvar::Status<std::string> str("prometheus_test_string", "abc");
+        output = DumpMetrics();
+        ASSERT_NE(std::string::npos, output.find(
+            "# TYPE prometheus_test_adder gauge\nprometheus_test_adder 3\n"))
+            << output;
+        ASSERT_EQ(std::string::npos, output.find("prometheus_test_string"));
+    }
+    // Hidden variables are removed from cached descriptors.
+    output = DumpMetrics();
+    ASSERT_EQ(std::string::npos, output.find("prometheus_test_adder"));
+}
+
+TEST(PrometheusMetrics, histogram) {
+    bvar::FLAGS_bvar_latency_histogram = true;
+    bvar::LatencyRecorder rec("prometheus_test");
+    bvar::FLAGS_bvar_latency_histogram = false;
+    for (int i = 1; i <= 100; ++i) {
+        rec << i;
+    }
+    rec << 0;
+    const std::string output = DumpMetrics();
+    ASSERT_NE(std::string::npos, output.find(
+        "# TYPE prometheus_test_latency_histogram histogram\n"
+        "prometheus_test_latency_histogram_bucket{le=\"1\"} 2\n"
+        "prometheus_test_latency_histogram_bucket{le=\"2\"} 3\n"
+        "prometheus_test_latency_histogram_bucket{le=\"4\"} 5\n")) << output;
+    ASSERT_NE(std::string::npos, output.find(
+        "prometheus_test_latency_histogram_bucket{le=\"128\"} 101\n"
+        "prometheus_test_latency_histogram_bucket{le=\"+Inf\"} 101\n"
+        "prometheus_test_latency_histogram_sum 5050\n"
+        "prometheus_test_latency_histogram_count 101\n")) << output;
+}
+
+TEST(PrometheusMetrics, multi_dimension) {
+    const int32_t saved = bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number;
+    bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number = 100;
+    bvar::FLAGS_bvar_latency_histogram = true;
+    bvar::MultiDimension<bvar::LatencyRecorder> md(
+        "prometheus_test_md", std::list<std::string>{"method"});
+    // Stats are created on demand.
+    bvar::LatencyRecorder* get = md.get_stats(std::list<std::string>{"get"});
+    bvar::LatencyRecorder* ab = md.get_stats(std::list<std::string>{"a\"b"});
+    bvar::FLAGS_bvar_latency_histogram = false;
+    // Percentiles are the difference between samples of windows which are
+    // taken every second, record between samples.
+    usleep(1200000);
+    *get << 10;
+    *ab << 20;
+    usleep(1200000);
+    const std::string output = DumpMetrics();
+    bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number = saved;
+
+    // Lines of a family are consecutive, with labels escaped.
+    const size_t summary = output.find(
+        "# TYPE prometheus_test_md_latency summary\n");
+    ASSERT_NE(std::string::npos, summary) << output;
+    const size_t histogram = output.find(
+        "# TYPE prometheus_test_md_latency_histogram histogram\n");
+    ASSERT_NE(std::string::npos, histogram) << output;
+    const size_t count = output.find(
+        "# TYPE prometheus_test_md_count counter\n");
+    ASSERT_NE(std::string::npos, count) << output;
+    const std::string summary_lines = output.substr(summary, histogram - summary);
+    ASSERT_NE(std::string::npos, summary_lines.find(
+        "prometheus_test_md_latency{method=\"get\",quantile=\"0.99\"} 10\n"));
+    ASSERT_NE(std::string::npos, summary_lines.find(
+        "prometheus_test_md_latency{method=\"a\\\"b\",quantile=\"0.99\"} 20\n"));
+    ASSERT_NE(std::string::npos, summary_lines.find(
+        "prometheus_test_md_latency_sum{method=\"get\"} 10\n"));
+    ASSERT_NE(std::string::npos, summary_lines.find(
+        "prometheus_test_md_latency_count{method=\"get\"} 1\n"));
+    ASSERT_NE(std::string::npos, output.find(
+        "prometheus_test_md_latency_histogram_bucket{method=\"get\",le=\"+Inf\"} 1\n"));
+    ASSERT_NE(std::string::npos, output.find(
+        "prometheus_test_md_count{method=\"get\"} 1\n"));
+}
+
+static std::map<std::string, brpc::prometheus::MetricFamily> DumpFamilies() {
+    butil::IOBuf buf;
+    EXPECT_EQ(0, brpc::DumpPrometheusMetricsToIOBufAsProtobuf(&buf));
+    butil::IOBufAsZeroCopyInputStream wrapper(buf);
+    google::protobuf::io::CodedInputStream coded_in(&wrapper);
+    std::map<std::string, brpc::prometheus::MetricFamily> families;
+    uint32_t size = 0;
+    while (coded_in.ReadVarint32(&size)) {
+        const google::protobuf::io::CodedInputStream::Limit limit =
+            coded_in.PushLimit(size);
+        brpc::prometheus::MetricFamily family;
+        EXPECT_TRUE(family.ParseFromCodedStream(&coded_in));
+        coded_in.PopLimit(limit);
+        EXPECT_EQ(0UL, families.count(family.name())) << family.name();
+        families[family.name()] = family;
+    }
+    return families;
+}
+
+TEST(PrometheusMetrics, protobuf) {
+    const int32_t saved = bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number;
+    bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number = 100;
+    bvar::Adder<int> adder("prometheus_test_pb_adder");
+    adder << 3;
+    bvar::FLAGS_bvar_latency_histogram = true;
+    bvar::MultiDimension<bvar::LatencyRecorder> md(
+        "prometheus_test_pb_md", std::list<std::string>{"method", "code"});
+    bvar::LatencyRecorder* rec = md.get_stats(std::list<std::string>{"get", "0"});
+    bvar::FLAGS_bvar_latency_histogram = false;
+    usleep(1200000);
+    for (int i = 1; i <= 1000; ++i) {
+        *rec << (i < 500 ? 10 : 1000);
+    }
+    usleep(1200000);
+    std::map<std::string, brpc::prometheus::MetricFamily> families = DumpFamilies();
+    bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number = saved;
+
+    const brpc::prometheus::MetricFamily& gauge = families["prometheus_test_pb_adder"];
+    ASSERT_EQ(brpc::prometheus::GAUGE, gauge.type());
+    ASSERT_EQ(1, gauge.metric_size());
+    ASSERT_EQ(3, gauge.metric(0).gauge().value());
+
+    const brpc::prometheus::MetricFamily& summary = families["prometheus_test_pb_md_latency"];
+    ASSERT_EQ(brpc::prometheus::SUMMARY, summary.type());
+    ASSERT_EQ(1, summary.metric_size());
+    const brpc::prometheus::Metric& sm = summary.metric(0);
+    ASSERT_EQ(2, sm.label_size());
+    ASSERT_EQ("method", sm.label(0).name());
+    ASSERT_EQ("get", sm.label(0).value());
+    ASSERT_EQ("code", sm.label(1).name());
+    ASSERT_EQ("0", sm.label(1).value());
+    ASSERT_EQ(5, sm.summary().quantile_size());
+    ASSERT_EQ(0.999, sm.summary().quantile(3).quantile());
+    ASSERT_NEAR(1000, sm.summary().quantile(3).value(), 11);
+    ASSERT_EQ(1000UL, sm.summary().sample_count());
+    ASSERT_EQ(499 * 10 + 501 * 1000, sm.summary().sample_sum());
+
+    const brpc::prometheus::MetricFamily& histogram =
+        families["prometheus_test_pb_md_latency_histogram"];
+    ASSERT_EQ(brpc::prometheus::HISTOGRAM, histogram.type());
+    ASSERT_EQ(1, histogram.metric_size());
+    const brpc::prometheus::Histogram& h = histogram.metric(0).histogram();
+    ASSERT_EQ(1000UL, h.sample_count());
+    ASSERT_EQ(5, h.schema());
+    // Decode native buckets.
+    ASSERT_EQ(2, h.positive_span_size());
+    int index = 0;
+    int64_t bucket_count = 0;
+    int d = 0;
+    std::map<int, int64_t> native;
+    for (int i = 0; i < h.positive_span_size(); ++i) {
+        index += h.positive_span(i).offset();
+        for (uint32_t j = 0; j < h.positive_span(i).length(); ++j) {
+            bucket_count += h.positive_delta(d++);
+            native[index++] = bucket_count;
+        }
+    }
+    ASSERT_EQ(h.positive_delta_size(), d);
+    ASSERT_EQ(2UL, native.size());
+    ASSERT_EQ(499, native[bvar::detail::HistogramBuckets::bucket_index(10)]);
+    ASSERT_EQ(501, native[bvar::detail::HistogramBuckets::bucket_index(1000)]);
+    // And classic buckets.
+    ASSERT_LT(0, h.bucket_size());
+    ASSERT_EQ(1000UL, h.bucket(h.bucket_size() - 1).cumulative_count());
+
+    const brpc::prometheus::MetricFamily& count = families["prometheus_test_pb_md_count"];
+    ASSERT_EQ(brpc::prometheus::COUNTER, count.type());
+    ASSERT_EQ(1000, count.metric(0).counter().value());
+}
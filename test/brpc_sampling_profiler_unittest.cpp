@@ -0,0 +1,155 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// brpc - A framework to host and access services throughout Baidu.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/details/sampling_profiler.h"
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
+
+volatile int64_t g_spin_result = 0;
+
+void __attribute__((noinline)) SpinForSamplingProfiler(int64_t ms) {
+    const int64_t end_us = butil::cpuwide_time_us() + ms * 1000;
+    while (butil::cpuwide_time_us() < end_us) {
+        for (int i = 0; i < 1000; ++i) {
+            g_spin_result = g_spin_result + i;
+        }
+    }
+}
+
+static void* SpinInBthread(void*) {
+    SpinForSamplingProfiler(500);
+    return NULL;
+}
+
+static void* DoNothing(void*) {
+    return NULL;
+}
+
+namespace {
+
+int64_t CountStacksWith(const std::map<std::string, int64_t>& stacks,
+                        const std::string& prefix, const std::string& frame) {
+    int64_t n = 0;
+    for (std::map<std::string, int64_t>::const_iterator
+             it = stacks.begin(); it != stacks.end(); ++it) {
+        if (it->first.compare(0, prefix.size(), prefix) == 0 &&
+            it->first.find(frame) != std::string::npos) {
+            n += it->second;
+        }
+    }
+    return n;
+}
+
+TEST(SamplingProfilerTest, sanity) {
+    brpc::SamplingProfiler* profiler = brpc::SamplingProfiler::GetInstance();
+    ASSERT_EQ(0, profiler->frequency());
+    ASSERT_EQ(-1, profiler->SetFrequency(-1));
+    // Start workers of bthread before sampling, threads created later are
+    // sampled after the next scan of threads.
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, DoNothing, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, profiler->SetFrequency(997));
+
+    SpinForSamplingProfiler(500);
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, SpinInBthread, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+
+    std::map<std::string, int64_t> stacks;
+    const int64_t nsample = profiler->GetFoldedStacks(60, &stacks);
+    ASSERT_EQ(0, profiler->SetFrequency(0));
+    ASSERT_GT(nsample, 0);
+    const int64_t npthread = CountStacksWith(
+        stacks, "pthread;", "SpinForSamplingProfiler");
+    const int64_t nbthread = CountStacksWith(
+        stacks, "bthread;", "SpinForSamplingProfiler");
+    LOG(INFO) << "nsample=" << nsample << " npthread=" << npthread
+              << " nbthread=" << nbthread
+              << " dropped=" << profiler->dropped_count();
+
+    // Timers of cpu time are checked at ticks of kernel, the actual
+    // frequency is probably less than 997.
+    ASSERT_GT(npthread, 50);
+    ASSERT_GT(nbthread, 50);
+
+    // No samples when stopped. Samples are moved out of the ring once per
+    // second, wait for pending ones before counting.
+    usleep(1100000);
+    std::map<std::string, int64_t> stacks2;
+    const int64_t nsample2 = profiler->GetFoldedStacks(60, &stacks2);
+    SpinForSamplingProfiler(200);
+    usleep(1100000);
+    std::map<std::string, int64_t> stacks3;
+    ASSERT_EQ(nsample2, profiler->GetFoldedStacks(60, &stacks3));
+}
+
+TEST(SamplingProfilerTest, flamegraph_service) {
+    brpc::Server server;
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    ASSERT_EQ(0, channel.Init(server.listen_address(), &options));
+
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "sampling_profiler_hz", "997").empty());
+    SpinForSamplingProfiler(300);
+    {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/flamegraph?seconds=5";
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        const std::string body = cntl.response_attachment().to_string();
+        ASSERT_NE(std::string::npos, body.find("SpinForSamplingProfiler"));
+        // Folded format: "frame;frame count"
+        ASSERT_NE(std::string::npos, body.find("pthread;"));
+    }
+    {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/flamegraph?seconds=5&console=0";
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        const std::string body = cntl.response_attachment().to_string();
+        ASSERT_NE(std::string::npos, body.find("<div class=\"fn\""));
+    }
+    {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/flamegraph?seconds=abc";
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_TRUE(cntl.Failed());
+    }
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "sampling_profiler_hz", "0").empty());
+    // Rejected by the validator.
+    ASSERT_TRUE(GFLAGS_NS::SetCommandLineOption(
+                    "sampling_profiler_hz", "-1").empty());
+}
+
+} // namespace
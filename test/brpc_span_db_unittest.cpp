@@ -0,0 +1,413 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <unistd.h>
+#include <sstream>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/files/file_path.h"
+#include "butil/file_util.h"
+#include "butil/time.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/span.h"
+#include "brpc/details/span_db.h"
+#include "bvar/variable.h"
+
+namespace {
+
+const int64_t BASE_US = 1600000000000000L;
+
+// Spans are leaked since they're destroyed by the collecting thread only.
+brpc::Span* MakeSpan(uint64_t trace_id, uint64_t span_id, int64_t start_us,
+                     int nclient) {
+    brpc::Span* span = brpc::Span::CreateServerSpan(
+        "test.EchoService.Echo", trace_id, span_id, 0, BASE_US);
+    span->set_received_us(start_us - BASE_US);
+    span->set_sent_us(start_us - BASE_US + 100);
+    span->set_error_code(span_id % 2 ? 0 : 1003);
+    span->Annotate("span %d", (int)span_id);
+    span->AsParent();
+    for (int i = 0; i < nclient; ++i) {
+        brpc::Span* client = brpc::Span::CreateClientSpan(
+            "test.EchoService.Echo", BASE_US);
+        client->set_start_send_us(start_us - BASE_US + 10 + i);
+    }
+    bthread::tls_bls.rpcz_parent_span = NULL;
+    return span;
+}
+
+class ErrorFilter : public brpc::SpanFilter {
+public:
+    bool Keep(const brpc::BriefSpan& brief) override {
+        return brief.error_code() != 0;
+    }
+};
+
+TEST(SpanDBTest, memory) {
+    brpc::MemorySpanDB* db = brpc::MemorySpanDB::Open("", 10, 64 * 1024);
+    ASSERT_TRUE(db);
+    db->AddRefManually();
+    // 10 is rounded up to 16.
+    for (int i = 1; i <= 16; ++i) {
+        ASSERT_EQ(0, db->Index(MakeSpan(i % 4 + 1, i, BASE_US + i * 1000, 2)));
+    }
+    ASSERT_EQ(16u, db->span_count());
+
+    brpc::RpczSpan span;
+    ASSERT_EQ(0, db->FindSpan(2, 5, &span));
+    ASSERT_EQ(2u, span.trace_id());
+    ASSERT_EQ(5u, span.span_id());
+    ASSERT_EQ(BASE_US + 5000, span.received_real_us());
+    ASSERT_EQ("test.EchoService.Echo", span.full_method_name());
+    ASSERT_NE(std::string::npos, span.info().find("span 5"));
+    ASSERT_EQ(2, span.client_spans_size());
+    ASSERT_EQ(2u, span.client_spans(0).trace_id());
+    ASSERT_EQ(5u, span.client_spans(0).parent_span_id());
+    ASSERT_EQ(BASE_US + 5010, span.client_spans(0).start_send_real_us());
+    ASSERT_EQ(-1, db->FindSpan(2, 6, &span));
+    ASSERT_EQ(-1, db->FindSpan(100, 5, &span));
+
+    std::deque<brpc::RpczSpan> spans;
+    db->FindSpans(2, &spans);
+    ASSERT_EQ(4u, spans.size());
+    for (size_t i = 0; i < spans.size(); ++i) {
+        ASSERT_EQ(2u, spans[i].trace_id());
+        ASSERT_EQ(1u, spans[i].span_id() % 4);
+    }
+
+    // Newest first, starting from the given time.
+    std::deque<brpc::BriefSpan> briefs;
+    db->ListSpans(BASE_US + 10500, 3, &briefs, NULL);
+    ASSERT_EQ(3u, briefs.size());
+    ASSERT_EQ(10u, briefs[0].span_id());
+    ASSERT_EQ(9u, briefs[1].span_id());
+    ASSERT_EQ(8u, briefs[2].span_id());
+    ASSERT_EQ(100, briefs[0].latency_us());
+    ASSERT_EQ("test.EchoService.Echo", briefs[0].full_method_name());
+    briefs.clear();
+    db->ListSpans(BASE_US + 100000, 100, &briefs, NULL);
+    ASSERT_EQ(16u, briefs.size());
+    ASSERT_EQ(16u, briefs[0].span_id());
+    briefs.clear();
+    ErrorFilter filter;
+    db->ListSpans(BASE_US + 100000, 100, &briefs, &filter);
+    ASSERT_EQ(8u, briefs.size());
+    for (size_t i = 0; i < briefs.size(); ++i) {
+        ASSERT_EQ(1003, briefs[i].error_code());
+    }
+
+    // Oldest spans are overwritten.
+    for (int i = 17; i <= 40; ++i) {
+        ASSERT_EQ(0, db->Index(MakeSpan(i % 4 + 1, i, BASE_US + i * 1000, 0)));
+    }
+    ASSERT_EQ(-1, db->FindSpan(2, 5, &span));
+    ASSERT_EQ(0, db->FindSpan(2, 37, &span));
+    spans.clear();
+    db->FindSpans(2, &spans);
+    ASSERT_GE(spans.size(), 3u);
+    ASSERT_LE(spans.size(), 4u);
+    briefs.clear();
+    db->ListSpans(BASE_US + 100000, 100, &briefs, NULL);
+    ASSERT_LE(briefs.size(), 16u);
+    ASSERT_GE(briefs.size(), 14u);
+    ASSERT_EQ(40u, briefs[0].span_id());
+
+    // Removed spans are invisible.
+    ASSERT_EQ(0, db->RemoveSpansBefore(BASE_US + 38000));
+    briefs.clear();
+    db->ListSpans(BASE_US + 100000, 100, &briefs, NULL);
+    ASSERT_EQ(3u, briefs.size());
+    ASSERT_EQ(-1, db->FindSpan(2, 37, &span));
+
+    std::ostringstream os;
+    db->Describe(os);
+    ASSERT_NE(std::string::npos, os.str().find("spans: 16/16 (40 indexed)"))
+        << os.str();
+    db->RemoveRefManually();
+}
+
+TEST(SpanDBTest, large_span_is_skipped) {
+    brpc::MemorySpanDB* db = brpc::MemorySpanDB::Open("", 16, 4096);
+    ASSERT_TRUE(db);
+    db->AddRefManually();
+    brpc::Span* span = MakeSpan(1, 1, BASE_US, 0);
+    span->Annotate(std::string(2000, 'a'));
+    ASSERT_EQ(0, db->Index(span));
+    ASSERT_EQ(0u, db->span_count());
+    // Data wraps around the ring many times.
+    for (int i = 2; i < 200; ++i) {
+        ASSERT_EQ(0, db->Index(MakeSpan(1, i, BASE_US + i, 0)));
+    }
+    brpc::RpczSpan rpcz_span;
+    ASSERT_EQ(0, db->FindSpan(1, 199, &rpcz_span));
+    ASSERT_EQ(BASE_US + 199, rpcz_span.received_real_us());
+    ASSERT_EQ(-1, db->FindSpan(1, 150, &rpcz_span));
+    db->RemoveRefManually();
+}
+
+TEST(SpanDBTest, persist) {
+    const std::string dir = "./span_db_unittest";
+    butil::DeleteFile(butil::FilePath(dir), true);
+    ASSERT_TRUE(butil::CreateDirectory(butil::FilePath(dir)));
+    const std::string path = dir + "/spans";
+    GFLAGS_NS::SetCommandLineOption("rpcz_keep_span_db", "true");
+    brpc::MemorySpanDB* db = brpc::MemorySpanDB::Open(path, 16, 64 * 1024);
+    ASSERT_TRUE(db);
+    db->AddRefManually();
+    for (int i = 1; i <= 5; ++i) {
+        ASSERT_EQ(0, db->Index(MakeSpan(7, i, BASE_US + i * 1000, 1)));
+    }
+    db->RemoveRefManually();
+    GFLAGS_NS::SetCommandLineOption("rpcz_keep_span_db", "false");
+
+    ASSERT_EQ(NULL, brpc::LoadSpanDBFromFile("./not_exist_spans"));
+    brpc::SpanDB* db2 = brpc::LoadSpanDBFromFile(path.c_str());
+    ASSERT_TRUE(db2);
+    std::deque<brpc::RpczSpan> spans;
+    brpc::FindSpans(db2, 7, &spans);
+    ASSERT_EQ(5u, spans.size());
+    brpc::RpczSpan span;
+    ASSERT_EQ(0, brpc::FindSpan(db2, 7, 3, &span));
+    ASSERT_EQ(1, span.client_spans_size());
+    std::deque<brpc::BriefSpan> briefs;
+    brpc::ListSpans(db2, BASE_US + 100000, 100, &briefs, NULL);
+    ASSERT_EQ(5u, briefs.size());
+    ASSERT_EQ(-1, db2->Index(MakeSpan(7, 6, BASE_US, 0)));
+    db2->RemoveRefManually();
+    // Loading does not remove the file.
+    ASSERT_TRUE(butil::PathExists(butil::FilePath(path)));
+    butil::DeleteFile(butil::FilePath(dir), true);
+}
+
+struct ReaderArg {
+    brpc::MemorySpanDB* db;
+    butil::atomic<bool> stop;
+    int64_t nread;
+};
+
+void* ReadSpans(void* void_arg) {
+    ReaderArg* arg = (ReaderArg*)void_arg;
+    std::deque<brpc::BriefSpan> briefs;
+    std::deque<brpc::RpczSpan> spans;
+    while (!arg->stop.load(butil::memory_order_relaxed)) {
+        briefs.clear();
+        arg->db->ListSpans(BASE_US + 1000000000L, 20, &briefs, NULL);
+        for (size_t i = 0; i < briefs.size(); ++i) {
+            // See MakeSpan() in the writing loop.
+            EXPECT_EQ(briefs[i].span_id() % 8 + 1, briefs[i].trace_id());
+            EXPECT_EQ("test.EchoService.Echo", briefs[i].full_method_name());
+        }
+        for (uint64_t trace_id = 1; trace_id <= 8; ++trace_id) {
+            spans.clear();
+            arg->db->FindSpans(trace_id, &spans);
+            for (size_t i = 0; i < spans.size(); ++i) {
+                EXPECT_EQ(trace_id, spans[i].trace_id());
+                EXPECT_EQ(spans[i].span_id() % 8 + 1, trace_id);
+                EXPECT_EQ(1, spans[i].client_spans_size());
+            }
+            arg->nread += spans.size();
+        }
+        arg->nread += briefs.size();
+    }
+    return NULL;
+}
+
+TEST(SpanDBTest, read_while_writing) {
+    brpc::MemorySpanDB* db = brpc::MemorySpanDB::Open("", 64, 8192);
+    ASSERT_TRUE(db);
+    db->AddRefManually();
+    ReaderArg args[2];
+    pthread_t th[2];
+    for (int i = 0; i < 2; ++i) {
+        args[i].db = db;
+        args[i].stop = false;
+        args[i].nread = 0;
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, ReadSpans, &args[i]));
+    }
+    for (int i = 1; i <= 200000; ++i) {
+        ASSERT_EQ(0, db->Index(MakeSpan(i % 8 + 1, i, BASE_US + i, 1)));
+    }
+    for (int i = 0; i < 2; ++i) {
+        args[i].stop = true;
+        pthread_join(th[i], NULL);
+        LOG(INFO) << "Reader " << i << " read " << args[i].nread << " spans";
+        ASSERT_GT(args[i].nread, 0);
+    }
+    db->RemoveRefManually();
+}
+
+TEST(SpanDBTest, rpcz) {
+    brpc::Server server;
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    ASSERT_EQ(0, channel.Init(server.listen_address(), &options));
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "true").empty());
+    for (int i = 0; i < 10; ++i) {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/version";
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    }
+    // Wait for the collecting thread.
+    usleep(1500000);
+    std::deque<brpc::BriefSpan> briefs;
+    brpc::ListSpans(butil::gettimeofday_us(), 100, &briefs, NULL);
+    ASSERT_FALSE(briefs.empty());
+    std::deque<brpc::RpczSpan> spans;
+    brpc::FindSpans(briefs[0].trace_id(), &spans);
+    ASSERT_FALSE(spans.empty());
+    std::ostringstream os;
+    brpc::DescribeSpanDB(os);
+    ASSERT_NE(std::string::npos, os.str().find("[ memory ]")) << os.str();
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "false").empty());
+}
+
+brpc::Span* CreateServerSpan(const char* name, int64_t latency_us,
+                             int error_code) {
+    const int64_t now = butil::cpuwide_time_us();
+    brpc::Span* span = brpc::Span::CreateServerSpan(
+        name, 0, 0, 0, butil::gettimeofday_us() - now);
+    span->set_received_us(now - latency_us);
+    span->set_error_code(error_code);
+    return span;
+}
+
+TEST(SpanDBTest, tail_sampling) {
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "true").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "rpcz_tail_sampling", "true").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "rpcz_max_tail_spans_per_second", "1000000").empty());
+    ASSERT_TRUE(brpc::IsTraceable(false));
+
+    // Spans are created for all requests, only part of them are sampled
+    // after the collecting thread adjusts the sampling ratio.
+    // Spans are recycled after being submitted, record what we check.
+    std::vector<std::pair<uint64_t, bool> > fast_traces;
+    const int64_t start_us = butil::gettimeofday_us();
+    while (butil::gettimeofday_us() < start_us + 2000000L) {
+        for (int i = 0; i < 100; ++i) {
+            brpc::Span* span = CreateServerSpan("test.Tail.Fast", 1000, 0);
+            // The first span after sleeping is often the slowest.
+            if (i == 50) {
+                fast_traces.push_back(
+                    std::make_pair(span->trace_id(), span->sampled()));
+            }
+            brpc::Span::Submit(span, butil::cpuwide_time_us());
+        }
+        usleep(1000);
+    }
+
+    // Wait for the collecting thread to consume sampled spans, which drops
+    // spans when too many are pending.
+    usleep(500000);
+
+    brpc::Span* slow = CreateServerSpan("test.Tail.Fast", 100000, 0);
+    const uint64_t slow_trace_id = slow->trace_id();
+    brpc::Span::Submit(slow, butil::cpuwide_time_us());
+    brpc::Span* failed = CreateServerSpan("test.Tail.Fast", 1000, EINVAL);
+    const uint64_t failed_trace_id = failed->trace_id();
+    brpc::Span::Submit(failed, butil::cpuwide_time_us());
+
+    // Failed client span keeps its parent.
+    std::vector<uint64_t> parent_trace_ids;
+    for (int i = 0; i < 100; ++i) {
+        brpc::Span* parent = CreateServerSpan("test.Tail.Fast", 1000, 0);
+        parent->AsParent();
+        brpc::Span* client = brpc::Span::CreateClientSpan(
+            "test.Tail.Client",
+            butil::gettimeofday_us() - butil::cpuwide_time_us());
+        bthread::tls_bls.rpcz_parent_span = NULL;
+        ASSERT_EQ(parent, client->local_parent());
+        ASSERT_EQ(parent->sampled(), client->sampled());
+        client->set_error_code(EINVAL);
+        brpc::Span::Submit(client, butil::cpuwide_time_us());
+        parent_trace_ids.push_back(parent->trace_id());
+        brpc::Span::Submit(parent, butil::cpuwide_time_us());
+    }
+
+    // Wait for the collecting thread.
+    usleep(1500000);
+    std::deque<brpc::RpczSpan> spans;
+    brpc::FindSpans(slow_trace_id, &spans);
+    ASSERT_EQ(1u, spans.size());
+    spans.clear();
+    brpc::FindSpans(failed_trace_id, &spans);
+    ASSERT_EQ(1u, spans.size());
+    ASSERT_EQ(EINVAL, spans[0].error_code());
+    for (size_t i = 0; i < parent_trace_ids.size(); ++i) {
+        spans.clear();
+        brpc::FindSpans(parent_trace_ids[i], &spans);
+        ASSERT_EQ(1u, spans.size());
+        ASSERT_EQ(1, spans[0].client_spans_size());
+        ASSERT_EQ(EINVAL, spans[0].client_spans(0).error_code());
+    }
+    // Unsampled spans are kept only if they're slower than the 99
+    // percentile of the method.
+    size_t nunsampled = 0;
+    size_t nkept = 0;
+    for (size_t i = 0; i < fast_traces.size(); ++i) {
+        spans.clear();
+        brpc::FindSpans(fast_traces[i].first, &spans);
+        if (!fast_traces[i].second) {
+            ++nunsampled;
+            nkept += !spans.empty();
+        }
+    }
+    LOG(INFO) << nunsampled << " of " << fast_traces.size()
+              << " fast spans are not sampled, " << nkept << " are kept";
+    ASSERT_GT(nunsampled, 0u);
+    ASSERT_LE(nkept, nunsampled / 10);
+
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "rpcz_max_tail_spans_per_second", "500").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "rpcz_tail_sampling", "false").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "false").empty());
+}
+
+void* SubmitFastSpans(void*) {
+    for (int i = 0; i < 100; ++i) {
+        brpc::Span* span = CreateServerSpan("test.Tail.Discarded", 1000, 0);
+        brpc::Span::Submit(span, butil::cpuwide_time_us());
+    }
+    return NULL;
+}
+
+TEST(SpanDBTest, discarded_spans_of_quitted_thread_are_recycled) {
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "true").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "rpcz_tail_sampling", "true").empty());
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, SubmitFastSpans, NULL));
+    ASSERT_EQ(0, pthread_join(th, NULL));
+    ASSERT_NE("0", bvar::Variable::describe_exposed(
+                  "rpcz_discarded_span_count"));
+    // Recycled in two rounds by the sweeper.
+    usleep(3500000);
+    ASSERT_EQ("0", bvar::Variable::describe_exposed(
+                  "rpcz_discarded_span_count"));
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "rpcz_tail_sampling", "false").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption("enable_rpcz", "false").empty());
+}
+
+} // namespace
@@ -15,6 +15,7 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <fstream>
 #include <gtest/gtest.h>
 #include "butil/atomicops.h"
 #include "butil/time.h"
@@ -32,6 +33,8 @@ extern butil::atomic<TaskControl*> g_task_control;
 inline TaskControl* get_task_control() {
     return g_task_control.load(butil::memory_order_consume);
 }
+bool BlockingProfilerStart(const char* filename);
+void BlockingProfilerStop();
 } // namespace bthread
 
 namespace {
@@ -443,4 +446,62 @@ TEST(ButexTest, wait_with_signal_triggered) {
     bthread::butex_destroy(butex);
 }
 
+void* sleep_and_wait_butex(void* arg) {
+    butil::atomic<int>* butex = static_cast<butil::atomic<int>*>(arg);
+    for (int i = 0; i < 10; ++i) {
+        bthread_usleep(2000);
+        const timespec abstime = butil::milliseconds_from_now(2);
+        bthread::butex_wait(butex, 0, &abstime);
+    }
+    return NULL;
+}
+
+TEST(ButexTest, blocking_profiler) {
+    const char* prof_name = "./blocking_profiler_unittest.prof";
+    ASSERT_TRUE(bthread::BlockingProfilerStart(prof_name));
+    // Only one blocking profiler at the same time.
+    ASSERT_FALSE(bthread::BlockingProfilerStart(prof_name));
+    butil::atomic<int>* butex =
+        bthread::butex_create_checked<butil::atomic<int> >();
+    *butex = 0;
+    bthread_t th[4];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, bthread_start_urgent(&th[i], NULL, sleep_and_wait_butex, butex));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    // Wait for the collector thread to dump the samples.
+    usleep(500000);
+    bthread::BlockingProfilerStop();
+    bthread::butex_destroy(butex);
+
+    // Same format as contention profiles:
+    //   <duration_ns> <count> @ <frame> <frame> ...
+    std::ifstream ifs(prof_name);
+    std::string line;
+    ASSERT_TRUE(std::getline(ifs, line));
+    ASSERT_EQ("--- contention", line);
+    ASSERT_TRUE(std::getline(ifs, line));
+    ASSERT_EQ("cycles/second=1000000000", line);
+    int64_t total_duration_ns = 0;
+    int64_t total_count = 0;
+    while (std::getline(ifs, line)) {
+        int64_t duration_ns = 0;
+        int64_t count = 0;
+        char at = 0;
+        if (sscanf(line.c_str(), "%" PRId64 " %" PRId64 " %c",
+                   &duration_ns, &count, &at) != 3 || at != '@') {
+            break;  // /proc/self/maps
+        }
+        total_duration_ns += duration_ns;
+        total_count += count;
+    }
+    LOG(INFO) << "total_count=" << total_count
+              << " total_duration_ns=" << total_duration_ns;
+    // 4 bthreads block 20 times for 2ms each.
+    ASSERT_GE(total_count, 40);
+    ASSERT_GT(total_duration_ns, 80 * 2000000L);
+}
+
 } // namespace
@@ -18,6 +18,7 @@
 #include <gtest/gtest.h>
 
 #include <bthread/execution_queue.h>
+#include <bthread/sharded_execution_queue.h>
 #include <bthread/sys_futex.h>
 #include <bthread/countdown_event.h>
 #include "butil/time.h"
@@ -755,4 +756,194 @@ TEST_F(ExecutionQueueTest, cancel_unexecuted_high_priority_task) {
 
     ASSERT_EQ(12345, result);
 }
+bool g_batch_released = false;
+
+struct BatchMeta {
+    int64_t sum;
+    size_t ncall;
+    size_t max_batch;
+};
+
+int add_in_batches(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    BatchMeta* m = (BatchMeta*)meta;
+    size_t n = 0;
+    for (; iter; ++iter, ++n) {
+        if (iter->value < 0) {
+            // Hold the executor so that following tasks are piled up.
+            while (!g_batch_released) {
+                bthread_usleep(1000);
+            }
+            continue;
+        }
+        m->sum += iter->value;
+    }
+    ++m->ncall;
+    m->max_batch = std::max(m->max_batch, n);
+    return 0;
+}
+
+TEST_F(ExecutionQueueTest, max_tasks_per_execute) {
+    g_batch_released = false;
+    BatchMeta m = { 0, 0, 0 };
+    bthread::ExecutionQueueId<LongIntTask> queue_id = { 0 }; // to suppress warnings
+    bthread::ExecutionQueueOptions options;
+    options.max_tasks_per_execute = 8;
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_in_batches, &m));
+    ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, -1));
+    int64_t expected = 0;
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, i));
+        expected += i;
+    }
+    g_batch_released = true;
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(expected, m.sum);
+    ASSERT_LE(m.max_batch, 8u);
+    ASSERT_GE(m.ncall, 1001u / 8);
+}
+
+const int SHARDED_NKEY = 64;
+const int SHARDED_NTHREAD = 4;
+const int SHARDED_NTASK_PER_THREAD = 100000;
+long sharded_next_task[SHARDED_NKEY][SHARDED_NTHREAD];
+butil::atomic<int> sharded_nstopped(0);
+
+// value = key << 40 | thread_id << 32 | seq
+int check_key_order(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
+    if (iter.is_queue_stopped()) {
+        sharded_nstopped.fetch_add(1, butil::memory_order_relaxed);
+        return 0;
+    }
+    for (; iter; ++iter) {
+        const long value = iter->value;
+        const int key = value >> 40;
+        const int thread_id = (value >> 32) & 0xFF;
+        const long seq = value & 0xFFFFFFFFul;
+        if (seq != sharded_next_task[key][thread_id]++) {
+            EXPECT_TRUE(false) << "key=" << key << " thread_id=" << thread_id
+                               << " seq=" << seq;
+            ((butil::atomic<long>*)meta)->fetch_add(1);
+        }
+    }
+    return 0;
+}
+
+struct ShardedPushArg {
+    bthread::ShardedExecutionQueue<LongIntTask>* q;
+    int thread_id;
+};
+
+void* sharded_push_thread(void* void_arg) {
+    ShardedPushArg* arg = (ShardedPushArg*)void_arg;
+    for (int i = 0; i < SHARDED_NTASK_PER_THREAD; ++i) {
+        const long key = i % SHARDED_NKEY;
+        const long seq = i / SHARDED_NKEY;
+        EXPECT_EQ(0, arg->q->execute(
+                      key, (key << 40) | ((long)arg->thread_id << 32) | seq));
+    }
+    return NULL;
+}
+
+TEST_F(ExecutionQueueTest, sharded_order) {
+    memset(sharded_next_task, 0, sizeof(sharded_next_task));
+    sharded_nstopped.store(0);
+    butil::atomic<long> disorder_times(0);
+    bthread::ExecutionQueueOptions options;
+    options.max_tasks_per_execute = 64;
+    {
+        bthread::ShardedExecutionQueue<LongIntTask> q;
+        ASSERT_EQ(0, q.start(8, &options, check_key_order, &disorder_times));
+        ASSERT_EQ(8u, q.shard_count());
+        pthread_t threads[SHARDED_NTHREAD];
+        ShardedPushArg args[SHARDED_NTHREAD];
+        butil::Timer tm;
+        tm.start();
+        for (int i = 0; i < SHARDED_NTHREAD; ++i) {
+            args[i].q = &q;
+            args[i].thread_id = i;
+            pthread_create(&threads[i], NULL, sharded_push_thread, &args[i]);
+        }
+        for (int i = 0; i < SHARDED_NTHREAD; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        ASSERT_EQ(0, q.stop());
+        ASSERT_EQ(0, q.join());
+        tm.stop();
+        ASSERT_EQ(EINVAL, q.execute(0, 1L));
+
+        std::vector<int64_t> counts;
+        q.get_shard_task_counts(&counts);
+        ASSERT_EQ(8u, counts.size());
+        int64_t total = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            total += counts[i];
+        }
+        ASSERT_EQ(SHARDED_NTHREAD * SHARDED_NTASK_PER_THREAD, total);
+        LOG(INFO) << "sharded queue: " << total * 1000000L / tm.u_elapsed()
+                  << " tasks/s imbalance=" << q.imbalance();
+    }
+    ASSERT_EQ(0, disorder_times.load());
+    ASSERT_EQ(1, sharded_nstopped.load());
+    for (int key = 0; key < SHARDED_NKEY; ++key) {
+        for (int t = 0; t < SHARDED_NTHREAD; ++t) {
+            ASSERT_EQ(SHARDED_NTASK_PER_THREAD / SHARDED_NKEY +
+                      (key < SHARDED_NTASK_PER_THREAD % SHARDED_NKEY),
+                      sharded_next_task[key][t]);
+        }
+    }
+}
+
+TEST_F(ExecutionQueueTest, sharded_stop_in_destructor) {
+    sharded_nstopped.store(0);
+    butil::atomic<long> disorder_times(0);
+    memset(sharded_next_task, 0, sizeof(sharded_next_task));
+    {
+        bthread::ShardedExecutionQueue<LongIntTask> q;
+        ASSERT_EQ(EINVAL, q.start(0, NULL, check_key_order, &disorder_times));
+        ASSERT_EQ(0, q.start(3, NULL, check_key_order, &disorder_times));
+        ASSERT_EQ(EINVAL, q.start(3, NULL, check_key_order, &disorder_times));
+        for (long i = 0; i < 1000; ++i) {
+            ASSERT_EQ(0, q.execute(1, (1L << 40) | i));
+        }
+    }
+    ASSERT_EQ(1, sharded_nstopped.load());
+    ASSERT_EQ(1000, sharded_next_task[1][0]);
+    ASSERT_EQ(0, disorder_times.load());
+}
+
+void* sharded_stop_and_join(void* arg) {
+    bthread::ShardedExecutionQueue<LongIntTask>* q =
+        (bthread::ShardedExecutionQueue<LongIntTask>*)arg;
+    EXPECT_EQ(0, q->stop());
+    EXPECT_EQ(0, q->join());
+    return NULL;
+}
+
+TEST_F(ExecutionQueueTest, sharded_concurrent_stop_and_join) {
+    sharded_nstopped.store(0);
+    butil::atomic<long> disorder_times(0);
+    memset(sharded_next_task, 0, sizeof(sharded_next_task));
+    bthread::ShardedExecutionQueue<LongIntTask> q;
+    ASSERT_EQ(0, q.start(4, NULL, check_key_order, &disorder_times));
+    for (long i = 0; i < 1000; ++i) {
+        ASSERT_EQ(0, q.execute(2, (2L << 40) | i));
+    }
+    pthread_t threads[SHARDED_NTHREAD];
+    for (int i = 0; i < SHARDED_NTHREAD; ++i) {
+        pthread_create(&threads[i], NULL, sharded_stop_and_join, &q);
+    }
+    for (int i = 0; i < SHARDED_NTHREAD; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    ASSERT_EQ(1, sharded_nstopped.load());
+    ASSERT_EQ(1000, sharded_next_task[2][0]);
+    ASSERT_EQ(0, q.stop());
+    ASSERT_EQ(0, q.join());
+    ASSERT_EQ(0, disorder_times.load());
+}
 } // namespace
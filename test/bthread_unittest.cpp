@@ -16,6 +16,7 @@
 // under the License.
 
 #include <execinfo.h>
+#include <vector>
 #include <gtest/gtest.h>
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -25,6 +26,7 @@
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
 #include "bthread/task_meta.h"
+#include "bthread/cpu_usage.h"
 
 namespace bthread {
     extern __thread bthread::LocalStorage tls_bls;
@@ -567,4 +569,172 @@ TEST_F(BthreadTest, yield_single_thread) {
     ASSERT_EQ(0, bthread_join(tid, NULL));
 }
 
+void* add_to_counter(void* arg) {
+    static_cast<butil::atomic<int>*>(arg)->fetch_add(1);
+    return NULL;
+}
+
+void start_batch_and_join(size_t n, const bthread_attr_t* attr) {
+    butil::atomic<int> counter(0);
+    std::vector<bthread_t> tids(n, INVALID_BTHREAD);
+    std::vector<void* (*)(void*)> fns(n, add_to_counter);
+    std::vector<void*> args(n, &counter);
+    ASSERT_EQ(0, bthread_start_batch(&tids[0], n, &fns[0], &args[0], attr));
+    if (attr && (attr->flags & BTHREAD_NOSIGNAL)) {
+        bthread_flush();
+    }
+    for (size_t i = 0; i < n; ++i) {
+        ASSERT_NE(INVALID_BTHREAD, tids[i]);
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+    }
+    ASSERT_EQ((int)n, counter.load());
+}
+
+void* start_batch_in_bthread(void* arg) {
+    const bthread_attr_t* attr = static_cast<const bthread_attr_t*>(arg);
+    start_batch_and_join(1, attr);
+    start_batch_and_join(1000, attr);
+    return NULL;
+}
+
+TEST_F(BthreadTest, start_batch) {
+    // From non-worker.
+    start_batch_and_join(1, NULL);
+    start_batch_and_join(17, NULL);
+    start_batch_and_join(1000, NULL);
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
+    start_batch_and_join(1000, &attr);
+    // From worker.
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, start_batch_in_bthread, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, start_batch_in_bthread, &attr));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+
+    // Empty batch and invalid functions.
+    ASSERT_EQ(0, bthread_start_batch(NULL, 0, NULL, NULL, NULL));
+    bthread_t tids[2];
+    void* (*fns[2])(void*) = { add_to_counter, NULL };
+    void* args[2] = { NULL, NULL };
+    ASSERT_EQ(EINVAL, bthread_start_batch(tids, 2, fns, args, NULL));
+}
+
+struct FanOutArgs {
+    size_t fanout;
+    bool batch;
+    int64_t elapsed_ns;
+};
+
+void* fan_out(void* void_arg) {
+    FanOutArgs* arg = static_cast<FanOutArgs*>(void_arg);
+    butil::atomic<int> counter(0);
+    std::vector<bthread_t> tids(arg->fanout);
+    std::vector<void* (*)(void*)> fns(arg->fanout, add_to_counter);
+    std::vector<void*> args(arg->fanout, &counter);
+    butil::Timer tm;
+    tm.start();
+    if (arg->batch) {
+        EXPECT_EQ(0, bthread_start_batch(&tids[0], arg->fanout, &fns[0],
+                                         &args[0], NULL));
+    } else {
+        for (size_t i = 0; i < arg->fanout; ++i) {
+            EXPECT_EQ(0, bthread_start_background(
+                          &tids[i], NULL, fns[i], args[i]));
+        }
+    }
+    for (size_t i = 0; i < arg->fanout; ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    tm.stop();
+    arg->elapsed_ns = tm.n_elapsed();
+    return NULL;
+}
+
+TEST_F(BthreadTest, start_batch_perf) {
+    const int REP = 200;
+    for (int worker = 0; worker < 2; ++worker) {
+        for (int batch = 0; batch < 2; ++batch) {
+            FanOutArgs arg = { 1000, (bool)batch, 0 };
+            int64_t total_ns = 0;
+            for (int i = 0; i < REP; ++i) {
+                if (worker) {
+                    bthread_t th;
+                    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, fan_out, &arg));
+                    ASSERT_EQ(0, bthread_join(th, NULL));
+                } else {
+                    fan_out(&arg);
+                }
+                total_ns += arg.elapsed_ns;
+            }
+            LOG(INFO) << "Fan-out to " << arg.fanout << " bthreads from "
+                      << (worker ? "worker" : "pthread") << " with "
+                      << (batch ? "bthread_start_batch" : "bthread_start_background")
+                      << " takes " << total_ns / REP / 1000 << "us";
+        }
+    }
+}
+
+void spin_for_ms(int64_t ms) {
+    const int64_t end_ms = butil::cpuwide_time_ms() + ms;
+    while (butil::cpuwide_time_ms() < end_ms) {}
+}
+
+void* spin_and_sleep(void*) {
+    spin_for_ms(50);
+    // Resumed probably by another worker.
+    bthread_usleep(10000);
+    spin_for_ms(50);
+    return NULL;
+}
+
+void* attributed_parent(void* arg) {
+    bthread::CpuUsageCounter* counter = (bthread::CpuUsageCounter*)arg;
+    EXPECT_EQ(NULL, bthread::get_cpu_usage_counter());
+    bthread_t child;
+    {
+        bthread::ScopedCpuUsageAttribution scope(counter);
+        EXPECT_EQ(counter, bthread::get_cpu_usage_counter());
+        spin_and_sleep(NULL);
+        // Inherited by the child.
+        EXPECT_EQ(0, bthread_start_background(
+                      &child, NULL, spin_and_sleep, NULL));
+    }
+    EXPECT_EQ(NULL, bthread::get_cpu_usage_counter());
+    // Not attributed.
+    spin_for_ms(200);
+    bthread_join(child, NULL);
+    return NULL;
+}
+
+void* drop_ref_in_scope(void*) {
+    bthread::CpuUsageCounter* counter = new bthread::CpuUsageCounter;
+    bthread::ScopedCpuUsageAttribution scope(counter);
+    counter->RemoveRef();
+    spin_and_sleep(NULL);
+    // Time of the running slice is counted when the bthread is switched out.
+    EXPECT_LE(45000000L, bthread::get_cpu_usage_counter()->cputime_ns());
+    return NULL;
+}
+
+TEST_F(BthreadTest, cpu_usage) {
+    ASSERT_EQ(EPERM, bthread::set_cpu_usage_counter(NULL));
+    ASSERT_EQ(NULL, bthread::get_cpu_usage_counter());
+
+    bthread::CpuUsageCounter* counter = new bthread::CpuUsageCounter;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, attributed_parent, counter));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // Sleeping and unattributed time are not counted.
+    const int64_t cputime_ms = counter->cputime_ns() / 1000000L;
+    LOG(INFO) << "cputime=" << cputime_ms << "ms";
+    ASSERT_LE(200, cputime_ms);
+    ASSERT_GT(350, cputime_ms);
+
+    counter->RemoveRef();
+
+    // The counter is deleted by the last bthread attributed to it.
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, drop_ref_in_scope, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+}
+
 } // namespace
@@ -0,0 +1,254 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <math.h>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "bvar/detail/log_histogram.h"
+#include "bvar/latency_recorder.h"
+
+namespace bvar {
+DECLARE_bool(bvar_latency_histogram);
+}
+
+namespace {
+
+using bvar::detail::HistogramBuckets;
+using bvar::detail::LogHistogram;
+
+TEST(LogHistogramTest, bucket_bounds) {
+    // Same layout as native histograms of prometheus with schema 5.
+    EXPECT_EQ(0, HistogramBuckets::bucket_index(1));
+    EXPECT_EQ(32, HistogramBuckets::bucket_index(2));
+    EXPECT_EQ(51, HistogramBuckets::bucket_index(3));
+    EXPECT_EQ(64, HistogramBuckets::bucket_index(4));
+    EXPECT_DOUBLE_EQ(1024, HistogramBuckets::bucket_upper_bound(320));
+    EXPECT_EQ(HistogramBuckets::NUM_BUCKETS - 1,
+              HistogramBuckets::bucket_index(HistogramBuckets::MAX_VALUE));
+    EXPECT_EQ(HistogramBuckets::NUM_BUCKETS - 1,
+              HistogramBuckets::bucket_index(HistogramBuckets::MAX_VALUE * 4));
+    for (int64_t v = 1; v < 100000; v = v * 1.01 + 1) {
+        const int i = HistogramBuckets::bucket_index(v);
+        ASSERT_LE(v, HistogramBuckets::bucket_upper_bound(i)) << v;
+        ASSERT_GT(v, HistogramBuckets::bucket_upper_bound(i - 1)) << v;
+    }
+}
+
+TEST(LogHistogramTest, values_not_above_1) {
+    EXPECT_DOUBLE_EQ(1, HistogramBuckets::bucket_upper_bound(0));
+    EXPECT_DOUBLE_EQ(exp2(-1.0 / HistogramBuckets::BUCKETS_PER_OCTAVE),
+                     HistogramBuckets::bucket_upper_bound(-1));
+    EXPECT_DOUBLE_EQ(0.5, HistogramBuckets::bucket_upper_bound(
+                              -HistogramBuckets::BUCKETS_PER_OCTAVE));
+    EXPECT_DOUBLE_EQ(exp2(-33.0 / HistogramBuckets::BUCKETS_PER_OCTAVE),
+                     HistogramBuckets::bucket_upper_bound(-33));
+
+    LogHistogram h;
+    // Negative values are dropped.
+    h << 1 << 1 << 0 << 0 << -5;
+    HistogramBuckets b = h.get_value();
+    ASSERT_EQ(4, b.count());
+    ASSERT_EQ(2, b.zero_count());
+    ASSERT_EQ(2, b.bucket_count(0));
+    ASSERT_EQ(0, b.get_number(0.5));
+    ASSERT_EQ(1, b.get_number(0.75));
+    ASSERT_EQ(1, b.get_number(1));
+}
+
+TEST(LogHistogramTest, relative_error) {
+    LogHistogram h;
+    const int N = 100000;
+    for (int i = 1; i <= N; ++i) {
+        h << i;
+    }
+    HistogramBuckets b = h.get_value();
+    ASSERT_EQ(N, b.count());
+    ASSERT_EQ((int64_t)N * (N + 1) / 2, b.sum());
+    const double ratios[] = { 0.01, 0.1, 0.5, 0.9, 0.99, 0.999, 0.9999, 1 };
+    for (size_t i = 0; i < arraysize(ratios); ++i) {
+        const double expected = ceil(ratios[i] * N);
+        const int64_t value = b.get_number(ratios[i]);
+        EXPECT_LE(fabs(value - expected) / expected, 0.011)
+            << "ratio=" << ratios[i] << " value=" << value;
+    }
+    // Small values are exact.
+    LogHistogram h2;
+    for (int i = 0; i <= 40; ++i) {
+        h2 << i;
+    }
+    b = h2.get_value();
+    ASSERT_EQ(1, b.zero_count());
+    for (int i = 0; i <= 40; ++i) {
+        EXPECT_EQ(i, b.get_number((i + 0.5) / 41));
+    }
+}
+
+TEST(LogHistogramTest, merge_and_subtract) {
+    HistogramBuckets b1;
+    HistogramBuckets b2;
+    for (int i = 1; i <= 1000; ++i) {
+        b1.add_bucket(HistogramBuckets::bucket_index(i), 1);
+        b1.add_sum(i);
+        b2.add_bucket(HistogramBuckets::bucket_index(i * 1000), 1);
+        b2.add_sum(i * 1000);
+    }
+    HistogramBuckets total = b1;
+    total += b2;
+    ASSERT_EQ(2000, total.count());
+    ASSERT_EQ(b1.sum() + b2.sum(), total.sum());
+    ASSERT_EQ(b1.begin_index(), total.begin_index());
+    ASSERT_EQ(b2.end_index(), total.end_index());
+    for (int i = total.begin_index(); i < total.end_index(); ++i) {
+        ASSERT_EQ(b1.bucket_count(i) + b2.bucket_count(i), total.bucket_count(i));
+    }
+    total -= b1;
+    ASSERT_EQ(b2.count(), total.count());
+    ASSERT_EQ(b2.sum(), total.sum());
+    ASSERT_EQ(b2.begin_index(), total.begin_index());
+    ASSERT_EQ(b2.end_index(), total.end_index());
+    for (int i = b2.begin_index(); i < b2.end_index(); ++i) {
+        ASSERT_EQ(b2.bucket_count(i), total.bucket_count(i));
+    }
+}
+
+TEST(LogHistogramTest, cumulative_counts) {
+    HistogramBuckets b;
+    std::vector<std::pair<double, int64_t> > out;
+    b.get_cumulative_counts(0, &out);
+    ASSERT_TRUE(out.empty());
+    b.add_zero(1);
+    for (int i = 1; i <= 100; ++i) {
+        b.add_bucket(HistogramBuckets::bucket_index(i), 1);
+    }
+    // Upper bounds are powers of 2 with schema 0.
+    b.get_cumulative_counts(0, &out);
+    ASSERT_EQ(8UL, out.size());
+    for (size_t i = 0; i < out.size(); ++i) {
+        ASSERT_DOUBLE_EQ(1 << i, out[i].first);
+        ASSERT_EQ(std::min(1 + (1 << i), 101), out[i].second);
+    }
+    // No merging with the schema of the buckets.
+    b.get_cumulative_counts(HistogramBuckets::SCHEMA, &out);
+    ASSERT_EQ((size_t)(b.end_index() - b.begin_index()), out.size());
+    int64_t cumulative = b.zero_count();
+    for (int i = b.begin_index(); i < b.end_index(); ++i) {
+        cumulative += b.bucket_count(i);
+        ASSERT_DOUBLE_EQ(HistogramBuckets::bucket_upper_bound(i),
+                         out[i - b.begin_index()].first);
+        ASSERT_EQ(cumulative, out[i - b.begin_index()].second);
+    }
+}
+
+static void* record_thread(void* arg) {
+    LogHistogram* h = static_cast<LogHistogram*>(arg);
+    for (int i = 1; i <= 100000; ++i) {
+        *h << i;
+    }
+    return NULL;
+}
+
+TEST(LogHistogramTest, multiple_threads) {
+    LogHistogram h;
+    pthread_t th[8];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, record_thread, &h));
+    }
+    // Reading concurrently with writers.
+    int64_t last_count = 0;
+    for (int i = 0; i < 10; ++i) {
+        const int64_t count = h.get_value().count();
+        ASSERT_GE(count, last_count);
+        last_count = count;
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    // Values of exited threads are kept.
+    HistogramBuckets b = h.get_value();
+    ASSERT_EQ(800000, b.count());
+    HistogramBuckets expected;
+    for (int i = 1; i <= 100000; ++i) {
+        expected.add_bucket(HistogramBuckets::bucket_index(i), 8);
+    }
+    for (int i = expected.begin_index(); i < expected.end_index(); ++i) {
+        ASSERT_EQ(expected.bucket_count(i), b.bucket_count(i));
+    }
+}
+
+TEST(LogHistogramTest, window) {
+    LogHistogram h;
+    bvar::detail::HistogramWindow w(&h, 2);
+    for (int i = 0; i < 1000; ++i) {
+        h << 100;
+    }
+    usleep(2500000);
+    for (int i = 0; i < 1000; ++i) {
+        h << 10000;
+    }
+    usleep(1200000);
+    // Values recorded more than 2 seconds ago are out of the window.
+    HistogramBuckets b = w.get_value();
+    ASSERT_EQ(1000, b.count());
+    ASSERT_NEAR(10000, b.get_number(0.01), 110);
+    ASSERT_EQ(2000, h.get_value().count());
+}
+
+TEST(LogHistogramTest, latency_recorder) {
+    bvar::FLAGS_bvar_latency_histogram = true;
+    bvar::LatencyRecorder rec(2);
+    bvar::FLAGS_bvar_latency_histogram = false;
+    for (int i = 1; i <= 100000; ++i) {
+        rec << i;
+    }
+    usleep(1200000);
+    HistogramBuckets b;
+    ASSERT_TRUE(rec.latency_histogram(&b));
+    ASSERT_EQ(100000, b.count());
+    EXPECT_NEAR(99900, rec.latency_percentile(0.999), 1100);
+    EXPECT_NEAR(99990, rec.latency_percentile(0.9999), 1100);
+    bvar::Vector<int64_t, 4> p = rec.latency_percentiles();
+    EXPECT_NEAR(99900, p[3], 1100);
+    EXPECT_EQ(100000, rec.count());
+
+    bvar::LatencyRecorder rec2;
+    ASSERT_FALSE(rec2.latency_histogram(&b));
+}
+
+TEST(LogHistogramTest, perf) {
+    LogHistogram h;
+    butil::Timer tm;
+    const int N = 10000000;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        h << (i & 0xFFFF);
+    }
+    tm.stop();
+    LOG(INFO) << "LogHistogram takes " << tm.n_elapsed() / N << "ns per value";
+
+    bvar::detail::Percentile p;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        p << (i & 0xFFFF);
+    }
+    tm.stop();
+    LOG(INFO) << "Percentile takes " << tm.n_elapsed() / N << "ns per value";
+}
+
+} // namespace
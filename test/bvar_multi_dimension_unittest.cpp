@@ -26,6 +26,7 @@
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include "butil/time.h"
+#include "butil/fast_rand.h"
 #include "butil/macros.h"
 #include "bvar/bvar.h"
 #include "bvar/multi_dimension.h"
@@ -359,6 +360,97 @@ TEST_F(MultiDimensionTest, stats) {
     ASSERT_TRUE(adder5);
 }
 
+TEST_F(MultiDimensionTest, overflow_reject) {
+    bvar::MultiDimension<bvar::Adder<int> > my_madder("test_overflow_reject", labels);
+    my_madder.set_max_stats_count(2, bvar::MultiDimension<bvar::Adder<int> >::OVERFLOW_REJECT);
+    ASSERT_TRUE(my_madder.get_stats({"tc", "get", "200"}));
+    ASSERT_TRUE(my_madder.get_stats({"nj", "get", "200"}));
+    ASSERT_FALSE(my_madder.get_stats({"hz", "get", "200"}));
+    // Existing stats are still available.
+    ASSERT_TRUE(my_madder.get_stats({"tc", "get", "200"}));
+    ASSERT_EQ(2, my_madder.count_stats());
+    ASSERT_EQ(1, my_madder.overflow_count());
+    ASSERT_EQ(0, my_madder.evicted_count());
+}
+
+TEST_F(MultiDimensionTest, overflow_to_other) {
+    bvar::MultiDimension<bvar::Adder<int> > my_madder("test_overflow_to_other", labels);
+    my_madder.set_max_stats_count(2, bvar::MultiDimension<bvar::Adder<int> >::OVERFLOW_TO_OTHER);
+    *my_madder.get_stats({"tc", "get", "200"}) << 1;
+    *my_madder.get_stats({"nj", "get", "200"}) << 1;
+    bvar::Adder<int>* other = my_madder.get_stats({"hz", "get", "200"});
+    ASSERT_TRUE(other);
+    *other << 1;
+    ASSERT_EQ(other, my_madder.get_stats({"gz", "post", "500"}));
+    *my_madder.get_stats({"gz", "post", "500"}) << 1;
+    ASSERT_FALSE(my_madder.has_stats({"hz", "get", "200"}));
+    ASSERT_TRUE(my_madder.has_stats({"other", "other", "other"}));
+    ASSERT_EQ(2, other->get_value());
+    ASSERT_EQ(3, my_madder.count_stats());
+    ASSERT_EQ(3, my_madder.overflow_count());
+}
+
+TEST_F(MultiDimensionTest, overflow_evict) {
+    typedef bvar::MultiDimension<bvar::Adder<int> > MAdder;
+    MAdder my_madder("test_overflow_evict", labels);
+    my_madder.set_max_stats_count(4, MAdder::OVERFLOW_EVICT);
+    const std::list<std::string> labels_values[] = {
+        {"tc", "get", "200"}, {"nj", "get", "200"},
+        {"hz", "get", "200"}, {"gz", "get", "200"}
+    };
+    for (size_t i = 0; i < arraysize(labels_values); ++i) {
+        ASSERT_TRUE(my_madder.get_stats(labels_values[i]));
+        usleep(2000);
+    }
+    // The first one is not the least recently got anymore.
+    ASSERT_TRUE(my_madder.get_stats(labels_values[0]));
+    usleep(2000);
+    ASSERT_TRUE(my_madder.get_stats({"sh", "get", "200"}));
+    ASSERT_EQ(4, my_madder.count_stats());
+    ASSERT_EQ(1, my_madder.evicted_count());
+    ASSERT_EQ(1, my_madder.overflow_count());
+    ASSERT_TRUE(my_madder.has_stats(labels_values[0]));
+    ASSERT_FALSE(my_madder.has_stats(labels_values[1]));
+    ASSERT_TRUE(my_madder.has_stats(labels_values[2]));
+    // Evicted stats are not deleted until the delay passes.
+    ASSERT_EQ(1UL, my_madder._retired_stats.size());
+    bvar::FLAGS_bvar_evicted_stats_delete_delay_s = 0;
+    ASSERT_TRUE(my_madder.get_stats(labels_values[1]));
+    ASSERT_EQ(2, my_madder.evicted_count());
+    ASSERT_TRUE(my_madder._retired_stats.empty());
+    bvar::FLAGS_bvar_evicted_stats_delete_delay_s = 10;
+}
+
+static void* get_stats_randomly(void* arg) {
+    bvar::MultiDimension<bvar::Adder<int> >* my_madder =
+        static_cast<bvar::MultiDimension<bvar::Adder<int> >*>(arg);
+    for (int i = 0; i < 5000; ++i) {
+        const std::string idc = std::to_string(butil::fast_rand_less_than(1000));
+        bvar::Adder<int>* adder = my_madder->get_stats({idc, "get", "200"});
+        EXPECT_TRUE(adder);
+        *adder << 1;
+    }
+    return NULL;
+}
+
+TEST_F(MultiDimensionTest, overflow_evict_multiple_threads) {
+    typedef bvar::MultiDimension<bvar::Adder<int> > MAdder;
+    MAdder my_madder("test_overflow_evict_multiple_threads", labels);
+    my_madder.set_max_stats_count(100, MAdder::OVERFLOW_EVICT);
+    pthread_t threads[8];
+    for (size_t i = 0; i < arraysize(threads); ++i) {
+        ASSERT_EQ(0, pthread_create(&threads[i], NULL, get_stats_randomly, &my_madder));
+    }
+    for (size_t i = 0; i < arraysize(threads); ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    // Threads may insert concurrently after checking the size.
+    ASSERT_LE(my_madder.count_stats(), 100UL + arraysize(threads));
+    ASSERT_LT(0, my_madder.evicted_count());
+    LOG(INFO) << "evicted=" << my_madder.evicted_count()
+              << " overflow=" << my_madder.overflow_count();
+}
+
 TEST_F(MultiDimensionTest, get_description) {
     bvar::MultiDimension<bvar::Adder<int> > my_madder("test_get_description", labels);
     std::list<std::string> labels_value1 = {"gz", "post", "200"};
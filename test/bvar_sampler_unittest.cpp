@@ -16,6 +16,10 @@
 // under the License.
 
 #include <limits>                           //std::numeric_limits
+#include <map>
+#include <set>
+#include <vector>
+#include <gflags/gflags.h>
 #include "bvar/detail/sampler.h"
 #include "butil/time.h"
 #include "butil/logging.h"
@@ -136,4 +140,92 @@ TEST(SamplerTest, multi_threaded) {
     }
 #endif
 }
+
+class ThreadSampler : public bvar::detail::Sampler {
+public:
+    struct State {
+        int ncalled;
+        pthread_t thread;
+        int64_t time_us;
+    };
+
+    ThreadSampler() : _ncalled(0), _thread(0), _time_us(0) {}
+    void take_sample() {
+        ++_ncalled;
+        _thread = pthread_self();
+        _time_us = bvar::detail::sample_time_us();
+    }
+    // _mutex is held by sampling threads during take_sample().
+    State state() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        State st = { _ncalled, _thread, _time_us };
+        return st;
+    }
+    int _ncalled;
+    pthread_t _thread;
+    int64_t _time_us;
+};
+
+// Returns true if samplers sampled by the same thread share the timestamp,
+// which is false when a round is running.
+static bool get_states(ThreadSampler** s, int n,
+                       std::vector<ThreadSampler::State>* states) {
+    states->resize(n);
+    std::map<pthread_t, int64_t> time_us;
+    bool same_time = true;
+    for (int i = 0; i < n; ++i) {
+        (*states)[i] = s[i]->state();
+        const ThreadSampler::State& st = (*states)[i];
+        if (!time_us.insert(std::make_pair(st.thread, st.time_us)).second &&
+            time_us[st.thread] != st.time_us) {
+            same_time = false;
+        }
+    }
+    return same_time;
+}
+
+TEST(SamplerTest, multiple_sampling_threads) {
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bvar_sampler_thread_num", "4").empty());
+    const int N = 1000;
+    ThreadSampler* s[N];
+    for (int i = 0; i < N; ++i) {
+        s[i] = new ThreadSampler;
+        s[i]->schedule();
+    }
+    usleep(2100000);
+    // Samplers of the same type share timestamps in a batch. Rounds take
+    // far less than the interval, retry if one is running.
+    std::vector<ThreadSampler::State> states;
+    bool same_time = false;
+    for (int i = 0; i < 10 && !same_time; ++i) {
+        same_time = get_states(s, N, &states);
+        if (!same_time) {
+            usleep(50000);
+        }
+    }
+    ASSERT_TRUE(same_time);
+    std::set<pthread_t> threads;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_LE(1, states[i].ncalled) << "i=" << i;
+        threads.insert(states[i].thread);
+    }
+    ASSERT_EQ(4u, threads.size());
+
+    // Samplers of extra threads are moved back.
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bvar_sampler_thread_num", "1").empty());
+    usleep(1100000);
+    std::vector<ThreadSampler::State> old_states;
+    get_states(s, N, &old_states);
+    usleep(1100000);
+    get_states(s, N, &states);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_LT(old_states[i].ncalled, states[i].ncalled) << "i=" << i;
+        ASSERT_EQ(states[0].thread, states[i].thread) << "i=" << i;
+    }
+    for (int i = 0; i < N; ++i) {
+        s[i]->destroy();
+    }
+}
 } // namespace
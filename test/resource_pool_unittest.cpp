@@ -22,6 +22,7 @@
 
 #define BAIDU_CLEAR_RESOURCE_POOL_AFTER_ALL_THREADS_QUIT
 #include "butil/resource_pool.h"
+#include "butil/details/free_chunk_stack.h"
 
 namespace {
 struct MyObject {};
@@ -36,9 +37,21 @@ struct Foo {
     }
     int x;
 };
+
+int ntrimmable_dtor = 0;
+struct TrimmableObject {
+    ~TrimmableObject() {
+        ++ntrimmable_dtor;
+    }
+    int x;
+};
 }
 
 namespace butil {
+template <> struct ResourcePoolTrimmable<TrimmableObject> {
+    static const bool value = true;
+};
+
 template <> struct ResourcePoolBlockMaxSize<MyObject> {
     static const size_t value = 128;
 };
@@ -401,6 +414,93 @@ TEST_F(ResourcePoolTest, get_and_return_int_multiple_threads) {
     ASSERT_EQ(0, memcmp(&info, &zero_info, sizeof(info)));
 }
 
+struct IntChunk {
+    size_t nfree;
+    int values[4];
+};
+
+TEST_F(ResourcePoolTest, free_chunk_stack_overflow) {
+    // Chunks more than nodes are kept in the overflow list.
+    const size_t N = butil::details::FCS_MAX_NSEGMENT *
+        butil::details::FCS_SEGMENT_NNODE + 100;
+    butil::details::FreeChunkStack<IntChunk>* stack =
+        new butil::details::FreeChunkStack<IntChunk>;
+    IntChunk c;
+    c.nfree = 1;
+    for (size_t i = 0; i < N; ++i) {
+        c.values[0] = (int)i;
+        ASSERT_TRUE(stack->push(c, i));
+    }
+    std::vector<bool> popped(N, false);
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_TRUE(stack->pop(c, i));
+        ASSERT_EQ(1UL, c.nfree);
+        ASSERT_FALSE(popped[c.values[0]]);
+        popped[c.values[0]] = true;
+    }
+    ASSERT_FALSE(stack->pop(c, 0));
+    delete stack;
+}
+
+const size_t TRIMMABLE_NBLOCK = 4;
+
+void* get_and_return_trimmable(void*) {
+    const size_t n = TRIMMABLE_NBLOCK *
+        ResourcePool<TrimmableObject>::BLOCK_NITEM;
+    std::vector<ResourceId<TrimmableObject> > ids(n);
+    for (size_t i = 0; i < n; ++i) {
+        EXPECT_TRUE(get_resource(&ids[i]));
+    }
+    for (size_t i = 0; i < n; ++i) {
+        EXPECT_EQ(0, return_resource(ids[i]));
+    }
+    return NULL;
+}
+
+TEST_F(ResourcePoolTest, trim_resources) {
+    // Not trimmable by default.
+    ResourceId<int> int_id;
+    ASSERT_TRUE(get_resource(&int_id));
+    ASSERT_EQ(0, return_resource(int_id));
+    ASSERT_EQ(0UL, trim_resources<int>());
+
+    ntrimmable_dtor = 0;
+    // Keep a local pool in this thread so that resources are not cleared
+    // after quitting of the other thread.
+    ResourceId<TrimmableObject> id0;
+    ASSERT_TRUE(get_resource(&id0));
+
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, get_and_return_trimmable, NULL));
+    pthread_join(th, NULL);
+    ASSERT_EQ(TRIMMABLE_NBLOCK + 1,
+              describe_resources<TrimmableObject>().block_num);
+
+    // Blocks with all items returned are not addressable any more.
+    ASSERT_EQ(TRIMMABLE_NBLOCK, trim_resources<TrimmableObject>());
+    ASSERT_EQ(0UL, trim_resources<TrimmableObject>());
+    ASSERT_EQ(1UL, describe_resources<TrimmableObject>().block_num);
+    ASSERT_TRUE(address_resource(id0));
+    const ResourceId<TrimmableObject> last_id = {
+        (TRIMMABLE_NBLOCK + 1) * ResourcePool<TrimmableObject>::BLOCK_NITEM - 1 };
+    ASSERT_FALSE(address_resource(last_id));
+    // Objects are destroyed by a later call after the delay.
+    ASSERT_EQ(0, ntrimmable_dtor);
+    usleep(RP_RETIRED_BLOCK_DELAY_US + 100000);
+    ASSERT_EQ(0UL, trim_resources<TrimmableObject>());
+    ASSERT_EQ(TRIMMABLE_NBLOCK * ResourcePool<TrimmableObject>::BLOCK_NITEM,
+              (size_t)ntrimmable_dtor);
+
+    // Identifiers in released blocks are never reused.
+    ResourceId<TrimmableObject> id1;
+    for (size_t i = 0; i < ResourcePool<TrimmableObject>::BLOCK_NITEM; ++i) {
+        ASSERT_TRUE(get_resource(&id1));
+        ASSERT_TRUE(id1.value < ResourcePool<TrimmableObject>::BLOCK_NITEM ||
+                    id1.value > last_id.value) << id1.value;
+    }
+    clear_resources<TrimmableObject>();
+}
+
 TEST_F(ResourcePoolTest, verify_get) {
     clear_resources<int>();
     std::cout << describe_resources<int>() << std::endl;
@@ -0,0 +1,381 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "butil/time.h"
+#include "butil/fast_rand.h"
+#include "butil/macros.h"
+#include "butil/logging.h"
+#include "butil/strings/string_piece.h"
+#include "butil/containers/hash_tables.h"
+#include "butil/containers/flat_map.h"
+#include "butil/containers/swiss_map.h"
+
+namespace {
+class SwissMapTest : public ::testing::Test{
+protected:
+    SwissMapTest(){};
+    virtual ~SwissMapTest(){};
+    virtual void SetUp() {
+    };
+    virtual void TearDown() {
+    };
+};
+
+int n_con = 0;
+int n_cp_con = 0;
+int n_des = 0;
+
+struct Value {
+    Value() : x_(0) { ++n_con; }
+    Value(int x) : x_(x) { ++ n_con; }
+    Value (const Value& rhs) : x_(rhs.x_) { ++ n_cp_con; }
+    ~Value() { ++ n_des; }
+
+    Value& operator= (const Value& rhs) {
+        x_ = rhs.x_;
+        return *this;
+    }
+
+    bool operator== (const Value& rhs) const { return x_ == rhs.x_; }
+    bool operator!= (const Value& rhs) const { return x_ != rhs.x_; }
+
+    int x_;
+};
+
+struct Bar {
+    int x;
+};
+
+TEST_F(SwissMapTest, group_match) {
+    int8_t ctrl[butil::SWISS_GROUP_WIDTH];
+    for (size_t i = 0; i < ARRAY_SIZE(ctrl); ++i) {
+        ctrl[i] = butil::SWISS_CTRL_EMPTY;
+    }
+    ctrl[1] = 5;
+    ctrl[3] = butil::SWISS_CTRL_DELETED;
+    ctrl[7] = 5;
+    ctrl[9] = butil::SWISS_CTRL_SENTINEL;
+    ctrl[15] = 127;
+    butil::SwissMapGroup g(ctrl);
+    ASSERT_EQ((1u << 1) | (1u << 7), g.match(5));
+    ASSERT_EQ(1u << 15, g.match(127));
+    ASSERT_EQ(0u, g.match(6));
+    ASSERT_EQ(0xFFFFu & ~((1u << 1) | (1u << 3) | (1u << 7) |
+                          (1u << 9) | (1u << 15)), g.match_empty());
+    ASSERT_EQ(0xFFFFu & ~((1u << 1) | (1u << 7) | (1u << 9) | (1u << 15)),
+              g.match_empty_or_deleted());
+    ASSERT_EQ(1u, g.count_leading_empty_or_deleted());
+    ctrl[1] = butil::SWISS_CTRL_EMPTY;
+    ASSERT_EQ(7u, butil::SwissMapGroup(ctrl).count_leading_empty_or_deleted());
+    for (size_t i = 0; i < ARRAY_SIZE(ctrl); ++i) {
+        ctrl[i] = butil::SWISS_CTRL_DELETED;
+    }
+    ASSERT_EQ(16u, butil::SwissMapGroup(ctrl).count_leading_empty_or_deleted());
+}
+
+TEST_F(SwissMapTest, sanity) {
+    typedef butil::SwissMap<uint64_t, long> Map;
+    Map m;
+    ASSERT_FALSE(m.initialized());
+    ASSERT_TRUE(m.empty());
+    ASSERT_EQ(0u, m.size());
+    ASSERT_TRUE(m.begin() == m.end());
+    ASSERT_TRUE(NULL == m.seek(1));
+    ASSERT_EQ(0u, m.erase(1));
+
+    ASSERT_EQ(0, m.init(100));
+    ASSERT_TRUE(m.initialized());
+    ASSERT_EQ(-1, m.init(100));
+    ASSERT_EQ(80u, m.load_factor());
+    ASSERT_EQ(127u, m.bucket_count());
+
+    const uint64_t k1 = 1;
+    long* p = m.insert(k1, 10);
+    ASSERT_TRUE(p != NULL);
+    ASSERT_EQ(10, *p);
+    ASSERT_EQ(1u, m.size());
+    ASSERT_EQ(p, m.seek(k1));
+    ASSERT_TRUE(NULL == m.seek(2));
+    // Overwrite.
+    ASSERT_EQ(p, m.insert(k1, 11));
+    ASSERT_EQ(11, *p);
+    ASSERT_EQ(1u, m.size());
+    ASSERT_EQ(11, m[k1]);
+    // operator[] inserts.
+    m[2] = 20;
+    ASSERT_EQ(2u, m.size());
+    ASSERT_EQ(20, *m.seek(2));
+
+    long old_value = 0;
+    ASSERT_EQ(1u, m.erase(k1, &old_value));
+    ASSERT_EQ(11, old_value);
+    ASSERT_EQ(0u, m.erase(k1));
+    ASSERT_TRUE(NULL == m.seek(k1));
+    ASSERT_EQ(1u, m.size());
+
+    size_t n = 0;
+    for (Map::iterator it = m.begin(); it != m.end(); ++it) {
+        ASSERT_EQ(2u, it->first);
+        ASSERT_EQ(20, it->second);
+        ++n;
+    }
+    ASSERT_EQ(1u, n);
+
+    m.clear();
+    ASSERT_TRUE(m.empty());
+    ASSERT_TRUE(m.begin() == m.end());
+    ASSERT_TRUE(m.initialized());
+}
+
+TEST_F(SwissMapTest, lazy_init_and_zeroized_values) {
+    butil::SwissMap<int, Bar> m;
+    Bar& b = m[1];
+    ASSERT_TRUE(m.initialized());
+    ASSERT_EQ(0, b.x);
+    b.x = 123;
+    ASSERT_EQ(123, m.seek(1)->x);
+    ASSERT_EQ(1u, m.erase(1));
+    ASSERT_EQ(0, m[1].x);
+}
+
+TEST_F(SwissMapTest, seek_by_string_piece) {
+    butil::SwissMap<std::string, int> m;
+    ASSERT_EQ(0, m.init(16));
+    m["abc"] = 1;
+    m["abcd"] = 2;
+    ASSERT_EQ(1, *m.seek(butil::StringPiece("abc")));
+    ASSERT_EQ(2, *m.seek(butil::StringPiece("abcd")));
+    ASSERT_TRUE(NULL == m.seek(butil::StringPiece("ab")));
+    ASSERT_EQ(1u, m.erase(butil::StringPiece("abc")));
+    ASSERT_TRUE(NULL == m.seek(std::string("abc")));
+}
+
+TEST_F(SwissMapTest, grow_and_shrink) {
+    butil::SwissMap<int, int> m;
+    ASSERT_EQ(0, m.init(10));
+    const size_t init_bucket_count = m.bucket_count();
+    for (int i = 0; i < 10000; ++i) {
+        m[i] = i * 2;
+        ASSERT_LE(m.size() * 100, m.bucket_count() * m.load_factor());
+    }
+    ASSERT_EQ(10000u, m.size());
+    ASSERT_GT(m.bucket_count(), init_bucket_count);
+    for (int i = 0; i < 10000; ++i) {
+        ASSERT_EQ(i * 2, *m.seek(i));
+    }
+    ASSERT_TRUE(m.resize(100000));
+    ASSERT_GE(m.bucket_count(), 100000u);
+    for (int i = 0; i < 10000; ++i) {
+        ASSERT_EQ(i * 2, *m.seek(i));
+    }
+    m.clear_and_reset_pool();
+    ASSERT_EQ(init_bucket_count, m.bucket_count());
+    ASSERT_TRUE(m.empty());
+}
+
+TEST_F(SwissMapTest, erase_reuses_slots) {
+    // Inserting and erasing distinct keys must not grow the map forever.
+    butil::SwissMap<int, int> m;
+    ASSERT_EQ(0, m.init(64));
+    const size_t bucket_count = m.bucket_count();
+    for (int i = 0; i < 100000; ++i) {
+        m[i] = i;
+        if (i >= 32) {
+            ASSERT_EQ(1u, m.erase(i - 32));
+        }
+    }
+    ASSERT_EQ(32u, m.size());
+    ASSERT_EQ(bucket_count, m.bucket_count());
+}
+
+TEST_F(SwissMapTest, copy_and_swap) {
+    butil::SwissMap<int, std::string> m1;
+    butil::SwissMap<int, std::string> m2;
+    ASSERT_EQ(0, m1.init(32));
+    m1[1] = "one";
+    m1[2] = "two";
+    m2 = m1;
+    ASSERT_EQ(2u, m2.size());
+    ASSERT_EQ("one", *m2.seek(1));
+    ASSERT_NE(m1.seek(1), m2.seek(1));
+    m1[3] = "three";
+    ASSERT_TRUE(NULL == m2.seek(3));
+
+    butil::SwissMap<int, std::string> m3(m1);
+    ASSERT_EQ(3u, m3.size());
+    ASSERT_EQ("three", *m3.seek(3));
+
+    butil::SwissMap<int, std::string> m4;
+    m4.swap(m3);
+    ASSERT_FALSE(m3.initialized());
+    ASSERT_EQ(3u, m4.size());
+    ASSERT_EQ("two", *m4.seek(2));
+
+    // Copy uninitialized map.
+    m4 = m3;
+    ASSERT_FALSE(m4.initialized());
+    ASSERT_TRUE(m4.empty());
+}
+
+TEST_F(SwissMapTest, const_iterator) {
+    butil::SwissMap<int, int> m;
+    ASSERT_EQ(0, m.init(1000));
+    for (int i = 0; i < 1000; i += 3) {
+        m[i] = i;
+    }
+    const butil::SwissMap<int, int>& cm = m;
+    std::vector<int> keys;
+    butil::SwissMap<int, int>::const_iterator it = cm.begin();
+    // Non-const iterators are convertible to const ones.
+    it = m.begin();
+    for (; it != cm.end(); ++it) {
+        ASSERT_EQ(it->first, it->second);
+        keys.push_back(it->first);
+    }
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(334u, keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ((int)i * 3, keys[i]);
+    }
+}
+
+TEST_F(SwissMapTest, random_insert_erase) {
+    srand(0);
+    n_con = 0;
+    n_cp_con = 0;
+    n_des = 0;
+    {
+        butil::hash_map<uint64_t, Value> ref[2];
+        typedef butil::SwissMap<uint64_t, Value> Map;
+        Map ht[2];
+        ht[0].init(40);
+        ht[1] = ht[0];
+
+        for (int j = 0; j < 30; ++j) {
+            // Make snapshot
+            ht[1] = ht[0];
+            ref[1] = ref[0];
+
+            for (int i = 0; i < 100000; ++i) {
+                int k = rand() % 0xFFFF;
+                int p = rand() % 1000;
+                if (p < 600) {
+                    ht[0].insert(k, i);
+                    ref[0][k] = i;
+                } else if (p < 999) {
+                    ht[0].erase(k);
+                    ref[0].erase(k);
+                } else {
+                    ht[0].clear();
+                    ref[0].clear();
+                }
+            }
+
+            // bi-check
+            for (int i = 0; i < 2; ++i) {
+                for (Map::iterator it = ht[i].begin(); it != ht[i].end(); ++it) {
+                    butil::hash_map<uint64_t, Value>::iterator it2 =
+                        ref[i].find(it->first);
+                    ASSERT_TRUE(it2 != ref[i].end());
+                    ASSERT_EQ(it2->second, it->second);
+                }
+                for (butil::hash_map<uint64_t, Value>::iterator it =
+                         ref[i].begin(); it != ref[i].end(); ++it) {
+                    Value* p_value = ht[i].seek(it->first);
+                    ASSERT_TRUE(p_value != NULL);
+                    ASSERT_EQ(it->second, p_value->x_);
+                }
+                ASSERT_EQ(ht[i].size(), ref[i].size());
+            }
+        }
+    }
+    ASSERT_EQ(n_con + n_cp_con, n_des);
+}
+
+template <typename Map>
+void perf_map(const char* name, const std::vector<uint64_t>& keys,
+              const std::vector<uint64_t>& missed_keys) {
+    butil::Timer tm;
+    Map m;
+    m.init(16);
+    tm.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        m[keys[i]] = i;
+    }
+    tm.stop();
+    const int64_t insert_ns = tm.n_elapsed() / keys.size();
+
+    long sum = 0;
+    tm.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        sum += *m.seek(keys[i]);
+    }
+    tm.stop();
+    const int64_t hit_ns = tm.n_elapsed() / keys.size();
+
+    tm.start();
+    for (size_t i = 0; i < missed_keys.size(); ++i) {
+        sum += (m.seek(missed_keys[i]) != NULL);
+    }
+    tm.stop();
+    const int64_t miss_ns = tm.n_elapsed() / missed_keys.size();
+
+    tm.start();
+    for (typename Map::const_iterator it = m.begin(); it != m.end(); ++it) {
+        sum += it->second;
+    }
+    tm.stop();
+    const int64_t iterate_ns = tm.n_elapsed() / keys.size();
+
+    tm.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        m.erase(keys[i]);
+    }
+    tm.stop();
+    const int64_t erase_ns = tm.n_elapsed() / keys.size();
+
+    LOG(INFO) << name << " nkey=" << keys.size()
+              << " insert=" << insert_ns << "ns"
+              << " seek_hit=" << hit_ns << "ns"
+              << " seek_miss=" << miss_ns << "ns"
+              << " iterate=" << iterate_ns << "ns"
+              << " erase=" << erase_ns << "ns sum=" << sum;
+}
+
+TEST_F(SwissMapTest, perf_cmp_with_flat_map) {
+    const size_t nkeys[] = { 1000, 10000, 100000, 1000000, 10000000 };
+    for (size_t pass = 0; pass < ARRAY_SIZE(nkeys); ++pass) {
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> missed_keys;
+        keys.reserve(nkeys[pass]);
+        missed_keys.reserve(nkeys[pass]);
+        for (size_t i = 0; i < nkeys[pass]; ++i) {
+            keys.push_back(butil::fast_rand() | 1);
+            missed_keys.push_back(butil::fast_rand() & ~1UL);
+        }
+        std::random_shuffle(keys.begin(), keys.end());
+        perf_map<butil::FlatMap<uint64_t, long> >("FlatMap", keys, missed_keys);
+        perf_map<butil::SwissMap<uint64_t, long> >("SwissMap", keys, missed_keys);
+    }
+}
+
+} // namespace